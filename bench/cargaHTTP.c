@@ -0,0 +1,554 @@
+/* Generador de carga HTTP para medir el servidor. Mantiene N conexiones con un
+ * bucle de eventos por hilo y reparte los pedidos segun una mezcla de rutas
+ * (archivos estaticos, 404, PHP...). Al final informa el throughput y los
+ * percentiles de latencia.
+ *
+ * En lazo cerrado (sin -r) cada conexion manda el proximo pedido apenas recibe
+ * la respuesta. En lazo abierto (-r pedidos/s) los pedidos se programan a tasa
+ * fija y la latencia se mide desde que el pedido tendria que haber salido, asi
+ * las demoras del servidor no esconden la cola (coordinated omission).
+ *
+ * Compilacion (desde la raiz del repositorio):
+ *   gcc -O2 -pthread bench/cargaHTTP.c -o cargaHTTP
+ * Uso:
+ *   ./cargaHTTP IP:puerto [-c conexiones] [-j hilos] [-d segundos] [-r pedidos/s] [-n]
+ *               [-m ruta:peso,ruta:peso,...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_MEZCLA 32
+#define MAX_PEDIDO 1024
+#define TAM_HEADERS_RTA 16384
+#define TAM_LECTURA 65536
+#define MAX_EVENTOS_CARGA 256
+
+// Histograma de latencias en microsegundos: exacto hasta SUB_CARGA y despues
+// SUB_CARGA buckets por cada potencia de 2 (error relativo menor al 7%)
+#define SUB_CARGA 16
+#define BITS_SUB_CARGA 4
+#define CANT_BUCKETS_CARGA 464			// Hasta ~2^32 us (mas de una hora)
+
+// Estados de una conexion del generador
+#define CARGA_LIBRE 0					// Sin pedido (solo en lazo abierto)
+#define CARGA_CONECTANDO 1
+#define CARGA_ENVIANDO 2
+#define CARGA_HEADERS 3					// Leyendo los headers de la respuesta
+#define CARGA_CUERPO 4					// Cuerpo con Content-Length
+#define CARGA_CHUNK_TAMANIO 5			// Linea con el tamaño de un chunk
+#define CARGA_CHUNK_DATOS 6				// Datos de un chunk (y su CRLF)
+#define CARGA_HASTA_CIERRE 7			// Cuerpo sin largo: termina con el cierre
+
+struct histogramaCarga {
+	unsigned long buckets[CANT_BUCKETS_CARGA];
+	unsigned long cantidad;
+	long long maximo;
+};
+
+struct rutaMezcla {
+	char ruta[512];
+	int peso;
+};
+
+struct opcionesCarga {
+	struct sockaddr_in direccion;
+	char host[64];
+	int conexiones;
+	int hilos;
+	int duracion;
+	double tasa;					// Pedidos/s en total (0: lazo cerrado)
+	int keepAlive;
+	struct rutaMezcla mezcla[MAX_MEZCLA];
+	int cantMezcla;
+	int pesoTotal;
+};
+
+struct resultadoCarga {
+	unsigned long pedidos;
+	unsigned long errores;
+	unsigned long status[6];			// Por clase: [1] 1xx ... [5] 5xx ([0] otros)
+	unsigned long long bytes;
+	struct histogramaCarga total;
+	struct histogramaCarga porRuta[MAX_MEZCLA];
+};
+
+struct conexionCarga {
+	int fd;
+	int estado;
+	int ruta;						// Indice de la ruta pedida en la mezcla
+	long long inicio;				// Desde cuando se mide la latencia (us)
+	char pedido[MAX_PEDIDO];
+	size_t lenPedido, enviado;
+	char headers[TAM_HEADERS_RTA];
+	size_t lenHeaders;
+	long long restante;				// Del cuerpo o del chunk actual
+	int status;
+	int cerrar;						// El servidor cierra despues de esta respuesta
+	int recibido;					// Llego algo de la respuesta
+	int usada;						// Ya respondio algun pedido (keep-alive)
+};
+
+struct hiloCarga {
+	pthread_t hilo;
+	int nro;
+	int conexiones;
+	double tasa;
+	unsigned int semilla;
+	struct resultadoCarga resultado;
+};
+
+struct opcionesCarga opciones = {
+	.conexiones = 64,
+	.hilos = 1,
+	.duracion = 10,
+	.tasa = 0,
+	.keepAlive = 1
+};
+
+long long ahoraUsCarga() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int bucketCarga(long long us) {
+	if (us < SUB_CARGA) return us;
+	int e = 63 - __builtin_clzll(us);
+	int i = (e - BITS_SUB_CARGA + 1) * SUB_CARGA + ((us >> (e - BITS_SUB_CARGA)) & (SUB_CARGA - 1));
+	return i < CANT_BUCKETS_CARGA ? i : CANT_BUCKETS_CARGA - 1;
+}
+
+/* Mayor latencia (us) que cae en el bucket dado */
+long long limiteBucketCarga(int i) {
+	if (i < SUB_CARGA) return i;
+	int e = i / SUB_CARGA + BITS_SUB_CARGA - 1;
+	return ((long long) (SUB_CARGA + i % SUB_CARGA + 1) << (e - BITS_SUB_CARGA)) - 1;
+}
+
+void medirCarga(struct histogramaCarga * h, long long us) {
+	if (us < 0) us = 0;
+	h->buckets[bucketCarga(us)]++;
+	h->cantidad++;
+	if (us > h->maximo) h->maximo = us;
+}
+
+void sumarHistogramaCarga(struct histogramaCarga * a, struct histogramaCarga * b) {
+	int i;
+	for (i = 0; i < CANT_BUCKETS_CARGA; i++) a->buckets[i] += b->buckets[i];
+	a->cantidad += b->cantidad;
+	if (b->maximo > a->maximo) a->maximo = b->maximo;
+}
+
+/* Latencia (us) por debajo de la cual queda la fraccion dada de las mediciones */
+long long percentilCarga(struct histogramaCarga * h, double fraccion) {
+	unsigned long objetivo = (unsigned long) (fraccion * h->cantidad + 0.5), acumulado = 0;
+	int i;
+	if (objetivo == 0) objetivo = 1;
+	for (i = 0; i < CANT_BUCKETS_CARGA; i++) {
+		acumulado += h->buckets[i];
+		if (acumulado >= objetivo)
+			return limiteBucketCarga(i) < h->maximo ? limiteBucketCarga(i) : h->maximo;
+	}
+	return h->maximo;
+}
+
+/* Elige una ruta de la mezcla segun los pesos */
+int elegirRuta(unsigned int * semilla) {
+	int r = rand_r(semilla) % opciones.pesoTotal, i;
+	for (i = 0; i < opciones.cantMezcla - 1; i++) {
+		r -= opciones.mezcla[i].peso;
+		if (r < 0) break;
+	}
+	return i;
+}
+
+void cerrarCarga(struct conexionCarga * c) {
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+	c->usada = 0;
+}
+
+/* Manda lo que falta del pedido. Retorna -1 si la conexion se rompio */
+int enviarCarga(struct conexionCarga * c) {
+	while (c->enviado < c->lenPedido) {
+		ssize_t n = send(c->fd, c->pedido + c->enviado, c->lenPedido - c->enviado, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		c->enviado += n;
+	}
+	c->estado = CARGA_HEADERS;
+	return 0;
+}
+
+/* Empieza un pedido en la conexion (conectandola si hace falta), midiendo desde inicio */
+int lanzarPedido(int epfd, struct conexionCarga * c, long long inicio, unsigned int * semilla) {
+	c->ruta = elegirRuta(semilla);
+	c->inicio = inicio;
+	c->lenPedido = snprintf(c->pedido, sizeof(c->pedido), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+		opciones.mezcla[c->ruta].ruta, opciones.host,
+		opciones.keepAlive ? "" : "Connection: close\r\n");
+	c->enviado = 0;
+	c->lenHeaders = 0;
+	c->recibido = 0;
+	c->cerrar = !opciones.keepAlive;
+
+	if (c->fd < 0) {
+		c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c->fd < 0) return -1;
+		int uno = 1;
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+			cerrarCarga(c);
+			return -1;
+		}
+		if (connect(c->fd, (struct sockaddr *) &opciones.direccion, sizeof(opciones.direccion)) < 0 &&
+				errno != EINPROGRESS) {
+			cerrarCarga(c);
+			return -1;
+		}
+		c->estado = CARGA_CONECTANDO;
+		return 0;
+	}
+	c->estado = CARGA_ENVIANDO;
+	return enviarCarga(c);
+}
+
+/* Analiza los headers de la respuesta: status, largo del cuerpo y si se cierra */
+void analizarHeaders(struct conexionCarga * c) {
+	char * p;
+	c->status = atoi(c->headers + 9);
+	c->estado = CARGA_HASTA_CIERRE;
+	for (p = strstr(c->headers, "\r\n"); p != NULL; p = strstr(p + 2, "\r\n")) {
+		char * h = p + 2;
+		if (strncasecmp(h, "Content-Length:", 15) == 0) {
+			c->restante = atoll(h + 15);
+			c->estado = CARGA_CUERPO;
+		} else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0 && strstr(h, "chunked") != NULL) {
+			c->estado = CARGA_CHUNK_TAMANIO;
+			c->lenHeaders = 0;
+		} else if (strncasecmp(h, "Connection:", 11) == 0 && strncasecmp(h + 12, "close", 5) == 0) {
+			c->cerrar = 1;
+		}
+	}
+}
+
+/* Consume bytes de la respuesta. Retorna 1 cuando la respuesta esta completa,
+ * 0 si falta y -1 si es invalida */
+int consumirRespuesta(struct conexionCarga * c, char * datos, size_t len) {
+	while (len > 0) {
+		if (c->estado == CARGA_HEADERS) {
+			// Acumulo hasta la linea en blanco; lo que sigue ya es cuerpo
+			size_t copiar = len < sizeof(c->headers) - 1 - c->lenHeaders ? len : sizeof(c->headers) - 1 - c->lenHeaders;
+			if (copiar == 0) return -1;
+			memcpy(c->headers + c->lenHeaders, datos, copiar);
+			c->lenHeaders += copiar;
+			c->headers[c->lenHeaders] = '\0';
+			char * fin = strstr(c->headers, "\r\n\r\n");
+			if (fin == NULL) {
+				datos += copiar;
+				len -= copiar;
+				continue;
+			}
+			size_t usados = (fin + 4 - c->headers) - (c->lenHeaders - copiar);
+			datos += usados;
+			len -= usados;
+			fin[2] = '\0';
+			if (strncmp(c->headers, "HTTP/1.", 7) != 0) return -1;
+			analizarHeaders(c);
+			if (c->estado == CARGA_CUERPO && c->restante == 0) return 1;
+		} else if (c->estado == CARGA_CUERPO || c->estado == CARGA_CHUNK_DATOS) {
+			size_t usados = (long long) len < c->restante ? len : (size_t) c->restante;
+			c->restante -= usados;
+			datos += usados;
+			len -= usados;
+			if (c->restante > 0) return 0;
+			if (c->estado == CARGA_CUERPO) return 1;
+			c->estado = CARGA_CHUNK_TAMANIO;
+			c->lenHeaders = 0;
+		} else if (c->estado == CARGA_CHUNK_TAMANIO) {
+			// La linea del tamaño se acumula en el buffer de headers
+			if (c->lenHeaders == 64) return -1;
+			c->headers[c->lenHeaders++] = *datos++;
+			len--;
+			if (c->headers[c->lenHeaders - 1] != '\n') continue;
+			c->headers[c->lenHeaders] = '\0';
+			long long tamanio = strtoll(c->headers, NULL, 16);
+			c->lenHeaders = 0;
+			// El chunk final (sin trailers) termina con otro CRLF
+			c->restante = tamanio + 2;
+			c->estado = CARGA_CHUNK_DATOS;
+			if (tamanio == 0) c->estado = CARGA_CUERPO;
+		} else {
+			// Hasta el cierre: no hay nada que contar
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* Registra la respuesta recibida */
+void contarRespuesta(struct hiloCarga * h, struct conexionCarga * c) {
+	long long latencia = ahoraUsCarga() - c->inicio;
+	struct resultadoCarga * r = &h->resultado;
+	r->pedidos++;
+	r->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+	medirCarga(&r->total, latencia);
+	medirCarga(&r->porRuta[c->ruta], latencia);
+}
+
+void * correrHilo(void * arg) {
+	struct hiloCarga * h = arg;
+	struct epoll_event eventos[MAX_EVENTOS_CARGA];
+	struct conexionCarga * conexiones = calloc(h->conexiones, sizeof(struct conexionCarga));
+	char * buf = malloc(TAM_LECTURA);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	int i;
+
+	// Pedidos de lazo abierto que esperan una conexion libre: como se programan a
+	// intervalos fijos alcanza con saber cuantos son y cuando salia el primero
+	long long intervalo = h->tasa > 0 ? (long long) (1e6 / h->tasa) : 0;
+	long long proximo = ahoraUsCarga(), primeroPendiente = 0;
+	unsigned long pendientes = 0;
+	long long fin = ahoraUsCarga() + opciones.duracion * 1000000LL;
+	if (intervalo < 1 && h->tasa > 0) intervalo = 1;
+
+	for (i = 0; i < h->conexiones; i++) {
+		conexiones[i].fd = -1;
+		conexiones[i].estado = CARGA_LIBRE;
+		if (intervalo == 0 && lanzarPedido(epfd, &conexiones[i], ahoraUsCarga(), &h->semilla) < 0)
+			h->resultado.errores++;
+	}
+
+	while (1) {
+		long long ahora = ahoraUsCarga();
+		if (ahora >= fin) break;
+
+		if (intervalo > 0) {
+			// Programo los pedidos que ya tendrian que haber salido
+			for (; proximo <= ahora; proximo += intervalo) {
+				if (pendientes++ == 0) primeroPendiente = proximo;
+			}
+			for (i = 0; i < h->conexiones && pendientes > 0; i++) {
+				if (conexiones[i].estado != CARGA_LIBRE) continue;
+				if (lanzarPedido(epfd, &conexiones[i], primeroPendiente, &h->semilla) < 0)
+					h->resultado.errores++;
+				primeroPendiente += intervalo;
+				pendientes--;
+			}
+		}
+
+		long long espera = (intervalo > 0 ? proximo : fin) - ahora;
+		if (espera > 100000) espera = 100000;
+		int n = epoll_wait(epfd, eventos, MAX_EVENTOS_CARGA, (int) ((espera + 999) / 1000));
+		for (i = 0; i < n; i++) {
+			struct conexionCarga * c = eventos[i].data.ptr;
+			int r = 0, cerrada = 0;
+			if (c->fd < 0) continue;
+
+			if (c->estado == CARGA_CONECTANDO) {
+				int err = 0;
+				socklen_t lenErr = sizeof(err);
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &lenErr);
+				if (err != 0) {
+					r = -1;
+				} else if (eventos[i].events & EPOLLOUT) {
+					c->estado = CARGA_ENVIANDO;
+				} else {
+					continue;
+				}
+			}
+			if (r == 0 && c->estado == CARGA_ENVIANDO) r = enviarCarga(c);
+
+			// Leo todo lo disponible (edge-triggered)
+			while (r == 0 && c->estado >= CARGA_HEADERS) {
+				ssize_t leidos = recv(c->fd, buf, TAM_LECTURA, 0);
+				if (leidos < 0) {
+					if (errno == EINTR) continue;
+					if (errno != EAGAIN && errno != EWOULDBLOCK) r = -1;
+					break;
+				}
+				if (leidos == 0) {
+					cerrada = 1;
+					r = c->estado == CARGA_HASTA_CIERRE ? 1 : -1;
+					break;
+				}
+				c->recibido = 1;
+				h->resultado.bytes += leidos;
+				r = consumirRespuesta(c, buf, leidos);
+			}
+			if (r == 0) continue;
+
+			if (r < 0 && c->usada && !c->recibido) {
+				// El servidor cerro una conexion keep-alive ociosa: reintento
+				// en una nueva sin perder el momento en que salio el pedido
+				long long inicio = c->inicio;
+				cerrarCarga(c);
+				if (lanzarPedido(epfd, c, inicio, &h->semilla) < 0)
+					h->resultado.errores++;
+				continue;
+			}
+			if (r < 0) {
+				h->resultado.errores++;
+				cerrarCarga(c);
+			} else {
+				contarRespuesta(h, c);
+				if (c->cerrar || cerrada) cerrarCarga(c);
+				else c->usada = 1;
+			}
+
+			// La conexion queda para el proximo pedido
+			c->estado = CARGA_LIBRE;
+			if (intervalo == 0) {
+				if (lanzarPedido(epfd, c, ahoraUsCarga(), &h->semilla) < 0)
+					h->resultado.errores++;
+			} else if (pendientes > 0) {
+				if (lanzarPedido(epfd, c, primeroPendiente, &h->semilla) < 0)
+					h->resultado.errores++;
+				primeroPendiente += intervalo;
+				pendientes--;
+			}
+		}
+	}
+
+	for (i = 0; i < h->conexiones; i++) cerrarCarga(&conexiones[i]);
+	close(epfd);
+	free(conexiones);
+	free(buf);
+	return NULL;
+}
+
+/* Carga la mezcla de rutas "ruta:peso,ruta:peso" (el peso es opcional) */
+void cargarMezcla(char * texto) {
+	char * item, * resto = NULL;
+	opciones.cantMezcla = 0;
+	opciones.pesoTotal = 0;
+	for (item = strtok_r(texto, ",", &resto); item != NULL; item = strtok_r(NULL, ",", &resto)) {
+		if (opciones.cantMezcla == MAX_MEZCLA) break;
+		struct rutaMezcla * m = &opciones.mezcla[opciones.cantMezcla];
+		char * dosPuntos = strrchr(item, ':');
+		m->peso = 1;
+		if (dosPuntos != NULL) {
+			*dosPuntos = '\0';
+			m->peso = atoi(dosPuntos + 1);
+		}
+		if (m->peso < 1 || item[0] != '/') {
+			fprintf(stderr, "Mezcla invalida: %s\n", item);
+			exit(EXIT_FAILURE);
+		}
+		snprintf(m->ruta, sizeof(m->ruta), "%s", item);
+		opciones.pesoTotal += m->peso;
+		opciones.cantMezcla++;
+	}
+}
+
+void ayudaCarga(char * programa) {
+	printf("Uso: %s IP:puerto [-c conexiones] [-j hilos] [-d segundos] [-r pedidos/s] [-n]\n"
+		"\t\t[-m ruta:peso,ruta:peso,...]\n\n", programa);
+	printf("\t[-c conexiones]: Conexiones abiertas en total. (Default: 64)\n");
+	printf("\t[-j hilos]: \tHilos del generador. (Default: 1)\n");
+	printf("\t[-d segundos]: \tDuracion de la prueba. (Default: 10)\n");
+	printf("\t[-r pedidos/s]: Lazo abierto a la tasa dada. (Default: lazo cerrado)\n");
+	printf("\t[-n]: \t\tSin keep-alive, una conexion por pedido.\n");
+	printf("\t[-m mezcla]: \tRutas pedidas y sus pesos. (Default: /index.html)\n");
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+	char mezclaDefault[] = "/index.html";
+	char * mezcla = mezclaDefault;
+	int opt, i, r;
+
+	while ((opt = getopt(argc, argv, "hc:j:d:r:nm:")) != -1) {
+		switch (opt) {
+		case 'c': opciones.conexiones = atoi(optarg); break;
+		case 'j': opciones.hilos = atoi(optarg); break;
+		case 'd': opciones.duracion = atoi(optarg); break;
+		case 'r': opciones.tasa = atof(optarg); break;
+		case 'n': opciones.keepAlive = 0; break;
+		case 'm': mezcla = optarg; break;
+		default: ayudaCarga(argv[0]);
+		}
+	}
+	if (optind >= argc || opciones.conexiones < 1 || opciones.hilos < 1 ||
+			opciones.duracion < 1 || opciones.tasa < 0)
+		ayudaCarga(argv[0]);
+	if (opciones.hilos > opciones.conexiones) opciones.hilos = opciones.conexiones;
+
+	snprintf(opciones.host, sizeof(opciones.host), "%s", argv[optind]);
+	char * puerto = strchr(opciones.host, ':');
+	opciones.direccion.sin_family = AF_INET;
+	opciones.direccion.sin_port = htons(puerto != NULL ? atoi(puerto + 1) : 80);
+	if (puerto != NULL) *puerto = '\0';
+	if (inet_pton(AF_INET, opciones.host, &opciones.direccion.sin_addr) != 1) {
+		fprintf(stderr, "IP invalida: %s\n", opciones.host);
+		return EXIT_FAILURE;
+	}
+	if (puerto != NULL) *puerto = ':';
+	cargarMezcla(mezcla);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct hiloCarga * hilos = calloc(opciones.hilos, sizeof(struct hiloCarga));
+	long long inicio = ahoraUsCarga();
+	for (i = 0; i < opciones.hilos; i++) {
+		hilos[i].nro = i;
+		hilos[i].conexiones = opciones.conexiones / opciones.hilos + (i < opciones.conexiones % opciones.hilos);
+		hilos[i].tasa = opciones.tasa / opciones.hilos;
+		hilos[i].semilla = 12345 + i;
+		r = pthread_create(&hilos[i].hilo, NULL, correrHilo, &hilos[i]);
+		if (r != 0) {
+			fprintf(stderr, "No se pudo crear el hilo %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Junto los resultados de todos los hilos
+	struct resultadoCarga * total = calloc(1, sizeof(struct resultadoCarga));
+	for (i = 0; i < opciones.hilos; i++) {
+		pthread_join(hilos[i].hilo, NULL);
+		struct resultadoCarga * h = &hilos[i].resultado;
+		total->pedidos += h->pedidos;
+		total->errores += h->errores;
+		total->bytes += h->bytes;
+		for (r = 0; r < 6; r++) total->status[r] += h->status[r];
+		sumarHistogramaCarga(&total->total, &h->total);
+		for (r = 0; r < opciones.cantMezcla; r++) sumarHistogramaCarga(&total->porRuta[r], &h->porRuta[r]);
+	}
+	double segundos = (ahoraUsCarga() - inicio) / 1e6;
+
+	printf("%s: %d conexiones, %d hilos, %s, %s\n", opciones.host, opciones.conexiones, opciones.hilos,
+		opciones.keepAlive ? "keep-alive" : "sin keep-alive", opciones.tasa > 0 ? "lazo abierto" : "lazo cerrado");
+	if (opciones.tasa > 0) printf("Tasa pedida: %.0f pedidos/s\n", opciones.tasa);
+	printf("Pedidos: %lu en %.2f s (%.0f pedidos/s, %.2f MB/s)\n", total->pedidos, segundos,
+		total->pedidos / segundos, total->bytes / segundos / 1e6);
+	printf("Status: 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, otros %lu, errores %lu\n", total->status[2],
+		total->status[3], total->status[4], total->status[5], total->status[0] + total->status[1], total->errores);
+	printf("%-32s %10s %10s %10s %10s %10s\n", "Latencia (us)", "pedidos", "p50", "p99", "p999", "max");
+	printf("%-32s %10lu %10lld %10lld %10lld %10lld\n", "total", total->total.cantidad,
+		percentilCarga(&total->total, 0.5), percentilCarga(&total->total, 0.99),
+		percentilCarga(&total->total, 0.999), total->total.maximo);
+	for (r = 0; r < opciones.cantMezcla && opciones.cantMezcla > 1; r++) {
+		struct histogramaCarga * h = &total->porRuta[r];
+		if (h->cantidad == 0) continue;
+		printf("%-32.32s %10lu %10lld %10lld %10lld %10lld\n", opciones.mezcla[r].ruta, h->cantidad,
+			percentilCarga(h, 0.5), percentilCarga(h, 0.99), percentilCarga(h, 0.999), h->maximo);
+	}
+	return total->errores > 0 && total->pedidos == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/* Microbenchmarks del servidor: miden por separado las partes del camino de un
+ * pedido (recepcion y analisis, normalizacion de la ruta, tipo de contenido,
+ * paginas de error y envio de archivos) con el mismo codigo del servidor, sin
+ * red de por medio.
+ *
+ * Compilacion (desde la raiz del repositorio):
+ *   gcc -O2 -pthread bench/microbench.c -o microbench -lz
+ * Uso:
+ *   ./microbench [iteraciones]
+ */
+
+// Incluyo el servidor entero para usar sus funciones tal cual; su main no se usa
+#define main mainServidor
+#include "../src/servidorHTTP.c"
+#undef main
+
+#define ITERACIONES 1000000
+#define TAM_ARCHIVO_BENCH (64 * 1024)
+
+// Para que el compilador no descarte los resultados
+volatile unsigned long sumidero = 0;
+
+/* Nanosegundos de un reloj monotono */
+long long ahoraNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Muestra el resultado de un benchmark */
+void informar(const char * nombre, long iteraciones, long long ns) {
+	printf("%-32s %10ld iter %10.1f ns/op %12.0f op/s\n", nombre, iteraciones,
+		(double) ns / iteraciones, iteraciones * 1e9 / ns);
+}
+
+/* Pedido tipico de un navegador */
+const char * pedidoBench =
+	"GET /imagenes/logo.png HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: image/avif,image/webp,*/*\r\n"
+	"Accept-Language: es-AR,es;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Referer: http://localhost:8080/index.html\r\n"
+	"Sec-Fetch-Dest: image\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"\r\n";
+
+/* Analisis de un pedido ya recibido (parsearPedido) */
+void benchParsear(long iteraciones) {
+	struct conexion * c = calloc(1, sizeof(struct conexion));
+	size_t len = strlen(pedidoBench);
+	long i;
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		// El analisis corta los tokens en el mismo buffer: lo vuelvo a copiar
+		memcpy(c->entrada, pedidoBench, len);
+		c->lenEntrada = len;
+		c->escaneado = 0;
+		buscarFinPedido(c);
+		sumidero += parsearPedido(c->entrada, c->finPedido, &c->pedido);
+		sumidero += c->pedido.cantHeaders;
+	}
+	informar("buscarFinPedido+parsearPedido", iteraciones, ahoraNs() - t);
+	free(c);
+}
+
+/* Recepcion desde un socket (recibirMensaje) y analisis */
+void benchRecibir(long iteraciones) {
+	struct conexion * c = calloc(1, sizeof(struct conexion));
+	int par[2];
+	size_t len = strlen(pedidoBench);
+	long i;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, par) < 0 || setNoBloqueante(par[1]) < 0) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	c->sock = par[1];
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		if (write(par[0], pedidoBench, len) != (ssize_t) len) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		c->lenEntrada = 0;
+		c->escaneado = 0;
+		c->llegada = 0;
+		if (recibirMensaje(c) != 1) {
+			fprintf(stderr, "recibirMensaje no encontro el pedido\n");
+			exit(EXIT_FAILURE);
+		}
+		sumidero += parsearPedido(c->entrada, c->finPedido, &c->pedido);
+	}
+	informar("recibirMensaje+parsearPedido", iteraciones, ahoraNs() - t);
+	close(par[0]);
+	close(par[1]);
+	free(c);
+}
+
+/* Ruta canonica de un pedido: decodificacion, segmentos . y .. y parametros */
+void benchNormalizar(long iteraciones) {
+	char * rutas[] = { "/index.html", "/imagenes/logo.png", "/js/vendor/jquery-3.7.1.min.js?v=20240101",
+		"/docs/manual%20de%20usuario/capitulo%201.html", "/css/../css/./estilo.css",
+		"/static/fonts/roboto-condensed-regular-webfont.woff2" };
+	int cant = sizeof(rutas) / sizeof(rutas[0]);
+	size_t largos[sizeof(rutas) / sizeof(rutas[0])];
+	char destino[256];
+	char * parametros;
+	long i;
+	for (i = 0; i < cant; i++) largos[i] = strlen(rutas[i]);
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		sumidero += normalizarRuta(rutas[i % cant], largos[i % cant], destino, &parametros);
+		sumidero += (unsigned long) parametros;
+	}
+	informar("normalizarRuta", iteraciones, ahoraNs() - t);
+}
+
+/* Tipo de contenido a partir del nombre del archivo */
+void benchMIME(long iteraciones) {
+	char * archivos[] = { "index.html", "css/estilo.css", "js/app.min.js", "imagenes/logo.PNG",
+		"fotos/playa.jpeg", "docs/manual.pdf", "fuentes/texto.woff2", "datos/sin_extension",
+		"videos/intro.mp4", "paquete.tar.gz" };
+	int cant = sizeof(archivos) / sizeof(archivos[0]);
+	char extension[MAX_EXTENSION];
+	long i;
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		extensionArchivo(archivos[i % cant], extension, sizeof(extension));
+		sumidero += (unsigned long) buscarMIME(extension);
+	}
+	informar("extensionArchivo+buscarMIME", iteraciones, ahoraNs() - t);
+}
+
+/* Pagina de error completa en el buffer de salida (mandarRechazo) */
+void benchRechazo(long iteraciones) {
+	struct conexion * c = calloc(1, sizeof(struct conexion));
+	long i;
+	c->keepAlive = 1;
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		c->lenSalida = 0;
+		mandarRechazo(c,RECHAZO_404);
+		sumidero += c->lenSalida;
+	}
+	informar("mandarRechazo (404)", iteraciones, ahoraNs() - t);
+	free(c->salida);
+	free(c);
+}
+
+/* Respuesta de un archivo de la cache: headers armados y el cuerpo con sendfile
+ * (a /dev/null, para medir el camino del servidor y no el del cliente) */
+void benchEnvio(long iteraciones) {
+	char directorio[] = "/tmp/microbenchXXXXXX";
+	char datos[TAM_ARCHIVO_BENCH];
+	long i;
+
+	if (mkdtemp(directorio) == NULL || chdir(directorio) < 0) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	memset(datos, 'x', sizeof(datos));
+	int fd = open("archivo.txt", O_WRONLY | O_CREAT, 0644);
+	if (fd < 0 || write(fd, datos, sizeof(datos)) != sizeof(datos)) {
+		perror("archivo.txt");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	int nulo = open("/dev/null", O_WRONLY);
+
+	struct conexion * c = calloc(1, sizeof(struct conexion));
+	c->keepAlive = 1;
+	c->archivo = -1;
+	if (cargarCache("archivo.txt", buscarMIME("txt")) == NULL) {
+		fprintf(stderr, "No se pudo cargar el archivo en la cache\n");
+		exit(EXIT_FAILURE);
+	}
+	long long t = ahoraNs();
+	for (i = 0; i < iteraciones; i++) {
+		struct archivoCache * e = buscarCache("archivo.txt");
+		c->lenSalida = 0;
+		mandarEntradaCache(c, e);
+		while (c->restante > 0) {
+			ssize_t n = sendfile(nulo, c->archivo, &c->offset, c->restante);
+			if (n <= 0) break;
+			c->restante -= n;
+		}
+		sumidero += c->lenSalida;
+		liberarArchivo(c);
+	}
+	informar("mandarEntradaCache+sendfile 64K", iteraciones, ahoraNs() - t);
+
+	close(nulo);
+	free(c->salida);
+	free(c);
+	unlink("archivo.txt");
+	if (chdir("/") == 0) rmdir(directorio);
+}
+
+int main(int argc, char *argv[]) {
+	long iteraciones = argc > 1 ? atol(argv[1]) : ITERACIONES;
+	if (iteraciones < 1) {
+		printf("Uso: %s [iteraciones]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// El mismo estado que arma un worker al arrancar
+	openlog("microbench", LOG_PERROR, LOG_LOCAL0);
+	config.workers = 1;
+	iniciarMIME();
+	armarRechazos();
+	iniciarMetricas();
+	misMetricas = &metricas[0];
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	iniciarCache();
+
+	benchParsear(iteraciones);
+	benchRecibir(iteraciones);
+	benchNormalizar(iteraciones);
+	benchMIME(iteraciones);
+	benchRechazo(iteraciones);
+	// El envio de archivos es mucho mas lento que el resto
+	benchEnvio(iteraciones / 10 > 0 ? iteraciones / 10 : 1);
+
+	return sumidero == 0;
+}
@@ -0,0 +1,221 @@
+/* Empaquetador de documentos: arma, a partir de un directorio, el paquete que
+ * el servidor sirve mapeado en memoria (-D). Cada archivo estatico queda con
+ * su cuerpo alineado a pagina, sus headers y su ETag ya armados y sus
+ * variantes comprimidas (los hermanos .br/.gz, o comprimido aca).
+ *
+ * Compilacion (desde la raiz del repositorio):
+ *   gcc -O2 -pthread src/empaquetar.c -o empaquetar -lz
+ * Uso:
+ *   ./empaquetar directorio paquete [-t mime.types]
+ *
+ * El paquete se escribe aparte y se renombra al terminar, asi que un servidor
+ * que esta sirviendo el anterior pasa al nuevo de una vez.
+ */
+
+// Incluyo el servidor entero para armar los headers con su mismo codigo; su main no se usa
+#define main mainServidor
+#include "servidorHTTP.c"
+#undef main
+
+#include <ftw.h>
+
+// Rutas de los archivos del directorio
+char ** rutas = NULL;
+int cantRutas = 0;
+dev_t dispositivoSalida;
+ino_t inodoSalida;
+
+/* Agrega a la lista cada archivo regular del directorio (menos el paquete que se esta escribiendo) */
+int anotarArchivo(const char * ruta, const struct stat * st, int tipo, struct FTW * ftw) {
+	(void) ftw;
+	if (tipo != FTW_F || !S_ISREG(st->st_mode)) return 0;
+	if (st->st_dev == dispositivoSalida && st->st_ino == inodoSalida) return 0;
+	rutas = realloc(rutas, (cantRutas + 1) * sizeof(char *));
+	rutas[cantRutas++] = strdup(ruta + 2);		// sin el "./"
+	return 0;
+}
+
+/* Hash FNV-1a de 64 bits del contenido, para el ETag */
+uint64_t hashContenido(const char * datos, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) datos[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Escribe todo el buffer en la posicion dada */
+void escribir(int fd, const void * datos, size_t len, off_t pos) {
+	const char * p = datos;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, pos);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+		p += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Lee el cuerpo de un archivo o de una variante (de su fd o de memoria) */
+char * leerCuerpo(int fd, char * datos, off_t size) {
+	char * buf = malloc(size > 0 ? size : 1);
+	if (datos != NULL) {
+		memcpy(buf, datos, size);
+	} else if (pread(fd, buf, size, 0) != size) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Posicion del proximo cuerpo, alineada a pagina */
+uint64_t alinear(uint64_t pos) {
+	return (pos + ALINEACION_PAQUETE - 1) & ~((uint64_t) ALINEACION_PAQUETE - 1);
+}
+
+int main(int argc, char * argv[]) {
+	if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-t") == 0)) {
+		fprintf(stderr, "Uso: %s directorio paquete [-t mime.types]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	openlog("empaquetar", LOG_PERROR, LOG_USER);
+	iniciarMIME();
+	if (argc == 5) cargarMIME(argv[4]);
+	// Sin cache: cada archivo es una entrada suelta. Todo lo que achique se comprime.
+	config.maxCache = 0;
+	config.memCompresion = (size_t) 1 << 40;
+
+	// El paquete nuevo se escribe al lado del final (en el mismo sistema de archivos, para el rename)
+	char temporal[strlen(argv[2]) + 16];
+	snprintf(temporal, sizeof(temporal), "%s.tmpXXXXXX", argv[2]);
+	int salida = mkstemp(temporal);
+	struct stat st;
+	if (salida < 0 || fstat(salida, &st) < 0) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	fchmod(salida, 0644);
+	dispositivoSalida = st.st_dev;
+	inodoSalida = st.st_ino;
+	char * directorioSalida = getcwd(NULL, 0);
+
+	if (chdir(argv[1]) < 0 || nftw(".", anotarArchivo, 32, FTW_PHYS) < 0) {
+		perror(argv[1]);
+		unlink(temporal);
+		return EXIT_FAILURE;
+	}
+
+	struct archivoPaquete * archivos = calloc(cantRutas > 0 ? cantRutas : 1, sizeof(struct archivoPaquete));
+	char * nombres = NULL;
+	size_t lenNombres = 0;
+	uint32_t cant = 0;
+	uint64_t pos = ALINEACION_PAQUETE;
+	size_t bytesVariantes = 0;
+	int i;
+	for (i = 0; i < cantRutas; i++) {
+		// Solo van los estaticos que el servidor mandaria: los PHP (y los que no
+		// tienen un tipo conocido) los sigue resolviendo desde el directorio
+		char extension[MAX_EXTENSION];
+		extensionArchivo(rutas[i], extension, sizeof(extension));
+		char * tipoCont = buscarMIME(extension);
+		if (tipoCont == NULL || strcmp(extension, "php") == 0 || strlen(tipoCont) >= sizeof(archivos->tipoCont))
+			continue;
+		struct archivoCache * e = cargarCache(rutas[i], tipoCont);
+		if (e == NULL) continue;
+		char * cuerpo = leerCuerpo(e->fd, NULL, e->size);
+		if (cuerpo == NULL) {
+			soltarArchivoCache(e);
+			continue;
+		}
+
+		// El ETag sale del contenido, asi no cambia entre un paquete y el siguiente
+		// (ni entre maquinas) si el archivo es el mismo
+		snprintf(e->etag, sizeof(e->etag), "\"%016llx-%llx\"",
+			(unsigned long long) hashContenido(cuerpo, e->size), (unsigned long long) e->size);
+		armarHeadersCache(e);
+
+		struct archivoPaquete * a = &archivos[cant];
+		a->offsetRuta = lenNombres;		// se corrige al ubicar los nombres
+		nombres = realloc(nombres, lenNombres + strlen(rutas[i]) + 1);
+		strcpy(nombres + lenNombres, rutas[i]);
+		lenNombres += strlen(rutas[i]) + 1;
+		a->offset = pos;
+		a->size = e->size;
+		a->mtime = e->mtime;
+		a->hash = e->hash;
+		a->comprimible = e->comprimible;
+		a->lenHeaders = e->lenHeaders;
+		strcpy(a->tipoCont, tipoCont);
+		memcpy(a->headers, e->headers, e->lenHeaders);
+		memcpy(a->etag, e->etag, sizeof(a->etag));
+		memcpy(a->ultimaModificacion, e->ultimaModificacion, sizeof(a->ultimaModificacion));
+		escribir(salida, cuerpo, e->size, pos);
+		pos = alinear(pos + e->size);
+		free(cuerpo);
+
+		int cod;
+		for (cod = 0; e->comprimible && cod < CANT_CODIFICACIONES; cod++) {
+			struct variante * v = &e->variantes[cod];
+			if (v->fd < 0) comprimirVariante(e, cod);
+			if (v->fd < 0 && v->datos == NULL) continue;
+			// Con el ETag nuevo cambian tambien los de las variantes
+			armarHeadersVariante(e, cod);
+			char * comprimido = leerCuerpo(v->fd, v->datos, v->size);
+			if (comprimido == NULL) continue;
+			struct variantePaquete * vp = &a->variantes[cod];
+			vp->offset = pos;
+			vp->size = v->size;
+			vp->lenHeaders = v->lenHeaders;
+			memcpy(vp->headers, v->headers, v->lenHeaders);
+			memcpy(vp->etag, v->etag, sizeof(vp->etag));
+			escribir(salida, comprimido, v->size, pos);
+			pos = alinear(pos + v->size);
+			bytesVariantes += v->size;
+			free(comprimido);
+		}
+		soltarArchivoCache(e);
+		cant++;
+	}
+
+	// Despues de los cuerpos van los archivos, la tabla de hash y las rutas
+	struct cabeceraPaquete cab;
+	memset(&cab, 0, sizeof(cab));
+	memcpy(cab.magia, MAGIA_PAQUETE, sizeof(cab.magia));
+	cab.cantArchivos = cant;
+	cab.tamTabla = 16;
+	while (cab.tamTabla < 2 * cant) cab.tamTabla *= 2;
+	cab.offsetArchivos = pos;
+	cab.offsetTabla = cab.offsetArchivos + cant * sizeof(struct archivoPaquete);
+	uint64_t offsetNombres = cab.offsetTabla + cab.tamTabla * sizeof(uint32_t);
+	cab.tam = offsetNombres + lenNombres;
+
+	uint32_t * tabla = calloc(cab.tamTabla, sizeof(uint32_t));
+	uint32_t n;
+	for (n = 0; n < cant; n++) {
+		uint32_t j = archivos[n].hash & (cab.tamTabla - 1);
+		while (tabla[j] != 0) j = (j + 1) & (cab.tamTabla - 1);
+		tabla[j] = n + 1;
+		archivos[n].offsetRuta += offsetNombres;
+	}
+	escribir(salida, archivos, cant * sizeof(struct archivoPaquete), cab.offsetArchivos);
+	escribir(salida, tabla, cab.tamTabla * sizeof(uint32_t), cab.offsetTabla);
+	escribir(salida, nombres, lenNombres, offsetNombres);
+	escribir(salida, &cab, sizeof(cab), 0);
+
+	// Recien cuando esta completo en el disco reemplaza al anterior
+	if (chdir(directorioSalida) < 0 || fsync(salida) < 0 || close(salida) < 0 ||
+			rename(temporal, argv[2]) < 0) {
+		perror(argv[2]);
+		unlink(temporal);
+		return EXIT_FAILURE;
+	}
+	printf("%u archivos, %zu bytes comprimidos, %llu bytes en total\n", cant, bytesVariantes,
+		(unsigned long long) cab.tam);
+	return EXIT_SUCCESS;
+}
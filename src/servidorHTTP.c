@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "servidorHTTP.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,41 +6,359 @@
 #include <unistd.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef USAR_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Configuracion del servidor (ver opciones en ayuda())
+struct configuracion config = {
+	.workers = 0,			// 0: uno por cada CPU
+	.backlog = SOMAXCONN,
+	.diferirAceptar = 1,
+	.colaFastOpen = 0,
+	.fijarCPU = 0,
+	.keepAlive = 5,
+	.plazoPedido = 10,
+	.plazoEscritura = 30,
+	.plazoPHP = 60,
+	.maxPedidos = 100,
+	.maxCache = 1024,
+	.memCompresion = 16 * 1024 * 1024,
+	.phpProcesos = 4,
+	.phpMaxPedidos = 500,
+	.ttlPHP = 0,
+	.destinoAccesos = NULL,
+	.formatoAccesos = FORMATO_COMBINED,
+	.muestreo = 1,
+	.maxErrores = 100,
+	.rutaEstado = "/server-status",
+	.uring = 0
+};
+
+// Motor de io_uring del worker (si se pidio con -u y el kernel lo permite)
+int motorUring = 0;
+struct anilloUring uring;
+
+// Metricas de todos los workers (memoria compartida) y las de este worker
+struct metricasWorker * metricas = NULL;
+struct metricasWorker * misMetricas = NULL;
+
+// Registro (log) asincronico del worker; NULL en el proceso principal, que escribe directo
+struct registro * registro = NULL;
+
+// Archivo del registro de accesos (-1 si los accesos van al syslog)
+int archivoAccesos = -1;
+
+// Socket Unix donde escuchan los php-cgi del pool y su direccion (la usan los workers)
+int socketPHP = -1;
+struct sockaddr_un direccionPHP;
+socklen_t lenDireccionPHP = 0;
+// Cantidad de php-cgi corriendo (la lleva el proceso principal, en memoria compartida)
+_Atomic int * phpVivos = NULL;
+
+// Descriptor del epoll del bucle de eventos
+int epollfd = -1;
+
+// Arenas de pedidos sin usar del worker, para no volver a pedirlas
+struct arena * arenasLibres = NULL;
+int cantArenasLibres = 0;
+
+// Conexiones cerradas en la vuelta actual del bucle, pendientes de liberar
+struct conexion * cerradas = NULL;
+
+// Rueda con los plazos de las conexiones del worker
+struct ruedaPlazos rueda;
+
+// Nombres de las fases con plazo (para las metricas)
+char * nombresPlazo[CANT_PLAZOS] = { "pedido", "ociosa", "escritura", "php" };
+
+// Cache de archivos abiertos del worker: tabla de hash por ruta y lista LRU
+struct archivoCache ** tablaCache = NULL;
+unsigned int tamTablaCache = 0;
+int cantCache = 0;
+struct archivoCache * masReciente = NULL;
+struct archivoCache * menosReciente = NULL;
+
+// Avisos de cambios en los directorios de los archivos de la cache
+int inotifyFd = -1;
+struct directorioVigilado * tablaVigilados[TAM_TABLA_VIGILADOS];
+
+// Descriptor que se suelta para poder rechazar conexiones cuando no quedan libres
+int reservaFd = -1;
+
+// Socket de escucha cuyo accept de io_uring espera a que se libere un descriptor
+int escuchaEnPausa = -1;
+
+// Paquete de documentos (-D) que se esta sirviendo y la vigilancia de su directorio
+struct paquete * paqueteVigente = NULL;
+int wdPaquete = -1;
+char * nombrePaquete = NULL;
+
+// Codificaciones soportadas, en orden de preferencia, y sus extensiones
+char * nombresCodificacion[CANT_CODIFICACIONES] = { "br", "gzip" };
+char * extensionesCodificacion[CANT_CODIFICACIONES] = { ".br", ".gz" };
+
+// Paginas de error. Las respuestas completas (con keep-alive y sin) se arman al arrancar
+struct rechazo rechazos[CANT_RECHAZOS] = {
+	[RECHAZO_400] = { RTA_400, "400 Bad Request", "The request sent didn't have the correct syntax." },
+	[RECHAZO_403] = { RTA_403, "403 Forbidden", "Not allowed to access the resource and authorization will not help." },
+	[RECHAZO_404] = { RTA_404, "404 Not Found", "The requested file was not found." },
+	[RECHAZO_431] = { RTA_431, "431 Request Header Fields Too Large", "The request headers are too large." },
+	[RECHAZO_431_CANTIDAD] = { RTA_431, "431 Request Header Fields Too Large", "The request has too many headers." },
+	[RECHAZO_500] = { RTA_500, "500 Internal Server Error", "The PHP interpreter could not be started." },
+	[RECHAZO_501] = { RTA_501, "501 Not Implemented", "The requested method is not implemented." },
+	[RECHAZO_503] = { RTA_503, "503 Service Unavailable", "No PHP interpreter is available." },
+	[RECHAZO_413] = { RTA_413, "413 Content Too Large", "PHP scripts do not accept a request body." },
+	[RECHAZO_504] = { RTA_504, "504 Gateway Timeout", "The PHP script did not answer in time." }
+};
+
+// Memoria usada por las variantes comprimidas en memoria de la cache
+size_t memVariantes = 0;
+
+// Arbol de rutas, armado antes de lanzar los workers
+struct nodoRutas raizRutas = { "", 0, NULL, NULL, NULL };
+
+// Indices de los directorios del worker, en el orden en que se buscan
+char * nombresIndice[CANT_INDICES] = { "index.html", "index.htm", "index.php" };
+struct indiceDirectorio * tablaIndices[TAM_TABLA_INDICES];
+int cantIndices = 0;
+
+// Tipos de contenido por extension (tabla de hash), cargados antes de lanzar los workers
+struct tipoMIME * tablaMIME[TAM_TABLA_MIME];
+
+// Tipos incluidos en el servidor (con -t se agregan o reemplazan desde un mime.types)
+const char * tiposIncluidos[][2] = {
+	{ "html", "text/html" }, { "htm", "text/html" }, { "shtml", "text/html" },
+	{ "css", "text/css" }, { "js", "text/javascript" }, { "mjs", "text/javascript" },
+	{ "json", "application/json" }, { "map", "application/json" },
+	{ "webmanifest", "application/manifest+json" }, { "xml", "text/xml" },
+	{ "xhtml", "application/xhtml+xml" }, { "rss", "application/rss+xml" },
+	{ "atom", "application/atom+xml" }, { "txt", "text/plain" }, { "csv", "text/csv" },
+	{ "md", "text/markdown" }, { "ics", "text/calendar" },
+	{ "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "png", "image/png" },
+	{ "gif", "image/gif" }, { "webp", "image/webp" }, { "avif", "image/avif" },
+	{ "svg", "image/svg+xml" }, { "ico", "image/x-icon" }, { "bmp", "image/bmp" },
+	{ "tif", "image/tiff" }, { "tiff", "image/tiff" },
+	{ "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" },
+	{ "otf", "font/otf" }, { "eot", "application/vnd.ms-fontobject" },
+	{ "mp3", "audio/mpeg" }, { "ogg", "audio/ogg" }, { "oga", "audio/ogg" },
+	{ "opus", "audio/ogg" }, { "wav", "audio/wav" }, { "flac", "audio/flac" },
+	{ "m4a", "audio/mp4" }, { "aac", "audio/aac" },
+	{ "mp4", "video/mp4" }, { "m4v", "video/mp4" }, { "webm", "video/webm" },
+	{ "ogv", "video/ogg" }, { "mov", "video/quicktime" }, { "avi", "video/x-msvideo" },
+	{ "mkv", "video/x-matroska" },
+	{ "pdf", "application/pdf" }, { "wasm", "application/wasm" }, { "zip", "application/zip" },
+	{ "gz", "application/gzip" }, { "tar", "application/x-tar" }, { "bz2", "application/x-bzip2" },
+	{ "xz", "application/x-xz" }, { "7z", "application/x-7z-compressed" },
+	{ "epub", "application/epub+zip" }, { "rtf", "application/rtf" },
+	{ "doc", "application/msword" }, { "xls", "application/vnd.ms-excel" },
+	{ "ppt", "application/vnd.ms-powerpoint" },
+	{ "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+	{ "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+	{ "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+	{ "odt", "application/vnd.oasis.opendocument.text" },
+	{ "ods", "application/vnd.oasis.opendocument.spreadsheet" }
+};
+
+// Cache de respuestas PHP del worker (tabla de hash por clave) y los headers
+// del pedido que forman parte de la clave
+struct respuestaPHP * tablaPHP[TAM_TABLA_PHP];
+int cantRespuestasPHP = 0;
+char ** variarPHP = NULL;
+int cantVariarPHP = 0;
+
+// Tabla estatica de HPACK (RFC 7541, apendice A)
+const char * estaticaHPACK[CANT_ESTATICA_HPACK][2] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+// Largo en bits del codigo Huffman de HPACK de cada byte (y de EOS, el 256). Al
+// ser un codigo canonico, los codigos salen de los largos (ver iniciarHPACK)
+const unsigned char largosHuffman[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+unsigned int primerCodigoHuffman[MAX_LARGO_HUFFMAN + 1];
+unsigned int cantCodigosHuffman[MAX_LARGO_HUFFMAN + 1];
+int inicioLargoHuffman[MAX_LARGO_HUFFMAN + 1];
+unsigned short simbolosHuffman[257];
 
 
 /* Muestra el mensaje de error y termina el programa con EXIT_FAILURE */
 void error(char *msg) {
-	log_error(msg);
+	// El proceso termina: no se puede dejar en el registro para despues
+	syslog(LOG_ERR, "%s", msg);
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-/* Para loggear errores en el system log */
+/* Para loggear errores en el system log. En los workers pasan por el registro
+ * asincronico, con un maximo de config.maxErrores por segundo */
 void log_error(char *msg) {
-	openlog ("servidorHTTP", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL0);
-	syslog (LOG_ERR, msg);
-	closelog ();
+	static time_t segundo = 0;
+	static int errores = 0;
+	if (registro == NULL) {
+		syslog(LOG_ERR, "%s", msg);
+		return;
+	}
+	time_t ahora = time(NULL);
+	if (ahora != segundo) {
+		segundo = ahora;
+		errores = 0;
+	}
+	if (++errores > config.maxErrores) {
+		atomic_fetch_add_explicit(&registro->descartadas, 1, memory_order_relaxed);
+		return;
+	}
+	encolarRegistro(REGISTRO_ERRORES, LOG_ERR, msg, strlen(msg));
 }
 
 /* Para loggear informacion en el system log */
 void log_info(char *msg) {
-	openlog ("servidorHTTP", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL0);
-	syslog (LOG_INFO, msg);
-	closelog ();
+	if (registro == NULL) {
+		syslog(LOG_INFO, "%s", msg);
+		return;
+	}
+	encolarRegistro(REGISTRO_ERRORES, LOG_INFO, msg, strlen(msg));
 }
 
 /* Muestra mensaje de ayuda */
 void ayuda() {
-   printf("Modo de uso: ./servidorHTTP [servidor][:puerto] [-h]\n \n");
+   printf("Modo de uso: ./servidorHTTP [servidor][:puerto] [-w workers] [-b backlog] [-d segundos]\n");
+   printf("\t\t[-T cola] [-a] [-k segundos] [-H segundos] [-W segundos] [-P segundos]\n");
+   printf("\t\t[-m pedidos] [-f archivos] [-z megas] [-p procesos] [-r pedidos] [-c segundos] [-v headers]\n");
+   printf("\t\t[-t mime.types] [-l destino] [-L formato] [-s muestreo] [-e errores] [-S ruta] [-u]\n");
+   printf("\t\t[-D paquete] [-R rutas] [-h]\n \n");
    printf("\t[servidor]: \tDireccion IP del servidor. (Default: localhost) \n");
    printf("\t[:puerto]: \tPuerto del servidor. (Default: 80)\n");
+   printf("\t[-w workers]: \tCantidad de procesos worker. (Default: uno por CPU)\n");
+   printf("\t[-b backlog]: \tLargo de la cola de conexiones de cada worker. (Default: %d)\n", SOMAXCONN);
+   printf("\t[-d segundos]: \tTiempo que el kernel espera el pedido antes de entregar una conexion. (Default: 1, 0 no espera)\n");
+   printf("\t[-T cola]: \tConexiones TCP Fast Open pendientes por worker. (Default: 0, sin Fast Open)\n");
+   printf("\t[-a]: \t\tFija cada worker a un CPU. \n");
+   printf("\t[-k segundos]: \tTiempo maximo de espera de una conexion keep-alive. (Default: 5, 0 la desactiva)\n");
+   printf("\t[-H segundos]: \tTiempo maximo para recibir los headers de un pedido. (Default: 10, 0 sin limite)\n");
+   printf("\t[-W segundos]: \tTiempo maximo sin poder mandarle nada al cliente. (Default: 30, 0 sin limite)\n");
+   printf("\t[-P segundos]: \tTiempo maximo de ejecucion de un script PHP. (Default: 60, 0 sin limite)\n");
+   printf("\t[-m pedidos]: \tCantidad maxima de pedidos por conexion. (Default: 100)\n");
+   printf("\t[-f archivos]: \tCantidad maxima de archivos abiertos en la cache de cada worker. (Default: 1024, 0 la desactiva)\n");
+   printf("\t[-z megas]: \tMemoria de cada worker para archivos comprimidos al vuelo. (Default: 16, 0 lo desactiva)\n");
+   printf("\t[-p procesos]: \tCantidad de procesos php-cgi (FastCGI) del pool, 0 sin PHP. (Default: 4)\n");
+   printf("\t[-r pedidos]: \tPedidos que atiende cada php-cgi antes de ser reiniciado. (Default: 500)\n");
+   printf("\t[-c segundos]: \tTiempo que se guardan las respuestas PHP sin Cache-Control ni Expires. (Default: 0, sin cache)\n");
+   printf("\t[-v headers]: \tHeaders del pedido (separados por comas) que cambian la respuesta PHP guardada.\n");
+   printf("\t[-t archivo]: \tArchivo con formato mime.types con tipos de contenido para agregar.\n");
+   printf("\t[-l destino]: \tArchivo del registro de accesos, o syslog. (Default: sin registro de accesos)\n");
+   printf("\t[-L formato]: \tFormato del registro de accesos: common, combined o json. (Default: combined)\n");
+   printf("\t[-s muestreo]: \tSe registra 1 de cada tantos accesos (los errores 5xx siempre). (Default: 1)\n");
+   printf("\t[-e errores]: \tMaximo de errores por segundo que registra cada worker. (Default: 100)\n");
+   printf("\t[-S ruta]: \tRuta de las metricas (solo para clientes locales), vacia para no publicarlas. (Default: /server-status)\n");
+   printf("\t[-u]: \t\tUsa io_uring para aceptar, recibir y mandar (si el kernel no lo permite, epoll).\n");
+   printf("\t[-D paquete]: \tPaquete de documentos (armado con empaquetar) que se sirve mapeado en memoria.\n");
+   printf("\t[-R rutas]: \tArchivo de rutas: \"prefijo raiz|alias|php|redireccion destino\" por linea.\n");
    printf("\t[-h]: \t\tAyuda por pantalla (este mensaje). \n");
    printf("\n");
    printf("Si no se especifica servidor o puerto, la direccion \n");
@@ -47,6 +366,11 @@ void ayuda() {
    exit(EXIT_SUCCESS);
 }
 
+/* Solo despierta al supervisor (la alarma interrumpe su wait) */
+void despertarSupervisor(int sig) {
+	(void) sig;
+}
+
 /* Manejador de señales */
 void signalHandler(int sig) {
 	if (sig == SIGUSR1) {  
@@ -75,11 +399,119 @@ int verificarPuerto(char * puerto){
 }
 
 int main(int argc, char *argv[]) {
-	// Reviso si me ingresaron un -h para mostrar ayuda
-	// Si asi fuera, se muestra la ayuda y se termina el programa
-	int i;
-	for (i = 1; i <= (argc - 1); i++) {
-		if (strcmp("-h", argv[i]) == 0) {
+	// Reviso las opciones ingresadas. Si me pidieron -h (o una opcion
+	// invalida) se muestra la ayuda y se termina el programa
+	int opt;
+	char * archivoMIME = NULL;
+	char * archivoRutas = NULL;
+	
+	// La conexion con el syslog se abre una sola vez y la heredan los workers
+	openlog("servidorHTTP", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL0);
+	while ((opt = getopt(argc, argv, "hw:b:d:T:ak:H:W:P:m:f:z:p:r:c:v:t:l:L:s:e:S:uD:R:")) != -1) {
+		switch (opt) {
+		case 'w':
+			config.workers = atoi(optarg);
+			if (config.workers < 1) error(ERROR_INPUT_DATOS);
+			break;
+		case 'b':
+			config.backlog = atoi(optarg);
+			if (config.backlog < 1) error(ERROR_INPUT_DATOS);
+			break;
+		case 'd':
+			config.diferirAceptar = atoi(optarg);
+			if (config.diferirAceptar < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'T':
+			config.colaFastOpen = atoi(optarg);
+			if (config.colaFastOpen < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'a':
+			config.fijarCPU = 1;
+			break;
+		case 'k':
+			config.keepAlive = atoi(optarg);
+			if (config.keepAlive < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'H':
+			config.plazoPedido = atoi(optarg);
+			if (config.plazoPedido < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'W':
+			config.plazoEscritura = atoi(optarg);
+			if (config.plazoEscritura < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'P':
+			config.plazoPHP = atoi(optarg);
+			if (config.plazoPHP < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'm':
+			config.maxPedidos = atoi(optarg);
+			if (config.maxPedidos < 1) error(ERROR_INPUT_DATOS);
+			break;
+		case 'f':
+			config.maxCache = atoi(optarg);
+			if (config.maxCache < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'z':
+			if (atoi(optarg) < 0) error(ERROR_INPUT_DATOS);
+			config.memCompresion = (size_t) atoi(optarg) * 1024 * 1024;
+			break;
+		case 'p':
+			config.phpProcesos = atoi(optarg);
+			if (config.phpProcesos < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'r':
+			config.phpMaxPedidos = atoi(optarg);
+			if (config.phpMaxPedidos < 1) error(ERROR_INPUT_DATOS);
+			break;
+		case 'c':
+			config.ttlPHP = atoi(optarg);
+			if (config.ttlPHP < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 't':
+			archivoMIME = optarg;
+			break;
+		case 'l':
+			config.destinoAccesos = optarg;
+			break;
+		case 'L':
+			if (strcmp(optarg, "common") == 0) config.formatoAccesos = FORMATO_COMMON;
+			else if (strcmp(optarg, "combined") == 0) config.formatoAccesos = FORMATO_COMBINED;
+			else if (strcmp(optarg, "json") == 0) config.formatoAccesos = FORMATO_JSON;
+			else error(ERROR_INPUT_DATOS);
+			break;
+		case 's':
+			config.muestreo = atoi(optarg);
+			if (config.muestreo < 1) error(ERROR_INPUT_DATOS);
+			break;
+		case 'e':
+			config.maxErrores = atoi(optarg);
+			if (config.maxErrores < 0) error(ERROR_INPUT_DATOS);
+			break;
+		case 'u':
+			config.uring = 1;
+			break;
+		case 'D':
+			config.paquete = optarg;
+			break;
+		case 'R':
+			archivoRutas = optarg;
+			break;
+		case 'S':
+			// Con una ruta vacia no se publican las metricas
+			config.rutaEstado = optarg[0] != '\0' ? optarg : NULL;
+			break;
+		case 'v': {
+			// Lista de headers separados por comas
+			char * header = strtok(strdup(optarg), ", ");
+			while (header != NULL) {
+				variarPHP = realloc(variarPHP, (cantVariarPHP + 1) * sizeof(char *));
+				variarPHP[cantVariarPHP++] = header;
+				header = strtok(NULL, ", ");
+			}
+			break;
+		}
+		default:
 			ayuda();
 		}
 	}
@@ -87,7 +519,7 @@ int main(int argc, char *argv[]) {
 	// Configuración para el manejo de señales
 	signal(SIGUSR1, (void *)signalHandler);
 	signal(SIGUSR2, (void *)signalHandler);
-    signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
 	signal(SIGABRT, (void *)signalHandler);
 	signal(SIGHUP, (void *)signalHandler);
 	signal(SIGINT, (void *)signalHandler);
@@ -102,12 +534,12 @@ int main(int argc, char *argv[]) {
 	char * puerto = NULL; 
 	// Asigno Servidor:Puerto, si existiera
 	// En caso de que no ingreso argumentos, uso el default
-	if (argc == 1) {
+	if (optind >= argc) {
 		// No pasaron argumentos (uso default!)
 		servidor = strdup(LOCALHOST); 	// 127.0.0.1
 		puerto = strdup(WEBPORT);		// 80
 	} else {
-		char * str = argv[1];
+		char * str = argv[optind];
 		
 		// Split Servidor:Puerto
 		servidor = strtok(str, ":");
@@ -134,17 +566,131 @@ int main(int argc, char *argv[]) {
 	} else 	if (!verificarIP(servidor) || !verificarPuerto(puerto)) {
 		error(ERROR_IP_PORT);
 	}
+	
+	// El registro de accesos va a un archivo (compartido por los workers, en modo
+	// append cada lote se escribe entero) o al syslog
+	if (config.destinoAccesos != NULL && strcmp(config.destinoAccesos, "syslog") != 0) {
+		archivoAccesos = open(config.destinoAccesos, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (archivoAccesos < 0) error(ERROR_REGISTRO);
+	}
+	
+	// Los workers heredan la tabla de tipos ya armada
+	iniciarMIME();
+	if (archivoMIME != NULL) cargarMIME(archivoMIME);
+	armarRechazos();
+	iniciarHPACK();
+	
+	// Sin otra regla, todo se sirve del directorio del servidor
+	agregarRegla("/", RUTA_RAIZ, ".");
+	if (archivoRutas != NULL) cargarRutas(archivoRutas);
+	
+	// Un paquete que no sirve se detecta antes de arrancar (cada worker lo mapea por su cuenta)
+	if (config.paquete != NULL) {
+		struct paquete * p = cargarPaquete(config.paquete);
+		if (p == NULL) error(ERROR_PAQUETE);
+		soltarPaquete(p);
+	}
+	
+	// Por defecto un worker por cada CPU disponible
+	if (config.workers == 0) {
+		config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (config.workers < 1) config.workers = 1;
+	}
+	
+	// Cada worker tiene su propio socket de escucha, todos ligados a servidor:puerto.
+	// Los creo todos aca para detectar errores de bind antes de arrancar y para
+	// que un worker que se reinicia reutilice su socket (y las conexiones encoladas).
+	int * sockets = malloc(config.workers * sizeof(int));
+	iniciarMetricas();
+	pid_t * workers = malloc(config.workers * sizeof(pid_t));
+	int w;
+	for (w = 0; w < config.workers; w++) {
+		sockets[w] = crearSocketEscucha(servidor, atoi(puerto), config.backlog);
+	}
+	
+	
+	// El pool de php-cgi escucha en un unico socket Unix: cada php-cgi libre
+	// toma la proxima conexion, y uno reiniciado sigue con la misma cola.
+	// Con -p 0 no hay pool y los .php se rechazan
+	phpVivos = mmap(NULL, sizeof(*phpVivos), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (phpVivos == MAP_FAILED)
+		error(ERROR_METRICAS);
+	if (config.phpProcesos > 0) socketPHP = crearSocketPHP(config.backlog);
+	pid_t * procesosPHP = calloc(config.phpProcesos, sizeof(pid_t));
+	time_t * inicioPHP = calloc(config.phpProcesos, sizeof(time_t));
+	int * esperaPHP = calloc(config.phpProcesos, sizeof(int));
+	int proximoPHP = revisarPoolPHP(procesosPHP, inicioPHP, esperaPHP, sockets);
+	
+	for (w = 0; w < config.workers; w++) {
+		workers[w] = iniciarWorker(w, sockets);
+	}
+	
+	// La alarma solo interrumpe el wait, para relanzar a tiempo un php-cgi demorado
+	struct sigaction alarma;
+	memset(&alarma, 0, sizeof(alarma));
+	alarma.sa_handler = despertarSupervisor;
+	sigaction(SIGALRM, &alarma, NULL);
+	
+	// El proceso principal solo supervisa: si un worker o un php-cgi muere, lo reinicio
+	while (1) {
+		int estado;
+		if (proximoPHP > 0) alarm(proximoPHP);
+		pid_t pid = wait(&estado);
+		if (pid < 0 && errno != EINTR) error(ERROR_UNEXPECTED_END);
+		for (w = 0; pid > 0 && w < config.workers; w++) {
+			if (workers[w] == pid) {
+				log_error(ERROR_WORKER);
+				workers[w] = iniciarWorker(w, sockets);
+			}
+		}
+		for (w = 0; pid > 0 && w < config.phpProcesos; w++) {
+			if (procesosPHP[w] == pid) {
+				// Terminar despues de phpMaxPedidos es lo esperado, pero si muere
+				// enseguida (por ejemplo, php-cgi no arranca) espera cada vez mas
+				procesosPHP[w] = 0;
+				atomic_fetch_sub(phpVivos, 1);
+				esperaPHP[w] = time(NULL) - inicioPHP[w] < 1 ? siguienteEsperaPHP(esperaPHP[w]) : 0;
+			}
+		}
+		proximoPHP = revisarPoolPHP(procesosPHP, inicioPHP, esperaPHP, sockets);
+	}
+	
+	// No deberia llegar aca
+	return 0; 
+}
 
-	int sockfd, newsockfd, portno, clilen, pid;
-	struct sockaddr_in serv_addr, cli_addr;
+/* Crea un socket TCP ligado a servidor:puerto que comparte el puerto
+ * con los sockets de los demas workers (SO_REUSEPORT) */
+int crearSocketEscucha(char * servidor, int portno, int backlog) {
+	int sockfd, uno = 1;
+	struct sockaddr_in serv_addr;
 	
 	// creo un socket TCP y obtengo el File Descriptor
 	sockfd = socket(AF_INET, SOCK_STREAM, 0); 
 	if (sockfd < 0) 
 		error(ERROR_ABRIR_SOCKET);
 	
+	// Todos los workers ligan el mismo puerto y el kernel reparte las conexiones
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &uno, sizeof(uno)) < 0 ||
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &uno, sizeof(uno)) < 0)
+		error(ERROR_ABRIR_SOCKET);
+	
+	// Cada respuesta ya sale junta (un sendmsg, o MSG_MORE antes del sendfile), asi
+	// que Nagle no ahorra segmentos: solo haria esperar el ACK retrasado (~40 ms) a
+	// la cola de una respuesta o a los marcos HTTP/2 que siguen a otros sin
+	// confirmar. Las conexiones aceptadas heredan la opcion
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+	
+	// El kernel entrega la conexion recien cuando llega el pedido, asi que el
+	// worker no se despierta por conexiones que todavia no mandan nada
+	if (config.diferirAceptar > 0)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.diferirAceptar, sizeof(int));
+	// Con Fast Open el pedido viaja en el SYN de los clientes que ya se conectaron
+	// antes (requiere el bit 2 de net.ipv4.tcp_fastopen)
+	if (config.colaFastOpen > 0)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &config.colaFastOpen, sizeof(int));
+	
 	bzero((char *) &serv_addr, sizeof(serv_addr));
-	portno = atoi(puerto);
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = inet_addr(servidor); 
 	serv_addr.sin_port = htons(portno);
@@ -152,389 +698,5069 @@ int main(int argc, char *argv[]) {
 	if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
 		error(ERROR_BIND_SOCKET);
 	
-	listen(sockfd,5);
-	clilen = sizeof(cli_addr);
-	while (1) {
-		newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-		if (newsockfd < 0) 
-			error(ERROR_ACCEPT_SOCKET);
+	if (listen(sockfd, backlog) < 0)
+		error(ERROR_BIND_SOCKET);
+	
+	return sockfd;
+}
+
+/* Lanza el worker numero nro, que atiende las conexiones de sockets[nro] */
+pid_t iniciarWorker(int nro, int * sockets) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		error(ERROR_FORK);
+	} else if (pid == 0) {
+		// Soy el worker. Si el proceso principal muere, muero con el
+		prctl(PR_SET_PDEATHSIG, SIGUSR1);
+		if (getppid() == 1) exit(EXIT_SUCCESS);
 		
-		pid = fork();
+		// Me quedo solo con mi socket de escucha (al pool de php-cgi me conecto por su direccion)
+		int w;
+		for (w = 0; w < config.workers; w++) {
+			if (w != nro) close(sockets[w]);
+		}
+		if (socketPHP >= 0) close(socketPHP);
 		
-		if (pid < 0) {
-			error(ERROR_FORK);
-		} else if (pid == 0)  {
-			// Soy hijo, me desligo del socket paterno y atiendo el pedido
-			close(sockfd);
-			atenderPedido(newsockfd);
-			exit(EXIT_SUCCESS);
-		} else  { 
-			// Soy padre, me desligo del socket de mi hijo 
-			// y sigo atendiendo pedidos.
-			close(newsockfd);
+		// Los contadores siguen de la vida anterior del worker, pero
+		// sus conexiones murieron con el
+		misMetricas = &metricas[nro];
+		atomic_store(&misMetricas->conexiones, 0);
+		atomic_store(&misMetricas->phpActivos, 0);
+		
+		if (config.fijarCPU) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(nro % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+			if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+				log_error(ERROR_AFINIDAD);
 		}
-	} 
-	// No deberia llegar aca
-	return 0; 
+		
+		// Atiendo todas mis conexiones con el bucle de eventos
+		bucleEventos(sockets[nro]);
+		exit(EXIT_SUCCESS);
+	}
+	return pid;
 }
 
-/* Parsea el mensaje dado en buffer y retorna el tipo de mensaje, 
- * la ruta del archivo y el protocolo usado.
- * No se encarga de hacer chequeos sobre la correctitud del mensaje.
- *  */
-void parseMsg (char * buf, char ** tipoMsg, char ** ruta, char ** protocolo) { 
-   	char * token = strtok(buf, "\n\r");
-    *tipoMsg = strtok(token," ");
-    *ruta = strtok(NULL," ");
-    *protocolo = strtok(NULL," ");    	
+/* Crea el socket Unix (en el espacio abstracto, sin archivo) donde escuchan los php-cgi */
+int crearSocketPHP(int backlog) {
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		error(ERROR_ABRIR_SOCKET);
+	
+	// El nombre incluye el pid del proceso principal para poder correr varios servidores
+	memset(&direccionPHP, 0, sizeof(direccionPHP));
+	direccionPHP.sun_family = AF_UNIX;
+	int n = snprintf(direccionPHP.sun_path + 1, sizeof(direccionPHP.sun_path) - 1,
+		"servidorHTTP-php-%d", (int) getpid());
+	lenDireccionPHP = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+	
+	if (bind(sock, (struct sockaddr *) &direccionPHP, lenDireccionPHP) < 0)
+		error(ERROR_BIND_SOCKET);
+	if (listen(sock, backlog) < 0)
+		error(ERROR_BIND_SOCKET);
+	return sock;
 }
 
-int archivoExiste(char * archivo) {
-	int rval = access (archivo, F_OK);
-	if (rval == 0) 
-			return 1;
-	else return 0;
+/* Lanza un php-cgi del pool. Recibe el socket de escucha como entrada estandar,
+ * que es como php-cgi sabe que tiene que atender FastCGI */
+pid_t iniciarPHP(int * sockets) {
+	// Si el exec falla, el hijo lo avisa por el pipe (que con un exec exitoso se cierra solo)
+	int aviso[2], err;
+	if (pipe2(aviso, O_CLOEXEC) < 0) {
+		log_error(ERROR_FORK);
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_error(ERROR_FORK);
+	} else if (pid == 0) {
+		// Si el proceso principal muere, muero con el
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() == 1) _exit(EXIT_SUCCESS);
+		
+		int w;
+		close(aviso[0]);
+		for (w = 0; w < config.workers; w++) close(sockets[w]);
+		dup2(socketPHP, 0);
+		close(socketPHP);
+		
+		// Un solo proceso por php-cgi (el pool lo maneja el servidor), que
+		// termina despues de atender phpMaxPedidos pedidos para ser reiniciado
+		char maxPedidos[16];
+		snprintf(maxPedidos, sizeof(maxPedidos), "%d", config.phpMaxPedidos);
+		unsetenv("PHP_FCGI_CHILDREN");
+		setenv("PHP_FCGI_MAX_REQUESTS", maxPedidos, 1);
+		
+		execlp("php-cgi", "php-cgi", NULL);
+		err = errno;
+		log_error(ERROR_PHP);
+		// Si el aviso no llega, el proceso principal lo ve morir enseguida y espera igual
+		if (write(aviso[1], &err, sizeof(err)) < 0) {}
+		_exit(EXIT_FAILURE);
+	}
+	close(aviso[1]);
+	if (pid > 0) {
+		ssize_t n;
+		do n = read(aviso[0], &err, sizeof(err)); while (n < 0 && errno == EINTR);
+		// El hijo que no pudo ejecutar php-cgi termina solo (y lo junta el wait)
+		if (n > 0) pid = -1;
+	}
+	close(aviso[0]);
+	return pid;
 }
 
-int archivoAbrible(char * archivo) {
-	int rval = access (archivo, R_OK);
-	if (rval == 0) 
-			return 1;
-	else return 0;
+/* Lanza los php-cgi del pool que no estan corriendo y ya cumplieron su espera.
+ * Retorna los segundos hasta el proximo que queda esperando (0 si no hay) */
+int revisarPoolPHP(pid_t * procesos, time_t * inicio, int * espera, int * sockets) {
+	time_t ahora = time(NULL);
+	int proximo = 0, w;
+	for (w = 0; w < config.phpProcesos; w++) {
+		if (procesos[w] != 0) continue;
+		long falta = inicio[w] + espera[w] - ahora;
+		if (falta <= 0) {
+			inicio[w] = ahora;
+			procesos[w] = iniciarPHP(sockets);
+			if (procesos[w] > 0) {
+				atomic_fetch_add(phpVivos, 1);
+				continue;
+			}
+			procesos[w] = 0;
+			espera[w] = siguienteEsperaPHP(espera[w]);
+			falta = espera[w];
+		}
+		if (proximo == 0 || falta < proximo) proximo = falta;
+	}
+	return proximo;
 }
 
-long archivoSize(char * archivo) {
-	FILE *file = fopen(archivo, "rb");
-	if (!file) error(ERROR_ABRIR_ARCHIVO); 
-	fseek(file, 0, SEEK_END);
-	long f_size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-	fclose(file);
-	return f_size;
+/* La espera antes de relanzar un php-cgi que no arranco: se duplica cada vez */
+int siguienteEsperaPHP(int espera) {
+	if (espera == 0) return 1;
+	return espera * 2 < MAX_ESPERA_PHP ? espera * 2 : MAX_ESPERA_PHP;
 }
 
-/* Revisa si una cadena dada es GET */
-int esGet(char * msg){
-	if (strcmp("GET", msg) == 0) 
-		return 1;
-	else return 0;
+/* Pone un descriptor en modo no bloqueante (y que no se herede en los exec) */
+int setNoBloqueante(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+		return -1;
+	return 0;
 }
 
-/* Revisa si una cadena dada es barra (/) */
-int esBarra(char * msg){
-	if (strcmp(msg,"/")==0)
-		return 1;
-	else return 0;
+/* Bucle principal: espera eventos y hace avanzar cada conexion */
+void bucleEventos(int sockfd) {
+	struct epoll_event ev, eventos[MAX_EVENTOS];
+	static struct fuente fuenteEscucha = { FUENTE_ESCUCHA, NULL };
+	int n;
+	
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0)
+		error(ERROR_EPOLL);
+	
+	reservaFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	iniciarCache();
+	iniciarPaquete();
+	// Los indices de los directorios tambien se vigilan (aunque no haya cache)
+	iniciarInotify();
+	iniciarRegistro();
+	iniciarRueda();
+	
+	if (config.uring) {
+		if (iniciarUring() == 0) {
+			// io_uring espera que el socket este listo en vez de devolver EAGAIN,
+			// asi que el de escucha queda bloqueante (y las conexiones tambien)
+			fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+			motorUring = 1;
+			bucleUring(sockfd);
+		}
+		log_error(ERROR_URING);
+	}
+	
+	if (setNoBloqueante(sockfd) < 0)
+		error(ERROR_ABRIR_SOCKET);
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &fuenteEscucha;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+		error(ERROR_EPOLL);
+	
+	while (1) {
+		n = epoll_wait(epollfd, eventos, MAX_EVENTOS, esperaPlazos());
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			error(ERROR_EPOLL);
+		}
+		vencerPlazos();
+		atenderEventos(sockfd, eventos, n);
+		liberarCerradas();
+	}
 }
 
-/* Manda headers a traves del socket, 
- * segun el tipo de respuesta y de contenido */
-void mandarHeader(int sock, char * resp){
-	if (resp!=NULL) {
-		if (send(sock,resp,strlen(resp),0) < 0) {
-			error(ERROR_SEND_SOCKET);
+/* Atiende los eventos que devolvio epoll */
+void atenderEventos(int sockfd, struct epoll_event * eventos, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		struct fuente * f = eventos[i].data.ptr;
+		struct conexion * c = f->conexion;
+		if (f->tipo == FUENTE_ESCUCHA) {
+			aceptarConexiones(sockfd);
+		} else if (f->tipo == FUENTE_INOTIFY) {
+			leerInotify();
+		} else if (c->estado == ESTADO_CERRADA) {
+			// La cerro un evento anterior de esta misma vuelta
+			continue;
+		} else if (f->tipo == FUENTE_PHP) {
+			leerPHP(c);
+		} else if (eventos[i].events & (EPOLLERR | EPOLLHUP)) {
+			cerrarConexion(c);
+		} else {
+			manejarConexion(c);
 		}
 	}
 }
 
-/* Manda headers a traves del socket, 
- * segun el tipo de respuesta y de contenido */
-void mandarHeaders(int sock, char * tipoResp, char * tipoCont){
-	mandarHeader(sock,tipoResp);
-	mandarHeader(sock,tipoCont);
-}
-
-/* Manda un header 4xx con un rechazo,
- * ademas le manda contenido en HTML
- * para mostrar una pagina de Error. */
-void mandarRechazo(int sock, char * tipoResp, char * titulo, char * mensaje){
-	mandarHeaders(sock,tipoResp,CT_HTML);	
-	// Preparo un mensaje HTML con el error 4xx o 5xx
-	char * rta = strdup("<html><body><title>");
-	strcat(rta,titulo);
-	strcat(rta,"</title><h1>");
-	strcat(rta,titulo);
-	strcat(rta,"</h1><p>");
-	strcat(rta,mensaje);
-	strcat(rta,"</p></body></html>");
-	mandarHeader(sock,rta);
-}
-
-/* Dado un socket y un archivo, se manda dicho archivo 
- * en modo binario a traves del socket */
-void mandarArchivo(int sock, char * archivo){
-	size_t lfile = archivoSize(archivo);
-	char * bufferSalida = malloc(lfile);
-
-	FILE *file = fopen(archivo, "rb");
-	if (!file) error(ERROR_ABRIR_ARCHIVO); 
-	int c; size_t t = 0;
-
-	int nro,n;
-	while(!feof(file))
-	{
-		nro = fread(bufferSalida,1,128,file);
-		n = send(sock,bufferSalida,nro,0);
-		if (n < 0) error(ERROR_SEND_SOCKET);
-	}
-	free(bufferSalida);
-}
-
-/* Revisa si una cadena es .html o .htm */
-int esHTML(char * archivo){
-	char * arch = getExtension(minusculas(archivo));
-	if ((strcmp(arch,".html")==0) || (strcmp(arch,".htm")==0))
-		return 1;
-	else return 0;
+/* Arranca la rueda de plazos vacia, en la hora actual */
+void iniciarRueda() {
+	memset(&rueda, 0, sizeof(rueda));
+	rueda.ahora = ahoraMs();
+	rueda.tick = rueda.ahora / TICK_RUEDA;
 }
 
-/* Revisa si una cadena es .jpg */
-int esJPG(char * archivo){
-	char * arch = getExtension(minusculas(archivo));
-	if (strcmp(arch,".jpg")==0)
-		return 1;
-	else return 0;
+/* Segundos de plazo de una fase (0: sin plazo) */
+int duracionPlazo(int fase) {
+	switch (fase) {
+	case PLAZO_PEDIDO: return config.plazoPedido;
+	case PLAZO_OCIOSA: return config.keepAlive;
+	case PLAZO_ESCRITURA: return config.plazoEscritura;
+	default: return config.plazoPHP;
+	}
 }
 
-/* Revisa si una cadena es .gif */
-int esGIF(char * archivo){
-	char * arch = getExtension(minusculas(archivo));
-	if (strcmp(arch,".gif")==0)
-		return 1;
-	else return 0;
+/* Pone la conexion en la ranura de la rueda de su vencimiento: en el primer
+ * nivel si vence en esta vuelta, si no en el segundo, de donde baja al primero
+ * cuando empieza su vuelta */
+void insertarPlazo(struct conexion * c) {
+	struct conexion ** ranura;
+	long long tick = (c->vencePlazo + TICK_RUEDA - 1) / TICK_RUEDA;
+	// Lo que ya vencio sale en la proxima ranura
+	if (tick <= rueda.tick) tick = rueda.tick + 1;
+	if (tick - rueda.tick < RANURAS_RUEDA) {
+		int i = tick & (RANURAS_RUEDA - 1);
+		ranura = &rueda.ranuras[i];
+		rueda.ocupadas[i / 64] |= 1UL << (i & 63);
+	} else {
+		long long vuelta = tick >> BITS_RUEDA;
+		long long actual = rueda.tick >> BITS_RUEDA;
+		// Lo que esta mas lejos que el segundo nivel se vuelve a ubicar al bajar
+		if (vuelta - actual >= RANURAS_RUEDA2) vuelta = actual + RANURAS_RUEDA2 - 1;
+		ranura = &rueda.ranuras2[vuelta & (RANURAS_RUEDA2 - 1)];
+	}
+	c->ranuraPlazo = ranura;
+	c->antPlazo = NULL;
+	c->sigPlazo = *ranura;
+	if (*ranura != NULL) (*ranura)->antPlazo = c;
+	*ranura = c;
 }
 
-/* Revisa si una cadena es .png */
-int esPNG(char * archivo){
-	char * arch = getExtension(minusculas(archivo));
-	if (strcmp(arch,".png")==0)
-		return 1;
-	else return 0;
+/* Arma el plazo de una fase de la conexion, reemplazando el que tuviera */
+void armarPlazo(struct conexion * c, int fase) {
+	if (c->estado == ESTADO_CERRADA) return;
+	cancelarPlazo(c);
+	// De los plazos de un stream HTTP/2 se encarga su conexion, salvo el de PHP
+	if (c->padre != NULL && fase != PLAZO_PHP) return;
+	c->fasePlazo = fase;
+	if (fase == PLAZO_ESCRITURA) c->progreso = rueda.ahora;
+	int segundos = duracionPlazo(fase);
+	if (segundos == 0) return;
+	c->vencePlazo = rueda.ahora + segundos * 1000LL;
+	insertarPlazo(c);
+	rueda.cantidad++;
 }
 
-/* Revisa si una cadena es .php */
-int esPHP(char * archivo){
-	char * arch = getExtension(minusculas(archivo));
-	if (strcmp(arch,".php")==0)
-		return 1;
-	else return 0;
+/* Arma el plazo que corresponde al estado de la respuesta que se empezo */
+void armarPlazoRespuesta(struct conexion * c) {
+	if (c->estado == ESTADO_PHP_EN_CURSO || c->estado == ESTADO_ESPERANDO_PHP)
+		armarPlazo(c, PLAZO_PHP);
+	else
+		armarPlazo(c, PLAZO_ESCRITURA);
 }
 
-/* Dado una cadena, obtiene su extension (si la tuviese) */
-char * getExtension(char* archivo) {
-	char *aux, *ext=strstr(archivo,".");
-	aux=ext; 
-	while (ext !=NULL) {		
-		aux= ext;
-		ext = strstr(ext+1, ".");
+/* Saca a la conexion de la rueda, si tenia un plazo corriendo */
+void cancelarPlazo(struct conexion * c) {
+	if (c->ranuraPlazo == NULL) return;
+	if (c->antPlazo != NULL)
+		c->antPlazo->sigPlazo = c->sigPlazo;
+	else
+		*c->ranuraPlazo = c->sigPlazo;
+	if (c->sigPlazo != NULL)
+		c->sigPlazo->antPlazo = c->antPlazo;
+	if (*c->ranuraPlazo == NULL && c->ranuraPlazo >= rueda.ranuras &&
+			c->ranuraPlazo < rueda.ranuras + RANURAS_RUEDA) {
+		int i = c->ranuraPlazo - rueda.ranuras;
+		rueda.ocupadas[i / 64] &= ~(1UL << (i & 63));
 	}
-	return aux;
+	c->ranuraPlazo = NULL;
+	rueda.cantidad--;
 }
 
-/* Funcion para agregar un caracter al final de una cadena */
-char * appchr(char * str, const char chr) {
-	size_t len = strlen(str);;
-	char * ptr = malloc(len+2);
-	strcpy(ptr,str);
-	ptr[len] = chr;
-	ptr[len+1] = '\0';
-	return ptr;
+/* Milisegundos hasta la proxima ranura con plazos o el proximo cambio de
+ * vuelta del primer nivel (-1 si no hay ningun plazo) */
+int esperaPlazos() {
+	if (rueda.cantidad == 0) return -1;
+	long long desde = rueda.tick + 1;
+	long long siguiente = (rueda.tick | (RANURAS_RUEDA - 1)) + 1;
+	int inicio = desde & (RANURAS_RUEDA - 1);
+	int k;
+	// Busco en el mapa de ranuras ocupadas, dando la vuelta desde la proxima
+	for (k = 0; k <= RANURAS_RUEDA / 64; k++) {
+		int w = (inicio / 64 + k) % (RANURAS_RUEDA / 64);
+		unsigned long bits = rueda.ocupadas[w];
+		if (k == 0) bits &= ~0UL << (inicio & 63);
+		else if (k == RANURAS_RUEDA / 64) bits &= (1UL << (inicio & 63)) - 1;
+		if (bits != 0) {
+			int i = w * 64 + __builtin_ctzl(bits);
+			long long tick = desde + ((i - inicio) & (RANURAS_RUEDA - 1));
+			if (tick < siguiente) siguiente = tick;
+			break;
+		}
+	}
+	long long falta = siguiente * TICK_RUEDA - ahoraMs();
+	return falta > 0 ? (int) falta : 0;
 }
 
-/* Recibe el mensaje de un socket hasta que se lean dos "enters" seguidos.
- * Devuelve un puntero al principio de lo leido (buffer) */
-char * recibirMensaje(int sock) {
-	char * buffer = malloc(sizeof(char));;
-	char * letra  = malloc(sizeof(char));
-	char a,b,c,d;
-	int n;
-	a = 1 ; b = 1; c = 1; d = 1; n = 1;
-	int termine = 0;
-	
-	while (!termine && n>0){
-	   n = recv(sock,letra,1,0);
-	   if (n < 0) error(ERROR_RECV_SOCKET);
-	   d = letra[0];
-	   buffer = appchr(buffer,d);
-	   // Si veo dos enters seguidos activo el flag de terminacion
-	   if ((a == 10 && b == 13 && c == 10 && d == 13) || (a == 13 && b == 10 && c == 13 && d == 10)){
-		   termine = 1;
-	   } else {
-		   a = b;
-		   b = c;
-		   c = d;
-	   }	   
-	}
-	free(letra);
-	return buffer;
-}
-
-/* Dada una cadena de caracteres, devuelve la misma cadena pero en minusculas */
-char * minusculas(char * str){
-	int i;
-	char * rta = malloc(strlen(str));
-	for(i = 0; str[i]; i++){
-		rta[i] = tolower(str[i]);
+/* Avanza la rueda hasta la hora actual y atiende los plazos vencidos */
+void vencerPlazos() {
+	rueda.ahora = ahoraMs();
+	long long hasta = rueda.ahora / TICK_RUEDA;
+	while (rueda.tick < hasta) {
+		if (rueda.cantidad == 0) {
+			rueda.tick = hasta;
+			break;
+		}
+		rueda.tick++;
+		if ((rueda.tick & (RANURAS_RUEDA - 1)) == 0) {
+			// Empieza otra vuelta del primer nivel: bajan los que vencen en ella
+			struct conexion ** ranura = &rueda.ranuras2[(rueda.tick >> BITS_RUEDA) & (RANURAS_RUEDA2 - 1)];
+			struct conexion * c = *ranura;
+			*ranura = NULL;
+			while (c != NULL) {
+				struct conexion * sig = c->sigPlazo;
+				insertarPlazo(c);
+				c = sig;
+			}
+		}
+		struct conexion ** ranura = &rueda.ranuras[rueda.tick & (RANURAS_RUEDA - 1)];
+		while (*ranura != NULL)
+			vencerPlazo(*ranura);
+	}
+}
+
+/* La conexion no cumplio el plazo de su fase. Si estaba mandando y el cliente
+ * recibio algo desde que se armo, el plazo sigue desde el ultimo envio; si no,
+ * se cierra. A un cliente que no manda su pedido o no lee la respuesta se le
+ * corta con un RST, asi el kernel no guarda nada de la conexion, y al que
+ * espera un script que todavia no mando nada se le responde un 504 */
+void vencerPlazo(struct conexion * c) {
+	cancelarPlazo(c);
+	if (c->fasePlazo == PLAZO_ESCRITURA && c->progreso + config.plazoEscritura * 1000LL > rueda.ahora) {
+		c->vencePlazo = c->progreso + config.plazoEscritura * 1000LL;
+		insertarPlazo(c);
+		rueda.cantidad++;
+		return;
+	}
+	sumarMetrica(&misMetricas->plazosVencidos[c->fasePlazo], 1);
+	if (c->fasePlazo == PLAZO_PHP && (c->estado == ESTADO_ESPERANDO_PHP ||
+			(c->estado == ESTADO_PHP_EN_CURSO && !c->respuestaPHP))) {
+		vencerPHP(c);
+		return;
+	}
+	if (c->fasePlazo == PLAZO_PEDIDO || c->fasePlazo == PLAZO_ESCRITURA) {
+		struct linger corte = { 1, 0 };
+		setsockopt(c->sock, SOL_SOCKET, SO_LINGER, &corte, sizeof(corte));
+	} else if (c->h2 != NULL && c->fasePlazo == PLAZO_OCIOSA) {
+		// Al cliente HTTP/2 se le avisa que la conexion se cierra
+		cerrarH2(c, H2_SIN_ERROR);
+		return;
 	}
-	return rta;
+	cerrarConexion(c);
 }
 
-/* Dada una ruta mediante archivo, obtiene el nombre del archivo
- * y los argumentos (si los hubiera), los separa y retorna
- * la ruta al indice (mediante el primer parametro)
- * y sus argumentos mediante el segundo parametro */
-void verificarPHP(char ** archivo, char ** argumentos){
-	char * arch = strdup(*archivo);
-	char * ruta = strtok(arch, " ?\n\r");
-    * argumentos = strstr(*archivo, "?");
-	* archivo = ruta;
+/* Corta el pedido a php-cgi (o la espera de la respuesta de otra conexion) que
+ * vencio antes de mandar nada, y responde un 504 cerrando la conexion despues */
+void vencerPHP(struct conexion * c) {
+	if (c->phpFd >= 0) {
+		// Al cerrar la conexion FastCGI, php-cgi abandona el pedido
+		sumarMetrica(&misMetricas->phpActivos, -1);
+		close(c->phpFd);
+		c->phpFd = -1;
+	}
+	if (c->capturaPHP != NULL)
+		abandonarCapturaPHP(c, 0);
+	if (c->esperaPHP != NULL)
+		quitarEsperaPHP(c);
+	c->cgi = NULL;
+	c->keepAlive = 0;
+	mandarRechazo(c,RECHAZO_504);
+	armarPlazo(c, PLAZO_ESCRITURA);
+	manejarConexion(c);
 }
 
-/* Se encarga de la parte PHP. Hace el fork, el hijo el exec(php-chi) 
- * y el padre envia el mensaje generado por el hijo */ 
-void procesarPHP(int sock, char * archivo, char * parametros){
-	int pipefd[2];
-	if (pipe(pipefd) < 0) { error(ERROR_PIPE); }
-	
-	pid_t pid = fork();
+/* Cierra el socket de la conexion y su archivo */
+void cerrarSocket(struct conexion * c) {
+	liberarArchivo(c);
+	close(c->sock);
+	c->sock = -1;
+	// Quedo un descriptor libre: io_uring puede volver a aceptar
+	if (escuchaEnPausa >= 0) {
+		aceptarUring(escuchaEnPausa);
+		escuchaEnPausa = -1;
+	}
+}
 
-	if (pid == 0) {
-		close(pipefd[0]);    // close reading end in the child
-		dup2(pipefd[1], 1);  // mando standart output al pipe
-		dup2(pipefd[1], 2);  // mando standart error al pipe
-		close(pipefd[1]);    // this descriptor is no longer needed
-
-		char * query;
-		if (parametros!=0) {
-			// Cargo en la variable de entorno QUERY_STRING
-			// los parametros que me hayan pasado
-			query = malloc(13+strlen(parametros));
-			strcpy(query,"QUERY_STRING=");
-			strcat(query,parametros+1);
-			putenv(query);
-		} else { 
-			// No me pasaron parametros, "reseteo el query string"
-			putenv("QUERY_STRING="); 
-		}
-				
-		// Cargo en la variable de entorno SCRIPT_FILENAME
-		// el archivo que este solicitando el usuario
-		char script [16+strlen(archivo)];
-		strcpy(script,"SCRIPT_FILENAME=");		
-		strcat(script,archivo);
-		putenv(script);
-
-		execlp("php-cgi","php-cgi",NULL);
-	} else if (pid > 0) {
-		// Soy el padre
-		char buf[1];
-		close(pipefd[1]);  // close the write end of the pipe in the parent
-		int n;
+/* Libera las conexiones cerradas. Se hace al final de cada vuelta del bucle,
+ * cuando ya no quedan eventos que las nombren; con io_uring, ademas, recien
+ * cuando terminaron todas sus operaciones */
+void liberarCerradas() {
+	struct conexion ** p = &cerradas;
+	while (*p != NULL) {
+		struct conexion * c = *p;
+		if (c->opsPendientes > 0) {
+			p = &c->sigCerrada;
+			continue;
+		}
+		*p = c->sigCerrada;
+		if (c->sock >= 0) cerrarSocket(c);
+		if (c->h2 != NULL) liberarSesionH2(c->h2);
+		liberarArena(c);
+		free(c->bufArchivo);
+		free(c->salida);
+		free(c);
+	}
+}
+
+/* Sin descriptores libres, acepta y cierra la primera conexion pendiente
+ * con el descriptor de reserva */
+int rechazarConexion(int sockfd) {
+	if (reservaFd < 0) {
+		reservaFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		return 0;
+	}
+	close(reservaFd);
+	int fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd >= 0) close(fd);
+	reservaFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return fd >= 0;
+}
+
+/* Acepta todas las conexiones pendientes (el socket de escucha es edge-triggered) */
+void aceptarConexiones(int sockfd) {
+	struct sockaddr_in cli_addr;
+	socklen_t clilen;
+	struct epoll_event ev;
+	
+	while (1) {
+		clilen = sizeof(cli_addr);
+		// Ya no bloqueante y sin heredarse a php-cgi, sin fcntl aparte
+		int newsockfd = accept4(sockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newsockfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				// Si la dejo en la cola no llega otro aviso (edge-triggered) y
+				// las conexiones pendientes esperarian hasta que entre una nueva
+				log_error(ERROR_ACCEPT_SOCKET);
+				if (rechazarConexion(sockfd)) continue;
+				return;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_error(ERROR_ACCEPT_SOCKET);
+			return;
+		}
 		
-		// Espero a que termine mi hijo
-		int returnStatus;
-		waitpid(pid,&returnStatus,0);
+		struct conexion * c = crearConexion(newsockfd);
+		inet_ntop(AF_INET, &cli_addr.sin_addr, c->ip, sizeof(c->ip));
 		
-		char * buffer = malloc(sizeof(char));;
-	
-		while (read(pipefd[0], buf, sizeof(buf)) != 0)
-		{
-			// Cargo lo que me respondio php-cgi en un buffer
-			buffer = appchr(buffer,buf[0]);
-		}	
-		// Lo mando
-		mandarHeader(sock,RTA_200);		
-		mandarHeader(sock,buffer);		
-		free(buffer);	
+		// Registro lectura y escritura de una vez, al ser edge-triggered
+		// solo recibo un evento cuando cambia el estado del socket
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = &c->fuenteSocket;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+			log_error(ERROR_EPOLL);
+			close(newsockfd);
+			cancelarPlazo(c);
+			free(c);
+			continue;
+		}
+		sumarMetrica(&misMetricas->conexiones, 1);
+		
+		// Puede que el pedido ya haya llegado junto con la conexion
+		manejarConexion(c);
 	}
-	else if (pid < 0) { error(ERROR_FORK); }
 }
 
-/* Metodo principal que se encarga de atender un pedido mediante un socket dado */
-void atenderPedido(int sock) {
-	int n;
+/* Crea el estado de una conexion recien aceptada */
+struct conexion * crearConexion(int sock) {
+	struct conexion * c = calloc(1, sizeof(struct conexion));
+	c->sock = sock;
+	c->estado = ESTADO_LEYENDO_PEDIDO;
+	c->fuenteSocket.tipo = FUENTE_SOCKET;
+	c->fuenteSocket.conexion = c;
+	c->fuentePHP.tipo = FUENTE_PHP;
+	c->fuentePHP.conexion = c;
+	c->archivo = -1;
+	c->phpFd = -1;
+	c->llegada = ahoraUs();
+	// El primer pedido tiene que llegar entero a tiempo desde que se acepta
+	armarPlazo(c, PLAZO_PEDIDO);
+	return c;
+}
+
+/* Pide len bytes de la arena del pedido en curso de la conexion. La arena sale
+ * del pool del worker con el primer pedido de memoria y vuelve al terminar el
+ * pedido; lo que no entra en ella se pide aparte y se libera con ella */
+void * pedirArena(struct conexion * c, size_t len) {
+	struct arena * a = c->arena;
+	if (a == NULL) {
+		a = arenasLibres;
+		if (a != NULL) {
+			arenasLibres = a->sig;
+			cantArenasLibres--;
+		} else {
+			a = malloc(sizeof(struct arena));
+			a->extra = NULL;
+		}
+		a->usado = 0;
+		c->arena = a;
+	}
+	len = (len + ALINEACION_ARENA - 1) & ~(size_t) (ALINEACION_ARENA - 1);
+	if (len <= TAM_ARENA - a->usado) {
+		void * p = a->datos + a->usado;
+		a->usado += len;
+		return p;
+	}
+	struct bloqueArena * b = malloc(sizeof(struct bloqueArena) + len);
+	b->sig = a->extra;
+	a->extra = b;
+	return b->datos;
+}
+
+/* Devuelve la arena de la conexion al pool (todo lo pedido queda liberado) */
+void liberarArena(struct conexion * c) {
+	struct arena * a = c->arena;
+	if (a == NULL) return;
+	c->arena = NULL;
+	while (a->extra != NULL) {
+		struct bloqueArena * b = a->extra;
+		a->extra = b->sig;
+		free(b);
+	}
+	if (cantArenasLibres >= MAX_ARENAS_LIBRES) {
+		free(a);
+		return;
+	}
+	a->sig = arenasLibres;
+	arenasLibres = a;
+	cantArenasLibres++;
+}
+
+/* Direccion del cliente. Con io_uring se acepta sin pedir la direccion, asi
+ * que se busca recien cuando hace falta */
+char * ipCliente(struct conexion * c) {
+	if (c->ip[0] == '\0') {
+		struct sockaddr_in dir;
+		socklen_t len = sizeof(dir);
+		if (getpeername(c->sock, (struct sockaddr *) &dir, &len) < 0 ||
+				inet_ntop(AF_INET, &dir.sin_addr, c->ip, sizeof(c->ip)) == NULL)
+			strcpy(c->ip, "-");
+	}
+	return c->ip;
+}
+
+/* Hace avanzar la maquina de estados hasta que haya que esperar */
+void manejarConexion(struct conexion * c) {
+	int r;
+	ssize_t n;
 	
-	char * tipoMsg = NULL;
-	char * ruta = NULL;
-	char * protocolo = NULL;
-   
-	char * buffer = recibirMensaje(sock);
-
-    // Analizo el mensaje (la primera linea es la que importa en realidad)
-    // Obtengo el tipo de metodo, la ruta y el protocolo utilizado.
-    parseMsg(buffer, &tipoMsg, &ruta, &protocolo);
-	
-	char * archivo = NULL;
-	char * parametros = NULL;
-	if (esBarra(ruta)) {
-		// Si me pasaron / tengo que buscar si tengo index.html, index.htm, o index.php
-		// Sobreescribir sobre el valor de la variable archivo
-		if (archivoExiste("index.html")) {
-			archivo = strdup("index.html");
-		} else if (archivoExiste("index.htm")) {
-				archivo = strdup("index.htm");
-			} else if (archivoExiste("index.php")) {
-					archivo = strdup("index.php");
+	while (1) {
+		switch (c->estado) {
+		case ESTADO_LEYENDO_PEDIDO:
+			r = recibirMensaje(c);
+			if (r == -2) {
+				// Los headers no entran en el buffer de entrada
+				c->keepAlive = 0;
+				c->inicioPedido = ahoraMs();
+				mandarRechazo(c,RECHAZO_431);
+				armarPlazo(c, PLAZO_ESCRITURA);
+				break;
+			}
+			if (r < 0) { cerrarConexion(c); return; }
+			if (r == 0) return;
+			atenderPedido(c);
+			armarPlazoRespuesta(c);
+			break;
+		case ESTADO_ESCRIBIENDO_HEADERS:
+			if (motorUring && c->padre == NULL) {
+				// Los headers y el cuerpo salen en una misma cadena de operaciones
+				r = enviarRespuestaUring(c);
+				if (r < 0) { cerrarConexion(c); return; }
+				if (r == 0) return;
+				if (siguienteRango(c)) break;
+				finalizarRespuesta(c);
+				if (c->estado == ESTADO_CERRADA) return;
+				break;
+			}
+			r = enviarSalida(c);
+			if (r < 0) { cerrarConexion(c); return; }
+			if (r == 0) return;
+			if (c->archivo >= 0 || c->cuerpo != NULL) {
+				// Con varios rangos se mide desde la primera parte
+				if (c->inicioEnvio == 0) c->inicioEnvio = ahoraUs();
+				c->estado = ESTADO_ESCRIBIENDO_CUERPO;
+			} else {
+				finalizarRespuesta(c);
+				if (c->estado == ESTADO_CERRADA) return;
+			}
+			break;
+		case ESTADO_ESCRIBIENDO_CUERPO:
+			// El kernel copia el archivo del page cache al socket directamente,
+			// sin pasar por un buffer del proceso. Las variantes comprimidas en
+			// memoria se mandan directo desde la cache. El de un stream HTTP/2
+			// sale en marcos de su conexion.
+			if (c->padre != NULL) {
+				// (-1: el stream ya se cerro)
+				if (enviarSalidaH2(c) <= 0) return;
+			}
+			while (c->restante > 0) {
+				if (c->cuerpo != NULL) {
+					n = send(c->sock, c->cuerpo + c->offset, c->restante, MSG_NOSIGNAL);
+					if (n > 0) c->offset += n;
+				} else {
+					n = sendfile(c->sock, c->archivo, &c->offset, c->restante);
 				}
-	} else {
-		archivo = ruta+1;
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+					cerrarConexion(c);
+					return;
+				}
+				if (n == 0) {
+					// El archivo se achico: ya mande un Content-Length
+					// que no voy a poder cumplir, asi que la unica salida es cerrar
+					log_error(ERROR_ABRIR_ARCHIVO);
+					cerrarConexion(c);
+					return;
+				}
+				c->restante -= n;
+				contarEnvio(c, n);
+			}
+			// En multipart/byteranges sigue la proxima parte
+			if (siguienteRango(c)) break;
+			finalizarRespuesta(c);
+			if (c->estado == ESTADO_CERRADA) return;
+			break;
+		case ESTADO_PHP_EN_CURSO:
+			// El cliente puede recibir mas: sigo con la salida de php-cgi
+			// (leerPHP manda lo pendiente y, si habia frenado, vuelve a leer)
+			leerPHP(c);
+			return;
+		case ESTADO_H2:
+			atenderH2(c);
+			return;
+		default:
+			// Cerrada, o esperando la respuesta PHP que genera otra conexion
+			return;
+		}
+	}
+}
+
+/* La respuesta ya salio completa. Si la conexion es keep-alive la dejo
+ * lista para el siguiente pedido, que puede estar ya en el buffer (pipelining) */
+void finalizarRespuesta(struct conexion * c) {
+	registrarAcceso(c);
+	if (c->inicioEnvio != 0) {
+		medirLatencia(&misMetricas->envioArchivo, ahoraUs() - c->inicioEnvio);
+		c->inicioEnvio = 0;
+	}
+	c->primerByte = 0;
+	liberarArchivo(c);
+	liberarArena(c);
+	if (c->padre != NULL) terminarStreamH2(c);
+	if (!c->keepAlive) {
+		cerrarConexion(c);
+		return;
 	}
 	
-	// Verifico si el archivo es PHP y separo sus parametros ("desgloso")
-	// Esto lo hago en este punto porque luego se hara el chequeo
-	// de la existencia del archivo (y necesitamos unicamente el nombre del archivo)
-	verificarPHP(&archivo,&parametros);
+	descartarPedido(c);
+	c->estado = ESTADO_LEYENDO_PEDIDO;
+	
+	// El proximo pedido se mide desde que llega (si vino con este, desde ahora)
+	c->llegada = c->lenEntrada > 0 ? ahoraUs() : 0;
+	// Si el proximo pedido no empezo a llegar, la conexion queda ociosa
+	armarPlazo(c, c->lenEntrada > 0 ? PLAZO_PEDIDO : PLAZO_OCIOSA);
+}
+
+/* Descarto el pedido ya atendido y me quedo con lo que vino despues */
+void descartarPedido(struct conexion * c) {
+	c->lenEntrada -= c->finPedido;
+	memmove(c->entrada, c->entrada + c->finPedido, c->lenEntrada);
+	c->finPedido = 0;
+	c->escaneado = 0;
+}
+
+/* Milisegundos de un reloj monotono */
+long long ahoraMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-    if (!ruta || !tipoMsg || !protocolo) {
-		// Me mandaron mal la request (alguno de los elementos del primer renglon es vacio (NULL);
-		mandarRechazo(sock,RTA_400,"400 Bad Request", "The request sent didn't have the correct syntax.");
+/* Cierra la conexion y la deja para liberar al final de la vuelta del bucle */
+void cerrarConexion(struct conexion * c) {
+	if (c->estado == ESTADO_CERRADA) return;
+	// Un stream HTTP/2 sale primero de su conexion (lo que sigue puede cerrarla)
+	if (c->padre != NULL) quitarStreamH2(c);
+	// Una respuesta cortada a la mitad tambien se registra
+	if (c->status != 0) registrarAcceso(c);
+	cancelarPlazo(c);
+	if (c->padre == NULL) sumarMetrica(&misMetricas->conexiones, -1);
+	if (c->phpFd >= 0) {
+		// El cliente se fue antes de que php-cgi terminara: al cerrar
+		// la conexion FastCGI, php-cgi abandona el pedido
+		sumarMetrica(&misMetricas->phpActivos, -1);
+		close(c->phpFd);
+		c->phpFd = -1;
+	}
+	if (c->capturaPHP != NULL)
+		abandonarCapturaPHP(c, 0);
+	if (c->esperaPHP != NULL)
+		quitarEsperaPHP(c);
+	if (c->padre != NULL) {
+		// Un stream no tiene socket
+		liberarArchivo(c);
+	} else if (c->opsPendientes > 0) {
+		// Hay operaciones de io_uring sobre el socket, el archivo o sus buffers: el
+		// shutdown las termina y el resto se cierra cuando vuelvan todas
+		shutdown(c->sock, SHUT_RDWR);
 	} else {
-		// Me mandaron un request que "puedo entender"
-		// Trato de interpretarlo y trabajarlo
-		if (esGet(tipoMsg)) {	
-			if(archivoExiste(archivo)) {
-				// El archivo existe
-				if (archivoAbrible(archivo)) {
-					// El archivo se puede abrir			
-					if (esHTML(archivo)) {
-						// Es HTML o HTM
-						mandarHeaders(sock,RTA_200,CT_HTML);
-						mandarArchivo(sock,archivo);
-					} else if (esJPG(archivo) || esPNG(archivo) || esGIF(archivo)) {
-							// Es JPG, GIF o PNG
-							if (esJPG(archivo)) {
-								mandarHeaders(sock,RTA_200,CT_JPG);
-							}
-							else if (esGIF(archivo)) {
-									mandarHeaders(sock,RTA_200,CT_GIF);
-								}
-								else { 
-									mandarHeaders(sock,RTA_200,CT_PNG); 
-								}
-							// Ya mande los headers, ahora mando el archivo
-							mandarArchivo(sock,archivo);
-					} else if (esPHP(archivo)) {
-							// es PHP
-							procesarPHP(sock,archivo,parametros);				
-						} else {
-							// No es un tipo valido (extension desconocida) pero existe el archivo
-							// Tomar una decision de diseño. Por ejemplo, mandar un 200 OK y el contenido del archivo
-							// Ojo con esto, podria influir en la "seguridad" del servidor
-							mandarRechazo(sock,RTA_403,"403 Forbidden", "Not allowed to access the resource and authorization will not help.");
-						}												
-				} else {
-					// Archivo no se puede abrir. Mando Error 403
-					mandarRechazo(sock,RTA_403,"403 Forbidden", "Not allowed to access the resource and authorization will not help.");
-				}		
-			} else {
-				// Archivo no existe, Mando Error 404
-				mandarRechazo(sock,RTA_404,"404 Not Found", "The requested file was not found.");
-			}
+		cerrarSocket(c);
+	}
+	c->estado = ESTADO_CERRADA;
+	c->sigCerrada = cerradas;
+	cerradas = c;
+	if (c->h2 != NULL) {
+		// Los streams se cierran con su conexion
+		while (c->h2->streams != NULL) cerrarConexion(c->h2->streams);
+	} else if (c->padre != NULL) {
+		// Lo que quedo pendiente en la conexion (el RST_STREAM, otros streams) sigue saliendo
+		programarH2(c->padre);
+	}
+}
+
+/* Deja lugar para len bytes al final del buffer de salida y retorna donde
+ * escribirlos (quien los escribe suma len a lenSalida) */
+char * reservarSalida(struct conexion * c, size_t len) {
+	// Antes de agrandar el buffer descarto lo que ya se mando (salvo que lo
+	// este usando un envio de io_uring)
+	if (c->enviados > 0 && c->lenSalida + len > c->capSalida && c->salidaEnVuelo == NULL) {
+		c->lenSalida -= c->enviados;
+		memmove(c->salida, c->salida + c->enviados, c->lenSalida);
+		c->enviados = 0;
+	}
+	if (c->lenSalida + len > c->capSalida) {
+		size_t cap = c->capSalida ? c->capSalida : 1024;
+		while (cap < c->lenSalida + len) cap *= 2;
+		if (c->salidaEnVuelo != NULL && c->salidaEnVuelo == c->salida) {
+			// El envio en curso sigue con el buffer viejo, que se libera cuando termina
+			char * nueva = malloc(cap);
+			memcpy(nueva, c->salida, c->lenSalida);
+			c->salida = nueva;
 		} else {
-			// Metodo no permitido, mando Error 501
-			mandarRechazo(sock,RTA_501,"501 Not Implemented", "The requested method is not implemented.");
+			c->salida = realloc(c->salida, cap);
+		}
+		c->capSalida = cap;
+	}
+	return c->salida + c->lenSalida;
+}
+
+/* Agrega datos al final del buffer de salida */
+void encolarSalida(struct conexion * c, const char * datos, size_t len) {
+	memcpy(reservarSalida(c, len), datos, len);
+	c->lenSalida += len;
+}
+
+/* Manda lo pendiente del buffer de salida sin bloquear. Si despues sigue el
+ * cuerpo de la respuesta, sale en los mismos segmentos que los headers: uno en
+ * memoria va en el mismo sendmsg, y antes de un archivo se avisa MSG_MORE para
+ * que el kernel complete el segmento con lo que mande sendfile */
+int enviarSalida(struct conexion * c) {
+	if (c->padre != NULL) return enviarSalidaH2(c);
+	if (motorUring) return enviarSalidaUring(c, 0);
+	struct iovec partes[2];
+	struct msghdr msg = { .msg_iov = partes, .msg_iovlen = 1 };
+	int flags = MSG_NOSIGNAL;
+	if (c->restante > 0 && c->cuerpo != NULL) msg.msg_iovlen = 2;
+	if (c->restante > 0 && c->archivo >= 0 && c->cuerpo == NULL) flags |= MSG_MORE;
+	while (c->enviados < c->lenSalida) {
+		size_t pendiente = c->lenSalida - c->enviados;
+		partes[0].iov_base = c->salida + c->enviados;
+		partes[0].iov_len = pendiente;
+		partes[1].iov_base = (char *) c->cuerpo + c->offset;
+		partes[1].iov_len = c->restante;
+		ssize_t n = sendmsg(c->sock, &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		contarEnvio(c, n);
+		if ((size_t) n > pendiente) {
+			// Tambien salio parte del cuerpo
+			c->offset += n - pendiente;
+			c->restante -= n - pendiente;
+			n = pendiente;
 		}
+		c->enviados += n;
 	}
-	free(buffer);
+	c->lenSalida = 0;
+	c->enviados = 0;
+	return 1;
+}
+
+/* Cuenta lo que salio de la respuesta (el primer envio cierra la medicion
+ * hasta el primer byte) */
+void contarEnvio(struct conexion * c, size_t n) {
+	c->bytesEnviados += n;
+	c->progreso = rueda.ahora;
+	if (!c->primerByte) {
+		c->primerByte = 1;
+		medirLatencia(&misMetricas->primerByte, ahoraUs() - c->llegada);
+	}
+}
+
+/* Avanza sobre un token de la primera linea hasta el separador dado
+ * (o el fin de linea) y lo deja terminado en '\0' dentro del mismo buffer */
+char * cortarToken(char * q, char * fin, char separador, struct segmento * seg) {
+	seg->ptr = q;
+	while (q < fin && *q != separador && *q != '\r' && *q != '\n') q++;
+	seg->len = q - seg->ptr;
+	return q;
+}
+
+/* Parsea el pedido dado en buffer, sin copiar nada: el metodo, la ruta, el
+ * protocolo y cada header quedan como segmentos del mismo buffer, terminados
+ * en '\0' en el lugar del separador que los seguia.
+ * No se encarga de hacer chequeos sobre la correctitud del mensaje. */
+int parsearPedido(char * buf, size_t len, struct pedido * p) {
+	char * q = buf;
+	char * fin = buf + len;
+	memset(p, 0, sizeof(struct pedido));
+	
+	// Se ignoran lineas vacias antes del pedido
+	while (q < fin && (*q == '\r' || *q == '\n')) q++;
 	
+	// Primera linea: METODO RUTA PROTOCOLO
+	q = cortarToken(q, fin, ' ', &p->metodo);
+	if (q >= fin || *q != ' ' || p->metodo.len == 0) return -1;
+	*q++ = '\0';
+	q = cortarToken(q, fin, ' ', &p->ruta);
+	if (q >= fin || *q != ' ' || p->ruta.len == 0) return -1;
+	*q++ = '\0';
+	q = cortarToken(q, fin, '\r', &p->protocolo);
+	if (q >= fin || p->protocolo.len == 0) return -1;
+	
+	// Headers "Nombre: valor", uno por linea, hasta una linea vacia
+	while (q < fin) {
+		char * finLinea = memchr(q, '\n', fin - q);
+		if (finLinea == NULL) finLinea = fin;
+		*q = '\0';		// termina el segmento anterior (estaba el '\r' o el '\n')
+		q = finLinea + 1;
+		if (q >= fin || *q == '\r' || *q == '\n') break;
+		
+		char * dosPuntos = memchr(q, ':', fin - q);
+		finLinea = memchr(q, '\n', fin - q);
+		if (finLinea == NULL) finLinea = fin;
+		if (dosPuntos == NULL || dosPuntos > finLinea) return -1;
+		if (p->cantHeaders == MAX_CANT_HEADERS) return -2;
+		
+		struct header * h = &p->headers[p->cantHeaders++];
+		h->nombre.ptr = q;
+		h->nombre.len = dosPuntos - q;
+		*dosPuntos = '\0';
+		q = dosPuntos + 1;
+		while (q < finLinea && (*q == ' ' || *q == '\t')) q++;
+		h->valor.ptr = q;
+		q = finLinea;
+		while (q > h->valor.ptr && (q[-1] == '\r' || q[-1] == ' ' || q[-1] == '\t')) q--;
+		h->valor.len = q - h->valor.ptr;
+	}
+	// Si el pedido se corto sin linea vacia, el ultimo segmento termina en el fin
+	if (q == fin) *fin = '\0';
+	return 0;
+}
+
+/* Retorna el valor del header pedido (sin distinguir mayusculas) o NULL si no esta */
+char * buscarHeader(struct pedido * p, const char * nombre) {
+	int i;
+	for (i = 0; i < p->cantHeaders; i++) {
+		if (strcasecmp(p->headers[i].nombre.ptr, nombre) == 0)
+			return p->headers[i].valor.ptr;
+	}
+	return NULL;
+}
+
+/* Dado el errno de un open que fallo, dice si es que el archivo no esta */
+int faltaArchivo(int err) {
+	return err == ENOENT || err == ENOTDIR;
+}
+
+/* El rechazo que corresponde a un archivo que no se pudo abrir */
+int rechazoApertura(int err) {
+	return faltaArchivo(err) ? RECHAZO_404 : RECHAZO_403;
+}
+
+/* Revisa si una cadena dada es GET */
+int esGet(char * msg){
+	if (strcmp("GET", msg) == 0) 
+		return 1;
+	else return 0;
+}
+
+/* Encola headers para mandar a traves del socket, 
+ * segun el tipo de respuesta y de contenido */
+void mandarHeader(struct conexion * c, char * resp){
+	if (resp!=NULL) {
+		encolarSalida(c,resp,strlen(resp));
+	}
+}
+
+/* Encola headers para mandar a traves del socket, 
+ * segun el tipo de respuesta y de contenido */
+void mandarHeaders(struct conexion * c, char * tipoResp, char * tipoCont){
+	mandarHeader(c,tipoResp);
+	mandarHeader(c,tipoCont);
+}
+
+/* Termina el bloque de headers: largo del cuerpo, 
+ * si la conexion sigue abierta y la linea en blanco */
+void terminarHeaders(struct conexion * c, long largo){
+	char linea[64];
+	snprintf(linea, sizeof(linea), "Content-Length: %ld\r\n", largo);
+	mandarHeader(c,linea);
+	mandarFinHeaders(c);
+}
+
+/* Termina el bloque de headers: si la conexion sigue abierta y la linea en blanco */
+void mandarFinHeaders(struct conexion * c){
+	if (c->keepAlive) {
+		mandarHeader(c,"Connection: keep-alive\r\n\r\n");
+	} else {
+		mandarHeader(c,"Connection: close\r\n\r\n");
+	}
+}
+
+/* Arma las respuestas completas de las paginas de error (headers y HTML),
+ * con keep-alive y sin, para mandarlas con una sola copia */
+void armarRechazos() {
+	char cuerpo[512];
+	char armado[1024];
+	int i, keepAlive;
+	for (i = 0; i < CANT_RECHAZOS; i++) {
+		struct rechazo * r = &rechazos[i];
+		int largo = snprintf(cuerpo, sizeof(cuerpo),
+			"<html><body><title>%s</title><h1>%s</h1><p>%s</p></body></html>", r->titulo, r->titulo, r->mensaje);
+		r->status = atoi(r->tipoResp + 9);
+		for (keepAlive = 0; keepAlive < 2; keepAlive++) {
+			int len = snprintf(armado, sizeof(armado), "%s%sContent-Length: %d\r\nConnection: %s\r\n\r\n%s",
+				r->tipoResp, CT_HTML, largo, keepAlive ? "keep-alive" : "close", cuerpo);
+			r->respuesta[keepAlive] = strdup(armado);
+			r->len[keepAlive] = len;
+		}
+	}
+}
+
+/* Manda una respuesta 4xx o 5xx con una pagina de error en HTML, ya armada
+ * al arrancar */
+void mandarRechazo(struct conexion * c, int tipo){
+	struct rechazo * r = &rechazos[tipo];
+	c->status = r->status;
+	encolarSalida(c, r->respuesta[c->keepAlive != 0], r->len[c->keepAlive != 0]);
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Dada una conexion y un archivo, se deja abierto el archivo para
+ * que el bucle de eventos lo mande en modo binario a traves del socket */
+void mandarArchivo(struct conexion * c, char * archivo, char * tipoCont){
+	struct archivoCache * e = cargarCache(archivo, tipoCont);
+	if (e == NULL) {
+		mandarRechazo(c,rechazoApertura(errno));
+		return;
+	}
+	mandarEntradaCache(c, e);
+}
+
+/* Prepara la respuesta de un archivo de la cache: los headers ya armados
+ * y el descriptor abierto, sin tocar el sistema de archivos */
+void mandarEntradaCache(struct conexion * c, struct archivoCache * e){
+	e->referencias++;
+	c->cache = e;
+	c->offset = 0;
+	
+	// Si el cliente acepta una version comprimida, mando esa. Los rangos
+	// se refieren al archivo sin comprimir, asi que con Range no comprimo.
+	char * rango = buscarHeader(&c->pedido, "Range");
+	struct variante * v = rango == NULL ? elegirVariante(e, buscarHeader(&c->pedido, "Accept-Encoding")) : NULL;
+	
+	// Si el cliente ya tiene esta version, le confirmo que no cambio y no mando el cuerpo
+	if (noModificado(c, e, v != NULL ? v->etag : e->etag)) {
+		char linea[192];
+		snprintf(linea, sizeof(linea), "%s%sETag: %s\r\nLast-Modified: %s\r\n", RTA_304,
+			e->comprimible ? "Vary: Accept-Encoding\r\n" : "", v != NULL ? v->etag : e->etag,
+			e->ultimaModificacion);
+		c->cache = NULL;
+		soltarArchivoCache(e);
+		c->status = 304;
+		mandarHeader(c, linea);
+		mandarFinHeaders(c);
+		c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+		return;
+	}
+	
+	// Un Range con sintaxis invalida (o un If-Range que no coincide) se ignora
+	if (rango != NULL && rangoVigente(c, e)) {
+		int cant = parsearRangos(rango, e->size, c->rangos, MAX_RANGOS);
+		if (cant >= 0) {
+			mandarRangos(c, e, cant);
+			return;
+		}
+	}
+	
+	c->status = 200;
+	if (v != NULL) {
+		c->archivo = v->fd;
+		c->cuerpo = v->datos;
+		c->restante = v->size;
+		encolarSalida(c, v->headers, v->lenHeaders);
+	} else {
+		c->archivo = e->fd;
+		c->cuerpo = e->datos;
+		c->restante = e->size;
+		encolarSalida(c, e->headers, e->lenHeaders);
+	}
+	mandarFinHeaders(c);
+	// Primero salen los headers ya encolados y despues el cuerpo
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Arma el ETag y el Last-Modified del archivo */
+void armarValidadores(struct archivoCache * e, struct stat * st){
+	struct tm tm;
+	// Si el archivo cambio en este mismo segundo podria volver a cambiar sin que
+	// cambie el mtime, asi que el ETag solo puede ser debil (como hace Apache)
+	int debil = st->st_mtime >= time(NULL) - 1;
+	snprintf(e->etag, sizeof(e->etag), "%s\"%llx-%llx-%llx\"", debil ? "W/" : "",
+		(unsigned long long) st->st_ino, (unsigned long long) st->st_size,
+		(unsigned long long) st->st_mtime);
+	gmtime_r(&st->st_mtime, &tm);
+	strftime(e->ultimaModificacion, sizeof(e->ultimaModificacion), FORMATO_FECHA_HTTP, &tm);
+}
+
+/* Revisa si el ETag esta en la lista de If-None-Match (o si la lista es "*") */
+int coincideETag(char * lista, char * etag){
+	// La comparacion de If-None-Match es debil: se ignora el W/
+	if (strncmp(etag, "W/", 2) == 0) etag += 2;
+	size_t n = strlen(etag);
+	char * p = lista;
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		if (*p == '*') return 1;
+		if (strncmp(p, "W/", 2) == 0) p += 2;
+		if (strncmp(p, etag, n) == 0 && (p[n] == '\0' || p[n] == ',' || p[n] == ' ' || p[n] == '\t'))
+			return 1;
+		while (*p && *p != ',') p++;
+	}
+	return 0;
+}
+
+/* Revisa si el cliente ya tiene esta version, segun If-None-Match o If-Modified-Since */
+int noModificado(struct conexion * c, struct archivoCache * e, char * etag){
+	char * siNoCoincide = buscarHeader(&c->pedido, "If-None-Match");
+	char * siModificado = buscarHeader(&c->pedido, "If-Modified-Since");
+	
+	// Si mandan If-None-Match, If-Modified-Since se ignora (RFC 9110)
+	if (siNoCoincide != NULL)
+		return coincideETag(siNoCoincide, etag);
+	if (siModificado != NULL) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		char * fin = strptime(siModificado, FORMATO_FECHA_HTTP, &tm);
+		if (fin == NULL || *fin != '\0') return 0;
+		// Una fecha futura no es valida (RFC 9110 13.1.3): un reloj mal puesto no
+		// puede dejar al cliente con una version vieja
+		time_t fecha = timegm(&tm);
+		return fecha <= time(NULL) && e->mtime <= fecha;
+	}
+	return 0;
+}
+
+/* Lee los rangos de un header Range. Retorna cuantos caen dentro del archivo,
+ * o -1 si el header no es valido o trae mas de max (se manda el archivo entero) */
+int parsearRangos(char * valor, off_t size, struct rango * rangos, int max){
+	int cant = 0;
+	char * p;
+	char * fin;
+	
+	if (strncasecmp(valor, "bytes=", 6) != 0) return -1;
+	p = valor + 6;
+	while (1) {
+		long long desde, hasta;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '-' && isdigit((unsigned char) p[1])) {
+			// Sufijo: los ultimos N bytes del archivo
+			long long n = strtoll(p + 1, &fin, 10);
+			desde = n >= size ? 0 : size - n;
+			hasta = n > 0 ? size - 1 : -1;
+		} else if (isdigit((unsigned char) *p)) {
+			desde = strtoll(p, &fin, 10);
+			if (*fin++ != '-') return -1;
+			if (isdigit((unsigned char) *fin)) {
+				hasta = strtoll(fin, &fin, 10);
+				if (hasta < desde) return -1;
+			} else {
+				hasta = size - 1;
+			}
+			if (hasta >= size) hasta = size - 1;
+		} else {
+			return -1;
+		}
+		
+		// Los rangos que caen fuera del archivo no se mandan
+		if (desde < size && desde <= hasta) {
+			// Demasiados rangos: mando el archivo entero
+			if (cant == max) return -1;
+			rangos[cant].desde = desde;
+			rangos[cant].largo = hasta - desde + 1;
+			cant++;
+		}
+		
+		p = fin;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '\0') return cant;
+		if (*p++ != ',') return -1;
+	}
+}
+
+/* Revisa con If-Range si los rangos pedidos son de esta version del archivo */
+int rangoVigente(struct conexion * c, struct archivoCache * e){
+	char * siRango = buscarHeader(&c->pedido, "If-Range");
+	if (siRango == NULL) return 1;
+	// If-Range exige comparacion fuerte: un ETag debil nunca coincide,
+	// y la fecha solo sirve si el archivo no cambio en el ultimo segundo
+	if (strncmp(e->etag, "W/", 2) == 0) return 0;
+	if (siRango[0] == '"') return strcmp(siRango, e->etag) == 0;
+	return strcmp(siRango, e->ultimaModificacion) == 0;
+}
+
+/* Arma el separador y los headers de la parte i de un multipart/byteranges.
+ * Retorna su largo (con buf NULL solo lo calcula) */
+size_t armarEncabezadoParte(struct conexion * c, int i, char * buf, size_t tam){
+	struct rango * r = &c->rangos[i];
+	return snprintf(buf, tam, "\r\n--%s\r\n%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+		c->separador, c->cache->tipoCont, (long long) r->desde,
+		(long long) (r->desde + r->largo - 1), (long long) c->cache->size);
+}
+
+/* Prepara la respuesta 206 con los rangos pedidos (o 416 si ninguno cae en el archivo) */
+void mandarRangos(struct conexion * c, struct archivoCache * e, int cant){
+	char linea[384];
+	int i;
+	
+	if (cant == 0) {
+		// Ningun rango cae dentro del archivo
+		snprintf(linea, sizeof(linea), "%sContent-Range: bytes */%lld\r\n", RTA_416, (long long) e->size);
+		c->cache = NULL;
+		soltarArchivoCache(e);
+		c->status = 416;
+		mandarHeader(c, linea);
+		terminarHeaders(c, 0);
+		c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+		return;
+	}
+	
+	c->status = 206;
+	c->archivo = e->fd;
+	c->cuerpo = e->datos;
+	c->cantRangos = cant;
+	c->rangoActual = 0;
+	c->offset = c->rangos[0].desde;
+	c->restante = c->rangos[0].largo;
+	if (cant == 1) {
+		snprintf(linea, sizeof(linea), "%s%sETag: %s\r\nLast-Modified: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+			RTA_206, e->tipoCont, e->etag, e->ultimaModificacion, (long long) c->rangos[0].desde,
+			(long long) (c->rangos[0].desde + c->rangos[0].largo - 1), (long long) e->size);
+		mandarHeader(c, linea);
+		terminarHeaders(c, c->rangos[0].largo);
+	} else {
+		// El largo total incluye el encabezado de cada parte y el separador final
+		snprintf(c->separador, sizeof(c->separador), "%08x%08x", e->hash, (unsigned int) ahoraMs());
+		long total = strlen(c->separador) + 8;
+		for (i = 0; i < cant; i++)
+			total += armarEncabezadoParte(c, i, NULL, 0) + c->rangos[i].largo;
+		snprintf(linea, sizeof(linea), "%sContent-Type: multipart/byteranges; boundary=%s\r\nETag: %s\r\nLast-Modified: %s\r\n",
+			RTA_206, c->separador, e->etag, e->ultimaModificacion);
+		mandarHeader(c, linea);
+		terminarHeaders(c, total);
+		size_t n = armarEncabezadoParte(c, 0, linea, sizeof(linea));
+		encolarSalida(c, linea, n);
+	}
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Termino de salir una parte: encola el encabezado de la siguiente (o el
+ * separador final). Retorna 1 si falta mandar algo, 0 si no hay mas partes */
+int siguienteRango(struct conexion * c){
+	char parte[256];
+	if (c->cantRangos < 2 || c->rangoActual >= c->cantRangos) return 0;
+	
+	c->rangoActual++;
+	if (c->rangoActual < c->cantRangos) {
+		size_t n = armarEncabezadoParte(c, c->rangoActual, parte, sizeof(parte));
+		encolarSalida(c, parte, n);
+		c->offset = c->rangos[c->rangoActual].desde;
+		c->restante = c->rangos[c->rangoActual].largo;
+	} else {
+		// Despues de la ultima parte va el separador de cierre
+		size_t n = snprintf(parte, sizeof(parte), "\r\n--%s--\r\n", c->separador);
+		encolarSalida(c, parte, n);
+	}
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+	return 1;
+}
+
+/* La conexion deja de usar el archivo que estaba mandando */
+void liberarArchivo(struct conexion * c){
+	if (c->cache != NULL) {
+		soltarArchivoCache(c->cache);
+		c->cache = NULL;
+	}
+	c->archivo = -1;
+	c->cuerpo = NULL;
+	c->cantRangos = 0;
+	c->enBuffer = 0;
+}
+
+/* Hash FNV-1a de una ruta */
+unsigned int hashRuta(const char * ruta){
+	unsigned int h = 2166136261u;
+	for (; *ruta; ruta++) {
+		h ^= (unsigned char) *ruta;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Crea el inotify del worker (lo comparten la cache y el paquete) */
+int iniciarInotify(){
+	if (inotifyFd >= 0) return 0;
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0) {
+		log_error(ERROR_INOTIFY);
+		return -1;
+	}
+	static struct fuente fuenteInotify = { FUENTE_INOTIFY, NULL };
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &fuenteInotify;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, inotifyFd, &ev) < 0) {
+		log_error(ERROR_INOTIFY);
+		close(inotifyFd);
+		inotifyFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Crea la tabla de la cache y el inotify del worker */
+void iniciarCache(){
+	if (config.maxCache == 0) return;
+	
+	// Sin avisos de cambios no puedo confiar en la cache, trabajo sin ella
+	if (iniciarInotify() < 0) return;
+	
+	tamTablaCache = 16;
+	while (tamTablaCache < 2 * (unsigned int) config.maxCache) tamTablaCache *= 2;
+	tablaCache = calloc(tamTablaCache, sizeof(struct archivoCache *));
+}
+
+/* Busca un archivo en la cache, y si esta lo marca como el mas reciente */
+struct archivoCache * buscarCache(char * ruta){
+	if (tablaCache == NULL || ruta == NULL) return NULL;
+	unsigned int h = hashRuta(ruta);
+	struct archivoCache * e = tablaCache[h & (tamTablaCache - 1)];
+	while (e != NULL && (e->hash != h || strcmp(e->ruta, ruta) != 0)) 
+		e = e->sigHash;
+	if (e != NULL && e != masReciente) {
+		quitarLRU(e);
+		agregarLRU(e);
+	}
+	return e;
+}
+
+/* Abre el archivo, arma sus headers y lo agrega a la cache (si esta activa).
+ * Retorna NULL (con el errno del open) si el archivo no se puede abrir o no es
+ * un archivo regular */
+struct archivoCache * cargarCache(char * ruta, char * tipoCont){
+	struct stat st;
+	struct directorioVigilado * v = NULL;
+	
+	// Vigilo el directorio antes de abrir, para no perder un cambio en el medio
+	if (tablaCache != NULL) {
+		char * barra = strrchr(ruta, '/');
+		if (barra != NULL) {
+			*barra = '\0';
+			v = vigilarDirectorio(barra == ruta ? "/" : ruta);
+			*barra = '/';
+		} else {
+			v = vigilarDirectorio(".");
+		}
+	}
+	
+	int fd = open(ruta, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		// Un archivo que no esta es un 404 comun, no un error del servidor
+		int err = fd < 0 ? errno : EACCES;
+		if (!faltaArchivo(err)) log_error(ERROR_ABRIR_ARCHIVO);
+		if (fd >= 0) close(fd);
+		if (v != NULL) soltarVigilado(v);
+		errno = err;
+		return NULL;
+	}
+	
+	struct archivoCache * e = calloc(1, sizeof(struct archivoCache));
+	e->ruta = strdup(ruta);
+	e->hash = hashRuta(ruta);
+	e->fd = fd;
+	e->size = st.st_size;
+	e->mtime = st.st_mtime;
+	e->inodo = st.st_ino;
+	e->tipoCont = tipoCont;
+	e->comprimible = esComprimible(tipoCont);
+	armarValidadores(e, &st);
+	armarHeadersCache(e);
+	char * barra = strrchr(e->ruta, '/');
+	e->nombre = barra != NULL ? barra + 1 : e->ruta;
+	if (e->comprimible) {
+		cargarVariantesPrecomprimidas(e);
+	} else {
+		int cod;
+		for (cod = 0; cod < CANT_CODIFICACIONES; cod++) e->variantes[cod].fd = -1;
+	}
+	
+	if (tablaCache == NULL || v == NULL) {
+		// Sin cache: la entrada vive solo mientras la use la conexion
+		return e;
+	}
+	
+	// Si la cache esta llena saco el archivo usado hace mas tiempo
+	if (cantCache >= config.maxCache)
+		sacarCache(menosReciente);
+	
+	struct archivoCache ** balde = &tablaCache[e->hash & (tamTablaCache - 1)];
+	e->sigHash = *balde;
+	*balde = e;
+	agregarLRU(e);
+	// La vigilancia del directorio queda con la entrada hasta que salga de la cache
+	e->vigilado = v;
+	e->sigVigilado = v->archivos;
+	if (v->archivos != NULL) v->archivos->antVigilado = e;
+	v->archivos = e;
+	e->enCache = 1;
+	e->referencias = 1;		// la referencia de la propia cache
+	cantCache++;
+	return e;
+}
+
+/* Arma los headers de la respuesta 200 del archivo */
+void armarHeadersCache(struct archivoCache * e){
+	// Si el contenido se puede comprimir, las respuestas dependen de Accept-Encoding
+	e->lenHeaders = snprintf(e->headers, sizeof(e->headers),
+		"%s%s%sAccept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\nContent-Length: %lld\r\n",
+		RTA_200, e->tipoCont, e->comprimible ? "Vary: Accept-Encoding\r\n" : "", e->etag,
+		e->ultimaModificacion, (long long) e->size);
+}
+
+/* Saca el archivo de la cache. Se cierra cuando ninguna conexion lo use */
+void sacarCache(struct archivoCache * e){
+	struct archivoCache ** p = &tablaCache[e->hash & (tamTablaCache - 1)];
+	while (*p != e) p = &(*p)->sigHash;
+	*p = e->sigHash;
+	quitarLRU(e);
+	struct directorioVigilado * v = e->vigilado;
+	if (e->antVigilado != NULL) e->antVigilado->sigVigilado = e->sigVigilado;
+	else v->archivos = e->sigVigilado;
+	if (e->sigVigilado != NULL) e->sigVigilado->antVigilado = e->antVigilado;
+	e->vigilado = NULL;
+	soltarVigilado(v);
+	e->enCache = 0;
+	cantCache--;
+	soltarArchivoCache(e);
+}
+
+/* Suelta una referencia al archivo, y si era la ultima lo cierra */
+void soltarArchivoCache(struct archivoCache * e){
+	int cod;
+	if (--e->referencias > 0) return;
+	if (e->paquete != NULL) {
+		// Sus datos son del mapa del paquete
+		soltarPaquete(e->paquete);
+		free(e);
+		return;
+	}
+	for (cod = 0; cod < CANT_CODIFICACIONES; cod++) {
+		struct variante * v = &e->variantes[cod];
+		if (v->fd >= 0) close(v->fd);
+		if (v->datos != NULL) {
+			memVariantes -= v->size;
+			free(v->datos);
+		}
+	}
+	close(e->fd);
+	free(e->ruta);
+	free(e);
+}
+
+/* Agrega el archivo como el mas reciente de la lista LRU */
+void agregarLRU(struct archivoCache * e){
+	e->antLRU = NULL;
+	e->sigLRU = masReciente;
+	if (masReciente != NULL) 
+		masReciente->antLRU = e;
+	else
+		menosReciente = e;
+	masReciente = e;
+}
+
+/* Saca el archivo de la lista LRU */
+void quitarLRU(struct archivoCache * e){
+	if (e->antLRU != NULL)
+		e->antLRU->sigLRU = e->sigLRU;
+	else
+		masReciente = e->sigLRU;
+	if (e->sigLRU != NULL)
+		e->sigLRU->antLRU = e->antLRU;
+	else
+		menosReciente = e->antLRU;
+}
+
+/* Lee los avisos de inotify y saca de la cache los archivos que cambiaron */
+void leerInotify(){
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t n = read(inotifyFd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		char * p;
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+			struct inotify_event * ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				// Se perdieron avisos: no se puede confiar en nada de lo guardado
+				recargarPaquete();
+				invalidarIndices(NULL);
+				while (menosReciente != NULL) sacarCache(menosReciente);
+				continue;
+			}
+			// El paquete nuevo se pone en su lugar con un rename (o se termino de escribir)
+			if (ev->wd == wdPaquete && ev->len > 0 && (ev->mask & (IN_MOVED_TO | IN_CLOSE_WRITE)) &&
+					strcmp(ev->name, nombrePaquete) == 0)
+				recargarPaquete();
+			struct directorioVigilado * v = buscarVigilado(ev->wd);
+			if (v == NULL) continue;		// Ya se dejo de vigilar
+			// Lo retengo mientras saco lo que depende de el
+			v->usos++;
+			if (ev->len == 0) {
+				// Sin nombre el aviso es del directorio mismo: saco todo lo que dependa de el
+				invalidarIndices(v);
+				while (v->archivos != NULL) sacarCache(v->archivos);
+			} else {
+				// Un indice puede aparecer, cambiar o desaparecer
+				if (strncmp(ev->name, "index.", 6) == 0) invalidarIndices(v);
+				sacarArchivosVigilado(v, ev->name);
+			}
+			soltarVigilado(v);
+		}
+	}
+}
+
+/* Vigila el directorio, o suma un uso a su vigilancia si ya estaba. El kernel
+ * da el mismo wd para el mismo directorio, asi que hay una sola por directorio */
+struct directorioVigilado * vigilarDirectorio(const char * directorio){
+	int wd = inotify_add_watch(inotifyFd, directorio, MASCARA_INOTIFY);
+	if (wd < 0) return NULL;
+	struct directorioVigilado * v = buscarVigilado(wd);
+	if (v == NULL) {
+		v = calloc(1, sizeof(struct directorioVigilado));
+		v->wd = wd;
+		v->sig = tablaVigilados[wd & (TAM_TABLA_VIGILADOS - 1)];
+		tablaVigilados[wd & (TAM_TABLA_VIGILADOS - 1)] = v;
+	}
+	v->usos++;
+	return v;
+}
+
+/* Busca el directorio vigilado de un wd */
+struct directorioVigilado * buscarVigilado(int wd){
+	struct directorioVigilado * v = tablaVigilados[wd & (TAM_TABLA_VIGILADOS - 1)];
+	while (v != NULL && v->wd != wd) v = v->sig;
+	return v;
+}
+
+/* Resta un uso a la vigilancia; sin usos se deja de vigilar el directorio */
+void soltarVigilado(struct directorioVigilado * v){
+	if (--v->usos > 0) return;
+	struct directorioVigilado ** p = &tablaVigilados[v->wd & (TAM_TABLA_VIGILADOS - 1)];
+	while (*p != v) p = &(*p)->sig;
+	*p = v->sig;
+	// Si el directorio ya no existe el kernel la saco solo (y esto falla sin problema)
+	inotify_rm_watch(inotifyFd, v->wd);
+	free(v);
+}
+
+/* Saca de la cache los archivos del directorio con ese nombre. Un aviso de
+ * archivo.gz o archivo.br tambien saca a archivo, por sus variantes precomprimidas */
+void sacarArchivosVigilado(struct directorioVigilado * v, const char * nombre){
+	struct archivoCache * e = v->archivos;
+	while (e != NULL) {
+		struct archivoCache * sig = e->sigVigilado;
+		size_t n = strlen(e->nombre);
+		int coincide = strcmp(e->nombre, nombre) == 0;
+		int cod;
+		for (cod = 0; !coincide && cod < CANT_CODIFICACIONES; cod++) {
+			coincide = strncmp(e->nombre, nombre, n) == 0 &&
+				strcmp(nombre + n, extensionesCodificacion[cod]) == 0;
+		}
+		if (coincide) sacarCache(e);
+		e = sig;
+	}
+}
+
+/* Mapea el paquete de documentos del worker y vigila su directorio */
+void iniciarPaquete(){
+	if (config.paquete == NULL) return;
+	
+	// El directorio se vigila con la misma mascara que la cache (si es el mismo,
+	// inotify_add_watch reemplaza la mascara y devuelve la misma vigilancia)
+	char * barra = strrchr(config.paquete, '/');
+	nombrePaquete = barra != NULL ? barra + 1 : config.paquete;
+	if (iniciarInotify() == 0) {
+		// El paquete usa la vigilancia mientras viva el worker
+		struct directorioVigilado * v;
+		if (barra != NULL) {
+			*barra = '\0';
+			v = vigilarDirectorio(barra == config.paquete ? "/" : config.paquete);
+			*barra = '/';
+		} else {
+			v = vigilarDirectorio(".");
+		}
+		if (v != NULL) wdPaquete = v->wd;
+		else log_error(ERROR_INOTIFY);
+	}
+	// Se mapea despues de vigilar, para no perder un cambio en el medio
+	recargarPaquete();
+}
+
+/* Mapea el paquete y revisa que no haya nada fuera del archivo */
+struct paquete * cargarPaquete(const char * ruta){
+	struct stat st;
+	int fd = open(ruta, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(struct cabeceraPaquete)) {
+		close(fd);
+		return NULL;
+	}
+	char * mapa = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapa == MAP_FAILED) return NULL;
+	
+	size_t tam = st.st_size;
+	struct cabeceraPaquete * cab = (struct cabeceraPaquete *) mapa;
+	struct archivoPaquete * archivos = (struct archivoPaquete *) (mapa + cab->offsetArchivos);
+	uint32_t * tabla = (uint32_t *) (mapa + cab->offsetTabla);
+	int valido = memcmp(cab->magia, MAGIA_PAQUETE, sizeof(cab->magia)) == 0 && cab->tam == tam &&
+		cab->tamTabla > cab->cantArchivos && (cab->tamTabla & (cab->tamTabla - 1)) == 0 &&
+		cab->offsetArchivos % 8 == 0 && cab->offsetTabla % 8 == 0 &&
+		cab->offsetArchivos <= tam && cab->cantArchivos <= (tam - cab->offsetArchivos) / sizeof(struct archivoPaquete) &&
+		cab->offsetTabla <= tam && cab->tamTabla <= (tam - cab->offsetTabla) / sizeof(uint32_t);
+	uint32_t i;
+	for (i = 0; valido && i < cab->tamTabla; i++) 
+		valido = tabla[i] <= cab->cantArchivos;
+	for (i = 0; valido && i < cab->cantArchivos; i++) {
+		struct archivoPaquete * a = &archivos[i];
+		int cod;
+		valido = a->offsetRuta < tam && memchr(mapa + a->offsetRuta, '\0', tam - a->offsetRuta) != NULL &&
+			a->offset <= tam && a->size <= tam - a->offset && a->lenHeaders < sizeof(a->headers) &&
+			memchr(a->tipoCont, '\0', sizeof(a->tipoCont)) != NULL && memchr(a->etag, '\0', sizeof(a->etag)) != NULL &&
+			memchr(a->ultimaModificacion, '\0', sizeof(a->ultimaModificacion)) != NULL;
+		for (cod = 0; valido && cod < CANT_CODIFICACIONES; cod++) {
+			struct variantePaquete * v = &a->variantes[cod];
+			valido = v->offset <= tam && v->size <= tam - v->offset && v->lenHeaders < sizeof(v->headers) &&
+				memchr(v->etag, '\0', sizeof(v->etag)) != NULL;
+		}
+	}
+	if (!valido) {
+		munmap(mapa, tam);
+		return NULL;
+	}
+	
+	struct paquete * p = calloc(1, sizeof(struct paquete));
+	p->mapa = mapa;
+	p->tam = tam;
+	p->cabecera = cab;
+	p->archivos = archivos;
+	p->tabla = tabla;
+	p->entradas = calloc(cab->cantArchivos > 0 ? cab->cantArchivos : 1, sizeof(struct archivoCache *));
+	p->referencias = 1;
+	return p;
+}
+
+/* Cambia el paquete vigente por el que esta ahora en su ruta */
+void recargarPaquete(){
+	if (config.paquete == NULL) return;
+	struct paquete * nuevo = cargarPaquete(config.paquete);
+	if (nuevo == NULL) {
+		// Uno a medio escribir (o que no es valido) no reemplaza al que funciona
+		log_error(ERROR_PAQUETE);
+		return;
+	}
+	struct paquete * viejo = paqueteVigente;
+	paqueteVigente = nuevo;
+	// Los indices de los directorios pueden salir del paquete
+	invalidarIndices(NULL);
+	if (viejo == NULL) return;
+	
+	// Las conexiones que estan mandando un archivo del viejo lo siguen
+	// mandando del mapa viejo, que se desmapea cuando terminan todas
+	uint32_t i;
+	for (i = 0; i < viejo->cabecera->cantArchivos; i++) {
+		if (viejo->entradas[i] != NULL) {
+			struct archivoCache * e = viejo->entradas[i];
+			viejo->entradas[i] = NULL;
+			soltarArchivoCache(e);
+		}
+	}
+	soltarPaquete(viejo);
+}
+
+/* Suelta una referencia al paquete, y si era la ultima lo desmapea */
+void soltarPaquete(struct paquete * p){
+	if (--p->referencias > 0) return;
+	munmap(p->mapa, p->tam);
+	free(p->entradas);
+	free(p);
+}
+
+/* Busca un archivo en el paquete vigente */
+struct archivoCache * buscarPaquete(char * ruta){
+	if (paqueteVigente == NULL || ruta == NULL) return NULL;
+	return entradaPaquete(paqueteVigente, ruta);
+}
+
+/* Busca el archivo en la tabla del paquete (direccionamiento abierto) y
+ * la primera vez arma su entrada, con los datos apuntando al mapa */
+struct archivoCache * entradaPaquete(struct paquete * p, const char * ruta){
+	uint32_t mascara = p->cabecera->tamTabla - 1;
+	unsigned int h = hashRuta(ruta);
+	uint32_t i;
+	for (i = h & mascara; p->tabla[i] != 0; i = (i + 1) & mascara) {
+		uint32_t n = p->tabla[i] - 1;
+		struct archivoPaquete * a = &p->archivos[n];
+		if (a->hash != h || strcmp(p->mapa + a->offsetRuta, ruta) != 0) continue;
+		if (p->entradas[n] != NULL) return p->entradas[n];
+		
+		struct archivoCache * e = calloc(1, sizeof(struct archivoCache));
+		int cod;
+		e->ruta = p->mapa + a->offsetRuta;
+		e->hash = h;
+		e->fd = -1;
+		e->datos = p->mapa + a->offset;
+		e->size = a->size;
+		e->mtime = a->mtime;
+		e->tipoCont = a->tipoCont;
+		memcpy(e->headers, a->headers, a->lenHeaders);
+		e->lenHeaders = a->lenHeaders;
+		memcpy(e->etag, a->etag, sizeof(e->etag));
+		memcpy(e->ultimaModificacion, a->ultimaModificacion, sizeof(e->ultimaModificacion));
+		e->comprimible = a->comprimible;
+		for (cod = 0; cod < CANT_CODIFICACIONES; cod++) {
+			struct variantePaquete * vp = &a->variantes[cod];
+			struct variante * v = &e->variantes[cod];
+			v->fd = -1;
+			v->intentada = 1;		// Lo que no vino comprimido no se comprime
+			if (vp->lenHeaders == 0) continue;
+			v->datos = p->mapa + vp->offset;
+			v->size = vp->size;
+			memcpy(v->headers, vp->headers, vp->lenHeaders);
+			v->lenHeaders = vp->lenHeaders;
+			memcpy(v->etag, vp->etag, sizeof(v->etag));
+		}
+		e->nombre = e->ruta;
+		e->paquete = p;
+		e->referencias = 1;			// la del propio paquete
+		p->referencias++;
+		p->entradas[n] = e;
+		return e;
+	}
+	return NULL;
+}
+
+/* Revisa si vale la pena comprimir un tipo de contenido (texto) */
+int esComprimible(char * tipoCont){
+	return strstr(tipoCont, "text/") != NULL || strstr(tipoCont, "javascript") != NULL ||
+		strstr(tipoCont, "json") != NULL || strstr(tipoCont, "xml") != NULL;
+}
+
+/* Revisa si el header Accept-Encoding acepta la codificacion dada (y no con q=0) */
+int aceptaCodificacion(char * aceptadas, const char * codificacion){
+	size_t n = strlen(codificacion);
+	char * p = aceptadas;
+	while (p != NULL && *p) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		char * fin = p;
+		while (*fin && *fin != ',' && *fin != ';' && *fin != ' ') fin++;
+		if ((size_t) (fin - p) == n && strncasecmp(p, codificacion, n) == 0) {
+			// Esta en la lista; solo la rechaza un peso q=0
+			char * q = strstr(fin, "q=");
+			char * coma = strchr(fin, ',');
+			return q == NULL || (coma != NULL && q > coma) || atof(q + 2) > 0;
+		}
+		p = strchr(fin, ',');
+	}
+	return 0;
+}
+
+/* Arma los headers de una variante comprimida de un archivo */
+void armarHeadersVariante(struct archivoCache * e, int cod){
+	struct variante * v = &e->variantes[cod];
+	// Cada codificacion es otra representacion, asi que lleva otro ETag
+	char etag[sizeof(v->etag)];
+	snprintf(etag, sizeof(etag), "%.*s-%s\"", (int) strlen(e->etag) - 1, e->etag,
+		nombresCodificacion[cod]);
+	memcpy(v->etag, etag, sizeof(etag));
+	v->lenHeaders = snprintf(v->headers, sizeof(v->headers),
+		"%s%sContent-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n"
+		"Content-Length: %lld\r\n",
+		RTA_200, e->tipoCont, nombresCodificacion[cod], etag, e->ultimaModificacion,
+		(long long) v->size);
+}
+
+/* Busca los hermanos ya comprimidos del archivo (archivo.br, archivo.gz) */
+void cargarVariantesPrecomprimidas(struct archivoCache * e){
+	int cod;
+	for (cod = 0; cod < CANT_CODIFICACIONES; cod++) {
+		struct variante * v = &e->variantes[cod];
+		struct stat st;
+		char ruta[strlen(e->ruta) + 4];
+		v->fd = -1;
+		snprintf(ruta, sizeof(ruta), "%s%s", e->ruta, extensionesCodificacion[cod]);
+		int fd = open(ruta, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) continue;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			continue;
+		}
+		v->fd = fd;
+		v->size = st.st_size;
+		v->intentada = 1;
+		armarHeadersVariante(e, cod);
+	}
+}
+
+/* Libera la memoria de las variantes comprimidas de los archivos menos usados
+ * (que ninguna conexion este mandando) hasta que entren necesarios bytes mas */
+void liberarMemoriaVariantes(size_t necesarios){
+	struct archivoCache * e;
+	for (e = menosReciente; e != NULL && memVariantes + necesarios > config.memCompresion; e = e->antLRU) {
+		int cod;
+		if (e->referencias > 1) continue;
+		for (cod = 0; cod < CANT_CODIFICACIONES; cod++) {
+			struct variante * v = &e->variantes[cod];
+			if (v->datos != NULL) {
+				memVariantes -= v->size;
+				free(v->datos);
+				v->datos = NULL;
+				v->intentada = 0;
+			}
+		}
+	}
+}
+
+/* Comprime el archivo en memoria con la codificacion dada y lo guarda como
+ * variante, si entra en la memoria para variantes y si achica el archivo */
+void comprimirVariante(struct archivoCache * e, int cod){
+	struct variante * v = &e->variantes[cod];
+	v->intentada = 1;
+	if (e->size < MIN_COMPRIMIR || e->size > MAX_COMPRIMIR || (size_t) e->size > config.memCompresion)
+		return;
+	
+	char * original = malloc(e->size);
+	if (pread(e->fd, original, e->size, 0) != e->size) {
+		free(original);
+		return;
+	}
+	
+	size_t len = 0;
+	char * comprimido = NULL;
+	if (cod == COD_GZIP) {
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		// 15 + 16: ventana maxima con encabezado gzip
+		if (deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			len = deflateBound(&z, e->size);
+			comprimido = malloc(len);
+			z.next_in = (unsigned char *) original;
+			z.avail_in = e->size;
+			z.next_out = (unsigned char *) comprimido;
+			z.avail_out = len;
+			if (deflate(&z, Z_FINISH) == Z_STREAM_END) {
+				len = z.total_out;
+			} else {
+				free(comprimido);
+				comprimido = NULL;
+			}
+			deflateEnd(&z);
+		}
+	}
+#ifdef USAR_BROTLI
+	else if (cod == COD_BR) {
+		len = BrotliEncoderMaxCompressedSize(e->size);
+		comprimido = malloc(len);
+		if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, e->size,
+				(const uint8_t *) original, &len, (uint8_t *) comprimido)) {
+			free(comprimido);
+			comprimido = NULL;
+		}
+	}
+#endif
+	free(original);
+	
+	// Si no achica el archivo no tiene sentido mandarlo comprimido
+	if (comprimido == NULL || len >= (size_t) e->size) {
+		free(comprimido);
+		return;
+	}
+	liberarMemoriaVariantes(len);
+	if (memVariantes + len > config.memCompresion) {
+		free(comprimido);
+		v->intentada = 0;
+		return;
+	}
+	v->datos = realloc(comprimido, len);
+	v->size = len;
+	memVariantes += len;
+	armarHeadersVariante(e, cod);
+}
+
+/* Elige la mejor variante comprimida que acepte el cliente, comprimiendo
+ * el archivo la primera vez que se pide si no tiene un hermano ya comprimido */
+struct variante * elegirVariante(struct archivoCache * e, char * aceptadas){
+	int cod;
+	if (!e->comprimible || aceptadas == NULL) return NULL;
+	for (cod = 0; cod < CANT_CODIFICACIONES; cod++) {
+		struct variante * v = &e->variantes[cod];
+		if (!aceptaCodificacion(aceptadas, nombresCodificacion[cod])) continue;
+		// Solo vale la pena comprimir si el resultado queda en la cache
+		if (!v->intentada && e->enCache && config.memCompresion > 0)
+			comprimirVariante(e, cod);
+		if (v->fd >= 0 || v->datos != NULL) return v;
+	}
+	return NULL;
+}
+
+/* Copia en minusculas la extension del archivo (sin el punto) en buf, sin pedir memoria.
+ * Si no tiene extension (o no entra en buf) queda vacia */
+size_t extensionArchivo(const char * archivo, char * buf, size_t tam) {
+	const char * punto = NULL;
+	const char * p;
+	size_t n = 0;
+	for (p = archivo; *p; p++) {
+		if (*p == '.') punto = p;
+		else if (*p == '/') punto = NULL;	// El punto de un directorio no cuenta
+	}
+	if (punto != NULL && (size_t) (p - punto - 1) < tam) {
+		for (p = punto + 1; *p; p++) buf[n++] = tolower((unsigned char) *p);
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/* Agrega (o reemplaza) el tipo de contenido de una extension en la tabla de tipos */
+void agregarMIME(const char * extension, const char * tipo) {
+	char ext[MAX_EXTENSION];
+	size_t n = strlen(extension);
+	size_t i;
+	if (n == 0 || n >= sizeof(ext)) return;
+	for (i = 0; i <= n; i++) ext[i] = tolower((unsigned char) extension[i]);
+	
+	char header[128];
+	snprintf(header, sizeof(header), "Content-Type: %s\r\n", tipo);
+	unsigned int hash = hashRuta(ext);
+	struct tipoMIME * t;
+	for (t = tablaMIME[hash & (TAM_TABLA_MIME - 1)]; t != NULL; t = t->sig) {
+		if (strcmp(t->extension, ext) == 0) {
+			// Las entradas de la tabla no se liberan: se pueden estar usando en la cache
+			t->header = strdup(header);
+			return;
+		}
+	}
+	t = malloc(sizeof(struct tipoMIME));
+	t->extension = strdup(ext);
+	t->header = strdup(header);
+	t->sig = tablaMIME[hash & (TAM_TABLA_MIME - 1)];
+	tablaMIME[hash & (TAM_TABLA_MIME - 1)] = t;
+}
+
+/* Carga la tabla con los tipos incluidos en el servidor */
+void iniciarMIME() {
+	size_t i;
+	for (i = 0; i < sizeof(tiposIncluidos) / sizeof(tiposIncluidos[0]); i++)
+		agregarMIME(tiposIncluidos[i][0], tiposIncluidos[i][1]);
+}
+
+/* Carga tipos de un archivo con el formato de mime.types ("tipo ext1 ext2 ...") */
+void cargarMIME(char * ruta) {
+	char linea[1024];
+	FILE * f = fopen(ruta, "r");
+	if (f == NULL) error(ERROR_MIME);
+	while (fgets(linea, sizeof(linea), f) != NULL) {
+		char * resto;
+		char * tipo = strtok_r(linea, " \t\r\n", &resto);
+		if (tipo == NULL || tipo[0] == '#') continue;
+		char * ext;
+		while ((ext = strtok_r(NULL, " \t\r\n", &resto)) != NULL && ext[0] != '#')
+			agregarMIME(ext, tipo);
+	}
+	fclose(f);
+}
+
+/* Busca el header Content-Type de una extension (ya en minusculas) */
+char * buscarMIME(const char * extension) {
+	unsigned int hash = hashRuta(extension);
+	struct tipoMIME * t;
+	for (t = tablaMIME[hash & (TAM_TABLA_MIME - 1)]; t != NULL; t = t->sig) {
+		if (strcmp(t->extension, extension) == 0) return t->header;
+	}
+	return NULL;
+}
+
+/* Agrega una regla al arbol de rutas. Si el prefijo se separa de una arista
+ * a la mitad, la arista se parte en dos */
+void agregarRegla(const char * prefijo, int accion, const char * destino) {
+	struct regla * r = malloc(sizeof(struct regla));
+	r->prefijo = strdup(prefijo);
+	r->accion = accion;
+	// Los directorios quedan con la barra final para pegarles la ruta
+	size_t len = strlen(destino);
+	int barra = (accion == RUTA_RAIZ || accion == RUTA_ALIAS) && len > 0 && destino[len - 1] != '/';
+	if ((accion == RUTA_RAIZ || accion == RUTA_ALIAS) && strcmp(destino, ".") == 0) {
+		r->destino = strdup("");
+	} else {
+		r->destino = malloc(len + 2);
+		snprintf(r->destino, len + 2, "%s%s", destino, barra ? "/" : "");
+	}
+	
+	struct nodoRutas * n = &raizRutas;
+	const char * p = r->prefijo;
+	while (*p) {
+		struct nodoRutas ** enlace = &n->hijo;
+		while (*enlace != NULL && (*enlace)->etiqueta[0] != *p) enlace = &(*enlace)->hermano;
+		struct nodoRutas * h = *enlace;
+		if (h == NULL) {
+			// Ningun hijo empieza asi: lo que queda del prefijo es una arista nueva
+			h = calloc(1, sizeof(struct nodoRutas));
+			h->etiqueta = p;
+			h->lenEtiqueta = strlen(p);
+			*enlace = h;
+			n = h;
+			break;
+		}
+		size_t i = 0;
+		while (i < h->lenEtiqueta && p[i] == h->etiqueta[i]) i++;
+		if (i < h->lenEtiqueta) {
+			// Coinciden solo los primeros i: parto la arista con un nodo intermedio
+			struct nodoRutas * m = calloc(1, sizeof(struct nodoRutas));
+			m->etiqueta = h->etiqueta;
+			m->lenEtiqueta = i;
+			m->hermano = h->hermano;
+			m->hijo = h;
+			h->etiqueta += i;
+			h->lenEtiqueta -= i;
+			h->hermano = NULL;
+			*enlace = m;
+			h = m;
+		}
+		n = h;
+		p += i;
+	}
+	n->regla = r;
+}
+
+/* Carga las reglas de un archivo de rutas ("prefijo accion destino") */
+void cargarRutas(char * ruta) {
+	char linea[1024];
+	int nroLinea = 0;
+	FILE * f = fopen(ruta, "r");
+	if (f == NULL) error(ERROR_RUTAS);
+	while (fgets(linea, sizeof(linea), f) != NULL) {
+		char * resto;
+		nroLinea++;
+		char * prefijo = strtok_r(linea, " \t\r\n", &resto);
+		if (prefijo == NULL || prefijo[0] == '#') continue;
+		char * accion = strtok_r(NULL, " \t\r\n", &resto);
+		char * destino = strtok_r(NULL, " \t\r\n", &resto);
+		int a = -1;
+		if (accion != NULL && strcmp(accion, "raiz") == 0) a = RUTA_RAIZ;
+		else if (accion != NULL && strcmp(accion, "alias") == 0) a = RUTA_ALIAS;
+		else if (accion != NULL && strcmp(accion, "php") == 0) a = RUTA_PHP;
+		else if (accion != NULL && strcmp(accion, "redireccion") == 0) a = RUTA_REDIRECCION;
+		char extension[MAX_EXTENSION];
+		if (destino != NULL && a == RUTA_PHP) extensionArchivo(destino, extension, sizeof(extension));
+		// Los prefijos son rutas sin parametros, y un script tiene que ser PHP
+		if (prefijo[0] != '/' || strchr(prefijo, '?') != NULL || a < 0 || destino == NULL ||
+				(a == RUTA_PHP && strcmp(extension, "php") != 0)) {
+			fprintf(stderr, "%s:%d: ", ruta, nroLinea);
+			error(ERROR_RUTAS);
+		}
+		agregarRegla(prefijo, a, destino);
+	}
+	fclose(f);
+}
+
+/* Busca la regla del prefijo mas largo de la ruta. Un prefijo cubre la ruta
+ * solo si termina en una barra o donde termina un segmento de la ruta */
+struct regla * buscarRegla(char * ruta, char ** resto) {
+	struct nodoRutas * n = &raizRutas;
+	struct regla * mejor = NULL;
+	char * p = ruta;
+	while (1) {
+		if (n->regla != NULL && (p[-1] == '/' || *p == '\0' || *p == '/')) {
+			mejor = n->regla;
+			*resto = p;
+		}
+		if (*p == '\0') break;
+		struct nodoRutas * h = n->hijo;
+		while (h != NULL && h->etiqueta[0] != *p) h = h->hermano;
+		if (h == NULL || strncmp(p, h->etiqueta, h->lenEtiqueta) != 0) break;
+		p += h->lenEtiqueta;
+		n = h;
+	}
+	return mejor;
+}
+
+/* Arma (en la arena) el archivo del pedido segun su regla */
+char * resolverRuta(struct conexion * c, struct regla * r, char * ruta, char * resto) {
+	// Todo lo del prefijo de un script lo atiende el mismo script
+	char * relativa = r->accion == RUTA_PHP ? "" : r->accion == RUTA_RAIZ ? ruta + 1 : resto + (*resto == '/');
+	size_t lenDestino = strlen(r->destino);
+	size_t lenArchivo = strlen(relativa);
+	
+	// Un directorio (la ruta termina en barra) se atiende con su indice
+	const char * indice = "";
+	if (r->accion != RUTA_PHP && (lenDestino + lenArchivo == 0 ||
+			(lenArchivo > 0 ? relativa[lenArchivo - 1] : r->destino[lenDestino - 1]) == '/')) {
+		char directorio[lenDestino + lenArchivo + 1];
+		memcpy(directorio, r->destino, lenDestino);
+		memcpy(directorio + lenDestino, relativa, lenArchivo);
+		directorio[lenDestino + lenArchivo] = '\0';
+		int i = resolverIndice(directorio);
+		if (i < 0) return NULL;
+		indice = nombresIndice[i];
+	}
+	
+	size_t len = lenDestino + lenArchivo + strlen(indice) + 1;
+	char * archivo = pedirArena(c, len);
+	snprintf(archivo, len, "%s%s%s", r->destino, relativa, indice);
+	return archivo;
+}
+
+/* Se fija si el indice esta. Uno estatico se abre y queda en la cache para el
+ * pedido que sigue; un php (lo abre php-cgi) se busca por nombre. Un indice que
+ * esta pero no se puede abrir cuenta igual: el pedido da 403 */
+int hayIndice(char * archivo) {
+	char extension[MAX_EXTENSION];
+	char * tipoCont;
+	if (buscarPaquete(archivo) != NULL || buscarCache(archivo) != NULL) return 1;
+	extensionArchivo(archivo, extension, sizeof(extension));
+	if ((tipoCont = buscarMIME(extension)) == NULL) return access(archivo, F_OK) == 0 || !faltaArchivo(errno);
+	struct archivoCache * e = cargarCache(archivo, tipoCont);
+	if (e == NULL) return !faltaArchivo(errno);
+	if (!e->enCache) {
+		// Sin cache la entrada no la usa nadie
+		e->referencias++;
+		soltarArchivoCache(e);
+	}
+	return 1;
+}
+
+/* Busca el indice del directorio, primero en la tabla del worker */
+int resolverIndice(const char * directorio) {
+	unsigned int h = hashRuta(directorio);
+	struct indiceDirectorio * d;
+	for (d = tablaIndices[h & (TAM_TABLA_INDICES - 1)]; d != NULL; d = d->sig) {
+		if (d->hash == h && strcmp(d->directorio, directorio) == 0) return d->indice;
+	}
+	
+	// Vigilo el directorio antes de mirarlo, para no perder un cambio en el medio.
+	// Sin vigilancia (o con la tabla llena) se busca cada vez.
+	struct directorioVigilado * v = NULL;
+	if (inotifyFd >= 0 && cantIndices < MAX_INDICES)
+		v = vigilarDirectorio(directorio[0] != '\0' ? directorio : ".");
+	int i;
+	for (i = 0; i < CANT_INDICES; i++) {
+		char archivo[strlen(directorio) + strlen(nombresIndice[i]) + 1];
+		snprintf(archivo, sizeof(archivo), "%s%s", directorio, nombresIndice[i]);
+		if (hayIndice(archivo)) break;
+	}
+	int indice = i < CANT_INDICES ? i : -1;
+	if (v == NULL) return indice;
+	
+	d = malloc(sizeof(struct indiceDirectorio));
+	d->directorio = strdup(directorio);
+	d->hash = h;
+	d->indice = indice;
+	d->vigilado = v;
+	d->sigVigilado = v->indices;
+	v->indices = d;
+	d->sig = tablaIndices[h & (TAM_TABLA_INDICES - 1)];
+	tablaIndices[h & (TAM_TABLA_INDICES - 1)] = d;
+	cantIndices++;
+	return indice;
+}
+
+/* Olvida los indices del directorio con esa vigilancia (NULL: todos) */
+void invalidarIndices(struct directorioVigilado * v) {
+	if (v == NULL) {
+		int b;
+		for (b = 0; cantIndices > 0 && b < TAM_TABLA_INDICES; b++) {
+			while (tablaIndices[b] != NULL) invalidarIndices(tablaIndices[b]->vigilado);
+		}
+		return;
+	}
+	// Lo retengo mientras suelto sus indices
+	v->usos++;
+	while (v->indices != NULL) {
+		struct indiceDirectorio * d = v->indices;
+		struct indiceDirectorio ** p = &tablaIndices[d->hash & (TAM_TABLA_INDICES - 1)];
+		while (*p != d) p = &(*p)->sig;
+		*p = d->sig;
+		v->indices = d->sigVigilado;
+		free(d->directorio);
+		free(d);
+		cantIndices--;
+		soltarVigilado(v);
+	}
+	soltarVigilado(v);
+}
+
+/* Prepara un 301 a la URL de la regla con el resto de la ruta y los parametros */
+void mandarRedireccion(struct conexion * c, const char * destino, const char * resto, char * parametros) {
+	if (parametros == NULL) parametros = "";
+	size_t len = strlen(RTA_301) + strlen(destino) + 3 * strlen(resto) + strlen(parametros) + 16;
+	char * linea = pedirArena(c, len);
+	char * p = linea + sprintf(linea, "%sLocation: %s", RTA_301, destino);
+	// El resto ya esta decodificado: lo que no puede ir tal cual en una URL se codifica otra vez
+	for (; *resto; resto++) {
+		unsigned char ch = *resto;
+		if (ch <= ' ' || ch >= 0x7f || ch == '%' || ch == '"' || ch == '?' || ch == '#')
+			p += sprintf(p, "%%%02X", ch);
+		else
+			*p++ = ch;
+	}
+	sprintf(p, "%s\r\n", parametros);
+	c->status = 301;
+	mandarHeader(c, linea);
+	terminarHeaders(c, 0);
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Dado un '\n' en la posicion i, revisa si cierra una linea vacia ("\n\n" o "\n\r\n") */
+int esFinHeaders(const char * buf, size_t i) {
+	return (i >= 1 && buf[i-1] == '\n') || (i >= 2 && buf[i-1] == '\r' && buf[i-2] == '\n');
+}
+
+/* Busca la linea vacia que termina los headers entre desde y len.
+ * Recorre de a 16 bytes buscando los '\n' con SSE2 y solo revisa esos */
+long buscarLineaVacia(const char * buf, size_t desde, size_t len) {
+	size_t i = desde;
+#ifdef __SSE2__
+	const __m128i enter = _mm_set1_epi8('\n');
+	for (; i + 16 <= len; i += 16) {
+		__m128i bloque = _mm_loadu_si128((const __m128i *) (buf + i));
+		unsigned int mascara = _mm_movemask_epi8(_mm_cmpeq_epi8(bloque, enter));
+		while (mascara != 0) {
+			size_t j = i + __builtin_ctz(mascara);
+			if (esFinHeaders(buf, j)) return j + 1;
+			mascara &= mascara - 1;
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (buf[i] == '\n' && esFinHeaders(buf, i)) return i + 1;
+	}
+	return -1;
+}
+
+/* Valor de un digito hexadecimal, o -1 si no lo es */
+static inline int valorHexa(unsigned char ch) {
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	ch |= 0x20;
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	return -1;
+}
+
+/* Escribe la ruta canonica en destino: decodificada, sin barras repetidas y sin
+ * segmentos . ni .., y separa los parametros. Los parametros quedan en la ruta
+ * original, asi que destino no puede pisarla. Retorna el largo, o -1 si la ruta
+ * no es valida */
+long normalizarRuta(const char * ruta, size_t len, char * destino, char ** parametros) {
+	const char * p = ruta + 1;
+	const char * fin = ruta + len;
+	size_t w = 1;
+	size_t inicioSegmento = 1;		// Donde empieza en destino el segmento en curso
+	
+	*parametros = NULL;
+	if (len == 0 || ruta[0] != '/') return -1;
+	destino[0] = '/';
+	while (1) {
+#ifdef __SSE2__
+		// Los tramos sin '%', '?', '/', '.' ni caracteres de control se copian de a 16
+		const __m128i control = _mm_set1_epi8(0x1f);
+		while (p + 16 <= fin) {
+			__m128i bloque = _mm_loadu_si128((const __m128i *) p);
+			__m128i especiales = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(bloque, _mm_set1_epi8('%')), _mm_cmpeq_epi8(bloque, _mm_set1_epi8('?'))),
+				_mm_or_si128(_mm_cmpeq_epi8(bloque, _mm_set1_epi8('/')), _mm_cmpeq_epi8(bloque, _mm_set1_epi8('.'))));
+			especiales = _mm_or_si128(especiales, _mm_or_si128(_mm_cmpeq_epi8(bloque, _mm_set1_epi8(0x7f)),
+				_mm_cmpeq_epi8(_mm_max_epu8(bloque, control), control)));
+			unsigned int mascara = _mm_movemask_epi8(especiales);
+			if (mascara != 0) {
+				// Solo lo anterior al primer especial: el resto lo sigue el codigo de abajo
+				unsigned int n = __builtin_ctz(mascara);
+				memcpy(destino + w, p, n);
+				p += n;
+				w += n;
+				break;
+			}
+			_mm_storeu_si128((__m128i *) (destino + w), bloque);
+			p += 16;
+			w += 16;
+		}
+#endif
+		unsigned char ch;
+		int fueBarra = 0;
+		if (p == fin || *p == '?') {
+			ch = '\0';
+		} else if (*p == '%') {
+			int alto = p + 2 < fin ? valorHexa(p[1]) : -1;
+			int bajo = alto >= 0 ? valorHexa(p[2]) : -1;
+			if (bajo < 0) return -1;
+			ch = alto * 16 + bajo;
+			p += 3;
+			// Una barra codificada separa segmentos igual que una sin codificar
+			fueBarra = ch == '/';
+			if (ch == '\0') return -1;
+		} else {
+			ch = *p++;
+			fueBarra = ch == '/';
+		}
+		if (ch != '\0' && (ch < 0x20 || ch == 0x7f)) return -1;
+		
+		if (ch != '\0' && !fueBarra) {
+			destino[w++] = ch;
+			continue;
+		}
+		
+		// Termino un segmento: las barras repetidas y los "." se descartan, y ".."
+		// descarta tambien el segmento anterior (salvo en la raiz, de donde no se sale)
+		size_t largo = w - inicioSegmento;
+		if (largo == 1 && destino[inicioSegmento] == '.') {
+			w = inicioSegmento;
+		} else if (largo == 2 && destino[inicioSegmento] == '.' && destino[inicioSegmento + 1] == '.') {
+			if (inicioSegmento == 1) return -1;
+			w = inicioSegmento - 1;
+			while (destino[w - 1] != '/') w--;
+			inicioSegmento = w;
+		} else if (largo > 0 && ch != '\0') {
+			destino[w++] = '/';
+			inicioSegmento = w;
+		}
+		if (ch == '\0') break;
+	}
+	destino[w] = '\0';
+	if (p < fin) *parametros = (char *) p;
+	return w;
+}
+
+/* Busca el fin del primer pedido del buffer (dos "enters" seguidos), 
+ * retomando desde donde quedo la busqueda anterior.
+ * Retorna 1 y deja en finPedido donde empieza el siguiente, o 0 si no esta completo */
+int buscarFinPedido(struct conexion * c) {
+	long fin = buscarLineaVacia(c->entrada, c->escaneado, c->lenEntrada);
+	if (fin < 0) {
+		c->escaneado = c->lenEntrada;
+		return 0;
+	}
+	c->finPedido = fin;
+	return 1;
+}
+
+/* Lee lo disponible del socket hasta que se lean dos "enters" seguidos.
+ * Retorna 1 si el pedido esta completo, 0 si falta, -1 si hubo error
+ * y -2 si el buffer de entrada se lleno sin completar los headers */
+int recibirMensaje(struct conexion * c) {
+	// Con pipelining el siguiente pedido puede haber llegado junto con el anterior
+	if (c->lenEntrada > 0 && buscarFinPedido(c))
+		return 1;
+	if (motorUring) {
+		// Lo recibido llega con las operaciones terminadas (terminarOperacion)
+		if (c->finLectura) {
+			if (c->lenEntrada == 0) return -1;
+			c->finPedido = c->lenEntrada;
+			return 1;
+		}
+		if (c->lenEntrada == MAX_HEADERS) return -2;
+		if (c->opsPendientes == 0) pedirRecepcion(c);
+		return 0;
+	}
+	while (1) {
+		if (c->lenEntrada == MAX_HEADERS)
+			return -2;
+		ssize_t n = recv(c->sock, c->entrada + c->lenEntrada, MAX_HEADERS - c->lenEntrada, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			log_error(ERROR_RECV_SOCKET);
+			return -1;
+		}
+		if (n == 0) {
+			// El cliente no va a mandar mas. Si mando algo, lo atiendo igual
+			if (c->lenEntrada == 0) return -1;
+			c->finPedido = c->lenEntrada;
+			return 1;
+		}
+		if (c->fasePlazo == PLAZO_OCIOSA) armarPlazo(c, PLAZO_PEDIDO);
+		if (c->llegada == 0) c->llegada = ahoraUs();
+		c->lenEntrada += n;
+		// Si veo dos enters seguidos el pedido esta completo
+		if (buscarFinPedido(c))
+			return 1;
+	}
+}
+
+/* Agrega un registro FastCGI (encabezado y contenido, sin relleno) a buf */
+size_t agregarRegistroFCGI(char * buf, int tipo, const char * datos, size_t len) {
+	unsigned char * h = (unsigned char *) buf;
+	h[0] = FCGI_VERSION;
+	h[1] = tipo;
+	h[2] = 0;					// Id de pedido 1: uno solo por conexion
+	h[3] = 1;
+	h[4] = (len >> 8) & 0xff;
+	h[5] = len & 0xff;
+	h[6] = 0;					// Sin relleno
+	h[7] = 0;
+	if (len > 0) memcpy(buf + 8, datos, len);
+	return 8 + len;
+}
+
+/* Codifica el largo de un nombre o valor de FastCGI (1 byte, o 4 si es >= 128) */
+size_t agregarLargoFCGI(char * buf, size_t len) {
+	unsigned char * p = (unsigned char *) buf;
+	if (len < 128) {
+		p[0] = len;
+		return 1;
+	}
+	p[0] = ((len >> 24) & 0x7f) | 0x80;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >> 8) & 0xff;
+	p[3] = len & 0xff;
+	return 4;
+}
+
+/* Agrega un parametro (variable CGI) a los parametros FastCGI armados hasta ahora */
+void agregarParamFCGI(struct paramsFCGI * p, const char * nombre, size_t lenNombre,
+		const char * valor, size_t lenValor) {
+	if (p->len + 8 + lenNombre + lenValor > sizeof(p->datos)) {
+		p->desbordado = 1;
+		return;
+	}
+	p->len += agregarLargoFCGI(p->datos + p->len, lenNombre);
+	p->len += agregarLargoFCGI(p->datos + p->len, lenValor);
+	memcpy(p->datos + p->len, nombre, lenNombre);
+	p->len += lenNombre;
+	memcpy(p->datos + p->len, valor, lenValor);
+	p->len += lenValor;
+}
+
+/* Igual que agregarParamFCGI, para nombre y valor terminados en '\0' */
+void agregarVariableFCGI(struct paramsFCGI * p, const char * nombre, const char * valor) {
+	agregarParamFCGI(p, nombre, strlen(nombre), valor, strlen(valor));
+}
+
+/* Arma las variables CGI del pedido: las del servidor y un HTTP_* por cada header */
+void armarParamsFCGI(struct conexion * c, char * archivo, char * parametros, struct paramsFCGI * p) {
+	struct sockaddr_storage dir;
+	socklen_t lenDir = sizeof(dir);
+	char ip[INET6_ADDRSTRLEN] = "";
+	char puerto[8] = "";
+	int i;
+	
+	p->len = 0;
+	p->desbordado = 0;
+	agregarVariableFCGI(p, "GATEWAY_INTERFACE", "CGI/1.1");
+	agregarVariableFCGI(p, "SERVER_SOFTWARE", "servidorHTTP");
+	agregarVariableFCGI(p, "SERVER_PROTOCOL", c->pedido.protocolo.ptr);
+	agregarVariableFCGI(p, "REQUEST_METHOD", c->pedido.metodo.ptr);
+	agregarVariableFCGI(p, "REQUEST_URI", c->pedido.ruta.ptr);
+	char script[2 + strlen(archivo)];
+	snprintf(script, sizeof(script), "/%s", archivo);
+	agregarVariableFCGI(p, "SCRIPT_NAME", script);
+	agregarVariableFCGI(p, "SCRIPT_FILENAME", archivo);
+	agregarVariableFCGI(p, "QUERY_STRING", parametros != NULL ? parametros + 1 : "");
+	// php-cgi (con cgi.force_redirect) solo ejecuta scripts pedidos por un servidor
+	agregarVariableFCGI(p, "REDIRECT_STATUS", "200");
+	// Un stream HTTP/2 no tiene socket: el cliente es el de su conexion
+	if (getpeername(c->padre != NULL ? c->padre->sock : c->sock, (struct sockaddr *) &dir, &lenDir) == 0) {
+		if (dir.ss_family == AF_INET) {
+			struct sockaddr_in * d = (struct sockaddr_in *) &dir;
+			inet_ntop(AF_INET, &d->sin_addr, ip, sizeof(ip));
+			snprintf(puerto, sizeof(puerto), "%d", ntohs(d->sin_port));
+		}
+		agregarVariableFCGI(p, "REMOTE_ADDR", ip);
+		agregarVariableFCGI(p, "REMOTE_PORT", puerto);
+	}
+	
+	for (i = 0; i < c->pedido.cantHeaders; i++) {
+		struct header * h = &c->pedido.headers[i];
+		char nombre[5 + h->nombre.len];
+		size_t j;
+		memcpy(nombre, "HTTP_", 5);
+		for (j = 0; j < h->nombre.len; j++) {
+			char ch = h->nombre.ptr[j];
+			nombre[5 + j] = ch == '-' ? '_' : toupper((unsigned char) ch);
+		}
+		agregarParamFCGI(p, nombre, 5 + h->nombre.len, h->valor.ptr, h->valor.len);
+	}
+}
+
+/* Se encarga de la parte PHP. Se conecta al pool de php-cgi, le manda el pedido
+ * por FastCGI y registra el socket en el bucle de eventos para leer la respuesta */ 
+void procesarPHP(struct conexion * c, char * archivo, char * parametros){
+	struct paramsFCGI params;
+	armarParamsFCGI(c, archivo, parametros, &params);
+	if (params.desbordado) {
+		mandarRechazo(c,RECHAZO_431);
+		return;
+	}
+	
+	// Sin ningun php-cgi corriendo el pedido quedaria en la cola hasta vencer su plazo
+	if (atomic_load(phpVivos) == 0) {
+		mandarRechazo(c,RECHAZO_503);
+		return;
+	}
+	
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		log_error(ERROR_ABRIR_SOCKET);
+		mandarRechazo(c,RECHAZO_500);
+		return;
+	}
+	// Con un socket Unix el connect no queda en curso: o entra en la cola
+	// de los php-cgi o la cola esta llena (EAGAIN)
+	if (connect(sock, (struct sockaddr *) &direccionPHP, lenDireccionPHP) < 0) {
+		close(sock);
+		mandarRechazo(c,RECHAZO_503);
+		return;
+	}
+	
+	// Pedido completo: inicio (rol responder, sin mantener la conexion),
+	// los parametros, el fin de los parametros y una entrada vacia
+	char pedido[24 + sizeof(params.datos) + 16];
+	unsigned char inicio[8] = { 0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0 };
+	size_t len = agregarRegistroFCGI(pedido, FCGI_BEGIN_REQUEST, (char *) inicio, sizeof(inicio));
+	len += agregarRegistroFCGI(pedido + len, FCGI_PARAMS, params.datos, params.len);
+	len += agregarRegistroFCGI(pedido + len, FCGI_PARAMS, NULL, 0);
+	len += agregarRegistroFCGI(pedido + len, FCGI_STDIN, NULL, 0);
+	
+	// El pedido entra de una vez en el buffer del socket Unix (es mucho mas chico)
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &c->fuentePHP;
+	if (send(sock, pedido, len, MSG_NOSIGNAL) != (ssize_t) len ||
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		log_error(ERROR_PHP);
+		close(sock);
+		mandarRechazo(c,RECHAZO_500);
+		return;
+	}
+	c->phpFd = sock;
+	c->inicioPHP = ahoraUs();
+	sumarMetrica(&misMetricas->phpActivos, 1);
+	c->lenHeaderFCGI = 0;
+	c->cgi = pedirArena(c, MAX_HEADERS);
+	c->lenCGI = 0;
+	c->respuestaPHP = 0;
+	c->estado = ESTADO_PHP_EN_CURSO;
+}
+
+/* Lee lo que genero php-cgi hasta el momento, separando los registros FastCGI,
+ * y lo manda al cliente a medida que llega. Cuando php-cgi termina el pedido, se
+ * termina la respuesta */
+void leerPHP(struct conexion * c) {
+	char buf[TAM_BLOQUE];
+	int terminado = 0;
+	while (!terminado) {
+		// Si el cliente no da abasto dejo de leer: php-cgi se frena cuando se llena
+		// la conexion FastCGI, y sigo cuando el cliente pueda recibir mas
+		if (c->lenSalida - c->enviados >= MAX_PENDIENTE_PHP) {
+			if (enviarSalida(c) < 0) {
+				cerrarConexion(c);
+				return;
+			}
+			if (c->lenSalida - c->enviados >= MAX_PENDIENTE_PHP) return;
+		}
+		
+		ssize_t n = read(c->phpFd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// Mando lo que ya genero sin esperar al resto
+			if (enviarSalida(c) < 0) cerrarConexion(c);
+			return;
+		} else if (n <= 0) {
+			// php-cgi cerro la conexion (o se murio) sin terminar el pedido
+			break;
+		}
+		
+		size_t i = 0;
+		while (i < (size_t) n) {
+			if (c->lenHeaderFCGI < 8) {
+				// Encabezado del registro (puede venir partido entre lecturas)
+				size_t m = 8 - c->lenHeaderFCGI;
+				if (m > n - i) m = n - i;
+				memcpy(c->headerFCGI + c->lenHeaderFCGI, buf + i, m);
+				c->lenHeaderFCGI += m;
+				i += m;
+				if (c->lenHeaderFCGI < 8) break;
+				c->restanteFCGI = (c->headerFCGI[4] << 8) | c->headerFCGI[5];
+				c->rellenoFCGI = c->headerFCGI[6];
+			} else if (c->restanteFCGI > 0) {
+				size_t m = c->restanteFCGI;
+				if (m > n - i) m = n - i;
+				// Paso lo que me respondio php-cgi al cliente (stderr se descarta)
+				if (c->headerFCGI[1] == FCGI_STDOUT)
+					recibirSalidaPHP(c, buf + i, m);
+				c->restanteFCGI -= m;
+				i += m;
+			} else {
+				size_t m = c->rellenoFCGI;
+				if (m > n - i) m = n - i;
+				c->rellenoFCGI -= m;
+				i += m;
+			}
+			if (c->lenHeaderFCGI == 8 && c->restanteFCGI == 0 && c->rellenoFCGI == 0) {
+				// Registro completo
+				if (c->headerFCGI[1] == FCGI_END_REQUEST) {
+					terminado = 1;
+					break;
+				}
+				c->lenHeaderFCGI = 0;
+			}
+		}
+	}
+	
+	// php-cgi termino (o fallo la conexion), mando lo que falte
+	close(c->phpFd);
+	c->phpFd = -1;
+	sumarMetrica(&misMetricas->phpActivos, -1);
+	medirLatencia(&misMetricas->ejecucionPHP, ahoraUs() - c->inicioPHP);
+	terminarRespuestaPHP(c, terminado);
+	manejarConexion(c);
+}
+
+/* Recibe salida de php-cgi: primero junta el bloque de headers CGI y, una vez
+ * armados los headers de la respuesta, pasa el resto directo al cliente */
+void recibirSalidaPHP(struct conexion * c, const char * datos, size_t len) {
+	while (!c->respuestaPHP && len > 0) {
+		size_t m = MAX_HEADERS - c->lenCGI;
+		if (m > len) m = len;
+		// El fin de los headers puede haber quedado partido con lo anterior
+		size_t desde = c->lenCGI > 3 ? c->lenCGI - 3 : 0;
+		memcpy(c->cgi + c->lenCGI, datos, m);
+		c->lenCGI += m;
+		datos += m;
+		len -= m;
+		
+		// Los headers CGI terminan con una linea en blanco
+		size_t finHeaders = 0, inicioCuerpo = 0;
+		char * p = memmem(c->cgi + desde, c->lenCGI - desde, "\r\n\r\n", 4);
+		char * q = memmem(c->cgi + desde, c->lenCGI - desde, "\n\n", 2);
+		if (p != NULL && (q == NULL || p < q)) {
+			finHeaders = p - c->cgi + 2;
+			inicioCuerpo = p - c->cgi + 4;
+		} else if (q != NULL) {
+			finHeaders = q - c->cgi + 1;
+			inicioCuerpo = q - c->cgi + 2;
+		} else if (c->lenCGI < MAX_HEADERS) {
+			continue;
+		}
+		// Sin linea en blanco en los primeros MAX_HEADERS bytes: todo es cuerpo
+		iniciarRespuestaPHP(c, finHeaders);
+		mandarCuerpoPHP(c, c->cgi + inicioCuerpo, c->lenCGI - inicioCuerpo);
+	}
+	mandarCuerpoPHP(c, datos, len);
+}
+
+/* Arma los headers de la respuesta a partir de los headers CGI de php-cgi:
+ * el header Status pasa a ser la linea de estado y el cuerpo va en chunks */
+void iniciarRespuestaPHP(struct conexion * c, size_t finHeaders) {
+	char * linea = c->cgi;
+	char * fin = c->cgi + finHeaders;
+	char * status = NULL;
+	size_t lenStatus = 0;
+	int redireccion = 0;
+	
+	c->respuestaPHP = 1;
+	size_t inicio = c->lenSalida;
+	// Busco el Status
+	while (linea < fin) {
+		char * finLinea = memchr(linea, '\n', fin - linea);
+		if (strncasecmp(linea, "Location:", 9) == 0) redireccion = 1;
+		if (strncasecmp(linea, "Status:", 7) == 0) {
+			status = linea + 7;
+			lenStatus = finLinea - status;
+			while (lenStatus > 0 && (*status == ' ' || *status == '\t')) { status++; lenStatus--; }
+			if (lenStatus > 0 && status[lenStatus - 1] == '\r') lenStatus--;
+		}
+		linea = finLinea + 1;
+	}
+	// Un Location sin Status es una redireccion al cliente (RFC 3875 6.2.3 y 6.3.2)
+	c->status = status != NULL && atoi(status) > 0 ? atoi(status) : redireccion ? 302 : 200;
+	if (status != NULL && lenStatus > 0) {
+		mandarHeader(c,"HTTP/1.1 ");
+		encolarSalida(c,status,lenStatus);
+		mandarHeader(c,"\r\n");
+	} else {
+		mandarHeader(c,redireccion ? RTA_302 : RTA_200);
+	}
+	if (finHeaders == 0) mandarHeader(c,CT_HTML);
+	
+	// El largo y la conexion los define el servidor, no el script
+	linea = c->cgi;
+	while (linea < fin) {
+		char * finLinea = memchr(linea, '\n', fin - linea);
+		if (strncasecmp(linea, "Status:", 7) != 0 && strncasecmp(linea, "Content-Length:", 15) != 0 &&
+				strncasecmp(linea, "Transfer-Encoding:", 18) != 0 && strncasecmp(linea, "Connection:", 11) != 0)
+			encolarSalida(c, linea, finLinea + 1 - linea);
+		linea = finLinea + 1;
+	}
+	
+	// Si se esta guardando la respuesta, me quedo con una copia de estos headers
+	if (c->capturaPHP != NULL) {
+		c->ttlCaptura = ttlRespuestaPHP(c->cgi, finHeaders);
+		if (c->ttlCaptura < 0 || c->status != 200 || (status != NULL && strncmp(status, "200", 3) != 0)) {
+			abandonarCapturaPHP(c, 1);
+		} else {
+			struct respuestaPHP * r = c->capturaPHP;
+			r->lenCabecera = c->lenSalida - inicio;
+			r->cabecera = malloc(r->lenCabecera);
+			memcpy(r->cabecera, c->salida + inicio, r->lenCabecera);
+		}
+	}
+	
+	// Todavia no se cuanto va a generar el script: en HTTP/1.1 mando el cuerpo
+	// en chunks, en HTTP/1.0 el fin del cuerpo lo marca el cierre de la conexion
+	if (strcmp(c->pedido.protocolo.ptr, "HTTP/1.1") == 0) {
+		c->chunked = 1;
+		mandarHeader(c,"Transfer-Encoding: chunked\r\n");
+	} else {
+		c->chunked = 0;
+		c->keepAlive = 0;
+	}
+	mandarFinHeaders(c);
+}
+
+/* Encola parte del cuerpo generado por php-cgi (como un chunk, si corresponde) */
+void mandarCuerpoPHP(struct conexion * c, const char * datos, size_t len) {
+	if (len == 0) return;		// Un chunk vacio terminaria la respuesta
+	if (c->capturaPHP != NULL) capturarCuerpoPHP(c, datos, len);
+	if (c->chunked) {
+		char largo[24];
+		int n = snprintf(largo, sizeof(largo), "%zx\r\n", len);
+		encolarSalida(c, largo, n);
+		encolarSalida(c, datos, len);
+		mandarHeader(c, "\r\n");
+	} else {
+		encolarSalida(c, datos, len);
+	}
+}
+
+/* Termina la respuesta de PHP cuando php-cgi termina el pedido (o se corta la conexion) */
+void terminarRespuestaPHP(struct conexion * c, int completo) {
+	if (!c->respuestaPHP) {
+		// La salida entera entro antes de encontrar una linea en blanco: es todo cuerpo
+		if (c->lenCGI == 0) {
+			// php-cgi no genero nada (por ejemplo, no se pudo ejecutar)
+			mandarRechazo(c,RECHAZO_500);
+		} else {
+			c->status = 200;
+			mandarHeader(c,RTA_200);
+			mandarHeader(c,CT_HTML);
+			terminarHeaders(c,c->lenCGI);
+			encolarSalida(c,c->cgi,c->lenCGI);
+		}
+	} else if (c->chunked && completo) {
+		mandarHeader(c,"0\r\n\r\n");
+	} else {
+		// Sin el chunk final (o en HTTP/1.0) el cliente solo sabe que termino por el cierre
+		c->keepAlive = 0;
+	}
+	c->cgi = NULL;
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+	armarPlazo(c, PLAZO_ESCRITURA);
+	
+	// La respuesta completa queda en la cache (la salida sin headers no se guarda)
+	if (c->capturaPHP != NULL) {
+		if (completo && c->respuestaPHP) {
+			completarCapturaPHP(c);
+		} else {
+			abandonarCapturaPHP(c, 0);
+		}
+	}
+}
+
+/* Arma la clave de la cache de respuestas PHP: script, parametros y los
+ * valores de los headers que se configuraron para variar la respuesta */
+char * armarClavePHP(struct conexion * c, char * archivo, char * parametros) {
+	size_t len = strlen(archivo) + (parametros != NULL ? strlen(parametros) : 0) + 1;
+	int i;
+	for (i = 0; i < cantVariarPHP; i++) {
+		char * valor = buscarHeader(&c->pedido, variarPHP[i]);
+		len += (valor != NULL ? strlen(valor) : 0) + 1;
+	}
+	
+	char * clave = pedirArena(c, len);
+	char * p = clave + sprintf(clave, "%s%s", archivo, parametros != NULL ? parametros : "");
+	for (i = 0; i < cantVariarPHP; i++) {
+		char * valor = buscarHeader(&c->pedido, variarPHP[i]);
+		p += sprintf(p, "\n%s", valor != NULL ? valor : "");
+	}
+	return clave;
+}
+
+/* Busca una respuesta PHP en la cache; las vencidas se sacan y no se encuentran */
+struct respuestaPHP * buscarRespuestaPHP(char * clave, unsigned int hash) {
+	struct respuestaPHP * r;
+	for (r = tablaPHP[hash & (TAM_TABLA_PHP - 1)]; r != NULL; r = r->sigHash) {
+		if (r->hash == hash && strcmp(r->clave, clave) == 0) {
+			if (r->estado != RESPUESTA_EN_CURSO && r->vence <= ahoraMs()) {
+				sacarRespuestaPHP(r);
+				return NULL;
+			}
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/* Saca una respuesta de la cache y la libera */
+void sacarRespuestaPHP(struct respuestaPHP * r) {
+	struct respuestaPHP ** p = &tablaPHP[r->hash & (TAM_TABLA_PHP - 1)];
+	while (*p != r) p = &(*p)->sigHash;
+	*p = r->sigHash;
+	cantRespuestasPHP--;
+	free(r->clave);
+	free(r->cabecera);
+	free(r->cuerpo);
+	free(r);
+}
+
+/* Saca de la cache todas las respuestas vencidas */
+void purgarRespuestasPHP() {
+	long long ahora = ahoraMs();
+	int i;
+	for (i = 0; i < TAM_TABLA_PHP; i++) {
+		struct respuestaPHP * r = tablaPHP[i];
+		while (r != NULL) {
+			struct respuestaPHP * sig = r->sigHash;
+			if (r->estado != RESPUESTA_EN_CURSO && r->vence <= ahora)
+				sacarRespuestaPHP(r);
+			r = sig;
+		}
+	}
+}
+
+/* Atiende un pedido PHP desde la cache de respuestas si se puede. Si no, lo manda a
+ * php-cgi y guarda la respuesta; los pedidos iguales que lleguen mientras tanto la esperan */
+void atenderPHP(struct conexion * c, char * archivo, char * parametros) {
+	// A php-cgi la entrada le llega vacia: antes que ejecutar el script sin el
+	// cuerpo del pedido, lo rechazo
+	char * contentLength = buscarHeader(&c->pedido, "Content-Length");
+	if ((contentLength != NULL && atol(contentLength) > 0) || buscarHeader(&c->pedido, "Transfer-Encoding") != NULL ||
+			(c->cuerpoH2 && contentLength == NULL)) {
+		mandarRechazo(c,RECHAZO_413);
+		return;
+	}
+	if (config.ttlPHP == 0) {
+		procesarPHP(c, archivo, parametros);
+		return;
+	}
+	
+	char * clave = armarClavePHP(c, archivo, parametros);
+	unsigned int hash = hashRuta(clave);
+	struct respuestaPHP * r = buscarRespuestaPHP(clave, hash);
+	
+	if (r != NULL && r->estado == RESPUESTA_LISTA) {
+		mandarRespuestaPHP(c, r);
+		return;
+	}
+	if (r != NULL && r->estado == RESPUESTA_EN_CURSO) {
+		// Otra conexion ya la esta generando: espero su resultado en vez de repetirlo
+		c->archivoPHP = archivo;
+		c->parametrosPHP = parametros;
+		c->esperaPHP = r;
+		c->sigEspera = r->esperando;
+		r->esperando = c;
+		c->estado = ESTADO_ESPERANDO_PHP;
+		return;
+	}
+	if (r != NULL) {
+		// Hace poco no se pudo guardar: voy directo a php-cgi
+		procesarPHP(c, archivo, parametros);
+		return;
+	}
+	
+	if (cantRespuestasPHP >= MAX_RESPUESTAS_PHP)
+		purgarRespuestasPHP();
+	if (cantRespuestasPHP >= MAX_RESPUESTAS_PHP) {
+		procesarPHP(c, archivo, parametros);
+		return;
+	}
+	
+	r = calloc(1, sizeof(struct respuestaPHP));
+	r->clave = strdup(clave);
+	r->hash = hash;
+	r->estado = RESPUESTA_EN_CURSO;
+	r->sigHash = tablaPHP[hash & (TAM_TABLA_PHP - 1)];
+	tablaPHP[hash & (TAM_TABLA_PHP - 1)] = r;
+	cantRespuestasPHP++;
+	
+	c->capturaPHP = r;
+	procesarPHP(c, archivo, parametros);
+	if (c->estado != ESTADO_PHP_EN_CURSO)
+		abandonarCapturaPHP(c, 0);
+}
+
+/* Encola una respuesta PHP guardada en la cache */
+void mandarRespuestaPHP(struct conexion * c, struct respuestaPHP * r) {
+	c->status = 200;
+	encolarSalida(c, r->cabecera, r->lenCabecera);
+	terminarHeaders(c, r->lenCuerpo);
+	encolarSalida(c, r->cuerpo, r->lenCuerpo);
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Segundos que se puede guardar una respuesta PHP segun sus headers CGI
+ * (Cache-Control, Expires, Set-Cookie), o -1 si no se puede guardar */
+int ttlRespuestaPHP(char * headers, size_t len) {
+	char * linea = headers;
+	char * fin = headers + len;
+	int ttl = config.ttlPHP;
+	int maxAge = 0;
+	
+	while (linea < fin) {
+		char * finLinea = memchr(linea, '\n', fin - linea);
+		char valor[256];
+		size_t n = finLinea - linea;
+		if (n >= sizeof(valor)) n = sizeof(valor) - 1;
+		memcpy(valor, linea, n);
+		valor[n] = '\0';
+		if (n > 0 && valor[n - 1] == '\r') valor[n - 1] = '\0';
+		
+		if (strncasecmp(valor, "Set-Cookie:", 11) == 0) {
+			// La respuesta es para un solo cliente
+			return -1;
+		} else if (strncasecmp(valor, "Cache-Control:", 14) == 0) {
+			char * p;
+			if (strcasestr(valor, "no-store") || strcasestr(valor, "no-cache") || strcasestr(valor, "private"))
+				return -1;
+			if ((p = strcasestr(valor, "s-maxage=")) != NULL) {
+				ttl = atoi(p + 9);
+				maxAge = 2;
+			} else if (maxAge < 2 && (p = strcasestr(valor, "max-age=")) != NULL) {
+				ttl = atoi(p + 8);
+				maxAge = 1;
+			}
+		} else if (strncasecmp(valor, "Expires:", 8) == 0 && !maxAge) {
+			// max-age tiene prioridad sobre Expires
+			struct tm tm;
+			char * fecha = valor + 8;
+			while (*fecha == ' ') fecha++;
+			memset(&tm, 0, sizeof(tm));
+			ttl = strptime(fecha, FORMATO_FECHA_HTTP, &tm) != NULL ? timegm(&tm) - time(NULL) : 0;
+		}
+		linea = finLinea + 1;
+	}
+	return ttl > 0 ? ttl : -1;
+}
+
+/* Agrega parte del cuerpo a la respuesta PHP que se esta guardando */
+void capturarCuerpoPHP(struct conexion * c, const char * datos, size_t len) {
+	struct respuestaPHP * r = c->capturaPHP;
+	if (r->lenCuerpo + len > MAX_RESPUESTA_PHP) {
+		// Demasiado grande para la cache
+		abandonarCapturaPHP(c, 1);
+		return;
+	}
+	if (r->lenCuerpo + len > r->capCuerpo) {
+		size_t cap = r->capCuerpo ? r->capCuerpo : 4096;
+		while (cap < r->lenCuerpo + len) cap *= 2;
+		r->cuerpo = realloc(r->cuerpo, cap);
+		r->capCuerpo = cap;
+	}
+	memcpy(r->cuerpo + r->lenCuerpo, datos, len);
+	r->lenCuerpo += len;
+}
+
+/* Deja la respuesta PHP de la conexion lista en la cache y se la manda a los que la esperaban */
+void completarCapturaPHP(struct conexion * c) {
+	struct respuestaPHP * r = c->capturaPHP;
+	c->capturaPHP = NULL;
+	r->estado = RESPUESTA_LISTA;
+	r->vence = ahoraMs() + c->ttlCaptura * 1000LL;
+	despertarEsperasPHP(r);
+}
+
+/* Deja de guardar la respuesta PHP de la conexion. Si no se podia guardar (pasar),
+ * la entrada queda un tiempo para que los proximos pedidos vayan directo a php-cgi;
+ * si fallo, se saca. Los que la esperaban ejecutan el script cada uno por su cuenta */
+void abandonarCapturaPHP(struct conexion * c, int pasar) {
+	struct respuestaPHP * r = c->capturaPHP;
+	c->capturaPHP = NULL;
+	if (pasar) {
+		r->estado = RESPUESTA_PASAR;
+		r->vence = ahoraMs() + config.ttlPHP * 1000LL;
+		free(r->cabecera);
+		free(r->cuerpo);
+		r->cabecera = NULL;
+		r->cuerpo = NULL;
+		despertarEsperasPHP(r);
+	} else {
+		despertarEsperasPHP(r);
+		sacarRespuestaPHP(r);
+	}
+}
+
+/* Atiende a las conexiones que esperaban una respuesta PHP: desde la cache
+ * si quedo lista o, si no, mandando cada pedido a php-cgi */
+void despertarEsperasPHP(struct respuestaPHP * r) {
+	struct conexion * esperando = r->esperando;
+	r->esperando = NULL;
+	while (esperando != NULL) {
+		struct conexion * e = esperando;
+		esperando = e->sigEspera;
+		e->esperaPHP = NULL;
+		if (r->estado == RESPUESTA_LISTA) {
+			mandarRespuestaPHP(e, r);
+		} else {
+			procesarPHP(e, e->archivoPHP, e->parametrosPHP);
+		}
+		armarPlazoRespuesta(e);
+		manejarConexion(e);
+	}
+}
+
+/* Saca a una conexion de la lista de espera de una respuesta PHP */
+void quitarEsperaPHP(struct conexion * c) {
+	struct conexion ** p = &c->esperaPHP->esperando;
+	while (*p != c) p = &(*p)->sigEspera;
+	*p = c->sigEspera;
+	c->esperaPHP = NULL;
+}
+
+/* Crea el registro del worker y lanza el hilo que lo escribe */
+void iniciarRegistro() {
+	pthread_t hilo;
+	registro = calloc(1, sizeof(struct registro));
+	if (pthread_create(&hilo, NULL, escribirRegistro, NULL) != 0) {
+		// Sin hilo sigo escribiendo directo, como el proceso principal
+		free(registro);
+		registro = NULL;
+		log_error(ERROR_REGISTRO);
+		return;
+	}
+	pthread_detach(hilo);
+}
+
+/* Agrega una entrada al registro del worker sin bloquear nunca: si esta lleno,
+ * la entrada se descarta (y se cuenta) */
+void encolarRegistro(int destino, int prioridad, const char * texto, size_t len) {
+	// Solo el bucle de eventos agrega entradas y solo el hilo las saca
+	unsigned long cabeza = atomic_load_explicit(&registro->cabeza, memory_order_relaxed);
+	unsigned long cola = atomic_load_explicit(&registro->cola, memory_order_acquire);
+	if (cabeza - cola == CAP_REGISTRO) {
+		atomic_fetch_add_explicit(&registro->descartadas, 1, memory_order_relaxed);
+		return;
+	}
+	struct entradaRegistro * e = &registro->entradas[cabeza % CAP_REGISTRO];
+	if (len > TAM_ENTRADA_REGISTRO) len = TAM_ENTRADA_REGISTRO;
+	memcpy(e->texto, texto, len);
+	e->len = len;
+	e->destino = destino;
+	e->prioridad = prioridad;
+	atomic_store_explicit(&registro->cabeza, cabeza + 1, memory_order_release);
+}
+
+/* Escribe todo un lote en el archivo de accesos */
+void escribirLote(const char * lote, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(archivoAccesos, lote, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		lote += n;
+		len -= n;
+	}
+}
+
+/* Hilo que vacia el registro del worker cada INTERVALO_REGISTRO ms: los accesos
+ * se juntan y se escriben al archivo de un solo write, los errores van al syslog */
+void * escribirRegistro(void * arg) {
+	char lote[TAM_LOTE_REGISTRO];
+	struct timespec espera = { 0, INTERVALO_REGISTRO * 1000000L };
+	(void) arg;
+	
+	while (1) {
+		unsigned long cola = atomic_load_explicit(&registro->cola, memory_order_relaxed);
+		unsigned long cabeza = atomic_load_explicit(&registro->cabeza, memory_order_acquire);
+		size_t len = 0;
+		
+		while (cola != cabeza) {
+			struct entradaRegistro * e = &registro->entradas[cola % CAP_REGISTRO];
+			if (e->destino == REGISTRO_ACCESOS && archivoAccesos >= 0) {
+				if (len + e->len > sizeof(lote)) {
+					escribirLote(lote, len);
+					len = 0;
+				}
+				memcpy(lote + len, e->texto, e->len);
+				len += e->len;
+			} else {
+				syslog(e->prioridad, "%.*s", (int) e->len, e->texto);
+			}
+			// Libero el lugar para el bucle de eventos
+			cola++;
+			atomic_store_explicit(&registro->cola, cola, memory_order_release);
+		}
+		if (len > 0) escribirLote(lote, len);
+		
+		unsigned long descartadas = atomic_exchange_explicit(&registro->descartadas, 0, memory_order_relaxed);
+		if (descartadas > 0)
+			syslog(LOG_WARNING, "Registro lleno o limite de errores: %lu entradas descartadas", descartadas);
+		nanosleep(&espera, NULL);
+	}
+	return NULL;
+}
+
+/* Copia texto a dst escapando comillas, barras y caracteres de control: en JSON
+ * como \u00HH y en los formatos de Apache como \xHH (ahi tambien los bytes no ASCII) */
+size_t escaparRegistro(char * dst, size_t tam, const char * src, size_t len, int json) {
+	size_t n = 0, i;
+	for (i = 0; i < len && n + 7 < tam; i++) {
+		unsigned char ch = src[i];
+		if (ch == '"' || ch == '\\') {
+			dst[n++] = '\\';
+			dst[n++] = ch;
+		} else if (json && (ch < 0x20 || ch == 0x7f)) {
+			n += sprintf(dst + n, "\\u%04x", ch);
+		} else if (!json && (ch < 0x20 || ch >= 0x7f)) {
+			n += sprintf(dst + n, "\\x%02x", ch);
+		} else {
+			dst[n++] = ch;
+		}
+	}
+	dst[n] = '\0';
+	return n;
+}
+
+/* Agrega el pedido que termino al registro de accesos, con el formato configurado */
+void registrarAcceso(struct conexion * c) {
+	int status = c->status;
+	struct pedido * p = &c->pedido;
+	c->status = 0;
+	
+	// Las metricas cuentan todas las respuestas, el registro solo las muestreadas
+	if (status >= 100 && status < 100 + CANT_STATUS)
+		sumarMetrica(&misMetricas->respuestas[status - 100], 1);
+	sumarMetrica(&misMetricas->bytesEnviados, c->bytesEnviados);
+	
+	// Se registra 1 de cada config.muestreo pedidos, pero los errores del servidor siempre
+	static unsigned long pedidos = 0;
+	if (config.destinoAccesos != NULL && registro != NULL &&
+			(pedidos++ % config.muestreo == 0 || status >= 500)) {
+		// La fecha se arma una sola vez por segundo
+		static time_t segundo = 0;
+		static char fecha[64];
+		time_t ahora = time(NULL);
+		if (ahora != segundo) {
+			struct tm tm;
+			localtime_r(&ahora, &tm);
+			strftime(fecha, sizeof(fecha), config.formatoAccesos == FORMATO_JSON ?
+				"%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", &tm);
+			segundo = ahora;
+		}
+		
+		char metodo[32], ruta[512], protocolo[32], referer[256], agente[256];
+		char * valor;
+		int json = config.formatoAccesos == FORMATO_JSON;
+		escaparRegistro(metodo, sizeof(metodo), p->metodo.ptr, p->metodo.len, json);
+		escaparRegistro(ruta, sizeof(ruta), p->ruta.ptr, p->ruta.len, json);
+		escaparRegistro(protocolo, sizeof(protocolo), p->protocolo.ptr, p->protocolo.len, json);
+		valor = buscarHeader(p, "Referer");
+		escaparRegistro(referer, sizeof(referer), valor != NULL ? valor : "-", valor != NULL ? strlen(valor) : 1, json);
+		valor = buscarHeader(p, "User-Agent");
+		escaparRegistro(agente, sizeof(agente), valor != NULL ? valor : "-", valor != NULL ? strlen(valor) : 1, json);
+		
+		char linea[TAM_ENTRADA_REGISTRO];
+		int n;
+		if (json) {
+			n = snprintf(linea, sizeof(linea), "{\"time\":\"%s\",\"remote\":\"%s\",\"method\":\"%s\","
+				"\"path\":\"%s\",\"protocol\":\"%s\",\"status\":%d,\"bytes\":%lld,\"referer\":\"%s\","
+				"\"agent\":\"%s\",\"ms\":%lld}\n", fecha, ipCliente(c), metodo, ruta, protocolo, status,
+				c->bytesEnviados, referer, agente, ahoraMs() - c->inicioPedido);
+		} else if (p->metodo.len == 0) {
+			// Pedido que no se pudo analizar
+			n = snprintf(linea, sizeof(linea), "%s - - [%s] \"-\" %d %lld\n", ipCliente(c), fecha, status, c->bytesEnviados);
+		} else {
+			n = snprintf(linea, sizeof(linea), "%s - - [%s] \"%s %s %s\" %d %lld", ipCliente(c), fecha,
+				metodo, ruta, protocolo, status, c->bytesEnviados);
+			if (config.formatoAccesos == FORMATO_COMBINED && n < (int) sizeof(linea))
+				n += snprintf(linea + n, sizeof(linea) - n, " \"%s\" \"%s\"", referer, agente);
+			if (n < (int) sizeof(linea))
+				n += snprintf(linea + n, sizeof(linea) - n, "\n");
+		}
+		// Si no entro, la corto pero que siga terminando en '\n'
+		if (n >= (int) sizeof(linea)) {
+			n = sizeof(linea);
+			linea[n - 1] = '\n';
+		}
+		encolarRegistro(REGISTRO_ACCESOS, LOG_INFO, linea, n);
+	}
+	
+	// Lo que queda en la conexion no es de un pedido nuevo
+	c->bytesEnviados = 0;
+	p->metodo.len = 0;
+	p->ruta.len = 0;
+	p->protocolo.len = 0;
+	p->cantHeaders = 0;
+}
+
+/* Microsegundos de un reloj monotono */
+long long ahoraUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Reserva las metricas de todos los workers en memoria compartida: cada worker
+ * escribe solo las suyas y cualquiera puede leerlas todas */
+void iniciarMetricas() {
+	metricas = mmap(NULL, config.workers * sizeof(struct metricasWorker),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (metricas == MAP_FAILED)
+		error(ERROR_METRICAS);
+}
+
+/* Suma a una metrica del worker. Como cada una tiene un solo escritor no hace
+ * falta una suma atomica: alcanza con que los demas no lean valores a medias */
+void sumarMetrica(_Atomic unsigned long * m, long v) {
+	atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+/* Agrega una medicion (en microsegundos) a un histograma del worker */
+void medirLatencia(struct histograma * h, long long us) {
+	if (us < 0) us = 0;
+	int i = bucketLatencia(us);
+	if (i < CANT_BUCKETS) sumarMetrica(&h->buckets[i], 1);
+	sumarMetrica(&h->cantidad, 1);
+	sumarMetrica(&h->suma, us);
+}
+
+/* Bucket de una latencia: los primeros son exactos y despues cada potencia de 2
+ * se parte en SUB_BUCKETS (como un HDR histogram, con error relativo acotado) */
+int bucketLatencia(long long us) {
+	if (us < SUB_BUCKETS) return us;
+	int e = 63 - __builtin_clzll(us);
+	return (e - 1) * SUB_BUCKETS + ((us >> (e - 2)) & (SUB_BUCKETS - 1));
+}
+
+/* Mayor latencia (en microsegundos) que cae en el bucket dado */
+long long limiteBucket(int i) {
+	if (i < SUB_BUCKETS) return i;
+	int e = i / SUB_BUCKETS + 1;
+	return ((long long) (SUB_BUCKETS + i % SUB_BUCKETS + 1) << (e - 2)) - 1;
+}
+
+/* Agrega a la salida un histograma sumando los de todos los workers */
+void mandarHistograma(char * buf, size_t * len, size_t tam, const char * nombre, const char * ayuda, size_t campo) {
+	unsigned long acumulado = 0, cantidad = 0, suma = 0;
+	int i, w;
+	
+	agregarTexto(buf, len, tam, "# HELP %s %s\n# TYPE %s histogram\n", nombre, ayuda, nombre);
+	for (i = 0; i < CANT_BUCKETS; i++) {
+		for (w = 0; w < config.workers; w++) {
+			struct histograma * h = (struct histograma *) ((char *) &metricas[w] + campo);
+			acumulado += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+		}
+		agregarTexto(buf, len, tam, "%s_bucket{le=\"%.6f\"} %lu\n", nombre, limiteBucket(i) / 1e6, acumulado);
+	}
+	for (w = 0; w < config.workers; w++) {
+		struct histograma * h = (struct histograma *) ((char *) &metricas[w] + campo);
+		cantidad += atomic_load_explicit(&h->cantidad, memory_order_relaxed);
+		suma += atomic_load_explicit(&h->suma, memory_order_relaxed);
+	}
+	agregarTexto(buf, len, tam, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n",
+		nombre, cantidad, nombre, suma / 1e6, nombre, cantidad);
+}
+
+/* Agrega texto con formato al final de buf, sin pasarse de tam */
+void agregarTexto(char * buf, size_t * len, size_t tam, const char * formato, ...) {
+	va_list args;
+	va_start(args, formato);
+	int n = vsnprintf(buf + *len, tam - *len, formato, args);
+	va_end(args);
+	if (n > 0) *len = *len + n < tam ? *len + n : tam - 1;
+}
+
+/* Revisa si el cliente es local (127.x, ::1 o ::ffff:127.x) por la direccion del socket */
+int esClienteLocal(struct conexion * c) {
+	struct sockaddr_storage dir;
+	socklen_t lenDir = sizeof(dir);
+	// Un stream HTTP/2 no tiene socket: el cliente es el de su conexion
+	if (getpeername(c->padre != NULL ? c->padre->sock : c->sock, (struct sockaddr *) &dir, &lenDir) < 0)
+		return 0;
+	if (dir.ss_family == AF_INET)
+		return (ntohl(((struct sockaddr_in *) &dir)->sin_addr.s_addr) >> 24) == 127;
+	if (dir.ss_family == AF_INET6) {
+		struct in6_addr * a = &((struct sockaddr_in6 *) &dir)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+	return 0;
+}
+
+/* Responde las metricas de todos los workers en el formato de texto de Prometheus.
+ * Solo se las doy a clientes locales */
+void mandarEstado(struct conexion * c) {
+	int s, w;
+	
+	if (!esClienteLocal(c)) {
+		mandarRechazo(c,RECHAZO_403);
+		return;
+	}
+	
+	// El cuerpo va despues de los headers en el buffer de salida: lo armo aparte
+	// (en la arena del pedido) para saber el largo antes de mandar los headers.
+	// Ninguna linea llega a LINEA_METRICAS bytes
+	size_t tam = (CANT_STATUS + CANT_PLAZOS + 2 * config.workers + 4 * (CANT_BUCKETS + 2) + 8) * LINEA_METRICAS;
+	char * cuerpo = pedirArena(c, tam);
+	size_t len = 0;
+	
+	agregarTexto(cuerpo, &len, tam, "# HELP servidorhttp_respuestas_total Respuestas por status.\n"
+		"# TYPE servidorhttp_respuestas_total counter\n");
+	for (s = 0; s < CANT_STATUS; s++) {
+		unsigned long total = 0;
+		for (w = 0; w < config.workers; w++)
+			total += atomic_load_explicit(&metricas[w].respuestas[s], memory_order_relaxed);
+		if (total == 0) continue;
+		agregarTexto(cuerpo, &len, tam, "servidorhttp_respuestas_total{status=\"%d\"} %lu\n", s + 100, total);
+	}
+	
+	unsigned long bytes = 0;
+	for (w = 0; w < config.workers; w++)
+		bytes += atomic_load_explicit(&metricas[w].bytesEnviados, memory_order_relaxed);
+	agregarTexto(cuerpo, &len, tam, "# HELP servidorhttp_enviados_bytes_total Bytes mandados a los clientes.\n"
+		"# TYPE servidorhttp_enviados_bytes_total counter\nservidorhttp_enviados_bytes_total %lu\n", bytes);
+	
+	agregarTexto(cuerpo, &len, tam, "# HELP servidorhttp_plazos_vencidos_total Conexiones cerradas por no cumplir el plazo de una fase.\n"
+		"# TYPE servidorhttp_plazos_vencidos_total counter\n");
+	for (s = 0; s < CANT_PLAZOS; s++) {
+		unsigned long total = 0;
+		for (w = 0; w < config.workers; w++)
+			total += atomic_load_explicit(&metricas[w].plazosVencidos[s], memory_order_relaxed);
+		agregarTexto(cuerpo, &len, tam, "servidorhttp_plazos_vencidos_total{fase=\"%s\"} %lu\n", nombresPlazo[s], total);
+	}
+	
+	agregarTexto(cuerpo, &len, tam, "# HELP servidorhttp_conexiones_activas Conexiones abiertas por worker.\n"
+		"# TYPE servidorhttp_conexiones_activas gauge\n");
+	for (w = 0; w < config.workers; w++) {
+		agregarTexto(cuerpo, &len, tam, "servidorhttp_conexiones_activas{worker=\"%d\"} %ld\n", w,
+			(long) atomic_load_explicit(&metricas[w].conexiones, memory_order_relaxed));
+	}
+	agregarTexto(cuerpo, &len, tam, "# HELP servidorhttp_php_activos Pedidos en curso en php-cgi por worker.\n"
+		"# TYPE servidorhttp_php_activos gauge\n");
+	for (w = 0; w < config.workers; w++) {
+		agregarTexto(cuerpo, &len, tam, "servidorhttp_php_activos{worker=\"%d\"} %ld\n", w,
+			(long) atomic_load_explicit(&metricas[w].phpActivos, memory_order_relaxed));
+	}
+	
+	mandarHistograma(cuerpo, &len, tam, "servidorhttp_primer_byte_seconds",
+		"Desde que se acepta la conexion (o llega el pedido) hasta el primer byte de la respuesta.",
+		offsetof(struct metricasWorker, primerByte));
+	mandarHistograma(cuerpo, &len, tam, "servidorhttp_analisis_pedido_seconds",
+		"Desde que llega el pedido hasta que sus headers estan analizados.",
+		offsetof(struct metricasWorker, analisisPedido));
+	mandarHistograma(cuerpo, &len, tam, "servidorhttp_envio_archivo_seconds",
+		"Envio del cuerpo de los archivos estaticos.",
+		offsetof(struct metricasWorker, envioArchivo));
+	mandarHistograma(cuerpo, &len, tam, "servidorhttp_ejecucion_php_seconds",
+		"Desde que se pasa el pedido a php-cgi hasta que termina.",
+		offsetof(struct metricasWorker, ejecucionPHP));
+	
+	c->status = 200;
+	mandarHeaders(c,RTA_200,CT_METRICAS);
+	mandarHeader(c,"Cache-Control: no-store\r\n");
+	terminarHeaders(c,len);
+	encolarSalida(c,cuerpo,len);
+	c->estado = ESTADO_ESCRIBIENDO_HEADERS;
+}
+
+/* Crea el io_uring del worker: las colas de operaciones y el anillo de buffers
+ * para recibir. Retorna -1 si el kernel no tiene lo necesario (accept multishot
+ * y anillos de buffers, desde Linux 5.19) y hay que seguir con epoll */
+int iniciarUring() {
+	struct io_uring_params p;
+	unsigned i;
+	
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	uring.fd = syscall(__NR_io_uring_setup, ENTRADAS_URING, &p);
+	if (uring.fd < 0 && errno == EINVAL) {
+		// Kernel anterior a 6.0: sin las optimizaciones para un solo hilo
+		memset(&p, 0, sizeof(p));
+		uring.fd = syscall(__NR_io_uring_setup, ENTRADAS_URING, &p);
+	}
+	if (uring.fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+			!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(uring.fd);
+		return -1;
+	}
+	
+	// Las dos colas comparten un mismo mapeo; las operaciones van aparte
+	size_t lenSQ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t lenCQ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	char * colas = mmap(NULL, lenSQ > lenCQ ? lenSQ : lenCQ, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	uring.buffers = mmap(NULL, CANT_BUFFERS_URING * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (colas == MAP_FAILED || uring.sqes == MAP_FAILED || uring.buffers == MAP_FAILED) {
+		close(uring.fd);
+		return -1;
+	}
+	uring.sqCabeza = (unsigned *) (colas + p.sq_off.head);
+	uring.sqCola = (unsigned *) (colas + p.sq_off.tail);
+	uring.sqMascara = *(unsigned *) (colas + p.sq_off.ring_mask);
+	uring.sqEntradas = p.sq_entries;
+	uring.colaSQ = *uring.sqCola;
+	// Cada lugar de la cola usa siempre la operacion del mismo indice
+	unsigned * indices = (unsigned *) (colas + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++) indices[i] = i;
+	uring.cqCabeza = (unsigned *) (colas + p.cq_off.head);
+	uring.cqCola = (unsigned *) (colas + p.cq_off.tail);
+	uring.cqMascara = *(unsigned *) (colas + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (colas + p.cq_off.cqes);
+	
+	// El kernel toma un buffer del anillo recien cuando llegan datos, asi
+	// las conexiones que esperan no tienen un buffer reservado cada una
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) uring.buffers;
+	reg.ring_entries = CANT_BUFFERS_URING;
+	reg.bgid = GRUPO_BUFFERS_URING;
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		close(uring.fd);
+		return -1;
+	}
+	uring.memBuffers = malloc(CANT_BUFFERS_URING * TAM_BUFFER_URING);
+	uring.colaBuffers = 0;
+	for (i = 0; i < CANT_BUFFERS_URING; i++) devolverBufferUring(i);
+	return 0;
+}
+
+/* Devuelve un buffer al anillo para que el kernel lo vuelva a usar */
+void devolverBufferUring(int bid) {
+	// Solo los campos del buffer: el resto del primero es la cola del anillo
+	struct io_uring_buf * b = &uring.buffers->bufs[uring.colaBuffers & (CANT_BUFFERS_URING - 1)];
+	b->addr = (unsigned long) (uring.memBuffers + bid * TAM_BUFFER_URING);
+	b->len = TAM_BUFFER_URING;
+	b->bid = bid;
+	uring.colaBuffers++;
+	__atomic_store_n(&uring.buffers->tail, uring.colaBuffers, __ATOMIC_RELEASE);
+}
+
+/* Agrega una operacion a la cola de envio. El kernel la ve recien en la proxima
+ * llamada a esperarUring, junto con todas las de la misma vuelta */
+struct io_uring_sqe * nuevaOperacion(struct conexion * c, int op) {
+	if (uring.colaSQ - __atomic_load_n(uring.sqCabeza, __ATOMIC_ACQUIRE) == uring.sqEntradas)
+		esperarUring(0);
+	struct io_uring_sqe * sqe = &uring.sqes[uring.colaSQ & uring.sqMascara];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (unsigned long) c | op;
+	uring.colaSQ++;
+	if (c != NULL) c->opsPendientes++;
+	return sqe;
+}
+
+/* Pasa al kernel las operaciones encoladas y espera a que termine alguna,
+ * hasta espera ms (-1 sin limite, 0 sin esperar). Es la unica llamada al
+ * sistema de cada vuelta del bucle */
+void esperarUring(int espera) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = IORING_ENTER_EXT_ARG, minimo = 0;
+	
+	unsigned enviar = uring.colaSQ - __atomic_load_n(uring.sqCabeza, __ATOMIC_ACQUIRE);
+	__atomic_store_n(uring.sqCola, uring.colaSQ, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof(arg));
+	if (espera != 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		minimo = 1;
+	}
+	if (espera > 0) {
+		ts.tv_sec = espera / 1000;
+		ts.tv_nsec = (espera % 1000) * 1000000L;
+		arg.ts = (unsigned long) &ts;
+	}
+	if (syscall(__NR_io_uring_enter, uring.fd, enviar, minimo, flags, &arg, sizeof(arg)) < 0 &&
+			errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+		error(ERROR_ENTER_URING);
+}
+
+/* Bucle de eventos con io_uring: el socket de escucha acepta con una sola
+ * operacion multishot y cada conexion avanza con operaciones de recepcion y
+ * envio encadenadas. Lo que no pasa por io_uring (php-cgi e inotify) sigue en
+ * epoll, cuyo descriptor se vigila desde el mismo io_uring */
+void bucleUring(int sockfd) {
+	aceptarUring(sockfd);
+	sondearEpoll();
+	while (1) {
+		esperarUring(esperaPlazos());
+		vencerPlazos();
+		
+		unsigned cabeza = *uring.cqCabeza;
+		unsigned cola = __atomic_load_n(uring.cqCola, __ATOMIC_ACQUIRE);
+		for (; cabeza != cola; cabeza++) {
+			struct io_uring_cqe * cqe = &uring.cqes[cabeza & uring.cqMascara];
+			terminarOperacion(sockfd, cqe->user_data, cqe->res, cqe->flags);
+		}
+		__atomic_store_n(uring.cqCabeza, cabeza, __ATOMIC_RELEASE);
+		
+		liberarCerradas();
+	}
+}
+
+/* Acepta todas las conexiones que lleguen al socket de escucha (multishot) */
+void aceptarUring(int sockfd) {
+	struct io_uring_sqe * sqe = nuevaOperacion(NULL, OP_ACEPTAR);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sockfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/* Avisa (una vez) cuando hay conexiones en la cola del socket de escucha */
+void sondearEscucha(int sockfd) {
+	struct io_uring_sqe * sqe = nuevaOperacion(NULL, OP_ACEPTAR);
+	sqe->user_data |= POLL_ESCUCHA;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sockfd;
+	sqe->poll32_events = POLLIN;
+}
+
+/* Avisa cada vez que hay eventos en epoll (php-cgi e inotify) */
+void sondearEpoll() {
+	struct io_uring_sqe * sqe = nuevaOperacion(NULL, OP_EPOLL);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = epollfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/* Pide los proximos datos del pedido. Normalmente en un buffer del anillo; si
+ * se quedaron sin buffers, directo en la entrada de la conexion */
+void pedirRecepcion(struct conexion * c) {
+	size_t lugar = MAX_HEADERS - c->lenEntrada;
+	struct io_uring_sqe * sqe = nuevaOperacion(c, OP_RECIBIR);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sock;
+	if (c->sinBuffers) {
+		sqe->addr = (unsigned long) (c->entrada + c->lenEntrada);
+		c->sinBuffers = 0;
+	} else {
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = GRUPO_BUFFERS_URING;
+		if (lugar > TAM_BUFFER_URING) lugar = TAM_BUFFER_URING;
+	}
+	sqe->len = lugar;
+}
+
+/* Manda lo pendiente del buffer de salida. El buffer no se puede mover mientras
+ * el envio esta en curso (ver encolarSalida). Retorna 1 si no quedaba nada */
+int enviarSalidaUring(struct conexion * c, int enlazar) {
+	if (c->salidaEnVuelo != NULL) return 0;
+	if (c->enviados == c->lenSalida) {
+		c->lenSalida = 0;
+		c->enviados = 0;
+		return 1;
+	}
+	struct io_uring_sqe * sqe = nuevaOperacion(c, OP_ENVIAR);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->sock;
+	sqe->addr = (unsigned long) (c->salida + c->enviados);
+	sqe->len = c->lenSalida - c->enviados;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	if (enlazar) {
+		// El cuerpo sigue en la cadena: que complete el segmento de los headers
+		sqe->msg_flags |= MSG_MORE;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	c->salidaEnVuelo = c->salida;
+	return 0;
+}
+
+/* Manda lo que falta de la respuesta: la salida pendiente y despues el cuerpo,
+ * en una cadena de operaciones que el kernel ejecuta en orden. Un archivo se
+ * lee de a bloques en un buffer de la conexion y se manda (con splice el kernel
+ * pasaria cada bloque a un hilo aparte, que cuesta mas que la copia).
+ * Retorna 1 si ya se mando todo, 0 si quedaron operaciones en curso y -1 si
+ * no se puede seguir */
+int enviarRespuestaUring(struct conexion * c) {
+	struct io_uring_sqe * sqe;
+	if (c->opsPendientes > 0) return 0;
+	
+	int hayCuerpo = (c->archivo >= 0 || c->cuerpo != NULL) && (c->restante > 0 || c->enBuffer > 0);
+	if (enviarSalidaUring(c, hayCuerpo) && !hayCuerpo) return 1;
+	if (!hayCuerpo) return 0;
+	
+	if (c->inicioEnvio == 0) c->inicioEnvio = ahoraUs();
+	if (c->cuerpo != NULL) {
+		sqe = nuevaOperacion(c, OP_CUERPO);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->sock;
+		sqe->addr = (unsigned long) (c->cuerpo + c->offset);
+		sqe->len = c->restante;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		return 0;
+	}
+	
+	// Si un envio anterior quedo corto, primero sale lo que quedo en el buffer
+	if (c->bufArchivo == NULL) c->bufArchivo = malloc(TAM_LECTURA_URING);
+	size_t largo = c->enBuffer;
+	if (largo == 0) {
+		largo = c->restante < TAM_LECTURA_URING ? c->restante : TAM_LECTURA_URING;
+		c->inicioBuffer = 0;
+		sqe = nuevaOperacion(c, OP_LEER_ARCHIVO);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = c->archivo;
+		sqe->off = c->offset;
+		sqe->addr = (unsigned long) c->bufArchivo;
+		sqe->len = largo;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	sqe = nuevaOperacion(c, OP_ENVIAR_ARCHIVO);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->sock;
+	sqe->addr = (unsigned long) (c->bufArchivo + c->inicioBuffer);
+	sqe->len = largo;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return 0;
+}
+
+/* Registra una operacion terminada. Cuando la conexion no tiene mas operaciones
+ * en curso, su maquina de estados sigue desde donde quedo. Una operacion
+ * cancelada (-ECANCELED) es la que seguia en una cadena que se corto: lo que
+ * no salio se vuelve a pedir */
+void terminarOperacion(int sockfd, unsigned long datos, int res, unsigned int flags) {
+	int op = datos & MASCARA_OP;
+	struct conexion * c = (struct conexion *) (datos & ~(unsigned long) MASCARA_OP);
+	
+	if (op == OP_ACEPTAR) {
+		if (datos & POLL_ESCUCHA) {
+			// Llegaron conexiones mientras el accept esta en pausa: las rechazo
+			// hasta que se libere un descriptor
+			if (escuchaEnPausa < 0) return;
+			int flagsEscucha = fcntl(sockfd, F_GETFL);
+			fcntl(sockfd, F_SETFL, flagsEscucha | O_NONBLOCK);
+			while (rechazarConexion(sockfd));
+			fcntl(sockfd, F_SETFL, flagsEscucha);
+			sondearEscucha(sockfd);
+			return;
+		}
+		if (res >= 0) {
+			c = crearConexion(res);
+			sumarMetrica(&misMetricas->conexiones, 1);
+			manejarConexion(c);
+		} else if (res == -EMFILE || res == -ENFILE) {
+			// El accept multishot termina: antes de volver a pedirlo saco de la cola
+			// (con el descriptor de reserva) la conexion que no se pudo aceptar
+			log_error(ERROR_ACCEPT_SOCKET);
+			int flagsEscucha = fcntl(sockfd, F_GETFL);
+			fcntl(sockfd, F_SETFL, flagsEscucha | O_NONBLOCK);
+			rechazarConexion(sockfd);
+			fcntl(sockfd, F_SETFL, flagsEscucha);
+			// Sin descriptores el accept falla apenas se pide, aunque la cola este
+			// vacia: se vuelve a pedir cuando se cierre una conexion, y mientras
+			// tanto solo se espera a que lleguen otras para rechazarlas
+			if (!(flags & IORING_CQE_F_MORE) && escuchaEnPausa < 0) {
+				escuchaEnPausa = sockfd;
+				sondearEscucha(sockfd);
+			}
+			return;
+		} else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+			log_error(ERROR_ACCEPT_SOCKET);
+		}
+		if (!(flags & IORING_CQE_F_MORE)) aceptarUring(sockfd);
+		return;
+	}
+	if (op == OP_EPOLL) {
+		struct epoll_event eventos[MAX_EVENTOS];
+		int n = epoll_wait(epollfd, eventos, MAX_EVENTOS, 0);
+		if (n > 0) atenderEventos(sockfd, eventos, n);
+		if (!(flags & IORING_CQE_F_MORE)) sondearEpoll();
+		return;
+	}
+	
+	c->opsPendientes--;
+	switch (op) {
+	case OP_RECIBIR:
+		if (c->h2 != NULL) c->h2->recibiendo = 0;
+		if (flags & IORING_CQE_F_BUFFER) {
+			int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (res > 0) memcpy(c->entrada + c->lenEntrada, uring.memBuffers + bid * TAM_BUFFER_URING, res);
+			devolverBufferUring(bid);
+		}
+		if (res > 0) {
+			if (c->fasePlazo == PLAZO_OCIOSA) armarPlazo(c, PLAZO_PEDIDO);
+			if (c->llegada == 0) c->llegada = ahoraUs();
+			c->lenEntrada += res;
+		} else if (res == 0) {
+			c->finLectura = 1;
+		} else if (res == -ENOBUFS) {
+			c->sinBuffers = 1;
+		} else if (res != -EINTR && res != -EAGAIN) {
+			c->errorUring = 1;
+		}
+		break;
+	case OP_ENVIAR:
+		if (c->salidaEnVuelo != c->salida) free(c->salidaEnVuelo);
+		c->salidaEnVuelo = NULL;
+		if (res > 0) {
+			c->enviados += res;
+			contarEnvio(c, res);
+		} else if (res != -EAGAIN) {
+			c->errorUring = 1;
+		}
+		break;
+	case OP_CUERPO:
+		if (res > 0) {
+			c->offset += res;
+			c->restante -= res;
+			contarEnvio(c, res);
+		} else if (res != -ECANCELED && res != -EAGAIN) {
+			c->errorUring = 1;
+		}
+		break;
+	case OP_LEER_ARCHIVO:
+		if (res > 0) {
+			c->offset += res;
+			c->restante -= res;
+			c->enBuffer = res;
+		} else if (res == 0) {
+			// El archivo se achico: ya mande un Content-Length que no voy a cumplir
+			log_error(ERROR_ABRIR_ARCHIVO);
+			c->errorUring = 1;
+		} else if (res != -ECANCELED && res != -EAGAIN) {
+			c->errorUring = 1;
+		}
+		break;
+	case OP_ENVIAR_ARCHIVO:
+		if (res > 0) {
+			c->inicioBuffer += res;
+			c->enBuffer -= res;
+			contarEnvio(c, res);
+		} else if (res != -ECANCELED && res != -EAGAIN) {
+			c->errorUring = 1;
+		}
+		break;
+	}
+	
+	if (c->estado == ESTADO_CERRADA) return;
+	// Una conexion HTTP/2 recibe mientras manda: sigue con cada operacion
+	if (c->opsPendientes > 0 && c->estado != ESTADO_H2) return;
+	if (c->errorUring) {
+		cerrarConexion(c);
+		return;
+	}
+	manejarConexion(c);
+}
+
+/* Arma las tablas para decodificar Huffman a partir de los largos de los codigos:
+ * al ser canonicos, los de cada largo son consecutivos y siguen a los del largo
+ * anterior */
+void iniciarHPACK() {
+	unsigned int codigo = 0;
+	int largo, i, n = 0;
+	for (largo = 1; largo <= MAX_LARGO_HUFFMAN; largo++) {
+		primerCodigoHuffman[largo] = codigo;
+		inicioLargoHuffman[largo] = n;
+		for (i = 0; i < 257; i++) {
+			if (largosHuffman[i] == largo) simbolosHuffman[n++] = i;
+		}
+		cantCodigosHuffman[largo] = n - inicioLargoHuffman[largo];
+		codigo = (codigo + cantCodigosHuffman[largo]) << 1;
+	}
+}
+
+/* Decodifica un string con el codigo Huffman de HPACK, de a un bit. Retorna el
+ * largo decodificado, -1 si es invalido o -2 si no entra en tam bytes */
+long decodificarHuffman(const unsigned char * p, size_t len, char * dst, size_t tam) {
+	unsigned int codigo = 0;
+	int largo = 0, b;
+	size_t i, n = 0;
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			codigo = (codigo << 1) | ((p[i] >> b) & 1);
+			largo++;
+			unsigned int k = codigo - primerCodigoHuffman[largo];
+			if (k < cantCodigosHuffman[largo]) {
+				unsigned short simbolo = simbolosHuffman[inicioLargoHuffman[largo] + k];
+				// EOS no puede aparecer dentro de un string
+				if (simbolo == 256) return -1;
+				if (n == tam) return -2;
+				dst[n++] = simbolo;
+				codigo = 0;
+				largo = 0;
+			} else if (largo == MAX_LARGO_HUFFMAN) {
+				return -1;
+			}
+		}
+	}
+	// El relleno del final son hasta 7 bits en 1 (el comienzo de EOS)
+	if (largo > 7 || codigo != (1u << largo) - 1) return -1;
+	return n;
+}
+
+/* Lee un entero HPACK con un prefijo de bits bits. Retorna los bytes que ocupa o -1 */
+int leerEnteroHPACK(const unsigned char * p, const unsigned char * fin, int bits, size_t * valor) {
+	const unsigned char * q = p;
+	size_t max = (1u << bits) - 1;
+	int desplazamiento = 0;
+	if (q >= fin) return -1;
+	*valor = *q++ & max;
+	if (*valor < max) return 1;
+	while (q < fin && desplazamiento <= 21) {
+		unsigned char b = *q++;
+		*valor += (size_t) (b & 0x7f) << desplazamiento;
+		desplazamiento += 7;
+		if (!(b & 0x80)) return q - p;
+	}
+	// Cortado, o mas grande que cualquier largo que se pueda recibir
+	return -1;
+}
+
+/* Escribe un entero HPACK con un prefijo de bits bits; los bits de arriba del
+ * primer byte son los de marca. Retorna los bytes escritos */
+size_t escribirEnteroHPACK(unsigned char * p, int bits, unsigned char marca, size_t valor) {
+	size_t max = (1u << bits) - 1, n = 0;
+	if (valor < max) {
+		p[0] = marca | valor;
+		return 1;
+	}
+	p[n++] = marca | max;
+	valor -= max;
+	while (valor >= 128) {
+		p[n++] = (valor & 0x7f) | 0x80;
+		valor >>= 7;
+	}
+	p[n++] = valor;
+	return n;
+}
+
+/* Lee el largo de un string HPACK y deja donde estan sus datos y si vienen con
+ * Huffman. Retorna los bytes que ocupa el string entero o -1 */
+long leerStringHPACK(const unsigned char * p, const unsigned char * fin, const unsigned char ** datos,
+		size_t * len, int * huffman) {
+	if (p >= fin) return -1;
+	*huffman = (*p & 0x80) != 0;
+	int n = leerEnteroHPACK(p, fin, 7, len);
+	if (n < 0 || *len > (size_t) (fin - p - n)) return -1;
+	*datos = p + n;
+	return n + *len;
+}
+
+/* Largo maximo de un string HPACK decodificado (con Huffman, cada simbolo ocupa
+ * por lo menos 5 bits) */
+size_t maxDecodificadoHPACK(size_t len, int huffman) {
+	return huffman ? len * 8 / 5 + 1 : len;
+}
+
+/* Decodifica un string HPACK en dst (con lugar para su largo maximo y el '\0').
+ * Retorna su largo o -1 si es invalido */
+long decodificarStringHPACK(const unsigned char * datos, size_t len, int huffman, char * dst) {
+	long n = len;
+	if (huffman)
+		n = decodificarHuffman(datos, len, dst, maxDecodificadoHPACK(len, 1));
+	else
+		memcpy(dst, datos, len);
+	if (n < 0) return -1;
+	dst[n] = '\0';
+	return n;
+}
+
+/* Busca la entrada i (desde 1) de las tablas de HPACK: primero la estatica y
+ * despues la dinamica, de la mas nueva a la mas vieja. Retorna -1 si no existe */
+int campoHPACK(struct tablaHPACK * t, size_t i, const char ** nombre, size_t * lenNombre,
+		const char ** valor, size_t * lenValor) {
+	if (i >= 1 && i <= CANT_ESTATICA_HPACK) {
+		*nombre = estaticaHPACK[i - 1][0];
+		*valor = estaticaHPACK[i - 1][1];
+		*lenNombre = strlen(*nombre);
+		*lenValor = strlen(*valor);
+		return 0;
+	}
+	i -= CANT_ESTATICA_HPACK + 1;
+	if (i >= (size_t) t->cantidad) return -1;
+	struct campoHPACK * e = t->campos[(t->primero + i) & (MAX_CAMPOS_HPACK - 1)];
+	*nombre = e->datos;
+	*lenNombre = e->lenNombre;
+	*valor = e->datos + e->lenNombre + 1;
+	*lenValor = e->lenValor;
+	return 0;
+}
+
+/* Saca la entrada mas vieja de la tabla dinamica */
+void sacarCampoHPACK(struct tablaHPACK * t) {
+	struct campoHPACK * e = t->campos[(t->primero + t->cantidad - 1) & (MAX_CAMPOS_HPACK - 1)];
+	t->tam -= e->lenNombre + e->lenValor + 32;
+	t->cantidad--;
+	free(e);
+}
+
+/* Agrega una entrada a la tabla dinamica, sacando las mas viejas hasta que entre.
+ * Una entrada mas grande que la tabla la deja vacia */
+void agregarCampoHPACK(struct tablaHPACK * t, struct campoHPACK * e) {
+	size_t tam = e->lenNombre + e->lenValor + 32;
+	while (t->cantidad > 0 && t->tam + tam > t->max)
+		sacarCampoHPACK(t);
+	if (tam > t->max) {
+		free(e);
+		return;
+	}
+	t->primero = (t->primero - 1) & (MAX_CAMPOS_HPACK - 1);
+	t->campos[t->primero] = e;
+	t->cantidad++;
+	t->tam += tam;
+}
+
+/* Copia un campo decodificado al texto del pedido (si no entra, lo marca desbordado) */
+void agregarCampoH2(struct camposH2 * h, const char * nombre, size_t lenNombre, const char * valor, size_t lenValor) {
+	if (h->cantidad == MAX_CANT_HEADERS + 8 || h->usado + lenNombre + lenValor + 2 > sizeof(h->texto)) {
+		h->desbordado = 1;
+		return;
+	}
+	struct header * c = &h->campos[h->cantidad++];
+	c->nombre.ptr = memcpy(h->texto + h->usado, nombre, lenNombre);
+	c->nombre.ptr[lenNombre] = '\0';
+	c->nombre.len = lenNombre;
+	h->usado += lenNombre + 1;
+	c->valor.ptr = memcpy(h->texto + h->usado, valor, lenValor);
+	c->valor.ptr[lenValor] = '\0';
+	c->valor.len = lenValor;
+	h->usado += lenValor + 1;
+}
+
+/* Decodifica un bloque de headers HPACK, actualizando la tabla dinamica. Los
+ * literales que se indexan se decodifican directo en su entrada de la tabla y
+ * los demas en el texto de los campos. Retorna -1 si el bloque es invalido */
+int decodificarHPACK(struct tablaHPACK * t, const unsigned char * p, size_t len, struct camposH2 * h) {
+	const unsigned char * fin = p + len;
+	h->cantidad = 0;
+	h->usado = 0;
+	h->desbordado = 0;
+	while (p < fin) {
+		const char * nombre = NULL, * valor;
+		size_t indice, lenNombre = 0, lenValor;
+		long n;
+		if (*p & 0x80) {
+			// Campo indexado: nombre y valor salen de las tablas
+			n = leerEnteroHPACK(p, fin, 7, &indice);
+			if (n < 0 || campoHPACK(t, indice, &nombre, &lenNombre, &valor, &lenValor) < 0) return -1;
+			p += n;
+			agregarCampoH2(h, nombre, lenNombre, valor, lenValor);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) {
+			// Cambio del tamaño de la tabla (hasta el que anuncio el servidor)
+			n = leerEnteroHPACK(p, fin, 5, &indice);
+			if (n < 0 || indice > TAM_TABLA_HPACK) return -1;
+			p += n;
+			t->max = indice;
+			while (t->tam > t->max) sacarCampoHPACK(t);
+			continue;
+		}
+
+		// Literal con indexado incremental (01), sin indexar (0000) o nunca indexado (0001)
+		int indexar = (*p & 0xc0) == 0x40;
+		const unsigned char * strNombre = NULL, * strValor;
+		size_t lenStrNombre = 0, lenStrValor;
+		int hufNombre = 0, hufValor;
+		n = leerEnteroHPACK(p, fin, indexar ? 6 : 4, &indice);
+		if (n < 0) return -1;
+		p += n;
+		if (indice > 0) {
+			if (campoHPACK(t, indice, &nombre, &lenNombre, &valor, &lenValor) < 0) return -1;
+		} else {
+			n = leerStringHPACK(p, fin, &strNombre, &lenStrNombre, &hufNombre);
+			if (n < 0) return -1;
+			p += n;
+			lenNombre = maxDecodificadoHPACK(lenStrNombre, hufNombre);
+		}
+		n = leerStringHPACK(p, fin, &strValor, &lenStrValor, &hufValor);
+		if (n < 0) return -1;
+		p += n;
+
+		size_t tam = lenNombre + maxDecodificadoHPACK(lenStrValor, hufValor) + 2;
+		struct campoHPACK * e = NULL;
+		char * dst;
+		if (indexar) {
+			e = malloc(sizeof(struct campoHPACK) + tam);
+			dst = e->datos;
+		} else if (h->cantidad < MAX_CANT_HEADERS + 8 && tam <= sizeof(h->texto) - h->usado) {
+			dst = h->texto + h->usado;
+		} else {
+			h->desbordado = 1;
+			continue;
+		}
+
+		long ln = lenNombre;
+		if (nombre != NULL) {
+			memcpy(dst, nombre, lenNombre);
+			dst[lenNombre] = '\0';
+		} else {
+			ln = decodificarStringHPACK(strNombre, lenStrNombre, hufNombre, dst);
+		}
+		long lv = ln < 0 ? -1 : decodificarStringHPACK(strValor, lenStrValor, hufValor, dst + ln + 1);
+		if (lv < 0) {
+			free(e);
+			return -1;
+		}
+		if (indexar) {
+			e->lenNombre = ln;
+			e->lenValor = lv;
+			agregarCampoH2(h, e->datos, ln, e->datos + ln + 1, lv);
+			agregarCampoHPACK(t, e);
+		} else {
+			struct header * c = &h->campos[h->cantidad++];
+			c->nombre.ptr = dst;
+			c->nombre.len = ln;
+			c->valor.ptr = dst + ln + 1;
+			c->valor.len = lv;
+			h->usado += ln + lv + 2;
+		}
+	}
+	return 0;
+}
+
+/* Indice de la tabla estatica de HPACK con ese nombre, 0 si no esta */
+int indiceEstaticoHPACK(const char * nombre) {
+	int i;
+	for (i = 0; i < CANT_ESTATICA_HPACK; i++) {
+		if (strcmp(estaticaHPACK[i][0], nombre) == 0) return i + 1;
+	}
+	return 0;
+}
+
+/* Revisa si un header es propio de una conexion HTTP/1 (no existe en HTTP/2) */
+int esHeaderDeConexion(const char * nombre) {
+	return strcasecmp(nombre, "Connection") == 0 || strcasecmp(nombre, "Keep-Alive") == 0 ||
+		strcasecmp(nombre, "Proxy-Connection") == 0 || strcasecmp(nombre, "Transfer-Encoding") == 0 ||
+		strcasecmp(nombre, "Upgrade") == 0;
+}
+
+/* Pasa a HPACK los headers de una respuesta HTTP/1 (desde la linea de estado
+ * hasta fin, sin la linea vacia). El status va indexado si esta en la tabla
+ * estatica y el resto como literales sin indexar, con el nombre indexado cuando
+ * se puede. Retorna el largo del bloque */
+size_t armarBloqueH2(const char * inicio, const char * fin, unsigned char * bloque) {
+	unsigned char * q = bloque;
+	char nombre[256];
+	int status = atoi(inicio + 9);
+	int i;
+
+	for (i = 8; i <= 14; i++) {
+		if (atoi(estaticaHPACK[i - 1][1]) == status) break;
+	}
+	if (i <= 14) {
+		*q++ = 0x80 | i;
+	} else {
+		q += escribirEnteroHPACK(q, 4, 0x00, 8);
+		q += escribirEnteroHPACK(q, 7, 0x00, 3);
+		q += sprintf((char *) q, "%03d", status % 1000);
+	}
+
+	const char * linea = memchr(inicio, '\n', fin - inicio);
+	linea = linea != NULL ? linea + 1 : fin;
+	while (linea < fin) {
+		const char * finLinea = memchr(linea, '\n', fin - linea);
+		if (finLinea == NULL) finLinea = fin;
+		const char * dosPuntos = memchr(linea, ':', finLinea - linea);
+		size_t lenNombre = dosPuntos != NULL ? (size_t) (dosPuntos - linea) : 0;
+		if (lenNombre > 0 && lenNombre < sizeof(nombre)) {
+			// En HTTP/2 los nombres van en minusculas
+			for (i = 0; i < (int) lenNombre; i++) nombre[i] = tolower((unsigned char) linea[i]);
+			nombre[lenNombre] = '\0';
+			const char * valor = dosPuntos + 1;
+			const char * finValor = finLinea;
+			while (valor < finValor && (*valor == ' ' || *valor == '\t')) valor++;
+			while (finValor > valor && (finValor[-1] == '\r' || finValor[-1] == ' ' || finValor[-1] == '\t')) finValor--;
+			if (!esHeaderDeConexion(nombre)) {
+				int indice = indiceEstaticoHPACK(nombre);
+				q += escribirEnteroHPACK(q, 4, 0x00, indice);
+				if (indice == 0) {
+					q += escribirEnteroHPACK(q, 7, 0x00, lenNombre);
+					memcpy(q, nombre, lenNombre);
+					q += lenNombre;
+				}
+				q += escribirEnteroHPACK(q, 7, 0x00, finValor - valor);
+				memcpy(q, valor, finValor - valor);
+				q += finValor - valor;
+			}
+		}
+		linea = finLinea + 1;
+	}
+	return q - bloque;
+}
+
+/* Lee un entero de 32 bits de un marco */
+unsigned long leer32H2(const unsigned char * p) {
+	return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Escribe un entero de 32 bits en un marco */
+void escribir32H2(unsigned char * p, unsigned long valor) {
+	p[0] = valor >> 24;
+	p[1] = valor >> 16;
+	p[2] = valor >> 8;
+	p[3] = valor;
+}
+
+/* Escribe el encabezado de un marco */
+void escribirEncabezadoH2(unsigned char * p, size_t len, int tipo, int flags, unsigned int id) {
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = tipo;
+	p[4] = flags;
+	escribir32H2(p + 5, id & 0x7fffffff);
+}
+
+/* Agrega un marco a la salida de la conexion */
+void encolarMarcoH2(struct conexion * c, int tipo, int flags, unsigned int id, const void * datos, size_t len) {
+	unsigned char * p = (unsigned char *) reservarSalida(c, LEN_ENCABEZADO_H2 + len);
+	escribirEncabezadoH2(p, len, tipo, flags, id);
+	if (len > 0) memcpy(p + LEN_ENCABEZADO_H2, datos, len);
+	c->lenSalida += LEN_ENCABEZADO_H2 + len;
+}
+
+/* Avisa al cliente que un stream se corta */
+void mandarRstH2(struct conexion * c, unsigned int id, int codigo) {
+	unsigned char datos[4];
+	escribir32H2(datos, codigo);
+	encolarMarcoH2(c, H2_RST_STREAM, 0, id, datos, sizeof(datos));
+}
+
+/* Cierra la conexion HTTP/2 avisandole al cliente con un GOAWAY el motivo y
+ * hasta que stream se atendio. Los streams se cortan en el momento, pero la
+ * conexion se cierra recien cuando sale el GOAWAY (con io_uring, en otra
+ * vuelta del bucle) o se le vence el plazo de escritura */
+void cerrarH2(struct conexion * c, int codigo) {
+	struct sesionH2 * s = c->h2;
+	unsigned char datos[8];
+	s->cerrando = 1;
+	while (s->streams != NULL) cerrarConexion(s->streams);
+	if (c->estado == ESTADO_CERRADA) return;
+	escribir32H2(datos, s->ultimoStream);
+	escribir32H2(datos + 4, codigo);
+	encolarMarcoH2(c, H2_GOAWAY, 0, 0, datos, sizeof(datos));
+	if (enviarSalida(c) != 0) {
+		cerrarConexion(c);
+		return;
+	}
+	armarPlazo(c, PLAZO_ESCRITURA);
+}
+
+/* Decodifica base64url (o base64), con o sin relleno. Retorna el largo o -1 si es invalido */
+long decodificarBase64(const char * texto, unsigned char * dst, size_t tam) {
+	unsigned int acumulado = 0;
+	int bits = 0;
+	size_t n = 0;
+	for (; *texto != '\0' && *texto != '='; texto++) {
+		char ch = *texto;
+		int v;
+		if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+		else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+		else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+		else if (ch == '-' || ch == '+') v = 62;
+		else if (ch == '_' || ch == '/') v = 63;
+		else return -1;
+		acumulado = ((acumulado << 6) | v) & 0xffff;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == tam) return -1;
+			dst[n++] = acumulado >> bits;
+		}
+	}
+	return n;
+}
+
+/* Pasa la conexion a HTTP/2: arma el estado de la sesion y encola los SETTINGS
+ * del servidor, que son lo primero que manda. El pedido HTTP/1 que la inicio
+ * (el comienzo del prefacio o el del Upgrade) sigue en la entrada */
+void iniciarSesionH2(struct conexion * c, int faltaPrefacio) {
+	struct sesionH2 * s = calloc(1, sizeof(struct sesionH2));
+	unsigned char settings[12] = { 0, H2_SET_STREAMS, 0, 0, 0, 0, 0, H2_SET_HEADERS, 0, 0, 0, 0 };
+	s->faltaPrefacio = faltaPrefacio;
+	s->tabla.max = TAM_TABLA_HPACK;
+	s->ventanaEnvio = VENTANA_H2;
+	s->ventanaInicial = VENTANA_H2;
+	s->maxMarco = MAX_MARCO_H2;
+	c->h2 = s;
+	c->estado = ESTADO_H2;
+	// Lo que manda la conexion son marcos; el primer byte se mide en cada stream
+	c->primerByte = 1;
+	liberarArena(c);
+
+	escribir32H2(settings + 2, MAX_STREAMS_H2);
+	escribir32H2(settings + 8, MAX_HEADERS);
+	encolarMarcoH2(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+/* Atiende un pedido HTTP/1.1 con Upgrade: h2c. Responde 101, pasa la conexion
+ * a HTTP/2 con los SETTINGS del header HTTP2-Settings y el mismo pedido pasa a
+ * ser el stream 1. Retorna 0 si no se puede pasar (sigue en HTTP/1.1) */
+int pasarAH2(struct conexion * c) {
+	struct header campos[MAX_CANT_HEADERS + 2];
+	unsigned char settings[256];
+	char * valor = buscarHeader(&c->pedido, "HTTP2-Settings");
+	long len = valor != NULL ? decodificarBase64(valor, settings, sizeof(settings)) : -1;
+	int cant = 0, i;
+	if (len < 0 || len % 6 != 0) return 0;
+
+	// El pedido como uno de HTTP/2, sin los headers de la conexion HTTP/1
+	campos[cant].nombre.ptr = ":method";
+	campos[cant].nombre.len = 7;
+	campos[cant++].valor = c->pedido.metodo;
+	campos[cant].nombre.ptr = ":path";
+	campos[cant].nombre.len = 5;
+	campos[cant++].valor = c->pedido.ruta;
+	for (i = 0; i < c->pedido.cantHeaders; i++) {
+		struct header * h = &c->pedido.headers[i];
+		if (!esHeaderDeConexion(h->nombre.ptr) && strcasecmp(h->nombre.ptr, "HTTP2-Settings") != 0)
+			campos[cant++] = *h;
+	}
+
+	mandarHeader(c, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	iniciarSesionH2(c, LEN_PREFACIO_H2);
+	if (aplicarSettingsH2(c, settings, len) != H2_SIN_ERROR) {
+		cerrarH2(c, H2_ERROR_PROTOCOLO);
+		return 1;
+	}
+	struct conexion * st = crearStreamH2(c, 1);
+	c->h2->ultimoStream = 1;
+	atenderStreamH2(st, armarPedidoH2(st, campos, cant));
+	descartarPedido(c);
+	return 1;
+}
+
+/* Aplica los parametros de un SETTINGS del cliente. Retorna el codigo de error */
+int aplicarSettingsH2(struct conexion * c, const unsigned char * p, size_t len) {
+	struct sesionH2 * s = c->h2;
+	struct conexion * st;
+	if (len % 6 != 0) return H2_ERROR_TAM_MARCO;
+	for (; len > 0; p += 6, len -= 6) {
+		int id = (p[0] << 8) | p[1];
+		unsigned long valor = leer32H2(p + 2);
+		if (id == H2_SET_PUSH && valor > 1) return H2_ERROR_PROTOCOLO;
+		if (id == H2_SET_VENTANA) {
+			if (valor > MAX_VENTANA_H2) return H2_ERROR_CONTROL_FLUJO;
+			// El cambio vale tambien para los streams abiertos
+			for (st = s->streams; st != NULL; st = st->sigStream) {
+				st->ventanaH2 += (long) valor - s->ventanaInicial;
+				if (st->ventanaH2 > MAX_VENTANA_H2) return H2_ERROR_CONTROL_FLUJO;
+			}
+			s->ventanaInicial = valor;
+		} else if (id == H2_SET_MARCO) {
+			if (valor < MAX_MARCO_H2 || valor > 0xffffff) return H2_ERROR_PROTOCOLO;
+			// Marcos mas grandes no ahorran casi nada y demoran a los otros streams
+			s->maxMarco = valor < 4 * MAX_MARCO_H2 ? valor : 4 * MAX_MARCO_H2;
+		}
+	}
+	return H2_SIN_ERROR;
+}
+
+/* Crea un stream como una conexion hija, sin socket, con la ventana y la
+ * prioridad por defecto, al final de los streams de la conexion */
+struct conexion * crearStreamH2(struct conexion * c, unsigned int id) {
+	struct sesionH2 * s = c->h2;
+	struct conexion * st = crearConexion(-1);
+	struct conexion ** p = &s->streams;
+	cancelarPlazo(st);
+	st->padre = c;
+	st->idStream = id;
+	st->ventanaH2 = s->ventanaInicial;
+	st->urgencia = URGENCIA_H2;
+	strcpy(st->ip, ipCliente(c));
+	while (*p != NULL) p = &(*p)->sigStream;
+	*p = st;
+	s->cantStreams++;
+	return st;
+}
+
+/* Busca un stream abierto de la conexion */
+struct conexion * buscarStreamH2(struct sesionH2 * s, unsigned int id) {
+	struct conexion * st;
+	for (st = s->streams; st != NULL; st = st->sigStream) {
+		if (st->idStream == id) return st;
+	}
+	return NULL;
+}
+
+/* Saca al stream de su conexion. Si el cliente todavia espera el resto de la
+ * respuesta, le avisa que no va a llegar; si la respuesta salio pero el
+ * cliente sigue mandando el cuerpo, le avisa que pare (RFC 9113 8.1) */
+void quitarStreamH2(struct conexion * st) {
+	struct conexion * c = st->padre;
+	struct conexion ** p = &c->h2->streams;
+	while (*p != st) p = &(*p)->sigStream;
+	*p = st->sigStream;
+	c->h2->cantStreams--;
+	if (c->estado != ESTADO_CERRADA && !c->h2->cerrando) {
+		if (!st->finH2) mandarRstH2(c, st->idStream, H2_ERROR_INTERNO);
+		else if (st->cuerpoH2) mandarRstH2(c, st->idStream, H2_SIN_ERROR);
+	}
+	st->finH2 = 1;
+	st->cuerpoH2 = 0;
+}
+
+/* Corta un stream avisandole al cliente el motivo */
+void resetearStreamH2(struct conexion * st, int codigo) {
+	mandarRstH2(st->padre, st->idStream, codigo);
+	st->finH2 = 1;
+	st->cuerpoH2 = 0;
+	cerrarConexion(st);
+}
+
+/* Pasa un stream incremental al final de la lista, para que se turne con los demas */
+void pasarAlFinalH2(struct sesionH2 * s, struct conexion * st) {
+	struct conexion ** p = &s->streams;
+	if (st->sigStream == NULL) return;
+	while (*p != st) p = &(*p)->sigStream;
+	*p = st->sigStream;
+	while (*p != NULL) p = &(*p)->sigStream;
+	*p = st;
+	st->sigStream = NULL;
+}
+
+/* Urgencia (RFC 9218) que corresponde a un peso de la prioridad de RFC 7540 (1 a 256) */
+int urgenciaPesoH2(int peso) {
+	return (256 - peso) / (256 / CANT_URGENCIAS_H2);
+}
+
+/* Toma la prioridad del header priority o de un PRIORITY_UPDATE (RFC 9218):
+ * "u=N" es la urgencia (0 la mas alta, 7 la mas baja) e "i" indica que el
+ * cliente usa la respuesta a medida que llega */
+void aplicarPrioridadH2(struct conexion * st, const char * valor, size_t len) {
+	const char * p = valor;
+	const char * fin = valor + len;
+	while (p < fin) {
+		while (p < fin && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+		const char * finItem = memchr(p, ',', fin - p);
+		if (finItem == NULL) finItem = fin;
+		size_t n = finItem - p;
+		while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) n--;
+		if (n == 3 && p[0] == 'u' && p[1] == '=' && p[2] >= '0' && p[2] < '0' + CANT_URGENCIAS_H2)
+			st->urgencia = p[2] - '0';
+		else if ((n == 1 && p[0] == 'i') || (n == 4 && memcmp(p, "i=?1", 4) == 0))
+			st->incremental = 1;
+		else if (n == 4 && memcmp(p, "i=?0", 4) == 0)
+			st->incremental = 0;
+		p = finItem;
+	}
+}
+
+/* Agrega len bytes en *p si entran antes de fin. Retorna -1 si no entran */
+int agregarTextoH2(char ** p, char * fin, const char * datos, size_t len) {
+	if ((size_t) (fin - *p) < len) return -1;
+	memcpy(*p, datos, len);
+	*p += len;
+	return 0;
+}
+
+/* Revisa que un campo de HTTP/2 se pueda pasar a texto de HTTP/1: el nombre sin
+ * espacios ni ':' (salvo el de un pseudo-header) y nada que corte las lineas */
+int campoValidoH2(struct header * h) {
+	size_t i;
+	if (h->nombre.len == 0) return 0;
+	for (i = 0; i < h->nombre.len; i++) {
+		char ch = h->nombre.ptr[i];
+		if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '\0' || (ch == ':' && i > 0)) return 0;
+	}
+	for (i = 0; i < h->valor.len; i++) {
+		char ch = h->valor.ptr[i];
+		if (ch == '\r' || ch == '\n' || ch == '\0') return 0;
+	}
+	return 1;
+}
+
+/* Escribe en la entrada del stream el pedido HTTP/2 como uno de HTTP/1: la linea
+ * del pedido (con protocolo HTTP/2.0), Host (de :authority) y los headers, con
+ * las partes de Cookie juntas en uno solo. Asi se atiende con atenderPedido.
+ * Retorna 0, -1 si el pedido esta mal formado o -2 si no entra */
+int armarPedidoH2(struct conexion * st, struct header * campos, int cant) {
+	struct segmento metodo = { NULL, 0 }, ruta = { NULL, 0 }, autoridad = { NULL, 0 };
+	char * p = st->entrada;
+	char * fin = st->entrada + MAX_HEADERS;
+	int i, regulares = 0, hayHost = 0, cookies = 0, r;
+
+	for (i = 0; i < cant; i++) {
+		struct header * h = &campos[i];
+		if (!campoValidoH2(h)) return -1;
+		if (h->nombre.ptr[0] == ':') {
+			struct segmento * destino = NULL;
+			// Los pseudo-headers van antes que los demas, una sola vez cada uno
+			if (regulares) return -1;
+			if (strcmp(h->nombre.ptr, ":method") == 0) destino = &metodo;
+			else if (strcmp(h->nombre.ptr, ":path") == 0) destino = &ruta;
+			else if (strcmp(h->nombre.ptr, ":authority") == 0) destino = &autoridad;
+			else if (strcmp(h->nombre.ptr, ":scheme") != 0) return -1;
+			if (destino != NULL) {
+				if (destino->ptr != NULL) return -1;
+				*destino = h->valor;
+			}
+		} else {
+			regulares = 1;
+			if (esHeaderDeConexion(h->nombre.ptr)) return -1;
+			if (strcasecmp(h->nombre.ptr, "Host") == 0) hayHost = 1;
+		}
+	}
+	if (metodo.len == 0 || ruta.len == 0 || memchr(metodo.ptr, ' ', metodo.len) != NULL ||
+			memchr(ruta.ptr, ' ', ruta.len) != NULL)
+		return -1;
+
+	r = agregarTextoH2(&p, fin, metodo.ptr, metodo.len) | agregarTextoH2(&p, fin, " ", 1) |
+		agregarTextoH2(&p, fin, ruta.ptr, ruta.len) | agregarTextoH2(&p, fin, " HTTP/2.0\r\n", 11);
+	if (autoridad.ptr != NULL && !hayHost) {
+		r |= agregarTextoH2(&p, fin, "Host: ", 6) | agregarTextoH2(&p, fin, autoridad.ptr, autoridad.len) |
+			agregarTextoH2(&p, fin, "\r\n", 2);
+	}
+	for (i = 0; i < cant; i++) {
+		struct header * h = &campos[i];
+		if (h->nombre.ptr[0] == ':') continue;
+		if (strcasecmp(h->nombre.ptr, "Cookie") == 0) {
+			cookies++;
+			continue;
+		}
+		r |= agregarTextoH2(&p, fin, h->nombre.ptr, h->nombre.len) | agregarTextoH2(&p, fin, ": ", 2) |
+			agregarTextoH2(&p, fin, h->valor.ptr, h->valor.len) | agregarTextoH2(&p, fin, "\r\n", 2);
+	}
+	if (cookies > 0) {
+		r |= agregarTextoH2(&p, fin, "Cookie: ", 8);
+		for (i = 0; i < cant; i++) {
+			struct header * h = &campos[i];
+			if (h->nombre.ptr[0] == ':' || strcasecmp(h->nombre.ptr, "Cookie") != 0) continue;
+			r |= agregarTextoH2(&p, fin, h->valor.ptr, h->valor.len);
+			if (--cookies > 0) r |= agregarTextoH2(&p, fin, "; ", 2);
+		}
+		r |= agregarTextoH2(&p, fin, "\r\n", 2);
+	}
+	r |= agregarTextoH2(&p, fin, "\r\n", 2);
+	if (r != 0) return -2;
+	st->lenEntrada = p - st->entrada;
+	return 0;
+}
+
+/* Atiende el pedido de un stream, ya escrito en su entrada (r es el resultado
+ * de armarPedidoH2). La respuesta sale cuando la arme programarH2 */
+void atenderStreamH2(struct conexion * st, int r) {
+	if (r == -1) {
+		resetearStreamH2(st, H2_ERROR_PROTOCOLO);
+		return;
+	}
+	if (r == -2) {
+		st->inicioPedido = ahoraMs();
+		mandarRechazo(st, RECHAZO_431);
+		return;
+	}
+	buscarFinPedido(st);
+	atenderPedido(st);
+	armarPlazoRespuesta(st);
+}
+
+/* Un bloque de headers completo abre un stream nuevo. Se decodifica siempre,
+ * aunque el stream no se atienda, para que la tabla dinamica siga igual a la
+ * del cliente. Retorna el codigo de error de la conexion */
+int procesarHeadersH2(struct conexion * c, const unsigned char * bloque, size_t len) {
+	struct sesionH2 * s = c->h2;
+	struct camposH2 campos;
+	unsigned int id = s->idBloque;
+	int i;
+
+	if (decodificarHPACK(&s->tabla, bloque, len, &campos) < 0) return H2_ERROR_COMPRESION;
+	// Un id que no es nuevo son trailers de un stream abierto (los pedidos no
+	// tienen cuerpo) o de uno ya cerrado
+	if (id <= s->ultimoStream) {
+		struct conexion * abierto = buscarStreamH2(s, id);
+		if (abierto != NULL && !s->cuerpoBloque) abierto->cuerpoH2 = 0;
+		return H2_SIN_ERROR;
+	}
+	s->ultimoStream = id;
+	if (s->cantStreams >= MAX_STREAMS_H2) {
+		mandarRstH2(c, id, H2_ERROR_RECHAZADO);
+		return H2_SIN_ERROR;
+	}
+
+	struct conexion * st = crearStreamH2(c, id);
+	if (s->pesoBloque > 0) st->urgencia = urgenciaPesoH2(s->pesoBloque);
+	st->cuerpoH2 = s->cuerpoBloque;
+	for (i = 0; i < campos.cantidad; i++) {
+		if (strcmp(campos.campos[i].nombre.ptr, "priority") == 0)
+			aplicarPrioridadH2(st, campos.campos[i].valor.ptr, campos.campos[i].valor.len);
+	}
+	atenderStreamH2(st, campos.desbordado ? -2 : armarPedidoH2(st, campos.campos, campos.cantidad));
+	return H2_SIN_ERROR;
+}
+
+/* Agrega un fragmento al bloque de headers en curso. Con END_HEADERS el bloque
+ * esta completo (si vino en un solo marco, se usa sin copiarlo) */
+int agregarBloqueH2(struct conexion * c, const unsigned char * datos, size_t len) {
+	struct sesionH2 * s = c->h2;
+	if (s->lenBloque == 0 && (s->flags & H2_FIN_HEADERS))
+		return procesarHeadersH2(c, datos, len);
+	if (s->lenBloque + len > MAX_BLOQUE_H2) return H2_ERROR_CALMA;
+	if (s->lenBloque + len > s->capBloque) {
+		s->capBloque = s->capBloque ? s->capBloque : MAX_MARCO_H2;
+		while (s->capBloque < s->lenBloque + len) s->capBloque *= 2;
+		s->bloque = realloc(s->bloque, s->capBloque);
+	}
+	memcpy(s->bloque + s->lenBloque, datos, len);
+	s->lenBloque += len;
+	if (!(s->flags & H2_FIN_HEADERS)) {
+		s->continuacion = 1;
+		return H2_SIN_ERROR;
+	}
+	s->continuacion = 0;
+	len = s->lenBloque;
+	s->lenBloque = 0;
+	return procesarHeadersH2(c, s->bloque, len);
+}
+
+/* Procesa un marco completo del cliente. Retorna el codigo de error de la
+ * conexion (H2_SIN_ERROR si puede seguir) */
+int procesarMarcoH2(struct conexion * c) {
+	struct sesionH2 * s = c->h2;
+	unsigned char * carga = s->carga;
+	size_t largo = s->largo;
+	unsigned int id = s->idMarco;
+	struct conexion * st;
+	long incremento;
+	int error;
+
+	// Un bloque de headers partido sigue en CONTINUATION, sin otros marcos en el medio
+	if (s->continuacion && (s->tipo != H2_CONTINUATION || id != s->idBloque))
+		return H2_ERROR_PROTOCOLO;
+
+	switch (s->tipo) {
+	case H2_DATA: {
+		unsigned char datos[4];
+		if (id == 0 || id > s->ultimoStream) return H2_ERROR_PROTOCOLO;
+		// Los pedidos no tienen cuerpo: se descarta y se le devuelve la ventana al
+		// cliente, la de la conexion y la del stream (si no, un cuerpo de mas de
+		// una ventana se traba)
+		s->porDevolver += largo;
+		if (s->porDevolver >= VENTANA_H2 / 2) {
+			escribir32H2(datos, s->porDevolver);
+			encolarMarcoH2(c, H2_WINDOW_UPDATE, 0, 0, datos, sizeof(datos));
+			s->porDevolver = 0;
+		}
+		// Si la respuesta ya salio el stream no esta y el cliente ya recibio el
+		// RST_STREAM que le pide que no mande mas
+		st = buscarStreamH2(s, id);
+		if (st == NULL) return H2_SIN_ERROR;
+		if (s->flags & H2_FIN_STREAM) {
+			st->cuerpoH2 = 0;
+			return H2_SIN_ERROR;
+		}
+		st->porDevolverH2 += largo;
+		if (st->porDevolverH2 >= VENTANA_H2 / 2) {
+			escribir32H2(datos, st->porDevolverH2);
+			encolarMarcoH2(c, H2_WINDOW_UPDATE, 0, id, datos, sizeof(datos));
+			st->porDevolverH2 = 0;
+		}
+		return H2_SIN_ERROR;
+	}
+	case H2_HEADERS: {
+		size_t inicio = 0, relleno = 0;
+		if (id == 0 || id % 2 == 0) return H2_ERROR_PROTOCOLO;
+		if (s->flags & H2_RELLENO) {
+			if (largo < 1) return H2_ERROR_PROTOCOLO;
+			relleno = carga[0];
+			inicio = 1;
+		}
+		s->pesoBloque = 0;
+		s->cuerpoBloque = !(s->flags & H2_FIN_STREAM);
+		if (s->flags & H2_PRIORIDAD) {
+			if (largo < inicio + 5) return H2_ERROR_PROTOCOLO;
+			s->pesoBloque = carga[inicio + 4] + 1;
+			inicio += 5;
+		}
+		if (inicio + relleno > largo) return H2_ERROR_PROTOCOLO;
+		s->idBloque = id;
+		return agregarBloqueH2(c, carga + inicio, largo - inicio - relleno);
+	}
+	case H2_CONTINUATION:
+		if (!s->continuacion) return H2_ERROR_PROTOCOLO;
+		return agregarBloqueH2(c, carga, largo);
+	case H2_PRIORITY:
+		if (id == 0) return H2_ERROR_PROTOCOLO;
+		if (largo != 5) return H2_ERROR_TAM_MARCO;
+		st = buscarStreamH2(s, id);
+		if (st != NULL) st->urgencia = urgenciaPesoH2(carga[4] + 1);
+		return H2_SIN_ERROR;
+	case H2_RST_STREAM:
+		if (id == 0) return H2_ERROR_PROTOCOLO;
+		if (largo != 4) return H2_ERROR_TAM_MARCO;
+		// El cliente ya no quiere la respuesta
+		st = buscarStreamH2(s, id);
+		if (st != NULL) {
+			st->finH2 = 1;
+			st->cuerpoH2 = 0;
+			cerrarConexion(st);
+		}
+		return H2_SIN_ERROR;
+	case H2_SETTINGS:
+		if (id != 0) return H2_ERROR_PROTOCOLO;
+		if (s->flags & H2_ACK) return largo == 0 ? H2_SIN_ERROR : H2_ERROR_TAM_MARCO;
+		error = aplicarSettingsH2(c, carga, largo);
+		if (error == H2_SIN_ERROR) encolarMarcoH2(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+		return error;
+	case H2_PUSH_PROMISE:
+		// Solo el servidor puede anunciar streams
+		return H2_ERROR_PROTOCOLO;
+	case H2_PING:
+		if (id != 0) return H2_ERROR_PROTOCOLO;
+		if (largo != 8) return H2_ERROR_TAM_MARCO;
+		if (!(s->flags & H2_ACK)) encolarMarcoH2(c, H2_PING, H2_ACK, 0, carga, 8);
+		return H2_SIN_ERROR;
+	case H2_GOAWAY:
+		if (id != 0) return H2_ERROR_PROTOCOLO;
+		s->goaway = 1;
+		return H2_SIN_ERROR;
+	case H2_WINDOW_UPDATE:
+		if (largo != 4) return H2_ERROR_TAM_MARCO;
+		incremento = leer32H2(carga) & 0x7fffffff;
+		if (id == 0) {
+			if (incremento == 0) return H2_ERROR_PROTOCOLO;
+			s->ventanaEnvio += incremento;
+			return s->ventanaEnvio > MAX_VENTANA_H2 ? H2_ERROR_CONTROL_FLUJO : H2_SIN_ERROR;
+		}
+		st = buscarStreamH2(s, id);
+		if (st == NULL) return H2_SIN_ERROR;
+		st->ventanaH2 += incremento;
+		if (incremento == 0)
+			resetearStreamH2(st, H2_ERROR_PROTOCOLO);
+		else if (st->ventanaH2 > MAX_VENTANA_H2)
+			resetearStreamH2(st, H2_ERROR_CONTROL_FLUJO);
+		return H2_SIN_ERROR;
+	case H2_PRIORITY_UPDATE:
+		if (id != 0) return H2_ERROR_PROTOCOLO;
+		if (largo < 4) return H2_ERROR_TAM_MARCO;
+		st = buscarStreamH2(s, leer32H2(carga) & 0x7fffffff);
+		if (st != NULL) aplicarPrioridadH2(st, (char *) carga + 4, largo - 4);
+		return H2_SIN_ERROR;
+	default:
+		// Los tipos de marco desconocidos se ignoran
+		return H2_SIN_ERROR;
+	}
+}
+
+/* Procesa lo recibido en la conexion HTTP/2: el resto del prefacio del cliente y
+ * despues los marcos, que pueden venir partidos entre recepciones. El contenido
+ * de cada marco se junta en la sesion, salvo el de DATA que no se usa.
+ * Retorna el codigo de error de la conexion */
+int procesarEntradaH2(struct conexion * c) {
+	struct sesionH2 * s = c->h2;
+	unsigned char * p = (unsigned char *) c->entrada;
+	unsigned char * fin = p + c->lenEntrada;
+	int error = H2_SIN_ERROR;
+	c->lenEntrada = 0;
+	while (p < fin && error == H2_SIN_ERROR && c->estado != ESTADO_CERRADA) {
+		size_t m;
+		if (s->faltaPrefacio > 0) {
+			if (*p++ != (unsigned char) PREFACIO_H2[LEN_PREFACIO_H2 - s->faltaPrefacio]) return H2_ERROR_PROTOCOLO;
+			s->faltaPrefacio--;
+			continue;
+		}
+		if (s->lenEncabezado < LEN_ENCABEZADO_H2) {
+			m = LEN_ENCABEZADO_H2 - s->lenEncabezado;
+			if (m > (size_t) (fin - p)) m = fin - p;
+			memcpy(s->encabezado + s->lenEncabezado, p, m);
+			s->lenEncabezado += m;
+			p += m;
+			if (s->lenEncabezado < LEN_ENCABEZADO_H2) break;
+			s->largo = (s->encabezado[0] << 16) | (s->encabezado[1] << 8) | s->encabezado[2];
+			s->tipo = s->encabezado[3];
+			s->flags = s->encabezado[4];
+			s->idMarco = leer32H2(s->encabezado + 5) & 0x7fffffff;
+			s->lenCarga = 0;
+			if (s->largo > MAX_MARCO_H2) return H2_ERROR_TAM_MARCO;
+		} else {
+			m = s->largo - s->lenCarga;
+			if (m > (size_t) (fin - p)) m = fin - p;
+			if (s->tipo != H2_DATA) memcpy(s->carga + s->lenCarga, p, m);
+			s->lenCarga += m;
+			p += m;
+		}
+		if (s->lenEncabezado == LEN_ENCABEZADO_H2 && s->lenCarga == s->largo) {
+			s->lenEncabezado = 0;
+			error = procesarMarcoH2(c);
+		}
+	}
+	return error;
+}
+
+/* Recibe lo que mando el cliente en la entrada de la conexion HTTP/2.
+ * Retorna 1 si llego algo, 0 si hay que esperar y -1 si el cliente cerro o
+ * hubo un error */
+int recibirH2(struct conexion * c) {
+	if (motorUring) {
+		// Lo recibido llega con las operaciones terminadas (terminarOperacion),
+		// y se recibe a la vez que se manda
+		if (c->finLectura) return -1;
+		if (!c->h2->recibiendo) {
+			pedirRecepcion(c);
+			c->h2->recibiendo = 1;
+		}
+		return 0;
+	}
+	while (1) {
+		ssize_t n = recv(c->sock, c->entrada + c->lenEntrada, MAX_HEADERS - c->lenEntrada, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			log_error(ERROR_RECV_SOCKET);
+			return -1;
+		}
+		if (n == 0) return -1;
+		c->lenEntrada += n;
+		return 1;
+	}
+}
+
+/* Revisa si al stream le queda algo por pasar a marcos: su salida o el cuerpo */
+int pendienteH2(struct conexion * st) {
+	return st->enviados < st->lenSalida || (st->restante > 0 && (st->archivo >= 0 || st->cuerpo != NULL));
+}
+
+/* Revisa si el stream puede armar un marco ahora: el HEADERS siempre, los DATA
+ * mientras las ventanas del stream y de la conexion lo permitan */
+int puedeMandarH2(struct sesionH2 * s, struct conexion * st) {
+	if (!st->headersH2) return st->enviados < st->lenSalida;
+	return pendienteH2(st) && st->ventanaH2 > 0 && s->ventanaEnvio > 0;
+}
+
+/* Revisa si con lo que ya se paso a marcos termino la respuesta del stream */
+int respuestaTerminadaH2(struct conexion * st) {
+	return !pendienteH2(st) && (st->estado == ESTADO_ESCRIBIENDO_HEADERS || st->estado == ESTADO_ESCRIBIENDO_CUERPO) &&
+		(st->cantRangos < 2 || st->rangoActual >= st->cantRangos);
+}
+
+/* Elige el stream que arma el proximo marco: el de menor urgencia y, entre los
+ * de la misma, primero los que no son incrementales por orden de id (la lista
+ * esta en ese orden) y despues los incrementales, que se turnan */
+struct conexion * elegirStreamH2(struct sesionH2 * s) {
+	struct conexion * st, * mejor = NULL;
+	for (st = s->streams; st != NULL; st = st->sigStream) {
+		if (!puedeMandarH2(s, st)) continue;
+		if (mejor == NULL || st->urgencia < mejor->urgencia ||
+				(st->urgencia == mejor->urgencia && mejor->incremental && !st->incremental))
+			mejor = st;
+	}
+	return mejor;
+}
+
+/* Arma el proximo marco del stream en la salida de la conexion: el HEADERS (y
+ * sus CONTINUATION) con los headers de la respuesta pasados a HPACK, o un DATA
+ * con lo que sigue de la salida del stream o del cuerpo, hasta lo que permitan
+ * las ventanas. El ultimo marco de la respuesta lleva END_STREAM */
+void producirMarcoH2(struct conexion * c, struct conexion * st) {
+	struct sesionH2 * s = c->h2;
+	size_t pendiente = st->lenSalida - st->enviados;
+	unsigned char * marco;
+	int flags = 0;
+
+	if (!st->headersH2) {
+		char * inicio = st->salida + st->enviados;
+		char * finHeaders = memmem(inicio, pendiente, "\r\n\r\n", 4);
+		if (finHeaders == NULL || finHeaders - inicio > 2 * MAX_HEADERS) {
+			resetearStreamH2(st, H2_ERROR_INTERNO);
+			return;
+		}
+		// El bloque HPACK nunca ocupa mas del doble que los headers en texto
+		unsigned char * bloque = pedirArena(st, 2 * (finHeaders + 2 - inicio));
+		size_t len = armarBloqueH2(inicio, finHeaders + 2, bloque);
+		st->enviados += finHeaders + 4 - inicio;
+		st->headersH2 = 1;
+		if (respuestaTerminadaH2(st)) {
+			flags = H2_FIN_STREAM;
+			st->finH2 = 1;
+		}
+		// Lo que no entra en un marco sigue en CONTINUATION
+		size_t hecho = len < s->maxMarco ? len : s->maxMarco;
+		encolarMarcoH2(c, H2_HEADERS, flags | (hecho == len ? H2_FIN_HEADERS : 0), st->idStream, bloque, hecho);
+		while (hecho < len) {
+			size_t n = len - hecho < s->maxMarco ? len - hecho : s->maxMarco;
+			encolarMarcoH2(c, H2_CONTINUATION, hecho + n == len ? H2_FIN_HEADERS : 0, st->idStream, bloque + hecho, n);
+			hecho += n;
+		}
+		contarEnvio(st, len + LEN_ENCABEZADO_H2);
+		return;
+	}
+
+	long largo = s->maxMarco;
+	if (largo > st->ventanaH2) largo = st->ventanaH2;
+	if (largo > s->ventanaEnvio) largo = s->ventanaEnvio;
+	if (pendiente > 0) {
+		// Lo que el stream dejo en su salida (paginas de error, salida de PHP, partes)
+		if ((size_t) largo > pendiente) largo = pendiente;
+		marco = (unsigned char *) reservarSalida(c, LEN_ENCABEZADO_H2 + largo);
+		memcpy(marco + LEN_ENCABEZADO_H2, st->salida + st->enviados, largo);
+		st->enviados += largo;
+		if (st->enviados == st->lenSalida) st->lenSalida = st->enviados = 0;
+	} else {
+		// El cuerpo, desde memoria o leido del archivo
+		if (largo > st->restante) largo = st->restante;
+		marco = (unsigned char *) reservarSalida(c, LEN_ENCABEZADO_H2 + largo);
+		if (st->cuerpo != NULL) {
+			memcpy(marco + LEN_ENCABEZADO_H2, st->cuerpo + st->offset, largo);
+		} else {
+			ssize_t n = pread(st->archivo, marco + LEN_ENCABEZADO_H2, largo, st->offset);
+			if (n <= 0) {
+				// El archivo se achico: ya mande un Content-Length que no voy a cumplir
+				log_error(ERROR_ABRIR_ARCHIVO);
+				resetearStreamH2(st, H2_ERROR_INTERNO);
+				return;
+			}
+			largo = n;
+		}
+		if (st->inicioEnvio == 0) st->inicioEnvio = ahoraUs();
+		st->offset += largo;
+		st->restante -= largo;
+	}
+	st->ventanaH2 -= largo;
+	s->ventanaEnvio -= largo;
+	if (respuestaTerminadaH2(st)) {
+		flags = H2_FIN_STREAM;
+		st->finH2 = 1;
+	}
+	escribirEncabezadoH2(marco, largo, H2_DATA, flags, st->idStream);
+	c->lenSalida += LEN_ENCABEZADO_H2 + largo;
+	contarEnvio(st, LEN_ENCABEZADO_H2 + largo);
+	// Los incrementales se turnan de a un marco
+	if (st->incremental) pasarAlFinalH2(s, st);
+}
+
+/* Arma marcos de los streams segun su prioridad mientras el cliente vaya
+ * recibiendo (hasta MAX_PENDIENTE_H2 pendientes en la conexion), los manda y
+ * hace seguir a los streams que ya pasaron a marcos todo lo que tenian: los
+ * que terminan, los que siguen con otra parte y los que habian dejado de leer
+ * de php-cgi. Retorna -1 si la conexion se cerro */
+int programarH2(struct conexion * c) {
+	struct sesionH2 * s = c->h2;
+	struct conexion * st, * sig;
+	if (c->estado == ESTADO_CERRADA) return -1;
+	// Lo que encolen los streams mientras tanto lo arma esta misma vuelta
+	if (s->programando) return 0;
+	s->programando = 1;
+	while (1) {
+		int avance = 0;
+		while (c->lenSalida - c->enviados < MAX_PENDIENTE_H2 && (st = elegirStreamH2(s)) != NULL) {
+			producirMarcoH2(c, st);
+			avance = 1;
+		}
+		int vacia = enviarSalida(c);
+		if (vacia < 0) {
+			cerrarConexion(c);
+			return -1;
+		}
+		for (st = s->streams; st != NULL && c->estado != ESTADO_CERRADA; st = sig) {
+			sig = st->sigStream;
+			if ((st->estado == ESTADO_ESCRIBIENDO_HEADERS || st->estado == ESTADO_ESCRIBIENDO_CUERPO) &&
+					!pendienteH2(st)) {
+				manejarConexion(st);
+				avance = 1;
+			} else if (st->estado == ESTADO_PHP_EN_CURSO && st->frenadoH2 &&
+					st->lenSalida - st->enviados < MAX_PENDIENTE_PHP) {
+				st->frenadoH2 = 0;
+				leerPHP(st);
+				avance = 1;
+			}
+		}
+		if (c->estado == ESTADO_CERRADA) break;
+		// Si el cliente recibio todo, se sigue armando lo que haya
+		if (!avance && (!vacia || elegirStreamH2(s) == NULL)) break;
+	}
+	s->programando = 0;
+	return c->estado == ESTADO_CERRADA ? -1 : 0;
+}
+
+/* Envio de un stream: lo pendiente sale en marcos de su conexion cuando le toca.
+ * Retorna 1 si ya no le queda nada, 0 si falta y -1 si el stream o su conexion
+ * se cerraron */
+int enviarSalidaH2(struct conexion * c) {
+	if (programarH2(c->padre) < 0 || c->estado == ESTADO_CERRADA) return -1;
+	if (!pendienteH2(c)) return 1;
+	// leerPHP deja de leer: programarH2 lo retoma cuando salga lo pendiente
+	if (c->estado == ESTADO_PHP_EN_CURSO && c->lenSalida - c->enviados >= MAX_PENDIENTE_PHP)
+		c->frenadoH2 = 1;
+	return 0;
+}
+
+/* Termina la respuesta del stream con END_STREAM, si no salio con su ultimo marco */
+void terminarStreamH2(struct conexion * st) {
+	if (st->finH2) return;
+	st->finH2 = 1;
+	encolarMarcoH2(st->padre, H2_DATA, H2_FIN_STREAM, st->idStream, NULL, 0);
+}
+
+/* Revisa si algun stream esta esperando a php-cgi */
+int hayPHPEnCursoH2(struct sesionH2 * s) {
+	struct conexion * st;
+	for (st = s->streams; st != NULL; st = st->sigStream) {
+		if (st->estado == ESTADO_PHP_EN_CURSO || st->estado == ESTADO_ESPERANDO_PHP) return 1;
+	}
+	return 0;
+}
+
+/* Atiende una conexion HTTP/2: procesa todo lo que mando el cliente, arma y
+ * manda los marcos de las respuestas de una vez y ajusta el plazo de la conexion */
+void atenderH2(struct conexion * c) {
+	struct sesionH2 * s = c->h2;
+	int r, error;
+
+	// Despues del GOAWAY solo queda que salga
+	if (s->cerrando) {
+		if (enviarSalida(c) != 0) cerrarConexion(c);
+		return;
+	}
+
+	// Las respuestas de todo lo recibido salen juntas al final
+	s->programando = 1;
+	while (1) {
+		if (c->lenEntrada > 0) {
+			error = procesarEntradaH2(c);
+			if (c->estado == ESTADO_CERRADA) return;
+			if (error != H2_SIN_ERROR) {
+				s->programando = 0;
+				cerrarH2(c, error);
+				return;
+			}
+		}
+		r = recibirH2(c);
+		if (r < 0) {
+			cerrarConexion(c);
+			return;
+		}
+		if (r == 0) break;
+	}
+	s->programando = 0;
+	if (programarH2(c) < 0) return;
+
+	// Si el cliente aviso que se va, la conexion se cierra cuando termina lo que pidio
+	if (s->goaway && s->cantStreams == 0 && c->lenSalida == c->enviados) {
+		cerrarConexion(c);
+		return;
+	}
+
+	// Plazo de la conexion: el de escritura mientras el cliente tiene algo por
+	// recibir (o no da ventana), ninguno mientras corren scripts PHP (tienen el
+	// suyo) y, sin streams, el de un marco a medio llegar o el de conexion ociosa
+	int fase = PLAZO_OCIOSA;
+	if (c->lenSalida > c->enviados)
+		fase = PLAZO_ESCRITURA;
+	else if (s->cantStreams > 0)
+		fase = hayPHPEnCursoH2(s) ? -1 : PLAZO_ESCRITURA;
+	else if (s->lenEncabezado > 0 || s->continuacion || s->faltaPrefacio > 0)
+		fase = PLAZO_PEDIDO;
+	if (fase < 0)
+		cancelarPlazo(c);
+	else if (fase == PLAZO_OCIOSA || c->ranuraPlazo == NULL || c->fasePlazo != fase)
+		armarPlazo(c, fase);
+}
+
+/* Libera el estado HTTP/2 de una conexion (sus streams ya se cerraron) */
+void liberarSesionH2(struct sesionH2 * s) {
+	while (s->tabla.cantidad > 0) sacarCampoHPACK(&s->tabla);
+	free(s->bloque);
+	free(s);
+}
+
+/* Revisa si el valor de un header (hasta el fin de linea) contiene el token dado */
+int headerContiene(char * valor, const char * token) {
+	size_t n = strlen(token);
+	if (valor == NULL) return 0;
+	for (; *valor && *valor != '\r' && *valor != '\n'; valor++) {
+		if (strncasecmp(valor, token, n) == 0) return 1;
+	}
+	return 0;
+}
+
+/* Metodo principal que se encarga de atender un pedido ya leido de una conexion */
+void atenderPedido(struct conexion * c) {
+    // Analizo el mensaje: la primera linea (metodo, ruta y protocolo) y los headers
+    int r = parsearPedido(c->entrada, c->finPedido, &c->pedido);
+	c->pedidos++;
+	c->inicioPedido = ahoraMs();
+	medirLatencia(&misMetricas->analisisPedido, ahoraUs() - c->llegada);
+	
+    if (r == -2) {
+		// Mandaron mas headers de los que se pueden analizar
+		c->keepAlive = 0;
+		mandarRechazo(c,RECHAZO_431_CANTIDAD);
+		return;
+	} else if (r < 0) {
+		// Me mandaron mal la request (alguno de los elementos del primer renglon es vacio o no hay ':' en un header)
+		c->keepAlive = 0;
+		c->pedido.metodo.len = 0;
+		mandarRechazo(c,RECHAZO_400);
+		return;
+	}
+	
+	char * tipoMsg = c->pedido.metodo.ptr;
+	char * ruta = c->pedido.ruta.ptr;
+	char * protocolo = c->pedido.protocolo.ptr;
+	char * connection = buscarHeader(&c->pedido, "Connection");
+	char * contentLength = buscarHeader(&c->pedido, "Content-Length");
+	char * transferEncoding = buscarHeader(&c->pedido, "Transfer-Encoding");
+	
+	// El prefacio de HTTP/2 sin Upgrade (prior knowledge) empieza como un pedido
+	// "PRI * HTTP/2.0"; le falta "SM" y otra linea vacia
+	if (c->pedidos == 1 && c->padre == NULL && strcmp(tipoMsg, "PRI") == 0 && strcmp(ruta, "*") == 0 &&
+			strcmp(protocolo, "HTTP/2.0") == 0) {
+		iniciarSesionH2(c, 6);
+		descartarPedido(c);
+		return;
+	}
+	
+	// En HTTP/1.1 la conexion sigue abierta salvo que pidan cerrarla,
+	// en HTTP/1.0 solo si la piden explicitamente
+	if (strcmp(protocolo, "HTTP/1.1") == 0) {
+		c->keepAlive = !headerContiene(connection, "close");
+	} else {
+		c->keepAlive = headerContiene(connection, "keep-alive");
+	}
+	// No leo cuerpos de pedidos, asi que si mandaron uno no se donde empieza el siguiente
+	if ((contentLength != NULL && atol(contentLength) > 0) || transferEncoding != NULL)
+		c->keepAlive = 0;
+	if (config.keepAlive == 0 || c->pedidos >= config.maxPedidos)
+		c->keepAlive = 0;
+	
+	// Un cliente HTTP/1.1 puede pasar a HTTP/2 (h2c) con este mismo pedido
+	if (c->keepAlive && headerContiene(buscarHeader(&c->pedido, "Upgrade"), "h2c") && pasarAH2(c))
+		return;
+	
+	// De aca en adelante se trabaja con la ruta canonica (el pedido queda como vino,
+	// para REQUEST_URI y el registro de accesos)
+	char * parametros;
+	char * canonica = pedirArena(c, c->pedido.ruta.len + 1);
+	if (normalizarRuta(ruta, c->pedido.ruta.len, canonica, &parametros) < 0) {
+		mandarRechazo(c,RECHAZO_400);
+		return;
+	}
+	ruta = canonica;
+	
+	// Las metricas del servidor no son un archivo
+	if (config.rutaEstado != NULL && esGet(tipoMsg) && strcmp(ruta, config.rutaEstado) == 0) {
+		mandarEstado(c);
+		return;
+	}
+	
+	// Una pasada por el arbol de rutas decide que archivo (o script) atiende el pedido
+	char * resto;
+	struct regla * regla = buscarRegla(ruta, &resto);
+	if (regla == NULL) {
+		mandarRechazo(c,RECHAZO_404);
+		return;
+	}
+	if (regla->accion == RUTA_REDIRECCION) {
+		mandarRedireccion(c, regla->destino, resto, parametros);
+		return;
+	}
+	char * archivo = resolverRuta(c, regla, ruta, resto);
+	
+	if (archivo == NULL) {
+		// Es un directorio sin indice
+		mandarRechazo(c,RECHAZO_404);
+		return;
+	}
+	
+	// Me mandaron un request que "puedo entender"
+	// Trato de interpretarlo y trabajarlo
+	if (esGet(tipoMsg)) {	
+		// Lo que esta en el paquete se manda directo del mapa, sin tocar el sistema de archivos
+		struct archivoCache * e = buscarPaquete(archivo);
+		if (e == NULL) e = buscarCache(archivo);
+		if (e != NULL) {
+			// Ya lo tengo abierto y con los headers armados
+			mandarEntradaCache(c,e);
+		} else {
+			// El tipo sale de su extension. Si no esta o no se puede abrir lo dice
+			// el errno del open: 404 o 403
+			char extension[MAX_EXTENSION];
+			char * tipoCont;
+			extensionArchivo(archivo, extension, sizeof(extension));
+			if (strcmp(extension, "php") == 0) {
+				// es PHP: el script lo abre php-cgi, asi que solo miro que se pueda leer
+				if (access(archivo, R_OK) == 0)
+					atenderPHP(c,archivo,parametros);
+				else
+					mandarRechazo(c,rechazoApertura(errno));
+			} else if ((tipoCont = buscarMIME(extension)) != NULL) {
+				mandarArchivo(c,archivo,tipoCont);
+			} else {
+				// No es un tipo valido (extension desconocida): si existe el archivo, 403.
+				// Un directorio pedido sin la barra final se redirige a la ruta con barra
+				struct stat st;
+				if (stat(archivo, &st) < 0) {
+					mandarRechazo(c,rechazoApertura(errno));
+				} else if (S_ISDIR(st.st_mode) && regla->accion != RUTA_PHP) {
+					char * conBarra = pedirArena(c, strlen(ruta) + 2);
+					sprintf(conBarra, "%s/", ruta);
+					mandarRedireccion(c, "", conBarra, parametros);
+				} else {
+					mandarRechazo(c,RECHAZO_403);
+				}
+			}
+		}
+	} else {
+		// Metodo no permitido, mando Error 501
+		mandarRechazo(c,RECHAZO_501);
+	}
 }
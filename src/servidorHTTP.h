@@ -14,23 +14,777 @@
 #define ERROR_UNEXPECTED_END "El servidor finalizo de manera inesperada \n"
 #define ERROR_IP_PORT "La IP o el puerto ingresado es invalido \n"
 #define ERROR_INPUT_DATOS "Error en el ingreso de datos \n"
+#define ERROR_EPOLL "Error en el manejo de eventos (epoll) \n"
+#define ERROR_WORKER "Un worker finalizo de manera inesperada, se reinicia \n"
+#define ERROR_AFINIDAD "Error al fijar el worker a un CPU \n"
+#define ERROR_PHP "Error al comunicarse con php-cgi (FastCGI) \n"
+#define ERROR_MIME "Error al leer el archivo de tipos de contenido \n"
+#define ERROR_METRICAS "Error al reservar la memoria de las metricas \n"
+#define ERROR_REGISTRO "Error al iniciar el registro de accesos \n"
+#define ERROR_URING "No se pudo iniciar io_uring, se usa epoll \n"
+#define ERROR_ENTER_URING "Error en el manejo de eventos (io_uring) \n"
+#define ERROR_INOTIFY "Error al vigilar el directorio, se trabaja sin cache de archivos \n"
+#define ERROR_PAQUETE "El paquete de documentos no es valido \n"
+#define ERROR_RUTAS "Error en el archivo de rutas \n"
 
 // Mensajes de respuesta HTTP https://www.w3.org/Protocols/rfc2616/rfc2616-sec10.html
-#define RTA_200 "HTTP/1.0 200 OK \n"
-#define RTA_400 "HTTP/1.0 400 Bad Request \n"
-#define RTA_403 "HTTP/1.0 403 Forbidden \n"
-#define RTA_404 "HTTP/1.0 404 Not Found \n"
-#define RTA_501 "HTTP/1.0 501 Not Implemented \n"
+#define RTA_200 "HTTP/1.1 200 OK\r\n"
+#define RTA_206 "HTTP/1.1 206 Partial Content\r\n"
+#define RTA_301 "HTTP/1.1 301 Moved Permanently\r\n"
+#define RTA_302 "HTTP/1.1 302 Found\r\n"
+#define RTA_304 "HTTP/1.1 304 Not Modified\r\n"
+#define RTA_400 "HTTP/1.1 400 Bad Request\r\n"
+#define RTA_403 "HTTP/1.1 403 Forbidden\r\n"
+#define RTA_404 "HTTP/1.1 404 Not Found\r\n"
+#define RTA_413 "HTTP/1.1 413 Content Too Large\r\n"
+#define RTA_416 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+#define RTA_431 "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+#define RTA_500 "HTTP/1.1 500 Internal Server Error\r\n"
+#define RTA_501 "HTTP/1.1 501 Not Implemented\r\n"
+#define RTA_503 "HTTP/1.1 503 Service Unavailable\r\n"
+#define RTA_504 "HTTP/1.1 504 Gateway Timeout\r\n"
+
+// Paginas de error armadas al arrancar (indices de rechazos)
+#define RECHAZO_400 0
+#define RECHAZO_403 1
+#define RECHAZO_404 2
+#define RECHAZO_431 3
+#define RECHAZO_431_CANTIDAD 4
+#define RECHAZO_500 5
+#define RECHAZO_501 6
+#define RECHAZO_503 7
+#define RECHAZO_413 8
+#define RECHAZO_504 9
+#define CANT_RECHAZOS 10
 
 // Tipos de Contenido usados en el proyecto
-#define CT_HTML "Content-type: text/html \n\n"
-#define CT_JPG "Content-type: image/jpeg \n\n"
-#define CT_PNG "Content-type: image/png \n\n"
-#define CT_GIF "Content-type: image/gif \n\n"
+// (el bloque de headers lo termina terminarHeaders, con el largo del cuerpo)
+#define CT_HTML "Content-Type: text/html\r\n"
+#define CT_METRICAS "Content-Type: text/plain; version=0.0.4\r\n"
+
+// Estados de la maquina de estados de cada conexion
+#define ESTADO_LEYENDO_PEDIDO 0			// Esperando el pedido completo (hasta dos enters seguidos)
+#define ESTADO_ESCRIBIENDO_HEADERS 1	// Mandando lo encolado en el buffer de salida
+#define ESTADO_ESCRIBIENDO_CUERPO 2		// Mandando el contenido de un archivo estatico (sendfile)
+#define ESTADO_PHP_EN_CURSO 3			// Esperando la respuesta de php-cgi (FastCGI)
+#define ESTADO_CERRADA 4				// Cerrada, pendiente de liberar al final de la vuelta del bucle
+#define ESTADO_ESPERANDO_PHP 5			// Esperando la respuesta PHP que otra conexion va a guardar en la cache
+#define ESTADO_H2 6						// Conexion HTTP/2: cada pedido lo atiende un stream (conexion hija)
+
+// Tipos de fuentes de eventos registradas en epoll
+#define FUENTE_ESCUCHA 0
+#define FUENTE_SOCKET 1
+#define FUENTE_PHP 2
+#define FUENTE_INOTIFY 3
+
+// Protocolo FastCGI (tipos de registro y rol)
+#define FCGI_VERSION 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_RESPONDER 1
+#define MAX_PARAMS_FCGI 16384		// Tamaño maximo de las variables CGI de un pedido
+#define MAX_PENDIENTE_PHP (256 * 1024)	// Salida de PHP pendiente de mandar que frena la lectura
+#define MAX_ESPERA_PHP 60				// Segundos maximos antes de relanzar un php-cgi que no arranca
+
+// Cache de respuestas PHP
+#define TAM_TABLA_PHP 1024				// Baldes de la tabla de hash (potencia de 2)
+#define MAX_RESPUESTAS_PHP 1024			// Cantidad maxima de respuestas guardadas por worker
+#define MAX_RESPUESTA_PHP (1024 * 1024)	// Tamaño maximo del cuerpo de una respuesta guardada
+#define RESPUESTA_EN_CURSO 0			// Una conexion la esta generando
+#define RESPUESTA_LISTA 1				// Guardada hasta que venza
+#define RESPUESTA_PASAR 2				// No se puede guardar: los pedidos van directo a php-cgi hasta que venza
+
+// Registro (log) asincronico de cada worker
+#define CAP_REGISTRO 1024				// Entradas del anillo (potencia de 2)
+#define TAM_ENTRADA_REGISTRO 1024		// Largo maximo de una entrada
+#define TAM_LOTE_REGISTRO 65536			// Lo que se escribe de una vez en el archivo de accesos
+#define INTERVALO_REGISTRO 100			// Cada cuanto (ms) se vacia el registro
+#define REGISTRO_ACCESOS 0
+#define REGISTRO_ERRORES 1
+#define FORMATO_COMMON 0
+#define FORMATO_COMBINED 1
+#define FORMATO_JSON 2
+
+// Motor io_uring (-u)
+#define ENTRADAS_URING 4096				// Lugares de la cola de operaciones
+#define CANT_BUFFERS_URING 1024			// Buffers para recibir (potencia de 2)
+#define TAM_BUFFER_URING 4096
+#define GRUPO_BUFFERS_URING 0
+#define TAM_LECTURA_URING 65536			// Lo que se lee del archivo en cada operacion
+#define OP_ACEPTAR 1					// Operaciones, en los 3 bits bajos de user_data
+#define OP_EPOLL 2
+#define OP_RECIBIR 3
+#define OP_ENVIAR 4
+#define OP_CUERPO 5
+#define OP_LEER_ARCHIVO 6
+#define OP_ENVIAR_ARCHIVO 7
+#define MASCARA_OP 7
+#define POLL_ESCUCHA 8					// Con OP_ACEPTAR: espera conexiones con el accept en pausa
+
+// Metricas de los workers
+#define CANT_STATUS 500					// Status contados (100 a 599)
+#define SUB_BUCKETS 4					// Buckets por potencia de 2 de los histogramas (potencia de 2)
+#define CANT_BUCKETS 100				// Buckets de los histogramas (hasta ~67 s, en microsegundos)
+#define LINEA_METRICAS 256				// Tope del largo de cada linea de /server-status
+
+// Tabla de tipos de contenido por extension
+#define TAM_TABLA_MIME 512				// Baldes de la tabla de hash (potencia de 2)
+#define MAX_EXTENSION 16				// Largo maximo de una extension (con el '\0')
+
+// Rutas (-R): que se hace con los pedidos de cada prefijo
+#define RUTA_RAIZ 0						// Archivos de un directorio, con la ruta entera del pedido
+#define RUTA_ALIAS 1					// Archivos de un directorio, con la ruta sin el prefijo
+#define RUTA_PHP 2						// Todos los pedidos van a un script PHP
+#define RUTA_REDIRECCION 3				// 301 a otra URL, con el resto de la ruta
+#define CANT_INDICES 3					// Archivos que pueden ser el indice de un directorio
+#define TAM_TABLA_INDICES 256			// Baldes de la tabla de indices (potencia de 2)
+#define MAX_INDICES 4096				// Directorios con el indice resuelto por worker
+#define TAM_TABLA_VIGILADOS 256			// Baldes de la tabla de directorios vigilados, por wd (potencia de 2)
+
+// Cantidad maxima de rangos de un pedido con Range (con mas se manda el archivo entero)
+#define MAX_RANGOS 16
+
+// Formato de las fechas de HTTP (IMF-fixdate, siempre en GMT)
+#define FORMATO_FECHA_HTTP "%a, %d %b %Y %H:%M:%S GMT"
+
+// Codificaciones de contenido (Content-Encoding), en orden de preferencia
+#define COD_BR 0
+#define COD_GZIP 1
+#define CANT_CODIFICACIONES 2
+
+// Limites para comprimir al vuelo (los mas chicos no ganan nada, los mas grandes frenan al worker)
+#define MIN_COMPRIMIR 256
+#define MAX_COMPRIMIR (4 * 1024 * 1024)
+
+// Cambios que invalidan un archivo de la cache
+#define MASCARA_INOTIFY (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Paquete de documentos (-D)
+#define MAGIA_PAQUETE "SRVPAQ1"			// Con la version del formato
+#define ALINEACION_PAQUETE 4096			// Los cuerpos empiezan en una pagina
+
+// Plazos de las conexiones, en una rueda de dos niveles
+#define PLAZO_PEDIDO 0					// Recibir los headers del pedido
+#define PLAZO_OCIOSA 1					// Esperar otro pedido (keep-alive)
+#define PLAZO_ESCRITURA 2				// Mandar la respuesta sin que el cliente deje de leer
+#define PLAZO_PHP 3						// Ejecucion del script (o espera de la misma respuesta)
+#define CANT_PLAZOS 4
+#define TICK_RUEDA 32					// Milisegundos de cada ranura del primer nivel
+#define BITS_RUEDA 8
+#define RANURAS_RUEDA (1 << BITS_RUEDA)	// Ranuras del primer nivel (~8 s)
+#define RANURAS_RUEDA2 64				// Ranuras del segundo nivel, de una vuelta del primero (~9 min)
+
+// HTTP/2 sin TLS (h2c), RFC 9113
+#define PREFACIO_H2 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define LEN_PREFACIO_H2 24
+#define LEN_ENCABEZADO_H2 9				// Encabezado de cada marco
+#define H2_DATA 0x0						// Tipos de marco
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+#define H2_PRIORITY_UPDATE 0x10			// RFC 9218
+#define H2_FIN_STREAM 0x1				// Flags de los marcos
+#define H2_ACK 0x1
+#define H2_FIN_HEADERS 0x4
+#define H2_RELLENO 0x8
+#define H2_PRIORIDAD 0x20
+#define H2_SET_TABLA 0x1				// Parametros de SETTINGS
+#define H2_SET_PUSH 0x2
+#define H2_SET_STREAMS 0x3
+#define H2_SET_VENTANA 0x4
+#define H2_SET_MARCO 0x5
+#define H2_SET_HEADERS 0x6
+#define H2_SIN_ERROR 0x0				// Codigos de error de RST_STREAM y GOAWAY
+#define H2_ERROR_PROTOCOLO 0x1
+#define H2_ERROR_INTERNO 0x2
+#define H2_ERROR_CONTROL_FLUJO 0x3
+#define H2_ERROR_TAM_MARCO 0x6
+#define H2_ERROR_RECHAZADO 0x7
+#define H2_ERROR_COMPRESION 0x9
+#define H2_ERROR_CALMA 0xb
+#define MAX_MARCO_H2 16384				// Contenido maximo de un marco recibido (SETTINGS_MAX_FRAME_SIZE)
+#define MAX_BLOQUE_H2 65536				// Tamaño maximo de un bloque de headers (HPACK) recibido
+#define MAX_STREAMS_H2 100				// Streams abiertos a la vez por conexion
+#define VENTANA_H2 65535				// Ventana inicial de control de flujo
+#define MAX_VENTANA_H2 0x7fffffffL
+#define MAX_PENDIENTE_H2 (128 * 1024)	// Salida pendiente de la conexion que frena el armado de marcos
+#define URGENCIA_H2 3					// Prioridad de un stream sin header priority (RFC 9218)
+#define CANT_URGENCIAS_H2 8
+#define TAM_TABLA_HPACK 4096			// Tamaño maximo de la tabla dinamica del decodificador
+#define MAX_CAMPOS_HPACK (TAM_TABLA_HPACK / 32)	// Entradas que entran en ella (potencia de 2)
+#define CANT_ESTATICA_HPACK 61			// Entradas de la tabla estatica
+#define MAX_LARGO_HUFFMAN 30			// Largo del codigo Huffman mas largo (EOS)
+
+// Parametros del bucle de eventos
+#define MAX_EVENTOS 256
+#define TAM_BLOQUE 16384
+
+// Arenas de los pedidos
+#define TAM_ARENA 16384				// Memoria de un pedido (headers de php-cgi, rutas, claves)
+#define ALINEACION_ARENA 16
+#define MAX_ARENAS_LIBRES 256		// Arenas que se guardan para reusar
+
+// Limites de un pedido
+#define MAX_HEADERS 8192			// Tamaño maximo de la primera linea mas los headers
+#define MAX_CANT_HEADERS 64			// Cantidad maxima de headers
 
 #ifndef SERVIDORHTTP_H_   /* Include guard */
 #define SERVIDORHTTP_H_
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+
+struct conexion;
+
+/** segmento:
+ * Porcion de un buffer (puntero y largo), sin copia. Los segmentos de un pedido
+ * ademas quedan terminados en '\0' para poder usarlos como string.
+ * */
+struct segmento {
+	char * ptr;
+	size_t len;
+};
+
+/** header:
+ * Un header de un pedido, como segmentos del buffer de entrada.
+ * */
+struct header {
+	struct segmento nombre;
+	struct segmento valor;
+};
+
+/** pedido:
+ * Resultado del analisis de un pedido: la primera linea y los headers,
+ * todos apuntando al buffer de entrada de la conexion.
+ * */
+struct pedido {
+	struct segmento metodo;
+	struct segmento ruta;
+	struct segmento protocolo;
+	struct header headers[MAX_CANT_HEADERS];
+	int cantHeaders;
+};
+
+/** configuracion:
+ * Opciones del servidor, cargadas a partir de los argumentos del programa.
+ * */
+struct configuracion {
+	int workers;		// Cantidad de procesos worker (uno por CPU por defecto)
+	int backlog;		// Largo de la cola de listen() de cada worker
+	int diferirAceptar;	// Segundos que el kernel espera el pedido antes de entregar la conexion (0: no espera)
+	int colaFastOpen;	// Conexiones TCP Fast Open pendientes por socket de escucha (0: sin Fast Open)
+	int fijarCPU;		// 1 si cada worker se fija a un CPU distinto
+	int keepAlive;		// Segundos que una conexion keep-alive espera otro pedido (0: sin keep-alive)
+	int plazoPedido;	// Segundos para recibir los headers de un pedido (0: sin limite)
+	int plazoEscritura;	// Segundos sin poder mandarle nada al cliente (0: sin limite)
+	int plazoPHP;		// Segundos de ejecucion de un script PHP (0: sin limite)
+	int maxPedidos;		// Cantidad maxima de pedidos atendidos por conexion
+	int maxCache;		// Cantidad maxima de archivos abiertos en la cache de cada worker (0: sin cache)
+	size_t memCompresion;	// Bytes de cada worker para variantes comprimidas al vuelo (0: no se comprime)
+	int phpProcesos;	// Cantidad de procesos php-cgi del pool FastCGI (0 sin PHP)
+	int phpMaxPedidos;	// Pedidos que atiende cada php-cgi antes de reiniciarse
+	int ttlPHP;			// Segundos que se guardan las respuestas PHP sin Cache-Control (0: sin cache)
+	char * destinoAccesos;	// Archivo del registro de accesos, "syslog" o NULL (sin registro)
+	int formatoAccesos;	// FORMATO_COMMON, FORMATO_COMBINED o FORMATO_JSON
+	int muestreo;		// Se registra 1 de cada tantos accesos
+	int maxErrores;		// Errores por segundo que registra cada worker (el resto se descarta)
+	char * rutaEstado;	// Ruta de las metricas (NULL: no se publican)
+	int uring;			// 1 para usar io_uring en vez de epoll (si el kernel lo permite)
+	char * paquete;		// Paquete de documentos armado con empaquetar (NULL: sin paquete)
+};
+
+/** anilloUring:
+ * Colas de io_uring del worker, mapeadas del kernel: la de operaciones (SQ), la
+ * de operaciones terminadas (CQ) y el anillo de buffers para recibir.
+ * */
+struct anilloUring {
+	int fd;
+	unsigned * sqCabeza;				// Hasta donde el kernel tomo operaciones
+	unsigned * sqCola;					// Hasta donde se le pasaron operaciones
+	unsigned sqMascara;
+	unsigned sqEntradas;
+	unsigned colaSQ;					// Hasta donde hay operaciones encoladas
+	struct io_uring_sqe * sqes;
+	unsigned * cqCabeza;
+	unsigned * cqCola;
+	unsigned cqMascara;
+	struct io_uring_cqe * cqes;
+	struct io_uring_buf_ring * buffers;	// Anillo de buffers para recibir
+	char * memBuffers;
+	unsigned short colaBuffers;
+};
+
+/** histograma:
+ * Latencias en microsegundos, en buckets log-lineales (ver bucketLatencia).
+ * */
+struct histograma {
+	_Atomic unsigned long buckets[CANT_BUCKETS];
+	_Atomic unsigned long cantidad;
+	_Atomic unsigned long suma;			// Suma de las latencias (us)
+};
+
+/** metricasWorker:
+ * Metricas de un worker, en memoria compartida con los demas procesos. Solo
+ * las escribe su worker; cualquiera las lee para sumarlas.
+ * */
+struct metricasWorker {
+	_Atomic unsigned long respuestas[CANT_STATUS];	// Respuestas por status (desde 100)
+	_Atomic unsigned long bytesEnviados;
+	_Atomic unsigned long conexiones;			// Conexiones abiertas
+	_Atomic unsigned long phpActivos;			// Pedidos en curso en php-cgi
+	_Atomic unsigned long plazosVencidos[CANT_PLAZOS];	// Conexiones cerradas por plazo, por fase
+	struct histograma primerByte;		// Aceptada (o pedido recibido) hasta el primer byte
+	struct histograma analisisPedido;	// Pedido recibido hasta headers analizados
+	struct histograma envioArchivo;		// Envio del cuerpo de un archivo estatico
+	struct histograma ejecucionPHP;		// Pedido a php-cgi hasta que termina
+} __attribute__((aligned(64)));			// Cada worker en sus propias lineas de cache
+
+/** entradaRegistro:
+ * Una linea del registro asincronico.
+ * */
+struct entradaRegistro {
+	int destino;					// REGISTRO_ACCESOS o REGISTRO_ERRORES
+	int prioridad;					// Prioridad de syslog
+	size_t len;
+	char texto[TAM_ENTRADA_REGISTRO];
+};
+
+/** registro:
+ * Anillo de entradas del registro de un worker. Lo llena el bucle de eventos y lo
+ * vacia un hilo aparte; como cada indice lo escribe uno solo, no necesita locks.
+ * */
+struct registro {
+	struct entradaRegistro entradas[CAP_REGISTRO];
+	_Atomic unsigned long cabeza;	// Proxima entrada a llenar (bucle de eventos)
+	_Atomic unsigned long cola;		// Proxima entrada a escribir (hilo)
+	_Atomic unsigned long descartadas;	// Entradas perdidas por anillo lleno o limite de errores
+};
+
+/** respuestaPHP:
+ * Respuesta PHP guardada en la cache de respuestas del worker, por script,
+ * parametros y los headers configurados con -v.
+ * */
+struct respuestaPHP {
+	char * clave;
+	unsigned int hash;
+	int estado;						// RESPUESTA_*
+	long long vence;				// Hasta cuando vale (ms)
+	char * cabecera;				// Linea de estado y headers del script (sin largo ni conexion)
+	size_t lenCabecera;
+	char * cuerpo;
+	size_t lenCuerpo;
+	size_t capCuerpo;
+	struct conexion * esperando;	// Conexiones esperando que este lista
+	struct respuestaPHP * sigHash;
+};
+
+/** paramsFCGI:
+ * Variables CGI de un pedido codificadas como pares nombre-valor de FastCGI.
+ * */
+struct paramsFCGI {
+	char datos[MAX_PARAMS_FCGI];
+	size_t len;
+	int desbordado;				// 1 si alguna variable no entro
+};
+
+/** rechazo:
+ * Pagina de error: su status, titulo y mensaje, y la respuesta completa ya armada
+ * sin keep-alive (0) y con keep-alive (1).
+ * */
+struct rechazo {
+	char * tipoResp;				// Linea de status (RTA_*)
+	char * titulo;
+	char * mensaje;
+	int status;
+	char * respuesta[2];
+	size_t len[2];
+};
+
+/** tipoMIME:
+ * Tipo de contenido de una extension, en la tabla de tipos.
+ * */
+struct tipoMIME {
+	char * extension;				// En minusculas, sin el punto
+	char * header;					// Header Content-Type ya armado
+	struct tipoMIME * sig;
+};
+
+/** regla:
+ * Que se hace con los pedidos cuya ruta empieza con un prefijo.
+ * */
+struct regla {
+	char * prefijo;
+	int accion;						// RUTA_RAIZ, RUTA_ALIAS, RUTA_PHP o RUTA_REDIRECCION
+	char * destino;					// Directorio (con la barra final, "" el del servidor), script o URL
+};
+
+/** nodoRutas:
+ * Nodo del arbol de prefijos (radix) de las reglas. Cada arista lleva un
+ * pedazo de prefijo, y los hijos de un nodo empiezan con letras distintas.
+ * */
+struct nodoRutas {
+	const char * etiqueta;			// Pedazo de prefijo de la arista que llega al nodo
+	size_t lenEtiqueta;
+	struct regla * regla;			// La del prefijo que termina en el nodo, o NULL
+	struct nodoRutas * hijo;
+	struct nodoRutas * hermano;
+};
+
+/** indiceDirectorio:
+ * Indice ya resuelto de un directorio, hasta que inotify avise que cambio.
+ * */
+struct indiceDirectorio {
+	char * directorio;				// Con la barra final ("" es el directorio del servidor)
+	unsigned int hash;
+	int indice;						// Posicion en nombresIndice, -1 si no tiene
+	struct directorioVigilado * vigilado;	// Vigilancia de inotify del directorio
+	struct indiceDirectorio * sig;
+	struct indiceDirectorio * sigVigilado;	// Siguiente indice con la misma vigilancia
+};
+
+/** directorioVigilado:
+ * Directorio vigilado con inotify (uno por wd), con lo que depende de el: las
+ * entradas de la cache de sus archivos y los indices resueltos. Cuando nada lo
+ * usa se deja de vigilar.
+ * */
+struct directorioVigilado {
+	int wd;
+	int usos;						// Entradas de la cache, indices y paquete que lo usan
+	struct archivoCache * archivos;	// Entradas de la cache de sus archivos
+	struct indiceDirectorio * indices;	// Indices resueltos con esta vigilancia
+	struct directorioVigilado * sig;	// Siguiente en el balde de la tabla por wd
+};
+
+/** rango:
+ * Parte de un archivo pedida con Range.
+ * */
+struct rango {
+	off_t desde;
+	off_t largo;
+};
+
+/** variante:
+ * Version comprimida de un archivo de la cache: un hermano ya comprimido en el
+ * disco (archivo.gz, archivo.br) o el archivo comprimido al vuelo en memoria.
+ * */
+struct variante {
+	int fd;							// Hermano ya comprimido, -1 si no hay
+	char * datos;					// Comprimido en memoria, NULL si no hay
+	off_t size;
+	char headers[384];				// Status, Content-Type, Content-Encoding, Vary, validadores y Content-Length
+	size_t lenHeaders;
+	char etag[64];					// ETag propio de esta codificacion
+	int intentada;					// 1 si ya se busco o se intento comprimir
+};
+
+/** archivoCache:
+ * Archivo estatico abierto, con sus datos y sus headers ya armados. Cada worker
+ * guarda los mas usados en una cache por ruta, de forma que servirlos no requiere
+ * ni stat ni open. Se invalida con los avisos de inotify de su directorio.
+ * */
+struct archivoCache {
+	char * ruta;					// Clave de la cache
+	unsigned int hash;
+	int fd;							// Descriptor abierto (compartido por las conexiones)
+	off_t size;
+	time_t mtime;
+	ino_t inodo;
+	char * tipoCont;				// Header Content-Type (de la tabla de tipos)
+	char headers[320];				// Status, Content-Type, validadores y Content-Length ya armados
+	size_t lenHeaders;
+	char etag[48];					// ETag (entre comillas, con W/ si es debil) de inodo, size y mtime
+	char ultimaModificacion[32];	// Valor de Last-Modified
+	int comprimible;				// 1 si el tipo de contenido vale la pena comprimirlo
+	struct variante variantes[CANT_CODIFICACIONES];
+	struct directorioVigilado * vigilado;	// Vigilancia de su directorio, NULL si no esta en la cache
+	char * nombre;					// Nombre del archivo dentro de su directorio
+	int enCache;					// 1 si esta en la tabla (si no, vive solo mientras se use)
+	int referencias;				// La de la cache mas una por cada conexion que lo manda
+	char * datos;					// Contenido en memoria (de un paquete), NULL si se manda de fd
+	struct paquete * paquete;		// Paquete del que sale, NULL si es un archivo abierto
+	struct archivoCache * sigHash;
+	struct archivoCache * antLRU;
+	struct archivoCache * sigLRU;
+	struct archivoCache * antVigilado;	// Entradas de la cache del mismo directorio
+	struct archivoCache * sigVigilado;
+};
+
+/** cabeceraPaquete:
+ * Comienzo de un paquete de documentos: un solo archivo con los archivos
+ * estaticos de un directorio, sus headers ya armados y sus variantes
+ * comprimidas, que el servidor mapea en memoria. Los numeros quedan en el
+ * orden de bytes de la maquina que lo armo.
+ * */
+struct cabeceraPaquete {
+	char magia[8];					// MAGIA_PAQUETE
+	uint32_t cantArchivos;
+	uint32_t tamTabla;				// Baldes de la tabla de hash (potencia de 2)
+	uint64_t offsetArchivos;		// struct archivoPaquete[cantArchivos]
+	uint64_t offsetTabla;			// uint32_t[tamTabla]: indice del archivo + 1, 0 si esta libre
+	uint64_t tam;					// Tamaño del paquete entero
+};
+
+/** variantePaquete:
+ * Version comprimida de un archivo del paquete (lenHeaders 0 si no hay).
+ * */
+struct variantePaquete {
+	uint64_t offset;				// Del cuerpo, desde el comienzo del paquete
+	uint64_t size;
+	uint32_t lenHeaders;
+	char headers[384];
+	char etag[64];
+};
+
+/** archivoPaquete:
+ * Un archivo del paquete, con lo mismo que se arma para la cache.
+ * */
+struct archivoPaquete {
+	uint64_t offsetRuta;			// Ruta relativa al directorio, terminada en '\0'
+	uint64_t offset;				// Del cuerpo (alineado a ALINEACION_PAQUETE)
+	uint64_t size;
+	int64_t mtime;					// Para If-Modified-Since
+	uint32_t hash;					// hashRuta de la ruta
+	uint32_t comprimible;
+	uint32_t lenHeaders;
+	char tipoCont[128];				// Header Content-Type
+	char headers[320];
+	char etag[48];					// ETag del contenido
+	char ultimaModificacion[32];
+	struct variantePaquete variantes[CANT_CODIFICACIONES];
+};
+
+/** paquete:
+ * Paquete de documentos mapeado por un worker. Las entradas de cache de sus
+ * archivos se arman la primera vez que se piden y apuntan al mapa, asi que
+ * el paquete vive hasta que se suelte la ultima.
+ * */
+struct paquete {
+	char * mapa;
+	size_t tam;
+	struct cabeceraPaquete * cabecera;
+	struct archivoPaquete * archivos;
+	uint32_t * tabla;
+	struct archivoCache ** entradas;	// Ya armadas, NULL las que nunca se pidieron
+	int referencias;				// 1 mientras es el vigente, mas una por entrada armada
+};
+
+/** bloqueArena:
+ * Bloque pedido aparte para lo que no entra en una arena.
+ * */
+struct bloqueArena {
+	struct bloqueArena * sig;
+	_Alignas(ALINEACION_ARENA) char datos[];
+};
+
+/** arena:
+ * Memoria de un pedido: se reparte de a pedazos consecutivos y se libera toda
+ * junta cuando termina el pedido, volviendo al pool del worker.
+ * */
+struct arena {
+	struct arena * sig;				// Siguiente arena libre del pool
+	struct bloqueArena * extra;		// Bloques pedidos aparte
+	size_t usado;					// Lo repartido de datos
+	_Alignas(ALINEACION_ARENA) char datos[TAM_ARENA];
+};
+
+/** ruedaPlazos:
+ * Plazos de las conexiones de un worker (timing wheel de dos niveles). Cada
+ * ranura del primer nivel es un tick de TICK_RUEDA ms y cada una del segundo,
+ * una vuelta entera del primero. Armar y cancelar un plazo es sacar o poner la
+ * conexion en una lista.
+ * */
+struct ruedaPlazos {
+	struct conexion * ranuras[RANURAS_RUEDA];
+	struct conexion * ranuras2[RANURAS_RUEDA2];
+	unsigned long ocupadas[RANURAS_RUEDA / 64];	// Ranuras del primer nivel con conexiones
+	long long tick;					// Ultimo tick atendido
+	long long ahora;				// Hora de la vuelta actual del bucle (ms)
+	int cantidad;					// Conexiones con un plazo corriendo
+};
+
+/** campoHPACK:
+ * Entrada de la tabla dinamica de HPACK: el nombre seguido del valor.
+ * */
+struct campoHPACK {
+	size_t lenNombre;
+	size_t lenValor;
+	char datos[];
+};
+
+/** tablaHPACK:
+ * Tabla dinamica del decodificador HPACK de una conexion, como un anillo con
+ * la entrada mas nueva primero.
+ * */
+struct tablaHPACK {
+	struct campoHPACK * campos[MAX_CAMPOS_HPACK];
+	int primero;					// Lugar de la entrada mas nueva
+	int cantidad;
+	size_t tam;						// Tamaño de las entradas segun HPACK (largos mas 32 cada una)
+	size_t max;						// Tamaño maximo actual (lo cambia el codificador del cliente)
+};
+
+/** camposH2:
+ * Headers de un pedido HTTP/2 ya decodificados, con los nombres y valores en
+ * texto y terminados en '\0'.
+ * */
+struct camposH2 {
+	struct header campos[MAX_CANT_HEADERS + 8];
+	int cantidad;
+	char texto[2 * MAX_HEADERS];
+	size_t usado;
+	int desbordado;					// 1 si algo no entro (el pedido es demasiado grande)
+};
+
+/** sesionH2:
+ * Estado de una conexion HTTP/2: el marco que se esta recibiendo, la tabla de
+ * HPACK del cliente, las ventanas de control de flujo y los streams abiertos,
+ * cada uno una conexion hija que atiende su pedido como uno de HTTP/1.
+ * */
+struct sesionH2 {
+	int faltaPrefacio;				// Bytes del prefacio del cliente que faltan recibir
+	unsigned char encabezado[LEN_ENCABEZADO_H2];	// Encabezado del marco que se esta recibiendo
+	int lenEncabezado;
+	size_t largo;					// Largo del contenido del marco
+	int tipo;
+	int flags;
+	unsigned int idMarco;
+	size_t lenCarga;				// Contenido ya recibido
+	unsigned char carga[MAX_MARCO_H2];	// Contenido del marco (el de DATA se descarta)
+	unsigned char * bloque;			// Bloque de headers que puede seguir en marcos CONTINUATION
+	size_t lenBloque;
+	size_t capBloque;
+	unsigned int idBloque;
+	int pesoBloque;					// Peso del HEADERS (prioridad de RFC 7540), 0 si no vino
+	int cuerpoBloque;				// 1 si el HEADERS no trajo END_STREAM (sigue un cuerpo)
+	int continuacion;				// 1 si faltan marcos CONTINUATION del bloque
+	struct tablaHPACK tabla;		// Tabla dinamica del decodificador
+	long ventanaEnvio;				// Lo que el cliente deja mandar en la conexion
+	long ventanaInicial;			// Ventana de los streams nuevos (SETTINGS_INITIAL_WINDOW_SIZE)
+	size_t maxMarco;				// Contenido maximo de los marcos que se mandan
+	size_t porDevolver;				// DATA recibido que todavia no se devolvio con WINDOW_UPDATE
+	unsigned int ultimoStream;		// Mayor stream abierto por el cliente
+	struct conexion * streams;		// Streams abiertos, por id (los incrementales van rotando)
+	int cantStreams;
+	int goaway;						// 1 si el cliente aviso que no abre mas streams
+	int cerrando;					// 1 si ya se mando el GOAWAY del servidor
+	int programando;				// 1 mientras se arman marcos (no se vuelve a entrar)
+	int recibiendo;					// io_uring: hay una recepcion en curso
+};
+
+/** fuente:
+ * Origen de eventos registrado en epoll (socket de escucha, socket de un cliente
+ * o pipe de php-cgi). Es lo que se guarda en el data.ptr de cada evento.
+ * */
+struct fuente {
+	int tipo;						// FUENTE_ESCUCHA, FUENTE_SOCKET o FUENTE_PHP
+	struct conexion * conexion;		// Conexion asociada (NULL para el socket de escucha)
+};
+
+/** conexion:
+ * Estado de una conexion atendida por el bucle de eventos. Cada conexion es una
+ * maquina de estados (ESTADO_*) que avanza a medida que el socket o la conexion
+ * con php-cgi estan listos, sin bloquear nunca al proceso.
+ * */
+struct conexion {
+	int sock;						// Socket del cliente (no bloqueante)
+	int estado;						// Estado actual (ESTADO_*)
+	struct fuente fuenteSocket;		// Fuente registrada en epoll para el socket
+	struct fuente fuentePHP;		// Fuente registrada en epoll para el pipe de php-cgi
+
+	char entrada[MAX_HEADERS + 1];	// Lo leido del socket (+1 para terminar el ultimo segmento)
+	size_t lenEntrada;
+	size_t escaneado;				// Hasta donde se busco el fin de los headers
+	size_t finPedido;				// Donde termina el pedido actual dentro de entrada
+	struct pedido pedido;			// El pedido actual ya analizado
+	struct arena * arena;			// Memoria del pedido actual, o NULL si no pidio
+
+	char * salida;					// Lo pendiente de mandar por el socket
+	size_t lenSalida;
+	size_t enviados;				// Cuanto de salida ya se mando
+	size_t capSalida;
+
+	int archivo;					// Archivo estatico a mandar, -1 si no hay
+	struct archivoCache * cache;	// Entrada de la cache del archivo que se manda
+	char * cuerpo;					// Cuerpo a mandar desde memoria (variante comprimida), o NULL
+	off_t offset;					// Desde donde sigue el envio del archivo
+	off_t restante;					// Bytes del archivo que faltan mandar
+	struct rango rangos[MAX_RANGOS];	// Partes pedidas con Range
+	int cantRangos;					// 0 si se manda el archivo entero
+	int rangoActual;				// Parte que se esta mandando
+	char separador[20];				// Separador de las partes de multipart/byteranges
+	int phpFd;						// Conexion FastCGI con el pool de php-cgi, -1 si no hay
+	unsigned char headerFCGI[8];	// Encabezado del registro FastCGI que se esta leyendo
+	size_t lenHeaderFCGI;
+	size_t restanteFCGI;			// Contenido del registro que falta leer
+	size_t rellenoFCGI;				// Relleno del registro que falta leer
+	char * cgi;						// Headers CGI de php-cgi mientras no estan completos
+	size_t lenCGI;
+	int respuestaPHP;				// 1 si ya se armaron los headers de la respuesta de PHP
+	int chunked;					// 1 si el cuerpo de PHP se manda en chunks
+	struct respuestaPHP * capturaPHP;	// Respuesta PHP que se esta guardando, o NULL
+	int ttlCaptura;					// Segundos que va a valer la respuesta guardada
+	struct respuestaPHP * esperaPHP;	// Respuesta PHP que se espera, o NULL
+	struct conexion * sigEspera;	// Lista de conexiones que esperan la misma respuesta
+	char * archivoPHP;				// Script y parametros del pedido que espera
+	char * parametrosPHP;
+
+	char ip[INET6_ADDRSTRLEN];		// Direccion del cliente (para el registro de accesos)
+	int status;						// Status de la respuesta en curso (0 si no hay)
+	long long bytesEnviados;		// Bytes mandados de la respuesta en curso
+	long long inicioPedido;			// Cuando empezo a atenderse el pedido (ms)
+	long long llegada;				// Aceptada o primer byte del pedido (us, 0 si no llego)
+	int primerByte;					// 1 si ya salio algo de la respuesta en curso
+	long long inicioEnvio;			// Inicio del envio del cuerpo del archivo (us, 0 si no hay)
+	long long inicioPHP;			// Cuando se paso el pedido a php-cgi (us)
+	int keepAlive;					// 1 si la conexion sigue abierta despues de la respuesta
+	int pedidos;					// Cantidad de pedidos atendidos en la conexion
+
+	int fasePlazo;					// Fase con plazo en curso (PLAZO_*)
+	long long vencePlazo;			// Cuando vence (ms)
+	long long progreso;				// Ultimo envio al cliente (ms)
+	struct conexion ** ranuraPlazo;	// Ranura de la rueda donde esta, o NULL si no hay plazo
+	struct conexion * antPlazo;
+	struct conexion * sigPlazo;
+
+	struct conexion * sigCerrada;	// Lista de conexiones cerradas pendientes de liberar
+
+	struct sesionH2 * h2;			// Estado HTTP/2 de la conexion, NULL si es HTTP/1
+	struct conexion * padre;		// Conexion HTTP/2 de un stream, NULL si no es un stream
+	unsigned int idStream;
+	long ventanaH2;					// Lo que el cliente deja mandar en el stream
+	long porDevolverH2;				// Cuerpo recibido en el stream que falta devolver en su ventana
+	int urgencia;					// Prioridad del stream (0 la mas urgente)
+	int cuerpoH2;					// 1 si el pedido del stream trae cuerpo (marcos DATA) que no termino de llegar
+	int incremental;				// 1 si el cliente usa el cuerpo a medida que llega
+	int headersH2;					// 1 si ya salio el HEADERS de la respuesta
+	int finH2;						// 1 si ya salio el END_STREAM (o el stream se reseteo)
+	int frenadoH2;					// 1 si se dejo de leer de php-cgi hasta que salga lo pendiente
+	struct conexion * sigStream;	// Siguiente stream de la misma conexion HTTP/2
+
+	int opsPendientes;				// io_uring: operaciones en curso sobre la conexion
+	int finLectura;					// io_uring: el cliente cerro su lado
+	int sinBuffers;					// io_uring: no habia buffers, recibir directo en entrada
+	int errorUring;					// io_uring: fallo una operacion, hay que cerrar
+	char * salidaEnVuelo;			// io_uring: buffer de salida que usa el envio en curso
+	char * bufArchivo;				// io_uring: bloque del archivo que se esta mandando
+	size_t inicioBuffer;			// io_uring: desde donde falta mandar el bloque
+	size_t enBuffer;				// io_uring: bytes del bloque que faltan mandar
+};
+
 /** error:
  * Muestra el mensaje de error y termina el programa con EXIT_FAILURE 
  * DE: 	Mensaje (string) 
@@ -60,6 +814,13 @@ void ayuda();
  * */
 void signalHandler(int sig);
 
+/** despertarSupervisor:
+ * Manejador de SIGALRM del proceso principal: no hace nada, solo interrumpe su
+ * wait para que relance el php-cgi que estaba demorado.
+ * DE: 	Signal (int), la señal.
+ * */
+void despertarSupervisor(int sig);
+
 /** verificarIP:
  * Dada una IP, verifica si la IP corresponde a una IPv4 valida.
  * DE: 	Servidor (string), la IP a analizar.
@@ -74,35 +835,52 @@ int verificarIP(char * servidor);
  * */
 int verificarPuerto(char * puerto);
 
-/** parseMsg: 
- * Analiza el mensaje brindado en el buffer y retorna cuál es el tipo de mensaje,
- * la ruta del archivo y el protocolo utilizado. No se encarga de hacer chequeos
- * en cuanto a la correctitud del mensaje.
+/** cortarToken:
+ * Avanza desde q hasta el separador dado (o hasta el fin de linea) y guarda
+ * lo recorrido como segmento.
+ * DE:	Q (char *), donde empieza el token.
+ * 		Fin (char *), el fin del buffer.
+ * 		Separador (char), el caracter que termina el token.
+ * DS: 	Seg (struct segmento *), el token recorrido.
+ * 		Retorna un puntero al separador (o al fin de linea).
+ *  */
+char * cortarToken(char * q, char * fin, char separador, struct segmento * seg);
+
+/** parsearPedido: 
+ * Analiza el pedido brindado en el buffer y retorna cuál es el tipo de mensaje,
+ * la ruta del archivo, el protocolo utilizado y sus headers. No copia nada: cada dato
+ * es un segmento del buffer, que se termina en '\0' en el lugar del separador que
+ * lo seguia. No se encarga de hacer chequeos en cuanto a la semantica del mensaje.
  * DE:	Buf, el buffer de entrada que posee el mensaje.
- * DS: 	TipoMsg, Ruta y Protocolo, los datos de salida según el análisis sintáctico.
+ * 		Len (size_t), el largo del pedido dentro del buffer.
+ * DS: 	P (struct pedido *), los datos de salida según el análisis sintáctico.
+ * 		Retorna 0 si el pedido se pudo analizar, -1 si esta mal formado y -2
+ * 		si tiene mas de MAX_CANT_HEADERS headers.
  *  */
-void parseMsg (char * buf, char ** tipoMsg, char ** ruta, char ** protocolo);
+int parsearPedido(char * buf, size_t len, struct pedido * p);
 
-/** archivoExiste:
- * Dada la ruta de un archivo, retorna verdadero si el archivo existe y falso en caso contrario. 
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo existe, 0 en caso contrario.
+/** buscarHeader:
+ * Busca un header por nombre (sin distinguir mayusculas) en un pedido ya analizado.
+ * DE: 	P (struct pedido *), el pedido.
+ * 		Nombre (string), el nombre del header.
+ * DS:	El valor del header (dentro del buffer del pedido), o NULL si no esta.
  * */
-int archivoExiste(char * archivo);
+char * buscarHeader(struct pedido * p, const char * nombre);
 
-/** archivoAbrible:
- * Dada la ruta de un archivo, retorna verdadero si el archivo se puede abrir y falso en caso contrario. 
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo se puede abrir, 0 en caso contrario.
+/** faltaArchivo:
+ * Dado el errno de un open que fallo, dice si es porque el archivo no existe.
+ * DE: 	Err (int), el errno.
+ * DS: 	1 si el archivo (o algun directorio de la ruta) no existe, 0 en caso contrario.
  * */
-int archivoAbrible(char * archivo);
+int faltaArchivo(int err);
 
-/** archivoSize:
- * Dada la ruta de un archivo, retorna el tamaño del contenido del archivo. 
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	Size (long), el tamaño del contenido del archivo.
+/** rechazoApertura:
+ * Dado el errno de un open que fallo, elige el rechazo: 404 si el archivo no
+ * existe y 403 si existe pero no se puede abrir.
+ * DE: 	Err (int), el errno.
+ * DS: 	RECHAZO_404 o RECHAZO_403.
  * */
-long archivoSize(char * archivo);
+int rechazoApertura(int err);
 
 /** esGet:
  * Dada una cadena de texto, analiza si la misma es un "GET"
@@ -111,154 +889,1562 @@ long archivoSize(char * archivo);
  * */
 int esGet(char * msg);
 
-/** esBarra:
- * Dada una cadena de texto, analiza si la misma es una barra "/"
- * DE: 	Mensaje (string), la cadena de texto.
- * DS: 	1 si la cadena es una barra "/", 0 en caso contrario.
- * */
-int esBarra(char * msg);
-
 /** mandarHeader:
- * Dada una cadena de texto y un socket, envia el texto a traves de ese socket.
- * DE: 	Sock (int), el socket asociado por donde mandar el mensaje.
+ * Dada una cadena de texto y una conexion, encola el texto para ser enviado
+ * a traves del socket de esa conexion.
+ * DE: 	Conexion (struct conexion *), la conexion por donde mandar el mensaje.
  * 		Resp (string), el mensaje a ser enviado a traves del socket.
  * */
-void mandarHeader(int sock, char * resp);
+void mandarHeader(struct conexion * c, char * resp);
 
 /** mandarHeaders:
  * Método para encapsular y mandar 2 mensajes a traves de un socket.
  * Hace dos llamadas a el metodo "mandarHeader", con tipoResp y con tipoCont.
  * Normalmente se usa para mandar un tipo de respuesta (status)
  * y el tipo de contenido a ser enviado (content type).
- * DE: 	Sock (int), el socket asociado por donde mandar el mensaje.
+ * DE: 	Conexion (struct conexion *), la conexion por donde mandar el mensaje.
  * 		TipoResp (string), el tipo de respuesta a enviar.
  * 		TipoCont (string), el tipo de contenido a enviar.
  * */
-void mandarHeaders(int sock, char * tipoResp, char * tipoCont);
+void mandarHeaders(struct conexion * c, char * tipoResp, char * tipoCont);
+
+/** terminarHeaders:
+ * Encola los headers que cierran el bloque de headers de una respuesta:
+ * el largo del cuerpo (Content-Length), si la conexion sigue abierta
+ * (Connection) y la linea en blanco que separa los headers del cuerpo.
+ * DE: 	Conexion (struct conexion *), la conexion por donde mandar el mensaje.
+ * 		Largo (long), el largo en bytes del cuerpo de la respuesta.
+ * */
+void terminarHeaders(struct conexion * c, long largo);
+
+/** mandarFinHeaders:
+ * Encola el header Connection (segun si la conexion sigue abierta)
+ * y la linea en blanco que separa los headers del cuerpo.
+ * DE: 	Conexion (struct conexion *), la conexion por donde mandar el mensaje.
+ * */
+void mandarFinHeaders(struct conexion * c);
+
+/** armarRechazos:
+ * Arma al arrancar las respuestas completas (headers y pagina HTML con el titulo
+ * y el mensaje) de cada pagina de error, con keep-alive y sin.
+ * */
+void armarRechazos();
 
 /** mandarRechazo:
- * Dado un socket, un tipo de respuesta, un titulo y un mensaje,
- * el método se encarga de mandar una respuesta del estado de tipoResp.
- * Y además se encarga de crear una página de contenido HTML con el 
- * título y el mensaje otorgado. El método normalmente se usa para mandar
- * respuestas de tipo 4XX o 5XX y mostrar de forma amigable una página,
- * para los que esten haciendo solicitudes mediante un navegador web. 
- * DE: 	Sock (int), el socket asociado por donde mandar el mensaje.
- * 		TipoResp (string), el tipo de respuesta a ser enviado.
- * 		Titulo (string), título a ser mostrado en el contenido HTML.
- * 		Mensaje (string), mensaje a ser mostrado en el contenido HTML.
- * */
-void mandarRechazo(int sock, char * tipoResp, char * titulo, char * mensaje);
+ * Encola una respuesta 4XX o 5XX con una pagina de error en HTML, para los que
+ * esten haciendo solicitudes mediante un navegador web. La respuesta entera ya
+ * esta armada, asi que sale con una copia al buffer de salida.
+ * DE: 	Conexion (struct conexion *), la conexion por donde mandar el mensaje.
+ * 		Tipo (int), la pagina de error (RECHAZO_*).
+ * */
+void mandarRechazo(struct conexion * c, int tipo);
 
 /** mandarArchivo:
- * Dado un socket y la ruta de un archivo, manda el archivo
- * en modo binario a traves del socket.
- * DE: 	Socket (int), el socket asociado para mandar el archivo.
+ * Dada una conexion y la ruta de un archivo, abre el archivo (y lo agrega a la
+ * cache) y deja la conexion lista para mandarlo en modo binario a traves del socket.
+ * El envio en si lo hace el bucle de eventos con sendfile a medida que el socket
+ * admite escritura, por lo que la memoria usada no depende del tamaño del archivo.
+ * DE: 	Conexion (struct conexion *), la conexion asociada para mandar el archivo.
  * 		Archivo (string), la ruta del archivo.
+ * 		TipoCont (string), el header del tipo de contenido (de la tabla de tipos).
  * */
-void mandarArchivo(int sock, char * archivo);
+void mandarArchivo(struct conexion * c, char * archivo, char * tipoCont);
 
-/** esHTML:
- * Dada una cadena de texto referente a la ubicación de un archivo, 
- * revisa si el archivo tiene la extension HTML o HTM.
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo es HTML/HTM, 0 en caso contrario.
+/** mandarEntradaCache:
+ * Deja la conexion lista para mandar un archivo de la cache: encola sus headers
+ * ya armados y usa su descriptor abierto.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		E (struct archivoCache *), el archivo.
  * */
-int esHTML(char * archivo);
+void mandarEntradaCache(struct conexion * c, struct archivoCache * e);
 
-/** esJPG:
- * Dada una cadena de texto referente a la ubicación de un archivo, 
- * revisa si el archivo tiene la extension JPG.
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo es JPG, 0 en caso contrario.
+/** armarValidadores:
+ * Arma el ETag y el Last-Modified de un archivo a partir de su inodo, size y mtime.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * 		St (struct stat *), los datos del archivo abierto.
  * */
-int esJPG(char * archivo);
+void armarValidadores(struct archivoCache * e, struct stat * st);
 
-/** esGIF:
- * Dada una cadena de texto referente a la ubicación de un archivo, 
- * revisa si el archivo tiene la extension GIF.
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo es GIF, 0 en caso contrario.
+/** coincideETag:
+ * Compara (en forma debil) un ETag con la lista de un header If-None-Match.
+ * DE: 	Lista (string), el valor del header.
+ * 		Etag (string), el ETag de la representacion a mandar.
+ * DS:	1 si esta en la lista (o la lista es *), 0 en caso contrario.
  * */
-int esGIF(char * archivo);
+int coincideETag(char * lista, char * etag);
 
-/** esPNG:
- * Dada una cadena de texto referente a la ubicación de un archivo, 
- * revisa si el archivo tiene la extension PNG.
- * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo es PNG, 0 en caso contrario.
+/** noModificado:
+ * Evalua If-None-Match e If-Modified-Since contra un archivo de la cache (una
+ * fecha de If-Modified-Since en el futuro no es valida y se ignora).
+ * DE: 	C (struct conexion *), la conexion con el pedido.
+ * 		E (struct archivoCache *), el archivo.
+ * 		Etag (string), el ETag de la representacion que se mandaria.
+ * DS:	1 si el cliente ya tiene esa version (corresponde un 304), 0 en caso contrario.
+ * */
+int noModificado(struct conexion * c, struct archivoCache * e, char * etag);
+
+/** parsearRangos:
+ * Analiza el valor de un header Range ("bytes=0-99,200-,-50").
+ * DE: 	Valor (string), el valor del header.
+ * 		Size (off_t), el tamaño del archivo.
+ * 		Rangos (struct rango *), donde se guardan las partes que caen dentro del archivo.
+ * 		Max (int), la cantidad de lugares en rangos.
+ * DS:	La cantidad de partes (0 si ninguna cae dentro del archivo), o -1 si la sintaxis
+ * 		es invalida o hay demasiadas partes (en ese caso se ignora el Range).
  * */
-int esPNG(char * archivo);
+int parsearRangos(char * valor, off_t size, struct rango * rangos, int max);
 
-/** esPHP:
- * Dada una cadena de texto referente a la ubicación de un archivo, 
- * revisa si el archivo tiene la extension PHP.
+/** rangoVigente:
+ * Evalua If-Range (un ETag o una fecha) contra un archivo de la cache.
+ * DE: 	C (struct conexion *), la conexion con el pedido.
+ * 		E (struct archivoCache *), el archivo.
+ * DS:	1 si corresponde atender el Range, 0 si hay que mandar el archivo entero.
+ * */
+int rangoVigente(struct conexion * c, struct archivoCache * e);
+
+/** armarEncabezadoParte:
+ * Arma el separador y los headers de una parte de multipart/byteranges.
+ * DE: 	C (struct conexion *), la conexion con los rangos.
+ * 		I (int), el numero de parte.
+ * 		Buf (char *), donde se arma (puede ser NULL para solo medirlo).
+ * 		Tam (size_t), el tamaño de buf.
+ * DS:	El largo del encabezado.
+ * */
+size_t armarEncabezadoParte(struct conexion * c, int i, char * buf, size_t tam);
+
+/** mandarRangos:
+ * Arma la respuesta a un pedido con Range: 206 con una parte, 206 multipart/byteranges
+ * con varias, o 416 si ninguna cae dentro del archivo.
+ * DE: 	C (struct conexion *), la conexion (ya con una referencia a la entrada).
+ * 		E (struct archivoCache *), el archivo.
+ * 		Cant (int), la cantidad de partes en c->rangos.
+ * */
+void mandarRangos(struct conexion * c, struct archivoCache * e, int cant);
+
+/** siguienteRango:
+ * Pasa a la siguiente parte de una respuesta multipart/byteranges, encolando su
+ * encabezado (o el separador de cierre despues de la ultima).
+ * DE: 	C (struct conexion *), la conexion.
+ * DS:	1 si queda algo por mandar, 0 si la respuesta termino.
+ * */
+int siguienteRango(struct conexion * c);
+
+/** liberarArchivo:
+ * Suelta el archivo que la conexion estaba mandando, si hubiera.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void liberarArchivo(struct conexion * c);
+
+/** hashRuta:
+ * DE: 	Ruta (string), la ruta de un archivo.
+ * DS:	El hash FNV-1a de la ruta.
+ * */
+unsigned int hashRuta(const char * ruta);
+
+/** iniciarCache:
+ * Crea la cache de archivos del worker y su inotify. Si no se puede vigilar
+ * el sistema de archivos, el worker trabaja sin cache.
+ * */
+void iniciarCache();
+
+/** buscarCache:
+ * Busca un archivo en la cache por su ruta.
+ * DE: 	Ruta (string), la ruta del archivo.
+ * DS:	La entrada del archivo, o NULL si no esta en la cache.
+ * */
+struct archivoCache * buscarCache(char * ruta);
+
+/** cargarCache:
+ * Abre un archivo, arma sus headers y lo agrega a la cache (sacando el usado
+ * hace mas tiempo si esta llena). Antes de abrirlo vigila su directorio con inotify.
+ * DE: 	Ruta (string), la ruta del archivo.
+ * 		TipoCont (string), el header del tipo de contenido (de la tabla de tipos).
+ * DS:	La entrada del archivo, o NULL si no se puede abrir o no es un archivo regular
+ * 		(errno queda con el motivo: EACCES si no es un archivo regular).
+ * */
+struct archivoCache * cargarCache(char * ruta, char * tipoCont);
+
+/** sacarCache:
+ * Saca un archivo de la cache. Se cierra recien cuando ninguna conexion lo usa.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void sacarCache(struct archivoCache * e);
+
+/** soltarArchivoCache:
+ * Suelta una referencia a un archivo de la cache; con la ultima se cierra.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void soltarArchivoCache(struct archivoCache * e);
+
+/** agregarLRU:
+ * Agrega un archivo como el mas reciente de la lista LRU de la cache.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void agregarLRU(struct archivoCache * e);
+
+/** quitarLRU:
+ * Saca un archivo de la lista LRU de la cache.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void quitarLRU(struct archivoCache * e);
+
+/** esComprimible:
+ * DE: 	TipoCont (string), el header del tipo de contenido (de la tabla de tipos).
+ * DS:	1 si el contenido es texto y vale la pena comprimirlo, 0 en caso contrario.
+ * */
+int esComprimible(char * tipoCont);
+
+/** aceptaCodificacion:
+ * Revisa si el valor de un header Accept-Encoding acepta una codificacion
+ * (esta en la lista y no tiene peso q=0).
+ * DE: 	Aceptadas (string), el valor del header.
+ * 		Codificacion (string), el nombre de la codificacion ("gzip", "br").
+ * DS:	1 si la acepta, 0 en caso contrario.
+ * */
+int aceptaCodificacion(char * aceptadas, const char * codificacion);
+
+/** armarHeadersVariante:
+ * Arma los headers de la respuesta con una variante comprimida de un archivo.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * 		Cod (int), la codificacion de la variante (COD_*).
+ * */
+void armarHeadersVariante(struct archivoCache * e, int cod);
+
+/** cargarVariantesPrecomprimidas:
+ * Abre los hermanos ya comprimidos de un archivo (archivo.br, archivo.gz), si existen.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void cargarVariantesPrecomprimidas(struct archivoCache * e);
+
+/** liberarMemoriaVariantes:
+ * Libera las variantes comprimidas en memoria de los archivos usados hace mas
+ * tiempo (y que ninguna conexion este mandando) hasta que entren los bytes pedidos.
+ * DE: 	Necesarios (size_t), los bytes que se quieren agregar.
+ * */
+void liberarMemoriaVariantes(size_t necesarios);
+
+/** comprimirVariante:
+ * Comprime un archivo de la cache en memoria y lo guarda como variante, si el
+ * resultado es mas chico que el original y entra en la memoria para variantes.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * 		Cod (int), la codificacion (COD_*).
+ * */
+void comprimirVariante(struct archivoCache * e, int cod);
+
+/** elegirVariante:
+ * Elige la variante comprimida preferida entre las que acepta el cliente. La primera
+ * vez que se pide un archivo sin hermano ya comprimido, lo comprime al vuelo.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * 		Aceptadas (string), el valor del header Accept-Encoding (o NULL).
+ * DS:	La variante a mandar, o NULL para mandar el archivo sin comprimir.
+ * */
+struct variante * elegirVariante(struct archivoCache * e, char * aceptadas);
+
+/** leerInotify:
+ * Lee los avisos de inotify y saca de la cache los archivos que cambiaron,
+ * se borraron o se movieron (o todos los de un directorio que cambio). Cada
+ * aviso va directo al directorio de su wd.
+ * */
+void leerInotify();
+
+/** vigilarDirectorio:
+ * Vigila un directorio con inotify, o suma un uso a su vigilancia si ya estaba.
+ * DE: 	Directorio (string), el directorio.
+ * DS:	La vigilancia, o NULL si no se puede vigilar.
+ * */
+struct directorioVigilado * vigilarDirectorio(const char * directorio);
+
+/** buscarVigilado:
+ * Busca el directorio vigilado de un wd.
+ * DE: 	Wd (int), la vigilancia de inotify.
+ * DS:	El directorio, o NULL si ya no se vigila.
+ * */
+struct directorioVigilado * buscarVigilado(int wd);
+
+/** soltarVigilado:
+ * Resta un uso a la vigilancia de un directorio; con el ultimo se deja de vigilar.
+ * DE: 	V (struct directorioVigilado *), el directorio.
+ * */
+void soltarVigilado(struct directorioVigilado * v);
+
+/** sacarArchivosVigilado:
+ * Saca de la cache los archivos de un directorio con ese nombre. Un aviso de
+ * archivo.gz o archivo.br tambien saca a archivo, por sus variantes.
+ * DE: 	V (struct directorioVigilado *), el directorio.
+ * 		Nombre (string), el nombre del aviso.
+ * */
+void sacarArchivosVigilado(struct directorioVigilado * v, const char * nombre);
+
+/** iniciarInotify:
+ * Crea el inotify del worker y lo registra en epoll (si no lo estaba).
+ * DS:	0 si esta listo, -1 si no se pudo.
+ * */
+int iniciarInotify();
+
+/** armarHeadersCache:
+ * Arma los headers de la respuesta 200 de un archivo con sus validadores.
+ * DE: 	E (struct archivoCache *), el archivo.
+ * */
+void armarHeadersCache(struct archivoCache * e);
+
+/** iniciarPaquete:
+ * Mapea el paquete de documentos (-D) en el worker y vigila su directorio,
+ * para cambiarlo por el nuevo cuando se reemplace con un rename.
+ * */
+void iniciarPaquete();
+
+/** cargarPaquete:
+ * Mapea en memoria un paquete de documentos y revisa que este completo y
+ * que todos sus offsets caigan dentro del archivo.
+ * DE: 	Ruta (string), la ruta del paquete.
+ * DS:	El paquete (con una referencia), o NULL si no se pudo abrir o no es valido.
+ * */
+struct paquete * cargarPaquete(const char * ruta);
+
+/** recargarPaquete:
+ * Vuelve a mapear el paquete y reemplaza al vigente. Si el nuevo no es
+ * valido se sigue con el anterior.
+ * */
+void recargarPaquete();
+
+/** soltarPaquete:
+ * Suelta una referencia al paquete, y si era la ultima lo desmapea.
+ * DE: 	P (struct paquete *), el paquete.
+ * */
+void soltarPaquete(struct paquete * p);
+
+/** buscarPaquete:
+ * Busca un archivo en el paquete vigente, sin tocar el sistema de archivos.
+ * DE: 	Ruta (string), la ruta del archivo relativa al directorio del servidor.
+ * DS:	La entrada del archivo, o NULL si no esta en el paquete.
+ * */
+struct archivoCache * buscarPaquete(char * ruta);
+
+/** entradaPaquete:
+ * Busca un archivo en un paquete y arma (la primera vez) su entrada de cache.
+ * DE: 	P (struct paquete *), el paquete.
+ * 		Ruta (string), la ruta relativa al directorio.
+ * DS:	La entrada, o NULL si el archivo no esta.
+ * */
+struct archivoCache * entradaPaquete(struct paquete * p, const char * ruta);
+
+/** extensionArchivo:
+ * Dada la ruta de un archivo, copia su extension en minusculas (sin el punto),
+ * en una sola pasada y sin pedir memoria.
  * DE: 	Archivo (string), la ruta del archivo.
- * DS: 	1 si el archivo es PHP, 0 en caso contrario.
+ * 		Buf (char *), donde se copia la extension.
+ * 		Tam (size_t), el tamaño de buf.
+ * DS:	El largo de la extension (0 si no tiene o no entra en buf).
+ * */
+size_t extensionArchivo(const char * archivo, char * buf, size_t tam);
+
+/** agregarMIME:
+ * Agrega a la tabla de tipos el tipo de contenido de una extension (o lo reemplaza).
+ * DE: 	Extension (string), la extension sin el punto.
+ * 		Tipo (string), el tipo de contenido ("text/html").
+ * */
+void agregarMIME(const char * extension, const char * tipo);
+
+/** iniciarMIME:
+ * Carga en la tabla de tipos los tipos incluidos en el servidor.
+ * */
+void iniciarMIME();
+
+/** cargarMIME:
+ * Carga en la tabla de tipos los de un archivo con el formato de mime.types
+ * (un tipo por linea seguido de sus extensiones, '#' para comentarios).
+ * DE: 	Ruta (string), la ruta del archivo.
+ * */
+void cargarMIME(char * ruta);
+
+/** buscarMIME:
+ * Busca en la tabla de tipos el tipo de contenido de una extension.
+ * DE: 	Extension (string), la extension en minusculas.
+ * DS:	El header Content-Type, o NULL si la extension no tiene un tipo conocido.
+ * */
+char * buscarMIME(const char * extension);
+
+/** agregarRegla:
+ * Agrega una regla al arbol de rutas (reemplaza a la de su mismo prefijo).
+ * DE: 	Prefijo (string), el prefijo de las rutas (empieza con '/').
+ * 		Accion (int), RUTA_RAIZ, RUTA_ALIAS, RUTA_PHP o RUTA_REDIRECCION.
+ * 		Destino (string), el directorio, el script o la URL.
+ * */
+void agregarRegla(const char * prefijo, int accion, const char * destino);
+
+/** cargarRutas:
+ * Carga las reglas de un archivo de rutas: una por linea, con el prefijo, la
+ * accion (raiz, alias, php o redireccion) y el destino ('#' para comentarios).
+ * DE: 	Ruta (string), la ruta del archivo.
+ * */
+void cargarRutas(char * ruta);
+
+/** buscarRegla:
+ * Busca la regla del prefijo mas largo de la ruta, que termine donde termina
+ * un segmento, en una sola pasada por el arbol.
+ * DE: 	Ruta (string), la ruta canonica del pedido.
+ * 		Resto (char **), donde se deja lo que sigue al prefijo.
+ * DS:	La regla, o NULL si ninguna cubre la ruta.
  * */
-int esPHP(char * archivo);
+struct regla * buscarRegla(char * ruta, char ** resto);
 
-/** getExtension:
- * Dada una cadena de texto, obtiene su extension (si la tuviese).
- * DE: 	Archivo (string), la ruta del archivo para obtener su extensión.
- * DS:	Retorna un puntero a un string con la extensión, o NULL en caso de no
- * 		poseer una extensión reconocible.
+/** resolverRuta:
+ * Arma el archivo que atiende un pedido segun su regla. Un directorio se
+ * cambia por su indice.
+ * DE: 	Conexion (struct conexion *), la conexion (la ruta va en su arena).
+ * 		Regla (struct regla *), la regla del pedido.
+ * 		Ruta (string), la ruta canonica del pedido (sin parametros).
+ * 		Resto (string), lo que sigue al prefijo de la regla.
+ * DS:	El archivo, o NULL si es un directorio sin indice.
  * */
-char * getExtension(char* archivo);
+char * resolverRuta(struct conexion * c, struct regla * r, char * ruta, char * resto);
 
-/** appchr:
- * Dada una cadena de texto y un caracter, agrega dicho caracter
- * al final de la cadena de texto (append).
- * DE: 	Str (string), la cadena de texto.
- * 		Chr (char), la letra para agregar al final de la cadena.
- * DS:	Retorna un puntero a la primera posición de la cadena de texto resultante.
+/** hayIndice:
+ * Se fija si un indice esta: uno estatico se abre y queda en la cache para el
+ * pedido que sigue, uno php se busca por nombre.
+ * DE: 	Archivo (string), la ruta del indice.
+ * DS:	1 si esta (aunque no se pueda abrir), 0 si no.
  * */
-char * appchr(char * str, const char chr);
+int hayIndice(char * archivo);
+
+/** resolverIndice:
+ * Busca el indice de un directorio (en el paquete o en el disco) la primera
+ * vez, y despues lo toma de la tabla de indices del worker.
+ * DE: 	Directorio (string), con la barra final ("" es el del servidor).
+ * DS:	La posicion en nombresIndice, o -1 si no tiene indice.
+ * */
+int resolverIndice(const char * directorio);
+
+/** invalidarIndices:
+ * Olvida los indices de un directorio que cambio (o de todos).
+ * DE: 	V (struct directorioVigilado *), la vigilancia del directorio, NULL para todos.
+ * */
+void invalidarIndices(struct directorioVigilado * v);
+
+/** mandarRedireccion:
+ * Prepara una respuesta 301 a un destino seguido del resto de la ruta
+ * (codificado de nuevo) y de los parametros.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Destino (string), el comienzo de la URL (el de la regla, o "" para una ruta del servidor).
+ * 		Resto (string), lo que sigue al destino, sin codificar.
+ * 		Parametros (string), los parametros del pedido (con el '?'), o NULL.
+ * */
+void mandarRedireccion(struct conexion * c, const char * destino, const char * resto, char * parametros);
+
+/** esFinHeaders:
+ * Dado un '\n' en la posicion i del buffer, revisa si cierra una linea vacia.
+ * DE: 	Buf (char *), el buffer.
+ * 		I (size_t), la posicion del '\n'.
+ * DS:	1 si termina los headers, 0 en caso contrario.
+ * */
+int esFinHeaders(const char * buf, size_t i);
+
+/** buscarLineaVacia:
+ * Busca la linea vacia que termina los headers en el buffer, desde la posicion
+ * dada. Con SSE2 revisa 16 bytes por vez y solo mira los que son '\n'.
+ * DE: 	Buf (char *), el buffer.
+ * 		Desde (size_t), donde empezar a buscar.
+ * 		Len (size_t), el largo del buffer.
+ * DS:	La posicion siguiente a la linea vacia, o -1 si no esta.
+ * */
+long buscarLineaVacia(const char * buf, size_t desde, size_t len);
+
+/** buscarFinPedido:
+ * Busca en el buffer de entrada de la conexion el fin del primer pedido
+ * (dos enter seguidos) y lo guarda en finPedido. La busqueda se retoma
+ * desde donde quedo la anterior, asi cada byte se revisa una sola vez.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * DS:	1 si el pedido esta completo, 0 en caso contrario.
+ * */
+int buscarFinPedido(struct conexion * c);
 
 /** recibirMensaje:
- * Dado un socket, se hace una lectura a través de dicho socket hasta que
- * se lean dos enter seguidos (CR-LF o LF-CR). 
- * Luego, se retorna un string con el contenido de lo leído.
- * DE: 	Socket (int), el socket asociado para hacer la lectura.
- * DS:	Retorna un puntero a la primera posición de la cadena de texto leída.
+ * Dada una conexion, lee todo lo disponible en su socket (sin bloquear) y lo
+ * agrega a su buffer de entrada de tamaño fijo, hasta que se lean dos enter
+ * seguidos o el socket no tenga mas datos por el momento.
+ * DE: 	Conexion (struct conexion *), la conexion asociada para hacer la lectura.
+ * DS:	1 si el pedido esta completo, 0 si hay que esperar mas datos,
+ * 		-1 si hubo un error o el cliente cerro sin mandar nada, -2 si los
+ * 		headers no entran en MAX_HEADERS bytes.
  * */
-char * recibirMensaje(int sock);
+int recibirMensaje(struct conexion * c);
 
-/** minusculas:
- * Dada una cadena de caracteres, devuelve la misma cadena pero convertida a minúsculas.
- * DE: 	Str (string), la cadena de caracteres para convertir.
- * DS:	Retorna un puntero a la primera posición de la cadena de texto en minúsculas.
+/** normalizarRuta:
+ * Deja la ruta de un pedido en su forma canonica, en una sola pasada: decodifica
+ * los %XX (con SSE2 copia de a 16 bytes los tramos sin nada que cambiar), junta
+ * las barras seguidas, resuelve los segmentos . y .. y separa los parametros.
+ * La forma canonica es la clave de las caches, asi que las rutas equivalentes
+ * dan con la misma entrada.
+ * DE: 	Ruta (string), la ruta tal como vino en el pedido.
+ * 		Len (size_t), su largo.
+ * 		Destino (char *), donde se escribe (len + 1 bytes, aparte de la ruta).
+ * DS:	El largo de la ruta canonica, o -1 si no es valida: no empieza con '/', tiene
+ * 		un %XX mal formado o un caracter de control, o un .. sale del directorio.
+ * 		Parametros (char **), lo que sigue al '?' (con el '?') o NULL si no hay.
  * */
-char * minusculas(char * str);
+long normalizarRuta(const char * ruta, size_t len, char * destino, char ** parametros);
 
- /** verificarPHP:
- * Método para desglosar una ruta seguida de argumentos. Se utiliza para los archivos
- * PHP que reciben parámetros, para poder separar la ruta del archivo de sus argumentos.
- * El método retorna en su primer dato únicamente la ruta del archivo, y en su segundo argumento
- * los parámetros dados, si los hubiera.
- * DE: 	Archivo (string), la ruta del archivo a desglosar.
- * DS:	Archivo (string), la ruta del archivo, separado de sus parametros.
- * 		Argumentos (string), los parametros separados de la ruta del archivo, si existiesen.
- * 		En caso de no existir parámetros, argumentos será NULL.
+/** agregarRegistroFCGI:
+ * Agrega un registro FastCGI (encabezado y contenido) a un buffer.
+ * DE: 	Buf (char *), donde se agrega (con lugar para 8 + len bytes).
+ * 		Tipo (int), el tipo de registro (FCGI_*).
+ * 		Datos (char *), el contenido (puede ser NULL si len es 0).
+ * 		Len (size_t), el largo del contenido (hasta 65535).
+ * DS:	Los bytes agregados.
  * */
-void verificarPHP(char ** archivo, char ** argumentos);
+size_t agregarRegistroFCGI(char * buf, int tipo, const char * datos, size_t len);
+
+/** agregarLargoFCGI:
+ * Codifica el largo de un nombre o un valor de un par nombre-valor de FastCGI.
+ * DE: 	Buf (char *), donde se agrega.
+ * 		Len (size_t), el largo.
+ * DS:	Los bytes agregados (1 o 4).
+ * */
+size_t agregarLargoFCGI(char * buf, size_t len);
+
+/** agregarParamFCGI:
+ * Agrega una variable CGI a los parametros FastCGI de un pedido.
+ * DE: 	P (struct paramsFCGI *), los parametros.
+ * 		Nombre, Valor (char *) y sus largos.
+ * */
+void agregarParamFCGI(struct paramsFCGI * p, const char * nombre, size_t lenNombre,
+		const char * valor, size_t lenValor);
+
+/** agregarVariableFCGI:
+ * Igual que agregarParamFCGI, con nombre y valor terminados en '\0'.
+ * */
+void agregarVariableFCGI(struct paramsFCGI * p, const char * nombre, const char * valor);
+
+/** armarParamsFCGI:
+ * Arma las variables CGI de un pedido PHP (SCRIPT_FILENAME, QUERY_STRING,
+ * REQUEST_METHOD, etc. y un HTTP_* por cada header del pedido).
+ * DE: 	C (struct conexion *), la conexion con el pedido.
+ * 		Archivo (string), la ruta del archivo PHP.
+ * 		Parametros (string), los parametros ("?..."), o NULL.
+ * 		P (struct paramsFCGI *), donde se arman.
+ * */
+void armarParamsFCGI(struct conexion * c, char * archivo, char * parametros, struct paramsFCGI * p);
 
 /** procesarPHP:
  * Método para atender el pedido a un archivo PHP. Dada la ruta de un archivo y 
- * sus respectivos parámetros, el método se encarga de llamar al CGI de PHP
- * y de responder a través del socket según lo resultante de PHP-CGI.
- * DE: 	Socket (int), el socket asociado al hilo donde se responderá.
+ * sus respectivos parámetros, se conecta al pool de php-cgi y le manda el pedido
+ * por FastCGI, con las variables CGI como parametros.
+ * La respuesta se lee a traves de esa conexion registrada en el bucle de eventos,
+ * por lo que el servidor sigue atendiendo otras conexiones mientras el script corre.
+ * DE: 	Conexion (struct conexion *), la conexion donde se responderá.
  * 		Archivo (string), la ruta del archivo PHP.
  * 		Parametros (string), los parámetros de la ejecución, si existiesen.
  * */
-void procesarPHP(int sock, char * archivo, char * parametros);
+void procesarPHP(struct conexion * c, char * archivo, char * parametros);
+
+/** leerPHP:
+ * Lee todo lo disponible en la conexion FastCGI de la conexion, separa los registros
+ * y encola la salida de php-cgi en su buffer de salida. Cuando php-cgi termina el
+ * pedido, pasa la conexion a escribir la respuesta.
+ * DE: 	Conexion (struct conexion *), la conexion con un PHP en curso.
+ * */
+void leerPHP(struct conexion * c);
+
+/** armarClavePHP:
+ * Arma la clave de la cache de respuestas PHP de un pedido.
+ * DE: 	C (struct conexion *), la conexion con el pedido.
+ * 		Archivo (string), el script.
+ * 		Parametros (string), los parametros ("?..."), o NULL.
+ * DS:	La clave (en la arena del pedido).
+ * */
+char * armarClavePHP(struct conexion * c, char * archivo, char * parametros);
+
+/** buscarRespuestaPHP:
+ * Busca una respuesta en la cache de respuestas PHP (las vencidas se sacan).
+ * DE: 	Clave (string) y su hash.
+ * DS:	La respuesta, o NULL si no esta.
+ * */
+struct respuestaPHP * buscarRespuestaPHP(char * clave, unsigned int hash);
+
+/** sacarRespuestaPHP:
+ * Saca una respuesta de la cache de respuestas PHP y la libera.
+ * DE: 	R (struct respuestaPHP *), la respuesta.
+ * */
+void sacarRespuestaPHP(struct respuestaPHP * r);
+
+/** purgarRespuestasPHP:
+ * Saca todas las respuestas vencidas de la cache de respuestas PHP.
+ * */
+void purgarRespuestasPHP();
+
+/** atenderPHP:
+ * Atiende un pedido PHP desde la cache de respuestas (si esta activada con -c).
+ * Si la respuesta no esta, se manda el pedido a php-cgi y se guarda su respuesta;
+ * los pedidos iguales que llegan mientras tanto esperan esa misma respuesta.
+ * Los pedidos con cuerpo se rechazan con 413 (a php-cgi no se le pasa).
+ * DE: 	C (struct conexion *), la conexion.
+ * 		Archivo (string), la ruta del archivo PHP.
+ * 		Parametros (string), los parámetros, si existiesen.
+ * */
+void atenderPHP(struct conexion * c, char * archivo, char * parametros);
+
+/** mandarRespuestaPHP:
+ * Encola una respuesta guardada en la cache de respuestas PHP.
+ * DE: 	C (struct conexion *), la conexion.
+ * 		R (struct respuestaPHP *), la respuesta.
+ * */
+void mandarRespuestaPHP(struct conexion * c, struct respuestaPHP * r);
+
+/** ttlRespuestaPHP:
+ * Calcula cuanto se puede guardar una respuesta PHP segun sus headers CGI:
+ * s-maxage o max-age, si no Expires, si no config.ttlPHP. Con Set-Cookie o
+ * Cache-Control no-store, no-cache o private no se guarda.
+ * DE: 	Headers (char *), los headers CGI.
+ * 		Len (size_t), su largo.
+ * DS:	Los segundos, o -1 si no se puede guardar.
+ * */
+int ttlRespuestaPHP(char * headers, size_t len);
+
+/** capturarCuerpoPHP:
+ * Agrega parte del cuerpo a la respuesta PHP que guarda la conexion.
+ * DE: 	C (struct conexion *), la conexion.
+ * 		Datos (char *), el cuerpo y Len (size_t), su largo.
+ * */
+void capturarCuerpoPHP(struct conexion * c, const char * datos, size_t len);
+
+/** completarCapturaPHP:
+ * Deja lista en la cache la respuesta PHP que guardaba la conexion y se la manda
+ * a las conexiones que la esperaban.
+ * DE: 	C (struct conexion *), la conexion.
+ * */
+void completarCapturaPHP(struct conexion * c);
+
+/** abandonarCapturaPHP:
+ * Deja de guardar la respuesta PHP de la conexion. Las conexiones que la
+ * esperaban mandan su pedido a php-cgi.
+ * DE: 	C (struct conexion *), la conexion.
+ * 		Pasar (int), 1 si la respuesta no se puede guardar (los proximos pedidos van
+ * 		directo a php-cgi por un tiempo), 0 si fallo (se saca de la cache).
+ * */
+void abandonarCapturaPHP(struct conexion * c, int pasar);
+
+/** despertarEsperasPHP:
+ * Atiende a las conexiones que esperaban una respuesta PHP.
+ * DE: 	R (struct respuestaPHP *), la respuesta.
+ * */
+void despertarEsperasPHP(struct respuestaPHP * r);
+
+/** quitarEsperaPHP:
+ * Saca a una conexion de la lista de espera de su respuesta PHP.
+ * DE: 	C (struct conexion *), la conexion.
+ * */
+void quitarEsperaPHP(struct conexion * c);
+
+/** recibirSalidaPHP:
+ * Recibe parte de la salida de php-cgi. Mientras no termina el bloque de headers
+ * CGI lo junta en la conexion; despues lo pasa directo al cliente.
+ * DE: 	Conexion (struct conexion *), la conexion con un PHP en curso.
+ * 		Datos (char *), la salida recibida.
+ * 		Len (size_t), su largo.
+ * */
+void recibirSalidaPHP(struct conexion * c, const char * datos, size_t len);
+
+/** iniciarRespuestaPHP:
+ * Encola los headers de la respuesta a partir de los headers CGI: el header Status
+ * como linea de estado (o 200), los demas headers del script y Transfer-Encoding:
+ * chunked (en HTTP/1.0 el cuerpo termina con el cierre de la conexion).
+ * DE: 	Conexion (struct conexion *), la conexion con los headers CGI en cgi.
+ * 		FinHeaders (size_t), el largo del bloque de headers (0 si no tiene).
+ * */
+void iniciarRespuestaPHP(struct conexion * c, size_t finHeaders);
+
+/** mandarCuerpoPHP:
+ * Encola parte del cuerpo de la respuesta de PHP, como un chunk si corresponde.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Datos (char *), el cuerpo.
+ * 		Len (size_t), su largo.
+ * */
+void mandarCuerpoPHP(struct conexion * c, const char * datos, size_t len);
+
+/** terminarRespuestaPHP:
+ * Termina la respuesta de PHP cuando termina el pedido FastCGI: manda el chunk
+ * final o, si la salida nunca tuvo headers, la respuesta completa con su largo.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Completo (int), 1 si php-cgi termino el pedido, 0 si se corto la conexion.
+ * */
+void terminarRespuestaPHP(struct conexion * c, int completo);
+
+/** iniciarRegistro:
+ * Crea el registro asincronico del worker y lanza el hilo que lo vacia. Si no
+ * se puede, el worker sigue escribiendo directo al syslog.
+ * */
+void iniciarRegistro();
+
+/** encolarRegistro:
+ * Agrega una entrada al registro del worker sin bloquear. Si el anillo esta
+ * lleno la entrada se descarta y se cuenta.
+ * DE: 	Destino (int), REGISTRO_ACCESOS o REGISTRO_ERRORES.
+ * 		Prioridad (int), prioridad de syslog.
+ * 		Texto (string), la entrada (se corta en TAM_ENTRADA_REGISTRO).
+ * 		Largo (size_t), largo del texto.
+ * */
+void encolarRegistro(int destino, int prioridad, const char * texto, size_t len);
+
+/** escribirLote:
+ * Escribe un lote de lineas en el archivo de accesos.
+ * DE: 	Lote (string), las lineas.
+ * 		Largo (size_t), largo del lote.
+ * */
+void escribirLote(const char * lote, size_t len);
+
+/** escribirRegistro:
+ * Hilo que vacia el registro cada INTERVALO_REGISTRO ms: junta los accesos en
+ * un solo write y manda los errores al syslog.
+ * */
+void * escribirRegistro(void * arg);
+
+/** escaparRegistro:
+ * Copia un texto escapando comillas, barras y caracteres de control: como \u00HH
+ * en JSON y como \xHH (tambien los bytes no ASCII) en los formatos common y combined.
+ * DE: 	Destino (string), donde se copia.
+ * 		Tamanio (size_t), tamanio del destino.
+ * 		Texto (string), lo que se copia.
+ * 		Largo (size_t), largo del texto.
+ * 		Json (int), 1 para escapar como JSON.
+ * DS: 	Largo del texto escapado (size_t).
+ * */
+size_t escaparRegistro(char * dst, size_t tam, const char * src, size_t len, int json);
+
+/** registrarAcceso:
+ * Agrega el pedido que termino al registro de accesos (common, combined o json)
+ * segun el muestreo, y deja la conexion lista para el proximo pedido.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void registrarAcceso(struct conexion * c);
+
+/** ahoraUs:
+ * DS: 	Microsegundos de un reloj monotono (long long).
+ * */
+long long ahoraUs();
+
+/** iniciarMetricas:
+ * Reserva las metricas de todos los workers en memoria compartida. Se llama
+ * antes de lanzar los workers para que todos la hereden.
+ * */
+void iniciarMetricas();
+
+/** sumarMetrica:
+ * Suma a una metrica del worker (un solo escritor, sin instrucciones atomicas).
+ * DE: 	Metrica (_Atomic unsigned long *).
+ * 		Valor (long), lo que se suma (puede ser negativo).
+ * */
+void sumarMetrica(_Atomic unsigned long * m, long v);
+
+/** medirLatencia:
+ * Agrega una medicion a un histograma del worker.
+ * DE: 	Histograma (struct histograma *).
+ * 		Latencia (long long), en microsegundos.
+ * */
+void medirLatencia(struct histograma * h, long long us);
+
+/** bucketLatencia:
+ * Bucket de una latencia: exacto por debajo de SUB_BUCKETS, y despues
+ * SUB_BUCKETS por cada potencia de 2.
+ * DE: 	Latencia (long long), en microsegundos.
+ * DS: 	Indice del bucket (int), puede pasarse de CANT_BUCKETS.
+ * */
+int bucketLatencia(long long us);
+
+/** limiteBucket:
+ * DE: 	Indice del bucket (int).
+ * DS: 	Mayor latencia del bucket en microsegundos (long long).
+ * */
+long long limiteBucket(int i);
+
+/** mandarHistograma:
+ * Agrega al texto un histograma de Prometheus sumando el de cada worker.
+ * DE: 	Buf (char *), donde se arma el texto.
+ * 		Len (size_t *), lo ya escrito en buf (se actualiza).
+ * 		Tam (size_t), el tamaño de buf.
+ * 		Nombre (string), nombre de la metrica.
+ * 		Ayuda (string), descripcion de la metrica.
+ * 		Campo (size_t), offset del histograma en struct metricasWorker.
+ * */
+void mandarHistograma(char * buf, size_t * len, size_t tam, const char * nombre, const char * ayuda, size_t campo);
+
+/** agregarTexto:
+ * Agrega texto con formato (como printf) al final de un buffer; lo que no entra se corta.
+ * DE: 	Buf (char *), el buffer.
+ * 		Len (size_t *), lo ya escrito en buf (se actualiza).
+ * 		Tam (size_t), el tamaño de buf.
+ * 		Formato (string), el formato y sus argumentos.
+ * */
+void agregarTexto(char * buf, size_t * len, size_t tam, const char * formato, ...);
+
+/** esClienteLocal:
+ * Revisa por la direccion del socket si el cliente es local (127.x, ::1 o ::ffff:127.x).
+ * DE: 	Conexion (struct conexion *), la conexion (o un stream HTTP/2).
+ * DS:	1 si es local, 0 si no.
+ * */
+int esClienteLocal(struct conexion * c);
+
+/** mandarEstado:
+ * Responde las metricas de todos los workers en el formato de texto de
+ * Prometheus, solo a clientes locales (403 a los demas).
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void mandarEstado(struct conexion * c);
+
+/** headerContiene:
+ * Revisa si el valor de un header, hasta el fin de linea, contiene un token.
+ * DE: 	Valor (string), el valor del header (puede ser NULL).
+ * 		Token (string), el token a buscar (sin distinguir mayusculas).
+ * DS:	1 si lo contiene, 0 en caso contrario.
+ * */
+int headerContiene(char * valor, const char * token);
 
 /** atenderPedido:
- * Método principal. Dado un socket, se encarga de atenderlo.
+ * Método principal. Dada una conexion con un pedido completo, se encarga de atenderla.
  * El método se encarga de toda la inteligencia del servidor:
- * - Obtener el mensaje, analizarlo y devolver el Response HTTP según corresponda.
- * DE: 	Socket (int), el socket asociado al hilo donde se harán las lecturas y escrituras.
+ * - Analizar el mensaje y preparar el Response HTTP según corresponda.
+ * DE: 	Conexion (struct conexion *), la conexion con el pedido ya leido.
+ * */
+void atenderPedido(struct conexion * c);
+
+/** reservarSalida:
+ * Deja lugar para len bytes al final del buffer de salida (quien los escribe
+ * suma len a lenSalida).
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Len (size_t), la cantidad de bytes.
+ * DS: 	Donde escribirlos (char *).
+ * */
+char * reservarSalida(struct conexion * c, size_t len);
+
+/** encolarSalida:
+ * Agrega len bytes de datos al final del buffer de salida de la conexion.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Datos (char *), los bytes a encolar.
+ * 		Len (size_t), la cantidad de bytes.
+ * */
+void encolarSalida(struct conexion * c, const char * datos, size_t len);
+
+/** enviarSalida:
+ * Manda por el socket todo lo pendiente en el buffer de salida, sin bloquear.
+ * Si sigue un cuerpo en memoria, manda tambien lo que entre de el.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * DS:	1 si se mando todo, 0 si el socket no admite mas datos por ahora,
+ * 		-1 si hubo un error en el socket.
+ * */
+int enviarSalida(struct conexion * c);
+
+/** contarEnvio:
+ * Cuenta bytes mandados de la respuesta; el primero cierra la medicion hasta el primer byte.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Largo (size_t), bytes mandados.
+ * */
+void contarEnvio(struct conexion * c, size_t n);
+
+/** crearSocketEscucha:
+ * Crea un socket TCP ligado a servidor:puerto con SO_REUSEPORT, de forma que
+ * cada worker tenga su propio socket y el kernel reparta las conexiones entre ellos.
+ * DE: 	Servidor (string), la IP donde escuchar.
+ * 		Portno (int), el puerto donde escuchar.
+ * 		Backlog (int), el largo de la cola de conexiones pendientes.
+ * DS:	El descriptor del socket de escucha.
+ * */
+int crearSocketEscucha(char * servidor, int portno, int backlog);
+
+/** iniciarWorker:
+ * Lanza un proceso worker que atiende las conexiones de su socket de escucha
+ * con su propio bucle de eventos (opcionalmente fijado a un CPU).
+ * DE: 	Nro (int), el numero de worker.
+ * 		Sockets (int *), los sockets de escucha de todos los workers.
+ * DS:	El pid del worker lanzado.
+ * */
+pid_t iniciarWorker(int nro, int * sockets);
+
+/** crearSocketPHP:
+ * Crea el socket Unix (en el espacio de nombres abstracto) donde escucha el pool
+ * de php-cgi, y guarda su direccion en direccionPHP.
+ * DE: 	Backlog (int), largo de la cola de listen().
+ * DS:	El descriptor del socket.
+ * */
+int crearSocketPHP(int backlog);
+
+/** iniciarPHP:
+ * Lanza un proceso php-cgi del pool con el socket del pool como entrada estandar
+ * (asi php-cgi atiende FastCGI). Termina solo despues de config.phpMaxPedidos pedidos.
+ * DE: 	Sockets (int *), los sockets de escucha de los workers (para cerrarlos).
+ * DS:	El pid del proceso lanzado (o -1 si fallo el fork o no se pudo ejecutar php-cgi).
+ * */
+pid_t iniciarPHP(int * sockets);
+
+/** revisarPoolPHP:
+ * Lanza los php-cgi del pool que no estan corriendo y ya cumplieron su espera, y
+ * lleva la cuenta de los que corren en phpVivos.
+ * DE: 	Procesos (pid_t *), el pid de cada php-cgi (0 si no esta corriendo).
+ * 		Inicio (time_t *), cuando se lanzo cada uno por ultima vez.
+ * 		Espera (int *), los segundos que espera cada uno antes de relanzarse.
+ * 		Sockets (int *), los sockets de escucha de los workers.
+ * DS:	Los segundos hasta el proximo php-cgi que queda esperando, 0 si no hay.
+ * */
+int revisarPoolPHP(pid_t * procesos, time_t * inicio, int * espera, int * sockets);
+
+/** siguienteEsperaPHP:
+ * Duplica la espera antes de relanzar un php-cgi que no arranco, hasta MAX_ESPERA_PHP.
+ * DE: 	Espera (int), la espera anterior en segundos (0 la primera vez).
+ * DS:	La nueva espera en segundos.
+ * */
+int siguienteEsperaPHP(int espera);
+
+/** setNoBloqueante:
+ * Pone el descriptor dado en modo no bloqueante y close-on-exec.
+ * DE: 	Fd (int), el descriptor.
+ * DS:	0 si se pudo, -1 en caso contrario.
+ * */
+int setNoBloqueante(int fd);
+
+/** rechazarConexion:
+ * Sin descriptores libres (EMFILE o ENFILE), suelta el de reserva para
+ * aceptar la primera conexion pendiente y cerrarla, asi no queda trabada
+ * en la cola. Despues vuelve a tomar el de reserva.
+ * DE: 	Sockfd (int), el socket de escucha (no bloqueante).
+ * DS:	1 si se saco una conexion de la cola, 0 si no.
+ * */
+int rechazarConexion(int sockfd);
+
+/** aceptarConexiones:
+ * Acepta todas las conexiones pendientes en el socket de escucha y
+ * las registra en el bucle de eventos.
+ * DE: 	Sockfd (int), el socket de escucha (no bloqueante).
+ * */
+void aceptarConexiones(int sockfd);
+
+/** crearConexion:
+ * Crea el estado de una conexion recien aceptada.
+ * DE: 	Sock (int), el socket del cliente.
+ * DS: 	La conexion (struct conexion *).
+ * */
+struct conexion * crearConexion(int sock);
+
+/** pedirArena:
+ * Pide memoria de la arena del pedido en curso de la conexion, que se libera
+ * toda junta al terminar el pedido (no hay que liberarla aparte).
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Len (size_t), los bytes pedidos.
+ * DS: 	La memoria (void *), alineada a ALINEACION_ARENA.
+ * */
+void * pedirArena(struct conexion * c, size_t len);
+
+/** liberarArena:
+ * Devuelve la arena del pedido en curso al pool del worker, si tenia.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void liberarArena(struct conexion * c);
+
+/** ipCliente:
+ * Direccion del cliente; si no se conoce (con io_uring) se busca con getpeername.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * DS: 	La direccion (string).
+ * */
+char * ipCliente(struct conexion * c);
+
+/** manejarConexion:
+ * Hace avanzar la maquina de estados de la conexion todo lo posible
+ * hasta que el socket (o php-cgi) no permita seguir sin bloquear.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void manejarConexion(struct conexion * c);
+
+/** finalizarRespuesta:
+ * Se llama cuando la respuesta se termino de mandar. Si la conexion no es
+ * keep-alive la cierra; si no, descarta el pedido atendido y la deja esperando
+ * el siguiente (que puede haber llegado ya, con pipelining).
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void finalizarRespuesta(struct conexion * c);
+
+/** descartarPedido:
+ * Saca de la entrada el pedido ya atendido, dejando lo que llego despues.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void descartarPedido(struct conexion * c);
+
+/** ahoraMs:
+ * DS:	El tiempo actual de un reloj monotono, en milisegundos.
+ * */
+long long ahoraMs();
+
+/** cerrarConexion:
+ * Cierra el socket (y el pipe de php-cgi, si hubiera) de la conexion y la deja
+ * pendiente de liberar al final de la vuelta actual del bucle de eventos, ya que
+ * puede haber otros eventos de la misma vuelta que la referencien.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void cerrarConexion(struct conexion * c);
+
+/** bucleEventos:
+ * Bucle principal del servidor. Atiende en un unico proceso todas las conexiones
+ * con epoll en modo edge-triggered. No retorna.
+ * DE: 	Sockfd (int), el socket de escucha.
+ * */
+void bucleEventos(int sockfd);
+
+/** iniciarRueda:
+ * Arranca la rueda de plazos del worker vacia.
+ * */
+void iniciarRueda();
+
+/** duracionPlazo:
+ * DE: 	Fase (int), la fase (PLAZO_*).
+ * DS: 	Segundos de plazo de la fase, 0 si no tiene (int).
+ * */
+int duracionPlazo(int fase);
+
+/** insertarPlazo:
+ * Pone la conexion en la ranura de la rueda que corresponde a su vencimiento.
+ * DE: 	Conexion (struct conexion *), la conexion, con vencePlazo ya puesto.
+ * */
+void insertarPlazo(struct conexion * c);
+
+/** armarPlazo:
+ * Arma el plazo de una fase de la conexion, reemplazando el que tuviera. Si la
+ * fase no tiene plazo configurado, la conexion queda sin plazo.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Fase (int), la fase (PLAZO_*).
+ * */
+void armarPlazo(struct conexion * c, int fase);
+
+/** armarPlazoRespuesta:
+ * Arma el plazo de la respuesta que se empezo: PHP mientras se ejecuta el
+ * script, o escritura si ya hay algo para mandar.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void armarPlazoRespuesta(struct conexion * c);
+
+/** cancelarPlazo:
+ * Saca a la conexion de la rueda de plazos, si estaba.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void cancelarPlazo(struct conexion * c);
+
+/** esperaPlazos:
+ * DS: 	Milisegundos que se puede esperar sin que venza ningun plazo, -1 si no hay (int).
+ * */
+int esperaPlazos();
+
+/** vencerPlazos:
+ * Avanza la rueda hasta la hora actual y cierra las conexiones con plazos vencidos.
+ * */
+void vencerPlazos();
+
+/** vencerPlazo:
+ * Atiende el vencimiento del plazo de una conexion: la cierra o, si estaba
+ * mandando y el cliente recibio algo hace menos del plazo, lo vuelve a armar.
+ * Si esperaba un script PHP que no mando nada, le responde un 504.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void vencerPlazo(struct conexion * c);
+
+/** vencerPHP:
+ * Corta el pedido a php-cgi (o la espera de una respuesta PHP que genera otra
+ * conexion) cuyo plazo vencio sin que saliera nada, y responde un 504 Gateway
+ * Timeout; la conexion se cierra cuando termina de mandarlo.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void vencerPHP(struct conexion * c);
+
+/** atenderEventos:
+ * Atiende los eventos que devolvio epoll.
+ * DE: 	Sockfd (int), el socket de escucha.
+ * 		Eventos (struct epoll_event *), los eventos.
+ * 		N (int), cantidad de eventos.
+ * */
+void atenderEventos(int sockfd, struct epoll_event * eventos, int n);
+
+/** cerrarSocket:
+ * Cierra el socket de una conexion y su archivo, y vuelve a pedir el accept de
+ * io_uring si estaba en pausa por falta de descriptores.
+ * DE: 	C (struct conexion *), la conexion.
+ * */
+void cerrarSocket(struct conexion * c);
+
+/** liberarCerradas:
+ * Libera las conexiones cerradas que ya no tienen operaciones en curso.
+ * */
+void liberarCerradas();
+
+/** iniciarUring:
+ * Crea el io_uring del worker y registra el anillo de buffers para recibir.
+ * DS: 	0 si se pudo, -1 si el kernel no lo permite (se sigue con epoll).
+ * */
+int iniciarUring();
+
+/** devolverBufferUring:
+ * Devuelve un buffer al anillo de buffers para recibir.
+ * DE: 	Bid (int), el numero del buffer.
+ * */
+void devolverBufferUring(int bid);
+
+/** nuevaOperacion:
+ * Agrega una operacion (vacia) a la cola de io_uring.
+ * DE: 	Conexion (struct conexion *), la conexion de la operacion o NULL.
+ * 		Op (int), el tipo de operacion (OP_*).
+ * DS: 	La operacion para completar (struct io_uring_sqe *).
+ * */
+struct io_uring_sqe * nuevaOperacion(struct conexion * c, int op);
+
+/** esperarUring:
+ * Pasa al kernel las operaciones encoladas y espera a que termine alguna.
+ * DE: 	Espera (int), maximo en ms (-1 sin limite, 0 sin esperar).
+ * */
+void esperarUring(int espera);
+
+/** bucleUring:
+ * Bucle principal del worker con io_uring. No retorna.
+ * DE: 	Sockfd (int), el socket de escucha (bloqueante).
+ * */
+void bucleUring(int sockfd);
+
+/** aceptarUring:
+ * Pide aceptar todas las conexiones del socket de escucha (accept multishot).
+ * DE: 	Sockfd (int), el socket de escucha.
+ * */
+void aceptarUring(int sockfd);
+
+/** sondearEscucha:
+ * Pide que io_uring avise cuando hay conexiones pendientes en el socket de
+ * escucha, mientras el accept esta en pausa por falta de descriptores.
+ * DE: 	Sockfd (int), el socket de escucha.
+ * */
+void sondearEscucha(int sockfd);
+
+/** sondearEpoll:
+ * Pide que io_uring avise cada vez que hay eventos en epoll (php-cgi e inotify).
+ * */
+void sondearEpoll();
+
+/** pedirRecepcion:
+ * Pide recibir los proximos datos del pedido de la conexion.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * */
+void pedirRecepcion(struct conexion * c);
+
+/** enviarSalidaUring:
+ * Pide mandar lo pendiente del buffer de salida.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		Enlazar (int), 1 si la operacion siguiente tiene que esperar a esta.
+ * DS: 	1 si no quedaba nada pendiente, 0 si hay un envio en curso (int).
+ * */
+int enviarSalidaUring(struct conexion * c, int enlazar);
+
+/** enviarRespuestaUring:
+ * Pide mandar lo que falta de la respuesta (salida y cuerpo) encadenado; los
+ * archivos se leen de a bloques y se mandan en la misma cadena.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * DS: 	1 si ya se mando todo, 0 si hay operaciones en curso, -1 si hubo un error (int).
+ * */
+int enviarRespuestaUring(struct conexion * c);
+
+/** terminarOperacion:
+ * Registra una operacion de io_uring terminada y, si la conexion no tiene mas
+ * operaciones en curso, hace avanzar su maquina de estados.
+ * DE: 	Sockfd (int), el socket de escucha.
+ * 		Datos (unsigned long), user_data de la operacion (conexion y OP_*).
+ * 		Res (int), resultado de la operacion.
+ * 		Flags (unsigned int), flags del resultado.
+ * */
+void terminarOperacion(int sockfd, unsigned long datos, int res, unsigned int flags);
+
+/** iniciarHPACK:
+ * Arma las tablas para decodificar el codigo Huffman de HPACK a partir de los
+ * largos de los codigos (es un codigo canonico).
+ * */
+void iniciarHPACK();
+
+/** decodificarHuffman:
+ * Decodifica un string con el codigo Huffman de HPACK.
+ * DE: 	Datos (unsigned char *), el string codificado.
+ * 		Len (size_t), su largo.
+ * 		Destino (char *), donde se decodifica.
+ * 		Tamanio (size_t), lugar en el destino.
+ * DS: 	Largo decodificado, -1 si el string es invalido o -2 si no entra (long).
+ * */
+long decodificarHuffman(const unsigned char * p, size_t len, char * dst, size_t tam);
+
+/** leerEnteroHPACK:
+ * Lee un entero de HPACK (prefijo de N bits y despues de a 7 bits).
+ * DE: 	Datos (unsigned char *), desde el byte con el prefijo.
+ * 		Fin (unsigned char *), fin de los datos.
+ * 		Bits (int), bits del prefijo.
+ * 		Valor (size_t *), donde se deja el entero.
+ * DS: 	Bytes que ocupa, -1 si esta cortado o es demasiado grande (int).
+ * */
+int leerEnteroHPACK(const unsigned char * p, const unsigned char * fin, int bits, size_t * valor);
+
+/** escribirEnteroHPACK:
+ * Escribe un entero de HPACK.
+ * DE: 	Destino (unsigned char *).
+ * 		Bits (int), bits del prefijo.
+ * 		Marca (unsigned char), los bits de arriba del primer byte.
+ * 		Valor (size_t), el entero.
+ * DS: 	Bytes escritos (size_t).
+ * */
+size_t escribirEnteroHPACK(unsigned char * p, int bits, unsigned char marca, size_t valor);
+
+/** leerStringHPACK:
+ * Lee el largo de un string de HPACK.
+ * DE: 	Datos (unsigned char *), desde el byte con el largo.
+ * 		Fin (unsigned char *), fin de los datos.
+ * 		Contenido (unsigned char **), donde se deja el comienzo del string.
+ * 		Len (size_t *), donde se deja su largo codificado.
+ * 		Huffman (int *), donde se deja si esta codificado con Huffman.
+ * DS: 	Bytes que ocupa el string entero, -1 si esta cortado (long).
+ * */
+long leerStringHPACK(const unsigned char * p, const unsigned char * fin, const unsigned char ** datos,
+		size_t * len, int * huffman);
+
+/** maxDecodificadoHPACK:
+ * DE: 	Len (size_t), largo de un string de HPACK.
+ * 		Huffman (int), si esta codificado con Huffman.
+ * DS: 	Largo maximo del string decodificado (size_t).
+ * */
+size_t maxDecodificadoHPACK(size_t len, int huffman);
+
+/** decodificarStringHPACK:
+ * Decodifica un string de HPACK terminandolo en '\0'.
+ * DE: 	Contenido (unsigned char *), el string.
+ * 		Len (size_t), su largo codificado.
+ * 		Huffman (int), si esta codificado con Huffman.
+ * 		Destino (char *), con lugar para maxDecodificadoHPACK + 1 bytes.
+ * DS: 	Largo decodificado, -1 si es invalido (long).
+ * */
+long decodificarStringHPACK(const unsigned char * datos, size_t len, int huffman, char * dst);
+
+/** campoHPACK:
+ * Busca una entrada de las tablas de HPACK (la estatica y despues la dinamica).
+ * DE: 	Tabla (struct tablaHPACK *), la tabla dinamica.
+ * 		Indice (size_t), desde 1.
+ * 		Nombre, LenNombre, Valor, LenValor: donde se deja la entrada.
+ * DS: 	0, o -1 si no existe (int).
+ * */
+int campoHPACK(struct tablaHPACK * t, size_t i, const char ** nombre, size_t * lenNombre,
+		const char ** valor, size_t * lenValor);
+
+/** sacarCampoHPACK:
+ * Saca y libera la entrada mas vieja de la tabla dinamica.
+ * DE: 	Tabla (struct tablaHPACK *).
+ * */
+void sacarCampoHPACK(struct tablaHPACK * t);
+
+/** agregarCampoHPACK:
+ * Agrega una entrada a la tabla dinamica, sacando las mas viejas hasta que entre.
+ * DE: 	Tabla (struct tablaHPACK *).
+ * 		Entrada (struct campoHPACK *), pasa a ser de la tabla.
+ * */
+void agregarCampoHPACK(struct tablaHPACK * t, struct campoHPACK * e);
+
+/** agregarCampoH2:
+ * Copia un campo al texto de los campos de un pedido HTTP/2.
+ * DE: 	Campos (struct camposH2 *).
+ * 		Nombre, LenNombre, Valor, LenValor: el campo.
+ * */
+void agregarCampoH2(struct camposH2 * h, const char * nombre, size_t lenNombre, const char * valor, size_t lenValor);
+
+/** decodificarHPACK:
+ * Decodifica un bloque de headers de HPACK, actualizando la tabla dinamica.
+ * DE: 	Tabla (struct tablaHPACK *), la tabla del cliente.
+ * 		Bloque (unsigned char *), el bloque.
+ * 		Len (size_t), su largo.
+ * 		Campos (struct camposH2 *), donde se dejan los campos decodificados.
+ * DS: 	0, o -1 si el bloque es invalido (int).
+ * */
+int decodificarHPACK(struct tablaHPACK * t, const unsigned char * p, size_t len, struct camposH2 * h);
+
+/** indiceEstaticoHPACK:
+ * DE: 	Nombre (string), en minusculas.
+ * DS: 	Indice de la primera entrada de la tabla estatica con ese nombre, 0 si no esta (int).
+ * */
+int indiceEstaticoHPACK(const char * nombre);
+
+/** esHeaderDeConexion:
+ * Revisa si un header es propio de la conexion HTTP/1 (Connection, Keep-Alive,
+ * Proxy-Connection, Transfer-Encoding, Upgrade), que no existen en HTTP/2.
+ * DE: 	Nombre (string).
+ * DS: 	1 si lo es, 0 si no (int).
+ * */
+int esHeaderDeConexion(const char * nombre);
+
+/** armarBloqueH2:
+ * Pasa a un bloque de HPACK la linea de estado y los headers de una respuesta HTTP/1.
+ * DE: 	Inicio (char *), la linea de estado.
+ * 		Fin (char *), el fin del ultimo header (sin la linea vacia).
+ * 		Bloque (unsigned char *), con lugar para el doble de lo que ocupan los headers.
+ * DS: 	Largo del bloque (size_t).
+ * */
+size_t armarBloqueH2(const char * inicio, const char * fin, unsigned char * bloque);
+
+/** leer32H2:
+ * DS: 	Entero de 32 bits (big endian) de un marco (unsigned long).
+ * */
+unsigned long leer32H2(const unsigned char * p);
+
+/** escribir32H2:
+ * Escribe un entero de 32 bits (big endian) en un marco.
+ * */
+void escribir32H2(unsigned char * p, unsigned long valor);
+
+/** escribirEncabezadoH2:
+ * Escribe los 9 bytes del encabezado de un marco.
+ * DE: 	Destino (unsigned char *).
+ * 		Len (size_t), largo del contenido.
+ * 		Tipo, Flags (int).
+ * 		Id (unsigned int), el stream (0: la conexion).
+ * */
+void escribirEncabezadoH2(unsigned char * p, size_t len, int tipo, int flags, unsigned int id);
+
+/** encolarMarcoH2:
+ * Agrega un marco a la salida de la conexion.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Tipo, Flags (int).
+ * 		Id (unsigned int), el stream.
+ * 		Datos, Len: el contenido del marco.
+ * */
+void encolarMarcoH2(struct conexion * c, int tipo, int flags, unsigned int id, const void * datos, size_t len);
+
+/** mandarRstH2:
+ * Encola un RST_STREAM.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Id (unsigned int), el stream.
+ * 		Codigo (int), el motivo (H2_ERROR_*).
+ * */
+void mandarRstH2(struct conexion * c, unsigned int id, int codigo);
+
+/** cerrarH2:
+ * Corta los streams y cierra la conexion cuando sale el GOAWAY que se le manda
+ * al cliente con el ultimo stream atendido.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Codigo (int), el motivo (H2_SIN_ERROR o H2_ERROR_*).
+ * */
+void cerrarH2(struct conexion * c, int codigo);
+
+/** decodificarBase64:
+ * Decodifica base64url (o base64), con o sin relleno.
+ * DE: 	Texto (string).
+ * 		Destino (unsigned char *).
+ * 		Tamanio (size_t), lugar en el destino.
+ * DS: 	Largo decodificado, -1 si es invalido o no entra (long).
+ * */
+long decodificarBase64(const char * texto, unsigned char * dst, size_t tam);
+
+/** iniciarSesionH2:
+ * Pasa la conexion a HTTP/2 y encola los SETTINGS del servidor.
+ * DE: 	Conexion (struct conexion *), la conexion.
+ * 		FaltaPrefacio (int), bytes del prefacio del cliente que faltan llegar.
+ * */
+void iniciarSesionH2(struct conexion * c, int faltaPrefacio);
+
+/** pasarAH2:
+ * Atiende un pedido con Upgrade: h2c: responde 101, pasa la conexion a HTTP/2
+ * y atiende el pedido como el stream 1.
+ * DE: 	Conexion (struct conexion *), la conexion con el pedido ya analizado.
+ * DS: 	1 si la conexion paso a HTTP/2, 0 si sigue en HTTP/1.1 (int).
+ * */
+int pasarAH2(struct conexion * c);
+
+/** aplicarSettingsH2:
+ * Aplica los parametros de un SETTINGS del cliente.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Datos, Len: el contenido del SETTINGS.
+ * DS: 	H2_SIN_ERROR o el codigo de error de la conexion (int).
+ * */
+int aplicarSettingsH2(struct conexion * c, const unsigned char * p, size_t len);
+
+/** crearStreamH2:
+ * Crea un stream de la conexion como una conexion hija, sin socket.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Id (unsigned int), el id del stream.
+ * DS: 	El stream (struct conexion *).
+ * */
+struct conexion * crearStreamH2(struct conexion * c, unsigned int id);
+
+/** buscarStreamH2:
+ * DE: 	Sesion (struct sesionH2 *).
+ * 		Id (unsigned int).
+ * DS: 	El stream abierto con ese id, o NULL (struct conexion *).
+ * */
+struct conexion * buscarStreamH2(struct sesionH2 * s, unsigned int id);
+
+/** quitarStreamH2:
+ * Saca al stream de su conexion; si su respuesta no termino, le manda
+ * RST_STREAM al cliente.
+ * DE: 	Stream (struct conexion *).
+ * */
+void quitarStreamH2(struct conexion * st);
+
+/** resetearStreamH2:
+ * Corta un stream con un RST_STREAM y lo cierra.
+ * DE: 	Stream (struct conexion *).
+ * 		Codigo (int), el motivo (H2_ERROR_*).
+ * */
+void resetearStreamH2(struct conexion * st, int codigo);
+
+/** pasarAlFinalH2:
+ * Pasa un stream al final de la lista de su conexion.
+ * DE: 	Sesion (struct sesionH2 *).
+ * 		Stream (struct conexion *).
+ * */
+void pasarAlFinalH2(struct sesionH2 * s, struct conexion * st);
+
+/** urgenciaPesoH2:
+ * DE: 	Peso (int), de la prioridad de RFC 7540 (1 a 256).
+ * DS: 	La urgencia equivalente de RFC 9218 (0 a 7) (int).
+ * */
+int urgenciaPesoH2(int peso);
+
+/** aplicarPrioridadH2:
+ * Toma la urgencia ("u=N") y si es incremental ("i") de una prioridad de RFC 9218.
+ * DE: 	Stream (struct conexion *).
+ * 		Valor, Len: el header priority o el de un PRIORITY_UPDATE.
+ * */
+void aplicarPrioridadH2(struct conexion * st, const char * valor, size_t len);
+
+/** agregarTextoH2:
+ * Agrega bytes al pedido que se arma si entran.
+ * DE: 	Posicion (char **), se avanza lo agregado.
+ * 		Fin (char *), fin del lugar.
+ * 		Datos, Len: lo que se agrega.
+ * DS: 	0, o -1 si no entra (int).
+ * */
+int agregarTextoH2(char ** p, char * fin, const char * datos, size_t len);
+
+/** campoValidoH2:
+ * Revisa que un campo se pueda pasar a un header de HTTP/1.
+ * DE: 	Campo (struct header *).
+ * DS: 	1 si es valido, 0 si no (int).
+ * */
+int campoValidoH2(struct header * h);
+
+/** armarPedidoH2:
+ * Escribe en la entrada del stream el pedido como uno de HTTP/1 (protocolo
+ * HTTP/2.0), para atenderlo con atenderPedido.
+ * DE: 	Stream (struct conexion *).
+ * 		Campos (struct header *), los campos del pedido.
+ * 		Cant (int), cantidad de campos.
+ * DS: 	0, -1 si el pedido esta mal formado o -2 si no entra (int).
+ * */
+int armarPedidoH2(struct conexion * st, struct header * campos, int cant);
+
+/** atenderStreamH2:
+ * Atiende el pedido de un stream (o le responde el error que corresponda).
+ * DE: 	Stream (struct conexion *).
+ * 		Resultado (int), el de armarPedidoH2.
+ * */
+void atenderStreamH2(struct conexion * st, int r);
+
+/** procesarHeadersH2:
+ * Decodifica un bloque de headers completo y abre el stream del pedido.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Bloque, Len: el bloque de HPACK.
+ * DS: 	H2_SIN_ERROR o el codigo de error de la conexion (int).
+ * */
+int procesarHeadersH2(struct conexion * c, const unsigned char * bloque, size_t len);
+
+/** agregarBloqueH2:
+ * Agrega un fragmento de HEADERS o CONTINUATION al bloque de headers en curso.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Datos, Len: el fragmento.
+ * DS: 	H2_SIN_ERROR o el codigo de error de la conexion (int).
+ * */
+int agregarBloqueH2(struct conexion * c, const unsigned char * datos, size_t len);
+
+/** procesarMarcoH2:
+ * Procesa el marco del cliente que se termino de recibir.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * DS: 	H2_SIN_ERROR o el codigo de error de la conexion (int).
+ * */
+int procesarMarcoH2(struct conexion * c);
+
+/** procesarEntradaH2:
+ * Procesa lo recibido: el resto del prefacio y los marcos, que pueden llegar partidos.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * DS: 	H2_SIN_ERROR o el codigo de error de la conexion (int).
+ * */
+int procesarEntradaH2(struct conexion * c);
+
+/** recibirH2:
+ * Recibe lo que mando el cliente (con io_uring, pide la proxima recepcion).
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * DS: 	1 si llego algo, 0 si hay que esperar, -1 si el cliente cerro (int).
+ * */
+int recibirH2(struct conexion * c);
+
+/** pendienteH2:
+ * DE: 	Stream (struct conexion *).
+ * DS: 	1 si le queda salida o cuerpo por pasar a marcos, 0 si no (int).
+ * */
+int pendienteH2(struct conexion * st);
+
+/** puedeMandarH2:
+ * DE: 	Sesion (struct sesionH2 *).
+ * 		Stream (struct conexion *).
+ * DS: 	1 si el stream puede armar un marco (las ventanas lo permiten), 0 si no (int).
+ * */
+int puedeMandarH2(struct sesionH2 * s, struct conexion * st);
+
+/** respuestaTerminadaH2:
+ * DE: 	Stream (struct conexion *).
+ * DS: 	1 si ya se paso a marcos toda la respuesta, 0 si no (int).
+ * */
+int respuestaTerminadaH2(struct conexion * st);
+
+/** elegirStreamH2:
+ * Elige el stream que arma el proximo marco segun su prioridad (RFC 9218).
+ * DE: 	Sesion (struct sesionH2 *).
+ * DS: 	El stream, o NULL si ninguno puede mandar (struct conexion *).
+ * */
+struct conexion * elegirStreamH2(struct sesionH2 * s);
+
+/** producirMarcoH2:
+ * Arma el proximo marco del stream (HEADERS o DATA) en la salida de la conexion.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * 		Stream (struct conexion *).
+ * */
+void producirMarcoH2(struct conexion * c, struct conexion * st);
+
+/** programarH2:
+ * Arma marcos de los streams por prioridad, los manda y hace seguir a los
+ * streams que ya pasaron a marcos lo que tenian.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * DS: 	0, o -1 si la conexion se cerro (int).
+ * */
+int programarH2(struct conexion * c);
+
+/** enviarSalidaH2:
+ * enviarSalida de un stream: lo pendiente sale en marcos de su conexion.
+ * DE: 	Stream (struct conexion *).
+ * DS: 	1 si no le queda nada, 0 si falta, -1 si se cerro (int).
+ * */
+int enviarSalidaH2(struct conexion * c);
+
+/** terminarStreamH2:
+ * Manda END_STREAM si no salio con el ultimo marco de la respuesta.
+ * DE: 	Stream (struct conexion *).
+ * */
+void terminarStreamH2(struct conexion * st);
+
+/** hayPHPEnCursoH2:
+ * DE: 	Sesion (struct sesionH2 *).
+ * DS: 	1 si algun stream espera a php-cgi, 0 si no (int).
+ * */
+int hayPHPEnCursoH2(struct sesionH2 * s);
+
+/** atenderH2:
+ * Atiende una conexion HTTP/2: procesa lo recibido, manda las respuestas y
+ * ajusta el plazo de la conexion.
+ * DE: 	Conexion (struct conexion *), la conexion HTTP/2.
+ * */
+void atenderH2(struct conexion * c);
+
+/** liberarSesionH2:
+ * Libera el estado HTTP/2 de una conexion.
+ * DE: 	Sesion (struct sesionH2 *).
  * */
-void atenderPedido(int sock);
+void liberarSesionH2(struct sesionH2 * s);
 
 #endif // SERVIDORHTTP_H_